@@ -0,0 +1,131 @@
+/*
+
+ Body compression used by the luaazureiothub library.
+
+ Bodies are compressed with zlib deflate, in the zlib format used for the 'deflate' http content encoding. The 
+ output is written to a buffer owned by the compressor, and is only valid until the next call.
+
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iothubcompress.h"
+
+
+static bool reserveBuffer(Compressor *compressor, size_t size)
+{
+	if ( size > compressor->bufferSize ) {
+		unsigned char *buffer = realloc(compressor->buffer, size);
+		if ( buffer == NULL ) {
+			return false;
+		}
+		compressor->buffer = buffer;
+		compressor->bufferSize = size;
+	}
+	return true;
+}
+
+void compressorInit(Compressor *compressor)
+{
+	memset(compressor, 0, sizeof(Compressor));
+}
+
+void compressorFree(Compressor *compressor)
+{
+	if ( compressor->isDeflateReady ) {
+		deflateEnd(&compressor->deflateStream);
+	}
+	if ( compressor->isInflateReady ) {
+		inflateEnd(&compressor->inflateStream);
+	}
+	free(compressor->buffer);
+	memset(compressor, 0, sizeof(Compressor));
+}
+
+/*
+ Compress the data. Returns false if the data cannot be compressed, or would not get any smaller.
+*/
+bool compressorDeflate(Compressor *compressor, const void *data, size_t length, const unsigned char **output, size_t *outputLength)
+{
+	z_stream *stream = &compressor->deflateStream;
+	if ( length > UINT32_MAX ) {
+		return false;
+	}
+	if ( compressor->isDeflateReady ) {
+		deflateReset(stream);
+	}
+	else {
+		if ( deflateInit(stream, Z_DEFAULT_COMPRESSION) != Z_OK ) {
+			return false;
+		}
+		compressor->isDeflateReady = true;
+	}
+	if ( !reserveBuffer(compressor, deflateBound(stream, length)) ) {
+		return false;
+	}
+	stream->next_in = (Bytef *) data;
+	stream->avail_in = length;
+	stream->next_out = compressor->buffer;
+	stream->avail_out = compressor->bufferSize;
+	if ( deflate(stream, Z_FINISH) != Z_STREAM_END || stream->total_out >= length ) {
+		return false;
+	}
+	*output = compressor->buffer;
+	*outputLength = stream->total_out;
+	return true;
+}
+
+/*
+ Expand data made by compressorDeflate. Returns false if the data is not valid, or expands to more than 
+ COMPRESS_MAX_INFLATE_BYTES.
+*/
+bool compressorInflate(Compressor *compressor, const void *data, size_t length, const unsigned char **output, size_t *outputLength)
+{
+	z_stream *stream = &compressor->inflateStream;
+	int result = Z_OK;
+	if ( length > UINT32_MAX ) {
+		return false;
+	}
+	if ( compressor->isInflateReady ) {
+		inflateReset(stream);
+	}
+	else {
+		if ( inflateInit(stream) != Z_OK ) {
+			return false;
+		}
+		compressor->isInflateReady = true;
+	}
+	if ( !reserveBuffer(compressor, length * 4 + 256) ) {
+		return false;
+	}
+	stream->next_in = (Bytef *) data;
+	stream->avail_in = length;
+	stream->next_out = compressor->buffer;
+	stream->avail_out = compressor->bufferSize;
+	while ( (result = inflate(stream, Z_NO_FLUSH)) == Z_OK ) {
+		if ( stream->avail_out > 0 ) {
+			// no more input, so the data was cut short
+			return false;
+		}
+		size_t size = compressor->bufferSize * 2;
+		if ( compressor->bufferSize >= COMPRESS_MAX_INFLATE_BYTES ) {
+			return false;
+		}
+		if ( size > COMPRESS_MAX_INFLATE_BYTES ) {
+			size = COMPRESS_MAX_INFLATE_BYTES;
+		}
+		if ( !reserveBuffer(compressor, size) ) {
+			return false;
+		}
+		stream->next_out = compressor->buffer + stream->total_out;
+		stream->avail_out = compressor->bufferSize - stream->total_out;
+	}
+	if ( result != Z_STREAM_END ) {
+		return false;
+	}
+	*output = compressor->buffer;
+	*outputLength = stream->total_out;
+	return true;
+}
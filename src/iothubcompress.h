@@ -0,0 +1,43 @@
+#ifndef IOTHUBCOMPRESS_H
+#define IOTHUBCOMPRESS_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+
+
+#define COMPRESS_ENCODING_PROPERTY				"contentEncoding"		// message property set on compressed bodies
+#define COMPRESS_ENCODING_DEFLATE				"deflate"
+#define COMPRESS_MAX_INFLATE_BYTES				(1024 * 1024)			// larger bodies are not inflated
+
+
+/*
+ Deflate and inflate streams with one output buffer, all kept between messages so that compressing a body only
+ resets the streams instead of allocating them again.
+*/
+typedef struct {
+	z_stream deflateStream;
+	z_stream inflateStream;
+	bool isDeflateReady;
+	bool isInflateReady;
+	unsigned char *buffer;
+	size_t bufferSize;
+} Compressor;
+
+
+void compressorInit(Compressor *compressor);
+void compressorFree(Compressor *compressor);
+bool compressorDeflate(Compressor *compressor, const void *data, size_t length, const unsigned char **output, size_t *outputLength);
+bool compressorInflate(Compressor *compressor, const void *data, size_t length, const unsigned char **output, size_t *outputLength);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// IOTHUBCOMPRESS_H
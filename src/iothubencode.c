@@ -0,0 +1,382 @@
+/*
+
+ Body encoding used by the luaazureiothub library.
+
+ Lua tables sent as a message body are written as JSON (RFC 8259) or CBOR (RFC 8949) into a buffer owned by the
+ encoder, which is only valid until the next body is encoded. The walk over the lua table is done by the library,
+ this file only writes the values.
+
+ Numbers with an integral value up to 2^53 are written as integers, others as floats. Strings that are not valid
+ UTF-8 are binary data, they are sent as base64 strings in JSON and as byte strings in CBOR.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iothubencode.h"
+
+
+static const char base64Digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char hexDigits[] = "0123456789abcdef";
+static const double powersOf10[] = { 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+
+
+/*
+ Make room for 'length' more bytes, returns NULL if the body would be over ENCODE_MAX_BYTES or out of memory.
+*/
+static unsigned char *reserveBuffer(Encoder *encoder, size_t length)
+{
+	size_t size = encoder->bufferSize ? encoder->bufferSize : ENCODE_MIN_BUFFER_SIZE;
+	if ( length > ENCODE_MAX_BYTES - encoder->length ) {
+		return NULL;
+	}
+	if ( encoder->length + length > encoder->bufferSize ) {
+		while ( size < encoder->length + length ) {
+			size *= 2;
+		}
+		unsigned char *buffer = realloc(encoder->buffer, size);
+		if ( buffer == NULL ) {
+			return NULL;
+		}
+		encoder->buffer = buffer;
+		encoder->bufferSize = size;
+	}
+	return encoder->buffer + encoder->length;
+}
+
+static bool isSafeInteger(double value)
+{
+	return value >= -ENCODE_MAX_SAFE_INTEGER && value <= ENCODE_MAX_SAFE_INTEGER && value == (double) (long long) value;
+}
+
+void encoderInit(Encoder *encoder)
+{
+	memset(encoder, 0, sizeof(Encoder));
+}
+
+void encoderFree(Encoder *encoder)
+{
+	free(encoder->buffer);
+	memset(encoder, 0, sizeof(Encoder));
+}
+
+void encoderReset(Encoder *encoder)
+{
+	encoder->length = 0;
+}
+
+/*
+ Return true if the text is well formed UTF-8, so without overlong forms, surrogates or code points past U+10FFFF.
+*/
+bool encoderIsUtf8(const char *text, size_t length)
+{
+	const unsigned char *data = (const unsigned char *) text;
+	size_t index = 0;
+	while ( index < length ) {
+		unsigned char lead = data[index];
+		size_t count;
+		unsigned char low = 0x80;
+		unsigned char high = 0xBF;
+		if ( lead < 0x80 ) {
+			index ++;
+			continue;
+		}
+		if ( lead >= 0xC2 && lead <= 0xDF ) {
+			count = 1;
+		}
+		else if ( lead >= 0xE0 && lead <= 0xEF ) {
+			count = 2;
+			low = lead == 0xE0 ? 0xA0 : 0x80;
+			high = lead == 0xED ? 0x9F : 0xBF;
+		}
+		else if ( lead >= 0xF0 && lead <= 0xF4 ) {
+			count = 3;
+			low = lead == 0xF0 ? 0x90 : 0x80;
+			high = lead == 0xF4 ? 0x8F : 0xBF;
+		}
+		else {
+			return false;
+		}
+		if ( length - index <= count || data[index + 1] < low || data[index + 1] > high ) {
+			return false;
+		}
+		for ( size_t offset = 2; offset <= count; offset ++ ) {
+			if ( ( data[index + offset] & 0xC0 ) != 0x80 ) {
+				return false;
+			}
+		}
+		index += count + 1;
+	}
+	return true;
+}
+
+bool encoderAppend(Encoder *encoder, const void *data, size_t length)
+{
+	unsigned char *position = reserveBuffer(encoder, length);
+	if ( position == NULL ) {
+		return false;
+	}
+	memcpy(position, data, length);
+	encoder->length += length;
+	return true;
+}
+
+static bool appendBase64(Encoder *encoder, const unsigned char *data, size_t length)
+{
+	unsigned char *position;
+	size_t index;
+	if ( length > ENCODE_MAX_BYTES ) {
+		return false;
+	}
+	position = reserveBuffer(encoder, ( length + 2 ) / 3 * 4);
+	if ( position == NULL ) {
+		return false;
+	}
+	for ( index = 0; index + 2 < length; index += 3 ) {
+		uint32_t group = ( data[index] << 16 ) | ( data[index + 1] << 8 ) | data[index + 2];
+		*position ++ = base64Digits[( group >> 18 ) & 0x3F];
+		*position ++ = base64Digits[( group >> 12 ) & 0x3F];
+		*position ++ = base64Digits[( group >> 6 ) & 0x3F];
+		*position ++ = base64Digits[group & 0x3F];
+	}
+	if ( index < length ) {
+		uint32_t group = data[index] << 16;
+		if ( index + 1 < length ) {
+			group |= data[index + 1] << 8;
+		}
+		*position ++ = base64Digits[( group >> 18 ) & 0x3F];
+		*position ++ = base64Digits[( group >> 12 ) & 0x3F];
+		*position ++ = index + 1 < length ? base64Digits[( group >> 6 ) & 0x3F] : '=';
+		*position ++ = '=';
+	}
+	encoder->length += ( length + 2 ) / 3 * 4;
+	return true;
+}
+
+/*
+ Write the text as a quoted JSON string, escaping the quote, backslash and control characters. Binary data is
+ written as a base64 string.
+*/
+bool encoderJsonString(Encoder *encoder, const char *text, size_t length)
+{
+	const unsigned char *data = (const unsigned char *) text;
+	size_t start = 0;
+	size_t index;
+
+	if ( !encoderAppend(encoder, "\"", 1) ) {
+		return false;
+	}
+	if ( !encoderIsUtf8(text, length) ) {
+		return appendBase64(encoder, data, length) && encoderAppend(encoder, "\"", 1);
+	}
+	for ( index = 0; index < length; index ++ ) {
+		unsigned char value = data[index];
+		char escape[6] = { '\\', 0, '0', '0', 0, 0 };
+		size_t escapeLength = 2;
+		if ( value >= 0x20 && value != '"' && value != '\\' ) {
+			continue;
+		}
+		// copy the run of characters that do not need escaping in one go
+		if ( !encoderAppend(encoder, data + start, index - start) ) {
+			return false;
+		}
+		start = index + 1;
+		switch ( value ) {
+			case '"':	escape[1] = '"'; break;
+			case '\\':	escape[1] = '\\'; break;
+			case '\b':	escape[1] = 'b'; break;
+			case '\f':	escape[1] = 'f'; break;
+			case '\n':	escape[1] = 'n'; break;
+			case '\r':	escape[1] = 'r'; break;
+			case '\t':	escape[1] = 't'; break;
+			default:
+				escape[1] = 'u';
+				escape[4] = hexDigits[value >> 4];
+				escape[5] = hexDigits[value & 0x0F];
+				escapeLength = 6;
+				break;
+		}
+		if ( !encoderAppend(encoder, escape, escapeLength) ) {
+			return false;
+		}
+	}
+	return encoderAppend(encoder, data + start, length - start) && encoderAppend(encoder, "\"", 1);
+}
+
+static bool appendInteger(Encoder *encoder, long long value)
+{
+	char text[24];
+	char *position = text + sizeof(text);
+	unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long) value : (unsigned long long) value;
+	do {
+		*-- position = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while ( magnitude );
+	if ( value < 0 ) {
+		*-- position = '-';
+	}
+	return encoderAppend(encoder, position, text + sizeof(text) - position);
+}
+
+/*
+ Write the float with the fewest decimal places, up to 15, that read back as the same value. Most sensor readings 
+ take this path instead of snprintf, which is far slower. The decimal is n / 10^places, with both exact in a double
+ the division is correctly rounded, so it is equal to the value only if a reader gets the value back. Returns 0 if
+ the value needs more places or digits than a double holds exactly, otherwise the length of the text.
+*/
+static int formatDecimal(double value, char *text)
+{
+	size_t index;
+	for ( index = 0; index < sizeof(powersOf10) / sizeof(powersOf10[0]); index ++ ) {
+		int places = index + 1;
+		double scaled = value * powersOf10[index];
+		if ( scaled > ENCODE_MAX_SAFE_INTEGER || scaled < -ENCODE_MAX_SAFE_INTEGER ) {
+			return 0;
+		}
+		long long decimal = (long long) ( scaled < 0 ? scaled - 0.5 : scaled + 0.5 );
+		if ( (double) decimal / powersOf10[index] == value ) {
+			char digits[24];
+			int digitCount = 0;
+			int length = 0;
+			unsigned long long magnitude = decimal < 0 ? 0ULL - (unsigned long long) decimal : (unsigned long long) decimal;
+			do {
+				digits[digitCount ++] = '0' + magnitude % 10;
+				magnitude /= 10;
+			} while ( magnitude );
+			// pad so that there is at least one digit before the point
+			while ( digitCount <= places ) {
+				digits[digitCount ++] = '0';
+			}
+			if ( value < 0 ) {
+				text[length ++] = '-';
+			}
+			while ( digitCount > 0 ) {
+				if ( digitCount == places ) {
+					text[length ++] = '.';
+				}
+				text[length ++] = digits[-- digitCount];
+			}
+			return length;
+		}
+	}
+	return 0;
+}
+
+/*
+ Write the number in JSON. Floats use the fewest digits that read back to the same value, and always have a point 
+ or exponent so that they are not read back as integers. Returns false for nan and infinity, which JSON cannot hold.
+*/
+bool encoderJsonNumber(Encoder *encoder, double value)
+{
+	char text[32];
+	int length;
+	int index;
+	bool isFloat = false;
+
+	if ( value != value || value > 1.7976931348623157e308 || value < -1.7976931348623157e308 ) {
+		return false;
+	}
+	if ( isSafeInteger(value) ) {
+		return appendInteger(encoder, (long long) value);
+	}
+	length = formatDecimal(value, text);
+	if ( length > 0 ) {
+		return encoderAppend(encoder, text, length);
+	}
+	length = snprintf(text, sizeof(text), "%.15g", value);
+	if ( strtod(text, NULL) != value ) {
+		length = snprintf(text, sizeof(text), "%.17g", value);
+	}
+	for ( index = 0; index < length; index ++ ) {
+		// the locale can make the decimal point a comma
+		if ( text[index] == ',' ) {
+			text[index] = '.';
+		}
+		if ( text[index] == '.' || text[index] == 'e' ) {
+			isFloat = true;
+		}
+	}
+	if ( !isFloat ) {
+		text[length ++] = '.';
+		text[length ++] = '0';
+	}
+	return encoderAppend(encoder, text, length);
+}
+
+/*
+ Write a CBOR data item head, the major type with its argument in the fewest bytes.
+*/
+bool encoderCborHead(Encoder *encoder, int majorType, uint64_t value)
+{
+	unsigned char head[9];
+	size_t length;
+	int shift;
+	if ( value < 24 ) {
+		head[0] = ( majorType << 5 ) | value;
+		return encoderAppend(encoder, head, 1);
+	}
+	if ( value <= 0xFF ) {
+		head[0] = ( majorType << 5 ) | 24;
+		length = 1;
+	}
+	else if ( value <= 0xFFFF ) {
+		head[0] = ( majorType << 5 ) | 25;
+		length = 2;
+	}
+	else if ( value <= 0xFFFFFFFF ) {
+		head[0] = ( majorType << 5 ) | 26;
+		length = 4;
+	}
+	else {
+		head[0] = ( majorType << 5 ) | 27;
+		length = 8;
+	}
+	for ( shift = 0; shift < (int) length; shift ++ ) {
+		head[length - shift] = ( value >> ( shift * 8 ) ) & 0xFF;
+	}
+	return encoderAppend(encoder, head, length + 1);
+}
+
+/*
+ Write the text as a CBOR text string, or as a byte string if it is binary data.
+*/
+bool encoderCborString(Encoder *encoder, const char *text, size_t length)
+{
+	int majorType = encoderIsUtf8(text, length) ? CBOR_MAJOR_TEXT : CBOR_MAJOR_BYTES;
+	return encoderCborHead(encoder, majorType, length) && encoderAppend(encoder, text, length);
+}
+
+/*
+ Write the number in CBOR, floats are written as single precision if that holds the value exactly.
+*/
+bool encoderCborNumber(Encoder *encoder, double value)
+{
+	unsigned char data[9];
+	uint64_t bits;
+	float single = (float) value;
+	int index;
+
+	if ( isSafeInteger(value) ) {
+		if ( value < 0 ) {
+			return encoderCborHead(encoder, CBOR_MAJOR_NEGATIVE, (uint64_t) ( -1 - (long long) value ));
+		}
+		return encoderCborHead(encoder, CBOR_MAJOR_UNSIGNED, (uint64_t) value);
+	}
+	if ( (double) single == value ) {
+		uint32_t singleBits;
+		memcpy(&singleBits, &single, sizeof(singleBits));
+		data[0] = ( CBOR_MAJOR_SIMPLE << 5 ) | 26;
+		for ( index = 0; index < 4; index ++ ) {
+			data[4 - index] = ( singleBits >> ( index * 8 ) ) & 0xFF;
+		}
+		return encoderAppend(encoder, data, 5);
+	}
+	memcpy(&bits, &value, sizeof(bits));
+	data[0] = ( CBOR_MAJOR_SIMPLE << 5 ) | 27;
+	for ( index = 0; index < 8; index ++ ) {
+		data[8 - index] = ( bits >> ( index * 8 ) ) & 0xFF;
+	}
+	return encoderAppend(encoder, data, 9);
+}
@@ -0,0 +1,66 @@
+#ifndef IOTHUBENCODE_H
+#define IOTHUBENCODE_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define ENCODE_MAX_BYTES						(256 * 1024)	// largest device to cloud message the IotHub accepts
+#define ENCODE_MAX_DEPTH						32				// nested tables, also stops a table that contains itself
+#define ENCODE_MIN_BUFFER_SIZE					256
+#define ENCODE_MAX_SAFE_INTEGER					9007199254740992.0	// 2^53, larger numbers are written as floats
+
+#define CBOR_MAJOR_UNSIGNED						0
+#define CBOR_MAJOR_NEGATIVE						1
+#define CBOR_MAJOR_BYTES						2
+#define CBOR_MAJOR_TEXT							3
+#define CBOR_MAJOR_ARRAY						4
+#define CBOR_MAJOR_MAP							5
+#define CBOR_MAJOR_SIMPLE						7
+
+#define CBOR_SIMPLE_FALSE						20
+#define CBOR_SIMPLE_TRUE						21
+#define CBOR_SIMPLE_NULL						22
+
+
+typedef enum {
+	ENCODE_FORMAT_JSON,
+	ENCODE_FORMAT_CBOR,
+} EncodeFormat;
+
+/*
+ Output buffer for an encoded message body, kept between messages so that encoding a body only resets the length
+ instead of allocating the buffer again.
+*/
+typedef struct {
+	unsigned char *buffer;
+	size_t length;
+	size_t bufferSize;
+} Encoder;
+
+
+void encoderInit(Encoder *encoder);
+void encoderFree(Encoder *encoder);
+void encoderReset(Encoder *encoder);
+bool encoderIsUtf8(const char *text, size_t length);
+bool encoderAppend(Encoder *encoder, const void *data, size_t length);
+
+bool encoderJsonString(Encoder *encoder, const char *text, size_t length);
+bool encoderJsonNumber(Encoder *encoder, double value);
+
+bool encoderCborHead(Encoder *encoder, int majorType, uint64_t value);
+bool encoderCborString(Encoder *encoder, const char *text, size_t length);
+bool encoderCborNumber(Encoder *encoder, double value);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// IOTHUBENCODE_H
@@ -0,0 +1,131 @@
+/*
+
+ Message id generator used by the luaazureiothub library.
+
+ uuid_generate reads the kernel random source for every id. For high message rates the ids can instead be made
+ from a block of random bytes read in one call, or from a random uuid prefix made once per connection followed by a 
+ counter. The prefix keeps the ids unique across restarts of the same device. All ids are formatted without printf.
+
+*/
+
+#include <string.h>
+#include <strings.h>
+#include <sys/random.h>
+#include <uuid/uuid.h>
+
+#include "iothubid.h"
+
+
+static const char hexDigits[] = "0123456789abcdef";
+
+/*
+ Write the uuid in the same 8-4-4-4-12 lower case form as uuid_unparse, returns the length without the terminator.
+*/
+static size_t formatUUID(const unsigned char *uuid, char *buffer)
+{
+	char *out = buffer;
+	int index;
+	for ( index = 0; index < MESSAGE_ID_UUID_SIZE; index ++ ) {
+		if ( index == 4 || index == 6 || index == 8 || index == 10 ) {
+			*out ++ = '-';
+		}
+		*out ++ = hexDigits[uuid[index] >> 4];
+		*out ++ = hexDigits[uuid[index] & 0x0F];
+	}
+	*out = 0;
+	return out - buffer;
+}
+
+/*
+ Fill the batch with version 4 random uuids. If the random bytes cannot be read then fall back to uuid_generate,
+ which has its own fallbacks.
+*/
+static void fillBatch(MessageIdGenerator *generator)
+{
+	int index;
+	if ( getrandom(generator->batch, sizeof(generator->batch), 0) == (ssize_t) sizeof(generator->batch) ) {
+		for ( index = 0; index < MESSAGE_ID_BATCH_SIZE; index ++ ) {
+			generator->batch[index][6] = ( generator->batch[index][6] & 0x0F ) | 0x40;
+			generator->batch[index][8] = ( generator->batch[index][8] & 0x3F ) | 0x80;
+		}
+	}
+	else {
+		for ( index = 0; index < MESSAGE_ID_BATCH_SIZE; index ++ ) {
+			uuid_generate(generator->batch[index]);
+		}
+	}
+	generator->batchIndex = 0;
+}
+
+void messageIdInit(MessageIdGenerator *generator, MessageIdStrategy strategy)
+{
+	uuid_t uuid;
+	memset(generator, 0, sizeof(MessageIdGenerator));
+	generator->strategy = strategy;
+	generator->batchIndex = MESSAGE_ID_BATCH_SIZE;
+	if ( strategy == MESSAGE_ID_SEQUENCE ) {
+		uuid_generate(uuid);
+		generator->prefixLength = formatUUID(uuid, generator->prefix);
+		generator->prefix[generator->prefixLength ++] = '-';
+		generator->prefix[generator->prefixLength] = 0;
+	}
+}
+
+/*
+ Return the strategy for the name 'uuid', 'uuid-batched' or 'sequence', false if the name is not known.
+*/
+bool messageIdReadStrategy(const char *text, MessageIdStrategy *strategy)
+{
+	if ( strcasecmp(text, "uuid") == 0 ) {
+		*strategy = MESSAGE_ID_UUID;
+		return true;
+	}
+	if ( strcasecmp(text, "uuid-batched") == 0 ) {
+		*strategy = MESSAGE_ID_UUID_BATCHED;
+		return true;
+	}
+	if ( strcasecmp(text, "sequence") == 0 ) {
+		*strategy = MESSAGE_ID_SEQUENCE;
+		return true;
+	}
+	return false;
+}
+
+/*
+ Write the next id into the buffer, which must be at least MESSAGE_ID_BUFFER_SIZE bytes. Returns the length of the id.
+*/
+size_t messageIdNext(MessageIdGenerator *generator, char *buffer)
+{
+	uuid_t uuid;
+	char digits[16];
+	unsigned long long counter;
+	size_t length;
+	int digitCount = 0;
+	
+	switch ( generator->strategy ) {
+		case MESSAGE_ID_UUID_BATCHED:
+			if ( generator->batchIndex >= MESSAGE_ID_BATCH_SIZE ) {
+				fillBatch(generator);
+			}
+			return formatUUID(generator->batch[generator->batchIndex ++], buffer);
+		
+		case MESSAGE_ID_SEQUENCE:
+			// prefix followed by the counter in hex, without leading zeros
+			counter = ++ generator->counter;
+			do {
+				digits[digitCount ++] = hexDigits[counter & 0x0F];
+				counter >>= 4;
+			} while ( counter );
+			memcpy(buffer, generator->prefix, generator->prefixLength);
+			length = generator->prefixLength;
+			while ( digitCount > 0 ) {
+				buffer[length ++] = digits[-- digitCount];
+			}
+			buffer[length] = 0;
+			return length;
+			
+		default:
+			uuid_generate(uuid);
+			return formatUUID(uuid, buffer);
+	}
+}
@@ -0,0 +1,43 @@
+#ifndef IOTHUBID_H
+#define IOTHUBID_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#define MESSAGE_ID_BATCH_SIZE					32			// uuids made from one read of random bytes
+#define MESSAGE_ID_UUID_SIZE					16
+#define MESSAGE_ID_BUFFER_SIZE					64			// big enough for any id made by messageIdNext
+
+
+typedef enum {
+	MESSAGE_ID_UUID,						// uuid_generate for each id
+	MESSAGE_ID_UUID_BATCHED,				// random uuids made in blocks of MESSAGE_ID_BATCH_SIZE
+	MESSAGE_ID_SEQUENCE,					// random uuid prefix made once, followed by a counter
+} MessageIdStrategy;
+
+typedef struct {
+	MessageIdStrategy strategy;
+	unsigned char batch[MESSAGE_ID_BATCH_SIZE][MESSAGE_ID_UUID_SIZE];
+	int batchIndex;							// next unused uuid in the batch
+	char prefix[MESSAGE_ID_BUFFER_SIZE];
+	size_t prefixLength;
+	unsigned long long counter;
+} MessageIdGenerator;
+
+
+void messageIdInit(MessageIdGenerator *generator, MessageIdStrategy strategy);
+bool messageIdReadStrategy(const char *text, MessageIdStrategy *strategy);
+size_t messageIdNext(MessageIdGenerator *generator, char *buffer);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// IOTHUBID_H
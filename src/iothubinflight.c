@@ -0,0 +1,227 @@
+/*
+
+ Table of outstanding sends used by the luaazureiothub library.
+
+ Each send record is added when it is made and removed when it is released, so a confirmation from the SDK can be
+ checked against it, and lua can look up a message by its sequence number or id without walking the send queues.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "iothubinflight.h"
+
+
+static unsigned int hashSequence(unsigned long long sequence)
+{
+	// fibonacci hashing, the sequence numbers are consecutive so the high bits of the product spread them out
+	return (unsigned int) ( ( sequence * 0x9E3779B97F4A7C15ULL ) >> 32 );
+}
+
+static unsigned int hashMessageId(const char *messageId)
+{
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	while ( *messageId ) {
+		hash ^= (unsigned char) *messageId ++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void insertSequence(InFlightSequenceSlot *slots, unsigned int mask, unsigned long long sequence, void *value)
+{
+	unsigned int index = hashSequence(sequence) & mask;
+	while ( slots[index].sequence != 0 ) {
+		index = ( index + 1 ) & mask;
+	}
+	slots[index].sequence = sequence;
+	slots[index].value = value;
+}
+
+static void insertMessageId(InFlightIdSlot *slots, unsigned int mask, const char *messageId, unsigned int hash, void *value)
+{
+	unsigned int index = hash & mask;
+	while ( slots[index].messageId ) {
+		index = ( index + 1 ) & mask;
+	}
+	slots[index].messageId = messageId;
+	slots[index].hash = hash;
+	slots[index].value = value;
+}
+
+static bool grow(InFlightTable *table)
+{
+	unsigned int size = table->mask ? ( table->mask + 1 ) * 2 : IN_FLIGHT_MIN_SIZE;
+	unsigned int index;
+	InFlightSequenceSlot *sequenceSlots = calloc(size, sizeof(InFlightSequenceSlot));
+	InFlightIdSlot *idSlots = calloc(size, sizeof(InFlightIdSlot));
+	if ( sequenceSlots == NULL || idSlots == NULL ) {
+		free(sequenceSlots);
+		free(idSlots);
+		return false;
+	}
+	if ( table->mask ) {
+		for ( index = 0; index <= table->mask; index ++ ) {
+			if ( table->sequenceSlots[index].sequence ) {
+				insertSequence(sequenceSlots, size - 1, table->sequenceSlots[index].sequence, table->sequenceSlots[index].value);
+			}
+			if ( table->idSlots[index].messageId ) {
+				insertMessageId(idSlots, size - 1, table->idSlots[index].messageId, table->idSlots[index].hash, table->idSlots[index].value);
+			}
+		}
+	}
+	free(table->sequenceSlots);
+	free(table->idSlots);
+	table->sequenceSlots = sequenceSlots;
+	table->idSlots = idSlots;
+	table->mask = size - 1;
+	return true;
+}
+
+void inFlightFree(InFlightTable *table)
+{
+	free(table->sequenceSlots);
+	free(table->idSlots);
+	memset(table, 0, sizeof(InFlightTable));
+}
+
+/*
+ Add a send, the message id can be NULL. The id string is not copied, so it has to stay the same until the send
+ is removed. Returns false if the table cannot grow.
+*/
+bool inFlightAdd(InFlightTable *table, unsigned long long sequence, const char *messageId, void *value)
+{
+	if ( sequence == 0 ) {
+		return false;
+	}
+	if ( ( table->count + 1 ) * 2 > table->mask + 1 && !grow(table) ) {
+		return false;
+	}
+	insertSequence(table->sequenceSlots, table->mask, sequence, value);
+	if ( messageId ) {
+		insertMessageId(table->idSlots, table->mask, messageId, hashMessageId(messageId), value);
+	}
+	table->count ++;
+	return true;
+}
+
+/*
+ Close the gap left at 'index' by moving back the entries after it that probed past it, so lookups never
+ stop early at an empty slot.
+*/
+static void removeSequenceSlot(InFlightTable *table, unsigned int index)
+{
+	InFlightSequenceSlot *slots = table->sequenceSlots;
+	unsigned int next = ( index + 1 ) & table->mask;
+	while ( slots[next].sequence ) {
+		unsigned int home = hashSequence(slots[next].sequence) & table->mask;
+		if ( ( ( next - home ) & table->mask ) >= ( ( next - index ) & table->mask ) ) {
+			slots[index] = slots[next];
+			index = next;
+		}
+		next = ( next + 1 ) & table->mask;
+	}
+	slots[index].sequence = 0;
+	slots[index].value = NULL;
+}
+
+static void removeIdSlot(InFlightTable *table, unsigned int index)
+{
+	InFlightIdSlot *slots = table->idSlots;
+	unsigned int next = ( index + 1 ) & table->mask;
+	while ( slots[next].messageId ) {
+		unsigned int home = slots[next].hash & table->mask;
+		if ( ( ( next - home ) & table->mask ) >= ( ( next - index ) & table->mask ) ) {
+			slots[index] = slots[next];
+			index = next;
+		}
+		next = ( next + 1 ) & table->mask;
+	}
+	slots[index].messageId = NULL;
+	slots[index].value = NULL;
+}
+
+/*
+ Remove the send added with these values. Returns false if it is not in the table.
+*/
+bool inFlightRemove(InFlightTable *table, unsigned long long sequence, const char *messageId, void *value)
+{
+	unsigned int index;
+	if ( table->count == 0 || sequence == 0 ) {
+		return false;
+	}
+	index = hashSequence(sequence) & table->mask;
+	while ( table->sequenceSlots[index].sequence != sequence || table->sequenceSlots[index].value != value ) {
+		if ( table->sequenceSlots[index].sequence == 0 ) {
+			return false;
+		}
+		index = ( index + 1 ) & table->mask;
+	}
+	removeSequenceSlot(table, index);
+	table->count --;
+	if ( messageId ) {
+		index = hashMessageId(messageId) & table->mask;
+		while ( table->idSlots[index].messageId ) {
+			if ( table->idSlots[index].value == value ) {
+				removeIdSlot(table, index);
+				break;
+			}
+			index = ( index + 1 ) & table->mask;
+		}
+	}
+	return true;
+}
+
+void *inFlightFind(const InFlightTable *table, unsigned long long sequence)
+{
+	unsigned int index;
+	if ( table->count == 0 || sequence == 0 ) {
+		return NULL;
+	}
+	index = hashSequence(sequence) & table->mask;
+	while ( table->sequenceSlots[index].sequence ) {
+		if ( table->sequenceSlots[index].sequence == sequence ) {
+			return table->sequenceSlots[index].value;
+		}
+		index = ( index + 1 ) & table->mask;
+	}
+	return NULL;
+}
+
+void *inFlightFindId(const InFlightTable *table, const char *messageId)
+{
+	unsigned int hash;
+	unsigned int index;
+	if ( table->count == 0 || messageId == NULL ) {
+		return NULL;
+	}
+	hash = hashMessageId(messageId);
+	index = hash & table->mask;
+	while ( table->idSlots[index].messageId ) {
+		if ( table->idSlots[index].hash == hash && strcmp(table->idSlots[index].messageId, messageId) == 0 ) {
+			return table->idSlots[index].value;
+		}
+		index = ( index + 1 ) & table->mask;
+	}
+	return NULL;
+}
+
+/*
+ Walk the sends in no particular order, start with *index at 0. Returns NULL after the last one. The table must
+ not be changed during the walk.
+*/
+void *inFlightNext(const InFlightTable *table, unsigned int *index)
+{
+	if ( table->count == 0 ) {
+		return NULL;
+	}
+	while ( *index <= table->mask ) {
+		unsigned int slot = ( *index ) ++;
+		if ( table->sequenceSlots[slot].sequence ) {
+			return table->sequenceSlots[slot].value;
+		}
+	}
+	return NULL;
+}
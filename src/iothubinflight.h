@@ -0,0 +1,51 @@
+#ifndef IOTHUBINFLIGHT_H
+#define IOTHUBINFLIGHT_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+
+#define IN_FLIGHT_MIN_SIZE						64			// slots in each index when the first entry is added
+
+
+typedef struct {
+	unsigned long long sequence;			// 0 marks an empty slot
+	void *value;
+} InFlightSequenceSlot;
+
+typedef struct {
+	const char *messageId;					// NULL marks an empty slot, the string belongs to the value
+	unsigned int hash;
+	void *value;
+} InFlightIdSlot;
+
+/*
+ Open addressing table of the sends a connection is waiting on, indexed by sequence number and by message id.
+ Both indexes use linear probing and have the same power of two size, which is doubled when they are half full.
+ More than one entry can have the same message id, a lookup by id then returns any one of them.
+*/
+typedef struct {
+	InFlightSequenceSlot *sequenceSlots;
+	InFlightIdSlot *idSlots;
+	unsigned int mask;						// slots - 1, or 0 before the first entry is added
+	unsigned int count;
+} InFlightTable;
+
+
+void inFlightFree(InFlightTable *table);
+bool inFlightAdd(InFlightTable *table, unsigned long long sequence, const char *messageId, void *value);
+bool inFlightRemove(InFlightTable *table, unsigned long long sequence, const char *messageId, void *value);
+void *inFlightFind(const InFlightTable *table, unsigned long long sequence);
+void *inFlightFindId(const InFlightTable *table, const char *messageId);
+void *inFlightNext(const InFlightTable *table, unsigned int *index);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// IOTHUBINFLIGHT_H
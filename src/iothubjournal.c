@@ -0,0 +1,408 @@
+/*
+
+ Store and forward journal used by the luaazureiothub library.
+
+ Outbound messages are written as CRC framed records into a ring held in a memory mapped file, so they survive a
+ crash or power cut until the IotHub has confirmed them. A record is acked in place by changing its state, and the
+ head of the ring moves on over any acked records at the front.
+
+ The file starts with two copies of the header, written in turn with a generation count, so a torn header write 
+ leaves the other copy intact. The header holds the head of the ring and the sequence number of the record there.
+ On open only the records from the head onwards are checked, each must have the next sequence number and a valid 
+ CRC. The first record that does not is the end of the ring, so recovery time depends on the size of the un-acked 
+ part of the file and not on the size of the file.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iothubjournal.h"
+
+
+#define JOURNAL_MAGIC							0x4C4E524A	// 'JRNL'
+#define JOURNAL_VERSION							1
+#define JOURNAL_RECORD_MAGIC					0x44434552	// 'RECD'
+#define JOURNAL_WRAP_MAGIC						0x50415257	// 'WRAP', rest of the ring up to the end of the file is unused
+#define JOURNAL_STATE_PENDING					1
+#define JOURNAL_STATE_ACKED						2
+#define JOURNAL_ALIGN							8
+
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity;
+	uint64_t head;
+	uint64_t headSequence;
+	uint64_t generation;
+	uint32_t crc;							// of all the fields above
+	uint32_t reserved;
+} JournalFileHeader;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t length;						// of the data after this record header
+	uint64_t sequence;
+	uint32_t crc;							// of the length, sequence and data, the state is not covered
+	uint32_t state;
+} JournalRecord;
+
+
+static uint32_t crcTable[256];
+static bool isCRCTableReady = false;
+
+static uint32_t crcUpdate(uint32_t crc, const void *data, size_t length)
+{
+	const unsigned char *bytes = (const unsigned char *) data;
+	size_t index;
+	if ( !isCRCTableReady ) {
+		uint32_t value;
+		int tableIndex;
+		int bit;
+		for ( tableIndex = 0; tableIndex < 256; tableIndex ++ ) {
+			value = tableIndex;
+			for ( bit = 0; bit < 8; bit ++ ) {
+				value = ( value & 1 ) ? 0xEDB88320 ^ ( value >> 1 ) : value >> 1;
+			}
+			crcTable[tableIndex] = value;
+		}
+		isCRCTableReady = true;
+	}
+	crc = ~crc;
+	for ( index = 0; index < length; index ++ ) {
+		crc = crcTable[( crc ^ bytes[index] ) & 0xFF] ^ ( crc >> 8 );
+	}
+	return ~crc;
+}
+
+static uint32_t recordCRC(const JournalRecord *record)
+{
+	uint32_t crc = crcUpdate(0, &record->length, sizeof(record->length));
+	crc = crcUpdate(crc, &record->sequence, sizeof(record->sequence));
+	return crcUpdate(crc, record + 1, record->length);
+}
+
+static uint64_t recordSize(uint64_t length)
+{
+	return ( sizeof(JournalRecord) + length + JOURNAL_ALIGN - 1 ) & ~((uint64_t) JOURNAL_ALIGN - 1);
+}
+
+static JournalRecord *recordAt(Journal *journal, uint64_t offset)
+{
+	return (JournalRecord *) ( journal->data + offset % journal->capacity );
+}
+
+/*
+ Return the number of bytes to skip to get to the next lap of the ring, if there is no record at the offset
+ because the rest of the ring is too small or has been marked as unused. Returns 0 if there should be a record.
+*/
+static uint64_t wrapSize(Journal *journal, uint64_t offset, uint64_t sequence)
+{
+	uint64_t position = offset % journal->capacity;
+	uint64_t remaining = journal->capacity - position;
+	JournalRecord *record = recordAt(journal, offset);
+	if ( remaining < sizeof(JournalRecord) ) {
+		return remaining;
+	}
+	if ( record->magic == JOURNAL_WRAP_MAGIC && record->sequence == sequence ) {
+		return remaining;
+	}
+	return 0;
+}
+
+static void syncRange(Journal *journal, void *start, size_t length)
+{
+	long pageSize = sysconf(_SC_PAGESIZE);
+	uintptr_t first = (uintptr_t) start & ~((uintptr_t) pageSize - 1);
+	if ( journal->isSync ) {
+		msync((void *) first, (uintptr_t) start + length - first, MS_SYNC);
+	}
+}
+
+static uint32_t headerCRC(const JournalFileHeader *header)
+{
+	return crcUpdate(0, header, offsetof(JournalFileHeader, crc));
+}
+
+static void writeHeader(Journal *journal)
+{
+	JournalFileHeader header;
+	journal->generation ++;
+	memset(&header, 0, sizeof(header));
+	header.magic = JOURNAL_MAGIC;
+	header.version = JOURNAL_VERSION;
+	header.capacity = journal->capacity;
+	header.head = journal->head;
+	header.headSequence = journal->headSequence;
+	header.generation = journal->generation;
+	header.crc = headerCRC(&header);
+	
+	void *slot = journal->map + ( journal->generation & 1 ) * ( JOURNAL_HEADER_SIZE / 2 );
+	memcpy(slot, &header, sizeof(header));
+	syncRange(journal, slot, sizeof(header));
+}
+
+/*
+ Load the newest valid copy of the header, returns false if neither copy is valid for this file.
+*/
+static bool readHeader(Journal *journal)
+{
+	const JournalFileHeader *best = NULL;
+	int slotIndex;
+	for ( slotIndex = 0; slotIndex < 2; slotIndex ++ ) {
+		const JournalFileHeader *header = (const JournalFileHeader *) ( journal->map + slotIndex * ( JOURNAL_HEADER_SIZE / 2 ) );
+		if ( header->magic == JOURNAL_MAGIC && header->version == JOURNAL_VERSION && header->crc == headerCRC(header)
+				&& header->capacity == journal->capacity && header->head % JOURNAL_ALIGN == 0 ) {
+			if ( best == NULL || header->generation > best->generation ) {
+				best = header;
+			}
+		}
+	}
+	if ( best == NULL ) {
+		return false;
+	}
+	journal->head = best->head;
+	journal->headSequence = best->headSequence;
+	journal->generation = best->generation;
+	return true;
+}
+
+/*
+ Walk the records from the head to find the tail, and count the records still waiting for an ack.
+*/
+static void recover(Journal *journal)
+{
+	uint64_t offset = journal->head;
+	uint64_t sequence = journal->headSequence;
+	
+	journal->pendingCount = 0;
+	while ( offset - journal->head < journal->capacity ) {
+		uint64_t skip = wrapSize(journal, offset, sequence);
+		if ( skip ) {
+			offset += skip;
+			continue;
+		}
+		JournalRecord *record = recordAt(journal, offset);
+		uint64_t position = offset % journal->capacity;
+		if ( record->magic != JOURNAL_RECORD_MAGIC || record->sequence != sequence 
+				|| record->length > journal->capacity - position - sizeof(JournalRecord)
+				|| offset + recordSize(record->length) - journal->head > journal->capacity
+				|| record->crc != recordCRC(record) ) {
+			break;
+		}
+		if ( record->state != JOURNAL_STATE_ACKED ) {
+			journal->pendingCount ++;
+		}
+		offset += recordSize(record->length);
+		sequence ++;
+	}
+	journal->tail = offset;
+	journal->nextSequence = sequence;
+}
+
+/*
+ Open or create the journal file. An existing journal keeps its own size, 'size' is only used for a new file.
+ Returns NULL and sets errorMessage on failure.
+*/
+Journal *journalOpen(const char *path, size_t size, bool isSync, const char **errorMessage)
+{
+	struct stat fileStat;
+	bool isNew = false;
+	Journal *journal = calloc(1, sizeof(Journal));
+	
+	if ( journal == NULL ) {
+		*errorMessage = "Out of memory";
+		return NULL;
+	}
+	journal->isSync = isSync;
+	journal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if ( journal->fd < 0 ) {
+		*errorMessage = "Cannot open the journal file";
+		free(journal);
+		return NULL;
+	}
+	if ( flock(journal->fd, LOCK_EX | LOCK_NB) != 0 ) {
+		*errorMessage = "Journal file is in use";
+		journalClose(journal);
+		return NULL;
+	}
+	if ( fstat(journal->fd, &fileStat) != 0 ) {
+		*errorMessage = "Cannot read the journal file";
+		journalClose(journal);
+		return NULL;
+	}
+	
+	if ( (uint64_t) fileStat.st_size >= JOURNAL_HEADER_SIZE + JOURNAL_MIN_BYTES && fileStat.st_size % JOURNAL_ALIGN == 0 ) {
+		journal->capacity = fileStat.st_size - JOURNAL_HEADER_SIZE;
+	}
+	else {
+		if ( size < JOURNAL_MIN_BYTES ) {
+			size = JOURNAL_MIN_BYTES;
+		}
+		journal->capacity = size & ~((uint64_t) JOURNAL_ALIGN - 1);
+		isNew = true;
+	}
+	journal->mapSize = JOURNAL_HEADER_SIZE + journal->capacity;
+	if ( isNew && ( ftruncate(journal->fd, journal->mapSize) != 0 || posix_fallocate(journal->fd, 0, journal->mapSize) != 0 ) ) {
+		*errorMessage = "Cannot allocate the journal file";
+		journalClose(journal);
+		return NULL;
+	}
+	journal->map = mmap(NULL, journal->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+	if ( journal->map == MAP_FAILED ) {
+		journal->map = NULL;
+		*errorMessage = "Cannot map the journal file";
+		journalClose(journal);
+		return NULL;
+	}
+	journal->data = journal->map + JOURNAL_HEADER_SIZE;
+	
+	if ( isNew || !readHeader(journal) ) {
+		// start the sequence from the clock, so records left in the file from before cannot follow on from ours, even
+		// when they were written in the same second
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		memset(journal->map, 0, JOURNAL_HEADER_SIZE);
+		journal->head = 0;
+		journal->headSequence = ( (uint64_t) now.tv_sec << 24 ) | ( (uint64_t) now.tv_nsec >> 6 );
+		journal->generation = 0;
+		writeHeader(journal);
+	}
+	recover(journal);
+	return journal;
+}
+
+void journalClose(Journal *journal)
+{
+	if ( journal->map ) {
+		msync(journal->map, journal->mapSize, MS_ASYNC);
+		munmap(journal->map, journal->mapSize);
+	}
+	if ( journal->fd >= 0 ) {
+		close(journal->fd);
+	}
+	free(journal);
+}
+
+/*
+ Reserve room for a record with 'length' bytes of data, returns a pointer to write the data to, or NULL if the 
+ journal is full. The record is not part of the journal until journalCommit is called with the returned offset.
+*/
+void *journalReserve(Journal *journal, size_t length, unsigned long long *offset)
+{
+	uint64_t size = recordSize(length);
+	uint64_t position = journal->tail % journal->capacity;
+	uint64_t padding = 0;
+	
+	if ( position + size > journal->capacity ) {
+		padding = journal->capacity - position;
+	}
+	if ( length > UINT32_MAX || ( journal->tail - journal->head ) + padding + size > journal->capacity ) {
+		return NULL;
+	}
+	if ( padding >= sizeof(JournalRecord) ) {
+		JournalRecord *wrap = recordAt(journal, journal->tail);
+		memset(wrap, 0, sizeof(JournalRecord));
+		wrap->sequence = journal->nextSequence;
+		wrap->magic = JOURNAL_WRAP_MAGIC;
+		syncRange(journal, wrap, sizeof(JournalRecord));
+	}
+	journal->tail += padding;
+	
+	JournalRecord *record = recordAt(journal, journal->tail);
+	record->magic = 0;
+	record->length = length;
+	record->sequence = journal->nextSequence;
+	record->state = JOURNAL_STATE_PENDING;
+	*offset = journal->tail;
+	return record + 1;
+}
+
+void journalCommit(Journal *journal, unsigned long long offset)
+{
+	JournalRecord *record = recordAt(journal, offset);
+	record->crc = recordCRC(record);
+	record->magic = JOURNAL_RECORD_MAGIC;
+	journal->tail = offset + recordSize(record->length);
+	journal->nextSequence ++;
+	journal->pendingCount ++;
+	syncRange(journal, record, recordSize(record->length));
+}
+
+/*
+ Mark the record as sent, and move the head on over any acked records at the front of the ring.
+*/
+void journalAck(Journal *journal, unsigned long long offset)
+{
+	JournalRecord *record = recordAt(journal, offset);
+	bool isHeadMoved = false;
+	
+	if ( offset < journal->head || offset >= journal->tail || record->state == JOURNAL_STATE_ACKED ) {
+		return;
+	}
+	record->state = JOURNAL_STATE_ACKED;
+	journal->pendingCount --;
+	syncRange(journal, &record->state, sizeof(record->state));
+	
+	while ( journal->head < journal->tail ) {
+		uint64_t skip = wrapSize(journal, journal->head, journal->headSequence);
+		if ( skip ) {
+			journal->head += skip;
+			isHeadMoved = true;
+			continue;
+		}
+		record = recordAt(journal, journal->head);
+		if ( record->state != JOURNAL_STATE_ACKED ) {
+			break;
+		}
+		journal->head += recordSize(record->length);
+		journal->headSequence ++;
+		isHeadMoved = true;
+	}
+	if ( isHeadMoved ) {
+		writeHeader(journal);
+	}
+}
+
+/*
+ Step through the records that have not been acked, oldest first. Start with *offset set to JOURNAL_NO_RECORD.
+ Returns false when there are no more records. If the head has moved past *offset since the last call, the next 
+ record is found from the head, as the space behind the head may have been used again.
+*/
+bool journalNext(Journal *journal, unsigned long long *offset, const void **data, size_t *length)
+{
+	uint64_t cursor = journal->head;
+	uint64_t sequence = journal->headSequence;
+	JournalRecord *record;
+	
+	if ( *offset != JOURNAL_NO_RECORD && *offset >= journal->head ) {
+		record = recordAt(journal, *offset);
+		cursor = *offset + recordSize(record->length);
+		sequence = record->sequence + 1;
+	}
+	while ( cursor < journal->tail ) {
+		uint64_t skip = wrapSize(journal, cursor, sequence);
+		if ( skip ) {
+			cursor += skip;
+			continue;
+		}
+		record = recordAt(journal, cursor);
+		if ( record->state != JOURNAL_STATE_ACKED ) {
+			*offset = cursor;
+			*data = record + 1;
+			*length = record->length;
+			return true;
+		}
+		cursor += recordSize(record->length);
+		sequence ++;
+	}
+	return false;
+}
@@ -0,0 +1,51 @@
+#ifndef IOTHUBJOURNAL_H
+#define IOTHUBJOURNAL_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define JOURNAL_HEADER_SIZE						4096		// two copies of the file header, written in turn
+#define JOURNAL_MIN_BYTES						65536
+#define JOURNAL_NO_RECORD						((unsigned long long) -1)
+
+
+/*
+ Outbound message journal, a ring of CRC framed records in a memory mapped file. Record positions are logical 
+ offsets that only ever increase, the position in the file is the offset modulo the capacity.
+*/
+typedef struct {
+	int fd;
+	unsigned char *map;
+	size_t mapSize;
+	unsigned char *data;					// start of the record ring, after the file header
+	uint64_t capacity;
+	uint64_t head;							// oldest record that has not been acked
+	uint64_t headSequence;					// sequence number of the record at head
+	uint64_t tail;							// where the next record is written
+	uint64_t nextSequence;
+	uint64_t generation;					// bumped each time the file header is written
+	unsigned int pendingCount;				// records written and not yet acked
+	bool isSync;							// msync each change before returning
+} Journal;
+
+
+Journal *journalOpen(const char *path, size_t size, bool isSync, const char **errorMessage);
+void journalClose(Journal *journal);
+void *journalReserve(Journal *journal, size_t length, unsigned long long *offset);
+void journalCommit(Journal *journal, unsigned long long offset);
+void journalAck(Journal *journal, unsigned long long offset);
+bool journalNext(Journal *journal, unsigned long long *offset, const void **data, size_t *length);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// IOTHUBJOURNAL_H
@@ -0,0 +1,522 @@
+/*
+
+ Loopback transport used by the luaazureiothub library.
+
+ A transport provider for the SDK client that does not open a connection. Each message handed to the SDK is held
+ for the set latency and then confirmed, or failed with IOTHUB_CLIENT_CONFIRMATION_ERROR at the set error rate, and
+ cloud to device messages queued with loopbackInject are passed to the client of the device they are for. This runs
+ the same SDK and library code paths as a real transport, so the library can be tested without an IotHub.
+
+ The queue of injected messages is shared by all of the loopback transports and protected by a mutex, since the
+ transport DoWork can be run on the io thread. The rest of the transport is only used by the thread running the SDK.
+
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iothub_client_ll.h"
+#include "doublylinkedlist.h"
+
+#include "iothubloopback.h"
+
+
+typedef struct LoopbackTransport LoopbackTransport;
+typedef struct LoopbackDevice LoopbackDevice;
+typedef struct LoopbackBatch LoopbackBatch;
+typedef struct LoopbackMessage LoopbackMessage;
+
+// messages taken from the SDK in one DoWork, confirmed together once the latency has passed
+struct LoopbackBatch {
+	LoopbackBatch *next;
+	unsigned long long due;
+	DLIST_ENTRY messages;					// IOTHUB_MESSAGE_LIST entries moved from waitingToSend
+};
+
+struct LoopbackDevice {
+	LoopbackDevice *next;
+	LoopbackTransport *transport;
+	char *deviceId;
+	IOTHUB_CLIENT_LL_HANDLE clientHandle;
+	PDLIST_ENTRY waitingToSend;				// owned by the SDK client, NULL if the device is not in use
+	LoopbackBatch *batchHead;
+	LoopbackBatch *batchTail;
+	DLIST_ENTRY delivered;					// the batch being confirmed, left here if a callback leaves DoWork with a longjmp
+	DLIST_ENTRY failed;
+	LoopbackDevice *nextRetired;			// in the retired list of the transport once unregistered during DoWork
+	bool isSubscribed;
+};
+
+struct LoopbackTransport {
+	LoopbackDevice device;					// first, so the transport handle is also the handle of its own device
+	unsigned int latencyMs;
+	double errorRate;
+	uint32_t randomState;
+	unsigned int doWorkDepth;				// DoWork calls running, more than one when a callback runs the client again
+	LoopbackDevice *retired;				// devices unregistered during DoWork, freed once the outermost DoWork returns
+	bool isDestroyed;						// destroyed during DoWork, freed once the outermost DoWork returns
+};
+
+struct LoopbackMessage {
+	LoopbackMessage *next;
+	IOTHUB_MESSAGE_HANDLE messageHandle;
+	char deviceId[];
+};
+
+static pthread_mutex_t hubMutex = PTHREAD_MUTEX_INITIALIZER;
+static LoopbackMessage *hubHead = NULL;
+static LoopbackMessage *hubTail = NULL;
+
+
+static unsigned long long timeNowMs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ xorshift32, good enough to pick the messages that fail.
+*/
+static bool isFailure(LoopbackTransport *transport)
+{
+	if ( transport->errorRate <= 0 ) {
+		return false;
+	}
+	transport->randomState ^= transport->randomState << 13;
+	transport->randomState ^= transport->randomState >> 17;
+	transport->randomState ^= transport->randomState << 5;
+	return transport->randomState < transport->errorRate * UINT32_MAX;
+}
+
+/*
+ Queue a cloud to device message for the device, the message handle belongs to the queue from now on.
+*/
+bool loopbackInject(const char *deviceId, IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	size_t length = strlen(deviceId);
+	LoopbackMessage *message = malloc(sizeof(LoopbackMessage) + length + 1);
+	if ( message == NULL ) {
+		return false;
+	}
+	message->next = NULL;
+	message->messageHandle = messageHandle;
+	memcpy(message->deviceId, deviceId, length + 1);
+	pthread_mutex_lock(&hubMutex);
+	if ( hubTail ) {
+		hubTail->next = message;
+	}
+	else {
+		hubHead = message;
+	}
+	hubTail = message;
+	pthread_mutex_unlock(&hubMutex);
+	return true;
+}
+
+/*
+ Remove the oldest message queued for the device.
+*/
+static LoopbackMessage *hubTake(const char *deviceId)
+{
+	LoopbackMessage *previous = NULL;
+	LoopbackMessage *message;
+	pthread_mutex_lock(&hubMutex);
+	for ( message = hubHead; message; message = message->next ) {
+		if ( strcmp(message->deviceId, deviceId) == 0 ) {
+			if ( previous ) {
+				previous->next = message->next;
+			}
+			else {
+				hubHead = message->next;
+			}
+			if ( hubTail == message ) {
+				hubTail = previous;
+			}
+			message->next = NULL;
+			break;
+		}
+		previous = message;
+	}
+	pthread_mutex_unlock(&hubMutex);
+	return message;
+}
+
+/*
+ Put an abandoned message back at the front of the queue, so it is the next one passed to the device.
+*/
+static void hubPutBack(LoopbackMessage *message)
+{
+	pthread_mutex_lock(&hubMutex);
+	message->next = hubHead;
+	hubHead = message;
+	if ( hubTail == NULL ) {
+		hubTail = message;
+	}
+	pthread_mutex_unlock(&hubMutex);
+}
+
+/*
+ Move the messages waiting in the SDK client into a new batch, due once the latency has passed.
+*/
+static void deviceTakeWaiting(LoopbackDevice *device, unsigned long long now)
+{
+	if ( DList_IsListEmpty(device->waitingToSend) ) {
+		return;
+	}
+	// if this fails the messages stay in the SDK until the next DoWork
+	LoopbackBatch *batch = malloc(sizeof(LoopbackBatch));
+	if ( batch == NULL ) {
+		return;
+	}
+	batch->next = NULL;
+	batch->due = now + device->transport->latencyMs;
+	DList_InitializeListHead(&batch->messages);
+	while ( !DList_IsListEmpty(device->waitingToSend) ) {
+		DList_InsertTailList(&batch->messages, DList_RemoveHeadList(device->waitingToSend));
+	}
+	if ( device->batchTail ) {
+		device->batchTail->next = batch;
+	}
+	else {
+		device->batchHead = batch;
+	}
+	device->batchTail = batch;
+}
+
+static void deviceInitialize(LoopbackDevice *device, LoopbackTransport *transport)
+{
+	device->transport = transport;
+	DList_InitializeListHead(&device->delivered);
+	DList_InitializeListHead(&device->failed);
+}
+
+/*
+ Give the messages that have not been confirmed back to the SDK client, in the order they were sent. The client
+ fails them with IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY when it is destroyed. A confirmation running further up
+ the stack finds its list empty and stops.
+*/
+static void deviceReturnWaiting(LoopbackDevice *device)
+{
+	DLIST_ENTRY messages;
+	DList_InitializeListHead(&messages);
+	while ( !DList_IsListEmpty(&device->delivered) ) {
+		DList_InsertTailList(&messages, DList_RemoveHeadList(&device->delivered));
+	}
+	while ( !DList_IsListEmpty(&device->failed) ) {
+		DList_InsertTailList(&messages, DList_RemoveHeadList(&device->failed));
+	}
+	while ( device->batchHead ) {
+		LoopbackBatch *batch = device->batchHead;
+		device->batchHead = batch->next;
+		while ( !DList_IsListEmpty(&batch->messages) ) {
+			DList_InsertTailList(&messages, DList_RemoveHeadList(&batch->messages));
+		}
+		free(batch);
+	}
+	device->batchTail = NULL;
+	// newest first onto the front, so they go in front of any messages sent since the last DoWork
+	while ( !DList_IsListEmpty(&messages) ) {
+		PDLIST_ENTRY entry = messages.Blink;
+		DList_RemoveEntryList(entry);
+		DList_InsertHeadList(device->waitingToSend, entry);
+	}
+}
+
+/*
+ Pass the confirmed messages to the SDK client, which takes them off the list one at a time. Returns false if a
+ callback destroyed the transport.
+*/
+static bool deviceSendComplete(LoopbackDevice *device, PDLIST_ENTRY completed, IOTHUB_CLIENT_CONFIRMATION_RESULT result)
+{
+	if ( !DList_IsListEmpty(completed) ) {
+		IoTHubClient_LL_SendComplete(device->clientHandle, completed, result);
+	}
+	return !device->transport->isDestroyed;
+}
+
+/*
+ Confirm the batches that are due, after whatever is left of the last batch. That is left when a callback left DoWork
+ with a longjmp, or when a callback ran DoWork again and this call is the inner one. Returns false if a callback
+ destroyed the transport.
+*/
+static bool deviceConfirmDue(LoopbackDevice *device, unsigned long long now)
+{
+	LoopbackTransport *transport = device->transport;
+	if ( !deviceSendComplete(device, &device->delivered, IOTHUB_CLIENT_CONFIRMATION_OK)
+			|| !deviceSendComplete(device, &device->failed, IOTHUB_CLIENT_CONFIRMATION_ERROR) ) {
+		return false;
+	}
+	// unregistering the device from a callback returns its batches, which ends this
+	while ( device->batchHead && device->batchHead->due <= now ) {
+		LoopbackBatch *batch = device->batchHead;
+		
+		device->batchHead = batch->next;
+		if ( device->batchHead == NULL ) {
+			device->batchTail = NULL;
+		}
+		while ( !DList_IsListEmpty(&batch->messages) ) {
+			DList_InsertTailList(isFailure(transport) ? &device->failed : &device->delivered, DList_RemoveHeadList(&batch->messages));
+		}
+		free(batch);
+		if ( !deviceSendComplete(device, &device->delivered, IOTHUB_CLIENT_CONFIRMATION_OK)
+				|| !deviceSendComplete(device, &device->failed, IOTHUB_CLIENT_CONFIRMATION_ERROR) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ Pass the messages queued for the device to the SDK client. An abandoned message is put back and tried again on the
+ next DoWork. Returns false if a callback destroyed the transport.
+*/
+static bool deviceReceive(LoopbackDevice *device)
+{
+	LoopbackMessage *message;
+	// the device can be unregistered by a callback
+	while ( device->waitingToSend && (message = hubTake(device->deviceId)) != NULL ) {
+		IOTHUBMESSAGE_DISPOSITION_RESULT result = IoTHubClient_LL_MessageCallback(device->clientHandle, message->messageHandle);
+		if ( result == IOTHUBMESSAGE_ABANDONED ) {
+			hubPutBack(message);
+			return !device->transport->isDestroyed;
+		}
+		IoTHubMessage_Destroy(message->messageHandle);
+		free(message);
+		if ( device->transport->isDestroyed ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static STRING_HANDLE LoopbackTransport_GetHostname(TRANSPORT_LL_HANDLE handle)
+{
+	(void) handle;
+	return STRING_construct("loopback");
+}
+
+static IOTHUB_CLIENT_RESULT LoopbackTransport_SetOption(TRANSPORT_LL_HANDLE handle, const char *optionName, const void *value)
+{
+	LoopbackTransport *transport = (LoopbackTransport *) handle;
+	if ( transport == NULL || optionName == NULL || value == NULL ) {
+		return IOTHUB_CLIENT_INVALID_ARG;
+	}
+	if ( strcmp(optionName, LOOPBACK_OPTION_LATENCY_MS) == 0 ) {
+		transport->latencyMs = *(const unsigned int *) value;
+		return IOTHUB_CLIENT_OK;
+	}
+	if ( strcmp(optionName, LOOPBACK_OPTION_ERROR_RATE) == 0 ) {
+		transport->errorRate = *(const double *) value;
+		return IOTHUB_CLIENT_OK;
+	}
+	// the HTTP transport option, accepted so that a connection using it can be tested
+	if ( strcmp(optionName, "Batching") == 0 ) {
+		return IOTHUB_CLIENT_OK;
+	}
+	return IOTHUB_CLIENT_INVALID_ARG;
+}
+
+static TRANSPORT_LL_HANDLE LoopbackTransport_Create(const IOTHUBTRANSPORT_CONFIG *config)
+{
+	LoopbackTransport *transport = calloc(1, sizeof(LoopbackTransport));
+	if ( transport == NULL ) {
+		return NULL;
+	}
+	deviceInitialize(&transport->device, transport);
+	transport->randomState = (uint32_t) ( (uintptr_t) transport ^ timeNowMs() ) | 1;
+	// a client made from a connection string owns the transport, a shared transport has its devices registered
+	if ( config && config->waitingToSend && config->upperConfig && config->upperConfig->deviceId ) {
+		transport->device.deviceId = strdup(config->upperConfig->deviceId);
+		if ( transport->device.deviceId == NULL ) {
+			free(transport);
+			return NULL;
+		}
+		transport->device.waitingToSend = config->waitingToSend;
+	}
+	return transport;
+}
+
+static void transportFree(LoopbackTransport *transport)
+{
+	while ( transport->retired ) {
+		LoopbackDevice *device = transport->retired;
+		transport->retired = device->nextRetired;
+		free(device);
+	}
+	if ( transport->isDestroyed ) {
+		free(transport);
+	}
+}
+
+/*
+ A device unregistered during DoWork keeps its memory, and its place in the list of devices, until the outermost
+ DoWork returns, as DoWork may be confirming the messages of the device further up the stack.
+*/
+static void LoopbackTransport_Unregister(IOTHUB_DEVICE_HANDLE deviceHandle)
+{
+	LoopbackDevice *device = (LoopbackDevice *) deviceHandle;
+	LoopbackDevice *previous;
+	if ( device == NULL ) {
+		return;
+	}
+	LoopbackTransport *transport = device->transport;
+	if ( device->waitingToSend ) {
+		deviceReturnWaiting(device);
+	}
+	free(device->deviceId);
+	if ( device == &transport->device ) {
+		// the other devices are still registered
+		LoopbackDevice *next = device->next;
+		memset(device, 0, sizeof(LoopbackDevice));
+		deviceInitialize(device, transport);
+		device->next = next;
+		return;
+	}
+	for ( previous = &transport->device; previous->next != device; previous = previous->next ) {
+	}
+	previous->next = device->next;
+	if ( transport->doWorkDepth > 0 ) {
+		device->deviceId = NULL;
+		device->waitingToSend = NULL;
+		device->clientHandle = NULL;
+		device->nextRetired = transport->retired;
+		transport->retired = device;
+		return;
+	}
+	free(device);
+}
+
+static void LoopbackTransport_Destroy(TRANSPORT_LL_HANDLE handle)
+{
+	LoopbackTransport *transport = (LoopbackTransport *) handle;
+	if ( transport == NULL ) {
+		return;
+	}
+	while ( transport->device.next ) {
+		LoopbackTransport_Unregister(transport->device.next);
+	}
+	LoopbackTransport_Unregister(&transport->device);
+	transport->isDestroyed = true;
+	if ( transport->doWorkDepth == 0 ) {
+		transportFree(transport);
+	}
+}
+
+static IOTHUB_DEVICE_HANDLE LoopbackTransport_Register(TRANSPORT_LL_HANDLE handle, const IOTHUB_DEVICE_CONFIG *deviceConfig, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, PDLIST_ENTRY waitingToSend)
+{
+	LoopbackTransport *transport = (LoopbackTransport *) handle;
+	LoopbackDevice *device = &transport->device;
+	if ( transport == NULL || deviceConfig == NULL || deviceConfig->deviceId == NULL || waitingToSend == NULL ) {
+		return NULL;
+	}
+	// the device made by create is the same one, when the SDK also registers it
+	if ( device->waitingToSend == waitingToSend ) {
+		device->clientHandle = iotHubClientHandle;
+		return device;
+	}
+	if ( device->waitingToSend ) {
+		device = calloc(1, sizeof(LoopbackDevice));
+		if ( device == NULL ) {
+			return NULL;
+		}
+		deviceInitialize(device, transport);
+		device->next = transport->device.next;
+		transport->device.next = device;
+	}
+	device->deviceId = strdup(deviceConfig->deviceId);
+	if ( device->deviceId == NULL ) {
+		device->waitingToSend = NULL;
+		LoopbackTransport_Unregister(device);
+		return NULL;
+	}
+	device->clientHandle = iotHubClientHandle;
+	device->waitingToSend = waitingToSend;
+	return device;
+}
+
+static int LoopbackTransport_Subscribe(IOTHUB_DEVICE_HANDLE handle)
+{
+	LoopbackDevice *device = (LoopbackDevice *) handle;
+	if ( device == NULL ) {
+		return 1;
+	}
+	device->isSubscribed = true;
+	return 0;
+}
+
+static void LoopbackTransport_Unsubscribe(IOTHUB_DEVICE_HANDLE handle)
+{
+	LoopbackDevice *device = (LoopbackDevice *) handle;
+	if ( device ) {
+		device->isSubscribed = false;
+	}
+}
+
+static void LoopbackTransport_DoWork(TRANSPORT_LL_HANDLE handle, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle)
+{
+	LoopbackTransport *transport = (LoopbackTransport *) handle;
+	LoopbackDevice *device;
+	unsigned long long now = timeNowMs();
+	
+	if ( transport == NULL ) {
+		return;
+	}
+	// a client made from a connection string is only known once it calls DoWork
+	if ( transport->device.clientHandle == NULL && transport->device.next == NULL ) {
+		transport->device.clientHandle = iotHubClientHandle;
+	}
+	// a callback that leaves with a longjmp leaves the count raised, the next DoWork confirms what it left but the
+	// transport is then not freed when destroyed, since it cannot tell whether that DoWork is still on the stack
+	transport->doWorkDepth ++;
+	for ( device = &transport->device; device; device = device->next ) {
+		if ( device->waitingToSend == NULL || device->clientHandle == NULL ) {
+			continue;
+		}
+		deviceTakeWaiting(device, now);
+		if ( !deviceConfirmDue(device, now) || ( device->isSubscribed && !deviceReceive(device) ) ) {
+			break;
+		}
+	}
+	transport->doWorkDepth --;
+	if ( transport->doWorkDepth == 0 ) {
+		transportFree(transport);
+	}
+}
+
+static IOTHUB_CLIENT_RESULT LoopbackTransport_GetSendStatus(IOTHUB_DEVICE_HANDLE handle, IOTHUB_CLIENT_STATUS *iotHubClientStatus)
+{
+	LoopbackDevice *device = (LoopbackDevice *) handle;
+	if ( device == NULL || iotHubClientStatus == NULL ) {
+		return IOTHUB_CLIENT_INVALID_ARG;
+	}
+	if ( device->batchHead || !DList_IsListEmpty(&device->delivered) || !DList_IsListEmpty(&device->failed)
+			|| ( device->waitingToSend && !DList_IsListEmpty(device->waitingToSend) ) ) {
+		*iotHubClientStatus = IOTHUB_CLIENT_SEND_STATUS_BUSY;
+	}
+	else {
+		*iotHubClientStatus = IOTHUB_CLIENT_SEND_STATUS_IDLE;
+	}
+	return IOTHUB_CLIENT_OK;
+}
+
+static TRANSPORT_PROVIDER loopbackTransportProvider = {
+	LoopbackTransport_GetHostname,
+	LoopbackTransport_SetOption,
+	LoopbackTransport_Create,
+	LoopbackTransport_Destroy,
+	LoopbackTransport_Register,
+	LoopbackTransport_Unregister,
+	LoopbackTransport_Subscribe,
+	LoopbackTransport_Unsubscribe,
+	LoopbackTransport_DoWork,
+	LoopbackTransport_GetSendStatus
+};
+
+const TRANSPORT_PROVIDER *Loopback_Protocol(void)
+{
+	return &loopbackTransportProvider;
+}
@@ -0,0 +1,28 @@
+#ifndef IOTHUBLOOPBACK_H
+#define IOTHUBLOOPBACK_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "iothub_message.h"
+#include "iothub_transport_ll.h"
+
+
+#define LOOPBACK_OPTION_LATENCY_MS				"loopbackLatencyMs"		// value is an unsigned int
+#define LOOPBACK_OPTION_ERROR_RATE				"loopbackErrorRate"		// value is a double from 0 to 1
+
+
+const TRANSPORT_PROVIDER *Loopback_Protocol(void);
+
+bool loopbackInject(const char *deviceId, IOTHUB_MESSAGE_HANDLE messageHandle);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// IOTHUBLOOPBACK_H
@@ -0,0 +1,63 @@
+/*
+
+ Lock free single producer, single consumer ring used to pass sends, confirmations and received messages
+ between the lua thread and the background io thread.
+
+*/
+
+#include <stdlib.h>
+
+#include "iothubring.h"
+
+
+bool ringInit(Ring *ring, unsigned int size)
+{
+	unsigned int ringSize = 2;
+	while ( ringSize < size ) {
+		ringSize <<= 1;
+	}
+	ring->entries = calloc(ringSize, sizeof(RingEntry));
+	if ( ring->entries == NULL ) {
+		return false;
+	}
+	ring->mask = ringSize - 1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return true;
+}
+
+void ringFree(Ring *ring)
+{
+	free(ring->entries);
+	ring->entries = NULL;
+	ring->mask = 0;
+}
+
+bool ringPush(Ring *ring, const RingEntry *entry)
+{
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if ( tail - head > ring->mask ) {
+		return false;
+	}
+	ring->entries[tail & ring->mask] = *entry;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+bool ringPop(Ring *ring, RingEntry *entry)
+{
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if ( head == tail ) {
+		return false;
+	}
+	*entry = ring->entries[head & ring->mask];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return true;
+}
+
+unsigned int ringCount(Ring *ring)
+{
+	return atomic_load_explicit(&ring->tail, memory_order_acquire) - atomic_load_explicit(&ring->head, memory_order_acquire);
+}
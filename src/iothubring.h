@@ -0,0 +1,48 @@
+#ifndef IOTHUBRING_H
+#define IOTHUBRING_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+
+#define RING_CACHE_LINE_SIZE					64
+
+
+typedef struct {
+	int type;
+	int result;
+	void *data;
+} RingEntry;
+
+/*
+ Bounded single producer, single consumer ring. Only one thread may push and only one thread may pop, 
+ no locks are used. The size is always a power of two.
+*/
+typedef struct {
+	RingEntry *entries;
+	unsigned int mask;
+	char padHead[RING_CACHE_LINE_SIZE];
+	atomic_uint head;						// next entry to pop, written by the consumer
+	char padTail[RING_CACHE_LINE_SIZE];
+	atomic_uint tail;						// next entry to push, written by the producer
+	char padEnd[RING_CACHE_LINE_SIZE];
+} Ring;
+
+
+bool ringInit(Ring *ring, unsigned int size);
+void ringFree(Ring *ring);
+bool ringPush(Ring *ring, const RingEntry *entry);
+bool ringPop(Ring *ring, RingEntry *entry);
+unsigned int ringCount(Ring *ring);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// IOTHUBRING_H
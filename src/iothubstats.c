@@ -0,0 +1,88 @@
+/*
+
+ Counters and histograms used by the luaazureiothub library.
+
+ Recording is kept to a clock read and a few integer operations, so it can be left on for every message. The
+ histograms are only turned into percentiles when they are read.
+
+*/
+
+#include <string.h>
+#include <time.h>
+
+#include "iothubstats.h"
+
+
+static int bucketIndex(unsigned long long value)
+{
+	if ( value < STATS_SUB_BUCKETS ) {
+		return (int) value;
+	}
+	int shift = 63 - __builtin_clzll(value) - STATS_SUB_BUCKET_BITS;
+	return ( shift + 1 ) * STATS_SUB_BUCKETS + (int) ( ( value >> shift ) & ( STATS_SUB_BUCKETS - 1 ) );
+}
+
+/*
+ Return the highest value that is recorded in the bucket at 'index'.
+*/
+unsigned long long statsBucketHighest(int index)
+{
+	if ( index < STATS_SUB_BUCKETS ) {
+		return index;
+	}
+	int shift = index / STATS_SUB_BUCKETS - 1;
+	unsigned long long lowest = (unsigned long long) ( STATS_SUB_BUCKETS + index % STATS_SUB_BUCKETS ) << shift;
+	return lowest + ( 1ULL << shift ) - 1;
+}
+
+unsigned long long statsTimeNowNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void statsHistogramReset(StatsHistogram *histogram)
+{
+	memset(histogram, 0, sizeof(StatsHistogram));
+}
+
+void statsHistogramRecord(StatsHistogram *histogram, unsigned long long value)
+{
+	if ( histogram->count == 0 || value < histogram->min ) {
+		histogram->min = value;
+	}
+	if ( value > histogram->max ) {
+		histogram->max = value;
+	}
+	histogram->count ++;
+	histogram->sum += value;
+	histogram->buckets[bucketIndex(value)] ++;
+}
+
+/*
+ Return the value at or below which 'percentile' (0 to 100) of the recorded values fall. This is the top of the bucket
+ the value is in, capped at the largest value recorded.
+*/
+unsigned long long statsHistogramPercentile(const StatsHistogram *histogram, double percentile)
+{
+	unsigned long long total = 0;
+	unsigned long long target;
+	int index;
+	
+	if ( histogram->count == 0 ) {
+		return 0;
+	}
+	target = (unsigned long long) ( histogram->count * percentile / 100.0 + 0.5 );
+	if ( target < 1 ) {
+		target = 1;
+	}
+	for ( index = 0; index < STATS_BUCKET_COUNT; index ++ ) {
+		total += histogram->buckets[index];
+		if ( total >= target ) {
+			unsigned long long highest = statsBucketHighest(index);
+			return highest < histogram->max ? highest : histogram->max;
+		}
+	}
+	return histogram->max;
+}
@@ -0,0 +1,43 @@
+#ifndef IOTHUBSTATS_H
+#define IOTHUBSTATS_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+
+#define STATS_SUB_BUCKET_BITS					3			// 8 buckets for each power of two, values are within 12.5%
+#define STATS_SUB_BUCKETS						(1 << STATS_SUB_BUCKET_BITS)
+#define STATS_BUCKET_COUNT						((64 - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+
+/*
+ Log bucketed histogram in the style of HdrHistogram. Values below STATS_SUB_BUCKETS have a bucket each, above that
+ each power of two is split into STATS_SUB_BUCKETS equal buckets, so the whole 64 bit range fits in a fixed array
+ and a value is recorded with a few shifts and adds.
+*/
+typedef struct {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long buckets[STATS_BUCKET_COUNT];
+} StatsHistogram;
+
+
+unsigned long long statsTimeNowNs(void);
+
+void statsHistogramReset(StatsHistogram *histogram);
+void statsHistogramRecord(StatsHistogram *histogram, unsigned long long value);
+unsigned long long statsHistogramPercentile(const StatsHistogram *histogram, double percentile);
+unsigned long long statsBucketHighest(int index);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// IOTHUBSTATS_H
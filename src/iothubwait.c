@@ -0,0 +1,307 @@
+/*
+
+ Wait engine used by the luaazureiothub library.
+
+ Instead of spinning around IoTHubClient_LL_DoWork, each connection schedules its work on a small hashed timer wheel.
+ The caller then sleeps in poll() on any registered file descriptors until the next timer is due, an fd becomes ready
+ or the callers deadline expires. All times are in milliseconds taken from the monotonic clock.
+
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#include "iothubwait.h"
+
+
+static void unlinkTimer(WaitTimer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer;
+	timer->prev = timer;
+}
+
+static void linkTimer(WaitTimer *head, WaitTimer *timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+unsigned long long waitTimeNow(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void waitTimerInit(WaitTimer *timer, WaitTimerCallback callback, void *context)
+{
+	timer->next = timer;
+	timer->prev = timer;
+	timer->due = 0;
+	timer->callback = callback;
+	timer->context = context;
+	timer->isActive = false;
+}
+
+void waitTimerStart(WaitEngine *engine, WaitTimer *timer, unsigned long long due)
+{
+	WaitWheel *wheel = &engine->wheel;
+	unsigned long long tick = due / WAIT_WHEEL_TICK_MS;
+
+	waitTimerStop(engine, timer);
+	// timers that are already overdue go into the current slot, so the next expire will see them
+	if ( tick < wheel->lastTick ) {
+		tick = wheel->lastTick;
+	}
+	timer->due = due;
+	timer->isActive = true;
+	linkTimer(&wheel->slots[tick % WAIT_WHEEL_SLOTS], timer);
+	wheel->timerCount ++;
+}
+
+void waitTimerStop(WaitEngine *engine, WaitTimer *timer)
+{
+	if ( timer->isActive ) {
+		timer->isActive = false;
+		engine->wheel.timerCount --;
+	}
+	// an expired timer waits on the expired list of the wheel until it fires, taking it off that list as well
+	// means a callback can stop or restart a timer that expired in the same pass
+	unlinkTimer(timer);
+}
+
+void waitEngineInit(WaitEngine *engine)
+{
+	int index;
+	memset(engine, 0, sizeof(WaitEngine));
+	for ( index = 0; index < WAIT_WHEEL_SLOTS; index ++ ) {
+		engine->wheel.slots[index].next = &engine->wheel.slots[index];
+		engine->wheel.slots[index].prev = &engine->wheel.slots[index];
+	}
+	engine->wheel.expired.next = &engine->wheel.expired;
+	engine->wheel.expired.prev = &engine->wheel.expired;
+	engine->wheel.lastTick = waitTimeNow() / WAIT_WHEEL_TICK_MS;
+}
+
+bool waitEngineAddFd(WaitEngine *engine, int fd, short events)
+{
+	int index;
+	for ( index = 0; index < engine->fdCount; index ++ ) {
+		if ( engine->fds[index].fd == fd ) {
+			engine->fds[index].events = events;
+			return true;
+		}
+	}
+	if ( engine->fdCount >= WAIT_MAX_FDS ) {
+		return false;
+	}
+	engine->fds[engine->fdCount].fd = fd;
+	engine->fds[engine->fdCount].events = events;
+	engine->fds[engine->fdCount].revents = 0;
+	engine->fdCount ++;
+	return true;
+}
+
+void waitEngineRemoveFd(WaitEngine *engine, int fd)
+{
+	int index;
+	for ( index = 0; index < engine->fdCount; index ++ ) {
+		if ( engine->fds[index].fd == fd ) {
+			engine->fdCount --;
+			engine->fds[index] = engine->fds[engine->fdCount];
+			return;
+		}
+	}
+}
+
+/*
+ Return the time of the earliest active timer, or WAIT_NO_DEADLINE if there are none.
+ Walks forward one revolution of the wheel from the current tick, timers further out than that share
+ slots with nearer ones so the smallest due time seen is kept as a fallback.
+*/
+unsigned long long waitEngineNextDue(WaitEngine *engine)
+{
+	WaitWheel *wheel = &engine->wheel;
+	unsigned long long nextDue = WAIT_NO_DEADLINE;
+	unsigned long long offset;
+
+	// left over from an expire that did not finish, they fire on the next one
+	if ( wheel->expired.next != &wheel->expired ) {
+		return 0;
+	}
+	if ( wheel->timerCount == 0 ) {
+		return WAIT_NO_DEADLINE;
+	}
+	for ( offset = 0; offset < WAIT_WHEEL_SLOTS; offset ++ ) {
+		unsigned long long tick = wheel->lastTick + offset;
+		WaitTimer *head = &wheel->slots[tick % WAIT_WHEEL_SLOTS];
+		WaitTimer *timer;
+		bool isFound = false;
+		for ( timer = head->next; timer != head; timer = timer->next ) {
+			if ( timer->due < nextDue ) {
+				nextDue = timer->due;
+			}
+			if ( timer->due / WAIT_WHEEL_TICK_MS <= tick ) {
+				isFound = true;
+			}
+		}
+		if ( isFound ) {
+			break;
+		}
+	}
+	return nextDue;
+}
+
+/*
+ Fire all timers that are due at or before 'now'. Expired timers are moved to the expired list of the wheel first so
+ that the callbacks can safely restart themselves or other timers. The list is kept in the engine rather than on the 
+ stack, so if a callback does not return the timers left on it are still linked to live memory, and fire on the next 
+ expire. Returns the number of timers fired.
+*/
+int waitEngineExpire(WaitEngine *engine, unsigned long long now)
+{
+	WaitWheel *wheel = &engine->wheel;
+	WaitTimer *expired = &wheel->expired;
+	unsigned long long nowTick = now / WAIT_WHEEL_TICK_MS;
+	unsigned long long tick;
+	unsigned long long lastScanTick;
+	int fireCount = 0;
+
+	if ( wheel->timerCount == 0 || nowTick < wheel->lastTick ) {
+		if ( nowTick > wheel->lastTick ) {
+			wheel->lastTick = nowTick;
+		}
+	}
+	else {
+		lastScanTick = nowTick;
+		if ( nowTick - wheel->lastTick >= WAIT_WHEEL_SLOTS ) {
+			lastScanTick = wheel->lastTick + WAIT_WHEEL_SLOTS - 1;
+		}
+		for ( tick = wheel->lastTick; tick <= lastScanTick; tick ++ ) {
+			WaitTimer *head = &wheel->slots[tick % WAIT_WHEEL_SLOTS];
+			WaitTimer *timer = head->next;
+			while ( timer != head ) {
+				WaitTimer *nextTimer = timer->next;
+				if ( timer->due <= now ) {
+					unlinkTimer(timer);
+					linkTimer(expired, timer);
+					timer->isActive = false;
+					wheel->timerCount --;
+				}
+				timer = nextTimer;
+			}
+		}
+		wheel->lastTick = nowTick;
+	}
+
+	while ( expired->next != expired ) {
+		WaitTimer *timer = expired->next;
+		unlinkTimer(timer);
+		fireCount ++;
+		if ( timer->callback ) {
+			timer->callback(timer);
+		}
+	}
+	return fireCount;
+}
+
+static int pollTimeout(unsigned long long wakeTime)
+{
+	unsigned long long now = waitTimeNow();
+	if ( wakeTime == WAIT_NO_DEADLINE ) {
+		return -1;
+	}
+	if ( wakeTime <= now ) {
+		return 0;
+	}
+	return (wakeTime - now > INT_MAX) ? INT_MAX : (int) (wakeTime - now);
+}
+
+/*
+ Sleep until the next timer is due, a registered fd is ready, or the deadline is reached, whichever comes first.
+ Returns the number of ready fds, 0 on timeout and -1 on error.
+*/
+int waitEngineWait(WaitEngine *engine, unsigned long long deadline)
+{
+	unsigned long long wakeTime = waitEngineNextDue(engine);
+	int timeoutMs;
+	int result;
+	int index;
+
+	if ( deadline < wakeTime ) {
+		wakeTime = deadline;
+	}
+	for ( index = 0; index < engine->fdCount; index ++ ) {
+		engine->fds[index].revents = 0;
+	}
+	timeoutMs = pollTimeout(wakeTime);
+	if ( timeoutMs == 0 ) {
+		return 0;
+	}
+	result = poll(engine->fds, engine->fdCount, timeoutMs);
+	if ( result < 0 && errno == EINTR ) {
+		result = 0;
+	}
+	return result;
+}
+
+/*
+ Same as waitEngineWait, but sleeps on the timers and fds of a set of engines in one poll call. Use 
+ waitEngineIsReady afterwards to find which engines had fds ready. 'fds' is a buffer owned by the caller with room 
+ for count * WAIT_MAX_FDS entries, so that it can be kept over many waits instead of allocated for each one.
+*/
+int waitEngineWaitMany(WaitEngine **engines, int count, struct pollfd *fds, unsigned long long deadline)
+{
+	unsigned long long wakeTime = deadline;
+	int fdCount = 0;
+	int timeoutMs;
+	int result;
+	int index;
+	int fdIndex;
+
+	for ( index = 0; index < count; index ++ ) {
+		unsigned long long nextDue = waitEngineNextDue(engines[index]);
+		if ( nextDue < wakeTime ) {
+			wakeTime = nextDue;
+		}
+		for ( fdIndex = 0; fdIndex < engines[index]->fdCount; fdIndex ++ ) {
+			engines[index]->fds[fdIndex].revents = 0;
+		}
+		memcpy(&fds[fdCount], engines[index]->fds, sizeof(struct pollfd) * engines[index]->fdCount);
+		fdCount += engines[index]->fdCount;
+	}
+	timeoutMs = pollTimeout(wakeTime);
+	if ( timeoutMs == 0 ) {
+		return 0;
+	}
+	result = poll(fdCount ? fds : NULL, fdCount, timeoutMs);
+	if ( result < 0 && errno == EINTR ) {
+		result = 0;
+	}
+	if ( result > 0 ) {
+		fdCount = 0;
+		for ( index = 0; index < count; index ++ ) {
+			for ( fdIndex = 0; fdIndex < engines[index]->fdCount; fdIndex ++ ) {
+				engines[index]->fds[fdIndex].revents = fds[fdCount ++].revents;
+			}
+		}
+	}
+	return result;
+}
+
+bool waitEngineIsReady(WaitEngine *engine)
+{
+	int index;
+	for ( index = 0; index < engine->fdCount; index ++ ) {
+		if ( engine->fds[index].revents ) {
+			return true;
+		}
+	}
+	return false;
+}
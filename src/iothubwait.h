@@ -0,0 +1,65 @@
+#ifndef IOTHUBWAIT_H
+#define IOTHUBWAIT_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <poll.h>
+
+
+#define WAIT_WHEEL_SLOTS						64			// one wheel revolution is WAIT_WHEEL_SLOTS * WAIT_WHEEL_TICK_MS
+#define WAIT_WHEEL_TICK_MS						4
+#define WAIT_MAX_FDS							8
+#define WAIT_NO_DEADLINE						((unsigned long long) -1)
+
+
+typedef struct WaitTimer WaitTimer;
+typedef void (*WaitTimerCallback)(WaitTimer *timer);
+
+struct WaitTimer {
+	WaitTimer *next;
+	WaitTimer *prev;
+	unsigned long long due;
+	WaitTimerCallback callback;
+	void *context;
+	bool isActive;
+};
+
+typedef struct {
+	WaitTimer slots[WAIT_WHEEL_SLOTS];		// list heads, only next/prev are used
+	WaitTimer expired;						// list head for the timers taken off the wheel and not yet fired
+	unsigned long long lastTick;
+	int timerCount;
+} WaitWheel;
+
+typedef struct {
+	WaitWheel wheel;
+	struct pollfd fds[WAIT_MAX_FDS];
+	int fdCount;
+} WaitEngine;
+
+
+unsigned long long waitTimeNow(void);
+
+void waitTimerInit(WaitTimer *timer, WaitTimerCallback callback, void *context);
+void waitTimerStart(WaitEngine *engine, WaitTimer *timer, unsigned long long due);
+void waitTimerStop(WaitEngine *engine, WaitTimer *timer);
+
+void waitEngineInit(WaitEngine *engine);
+bool waitEngineAddFd(WaitEngine *engine, int fd, short events);
+void waitEngineRemoveFd(WaitEngine *engine, int fd);
+unsigned long long waitEngineNextDue(WaitEngine *engine);
+int waitEngineExpire(WaitEngine *engine, unsigned long long now);
+int waitEngineWait(WaitEngine *engine, unsigned long long deadline);
+int waitEngineWaitMany(WaitEngine **engines, int count, struct pollfd *fds, unsigned long long deadline);
+bool waitEngineIsReady(WaitEngine *engine);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// IOTHUBWAIT_H
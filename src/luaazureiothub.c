@@ -15,7 +15,11 @@ access the Azure Iot Hub.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <uuid/uuid.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "xio.h"
 #include "tlsio_openssl.h"
@@ -26,24 +30,307 @@ access the Azure Iot Hub.
 #include "iothubtransportamqp.h"
 #include "iothubtransporthttp.h"
 #include "iothubtransportmqtt.h"
+#include "iothubtransport.h"
 
 #include "luaazureiothub.h"
+#include "iothubwait.h"
+#include "iothubring.h"
+#include "iothubid.h"
+#include "iothubjournal.h"
+#include "iothubcompress.h"
+#include "iothubstats.h"
+#include "iothubloopback.h"
+#include "iothubinflight.h"
+#include "iothubencode.h"
 
 
 #define SEND_TIMEOUT_SECONDS						240
-#define RECEIVE_FUNCTION_CALLBACK_NAME				"luaazureiothub_receive_function"
-#define SEND_CONFIRMATION_FUNCTION_CALLBACK_NAME	"luaazureiothub_send_confirmation_function"
+#define WAIT_BUSY_INTERVAL_MS						1			// DoWork interval while messages are outstanding
+#define WAIT_IDLE_INTERVAL_MS						50			// default max DoWork interval when idle, see the connect option idleIntervalMs
+#define DEFAULT_MAX_IN_FLIGHT						1			// messages handed to the SDK and waiting for a confirmation
+#define DEFAULT_MAX_QUEUED							1024		// messages waiting in the library for a free in flight slot
+#define DEFAULT_RING_SIZE							1024		// entries in each ring between the lua and io thread
+#define SEND_POOL_SLAB_SIZE							64			// send records allocated in one go when the pool is empty
+#define SEND_ID_INLINE_SIZE							64			// message ids up to this size are kept in the send record
+#define ENVELOPE_SEQUENCE_BIT						(1ULL << 63)	// set in the sequence number of a coalescer envelope
+#define DEFAULT_READ_BATCH_SIZE						64			// received messages held for processReadBatch
+#define DEFAULT_READ_BATCH_DELAY_MS					0			// max time a received message is held, 0 is the end of the loop cycle
+#define READ_BATCH_MAX_PASSES						3			// batches a message can be abandoned in before it is dropped
+#define DEFAULT_JOURNAL_BYTES						(16 * 1024 * 1024)
+#define DEFAULT_RENEW_SECONDS						3000		// make a new client before the default one hour SAS token expires
+#define DEFAULT_RECONNECT_ERRORS					3			// failed confirmations in a row before a new client is made
+#define RECONNECT_MIN_DELAY_MS						1000		// wait before reconnecting after errors, doubles up to the max
+#define RECONNECT_MAX_DELAY_MS						60000
+#define DEFAULT_COMPRESS_MIN_BYTES					256			// shorter bodies are sent as is, even if compress is set
+#define DEFAULT_COALESCE_MAX_BYTES					4096		// largest envelope body made by the coalescer
+#define COALESCE_FRAME_HEADER_BYTES					4			// big endian length before each body in a frames envelope
+#define COALESCE_FORMAT_PROPERTY					"envelope"	// property set on an envelope to the format of its body
+#define COALESCE_COUNT_PROPERTY						"envelopeCount"	// property set on an envelope to the number of messages in it
+#define COALESCE_FORMAT_JSON_TEXT					"json"		// body is a JSON array of the message bodies
+#define COALESCE_FORMAT_FRAMES_TEXT					"frames"	// body is each message body after its length
+#define DEFAULT_STANDBY_WARM_MS						10000		// time a hot standby client is run before it takes over
+#define STANDBY_DRAIN_MS							30000		// max time the old client is kept for its confirmations
+#define CONNECT_INFO_METATABLE_NAME					"luaazureiothub.connectInfo"
+#define TRANSPORT_INFO_METATABLE_NAME				"luaazureiothub.transportInfo"
+#define MESSAGE_TEMPLATE_METATABLE_NAME				"luaazureiothub.messageTemplate"
+#define MESSAGE_METATABLE_NAME						"luaazureiothub.message"
+#define DEFAULT_LOOP_ALL_TIMEOUT_MS					1000
 
 DEFINE_ENUM_STRINGS(IOTHUB_CLIENT_CONFIRMATION_RESULT, IOTHUB_CLIENT_CONFIRMATION_RESULT_VALUES);
 
 
 
+typedef struct SendCallbackInfo SendCallbackInfo;
+typedef struct TransportInfo TransportInfo;
+typedef struct YieldWait YieldWait;
+
+// body of the envelope sent by the coalescer
+typedef enum {
+	COALESCE_FORMAT_JSON,
+	COALESCE_FORMAT_FRAMES
+} CoalesceFormat;
+
+typedef struct {
+	unsigned int maxInFlight;
+	unsigned int maxQueued;
+	unsigned int idleIntervalMs;
+	bool isBatching;
+	bool isThreaded;
+	unsigned int ringSize;
+	unsigned int poolSize;
+	MessageIdStrategy idStrategy;
+	bool isLazyMessage;
+	unsigned int readBatchSize;
+	unsigned int readBatchDelayMs;
+	const char *journalPath;			// only valid while the connect call is running
+	size_t journalBytes;
+	bool isJournalSync;
+	bool isAutoReconnect;
+	unsigned int renewSeconds;
+	unsigned int reconnectErrors;
+	bool isHotStandby;
+	unsigned int standbyWarmMs;
+	size_t compressMinBytes;
+	unsigned int coalesceDelayMs;
+	size_t coalesceMaxBytes;
+	CoalesceFormat coalesceFormat;
+	unsigned int loopbackLatencyMs;
+	double loopbackErrorRate;
+} ConnectOptions;
+
+// values passed to processStatus
+typedef enum {
+	CONNECTION_STATUS_CONNECTED,
+	CONNECTION_STATUS_RECONNECTING,
+	CONNECTION_STATUS_DISCONNECTED
+} ConnectionStatus;
+
+// counters returned by stats, all are cumulative until stats is called with reset
+typedef struct {
+	unsigned long long sendCount;		// messages handed to the SDK, an envelope or a message sent again counts each time
+	unsigned long long sendBytes;
+	unsigned long long confirmationCounts[IOTHUB_CLIENT_CONFIRMATION_ERROR + 1];	// messages passed to processSent, by result
+	unsigned long long receiveCount;
+	unsigned long long receiveBytes;
+	unsigned long long doWorkCount;
+	StatsHistogram sendLatency;			// nanoseconds from sendMessage to the confirmation
+	StatsHistogram callbackTime;		// nanoseconds spent in processRead, processReadBatch and processSent
+	unsigned long long duplicateAckCount;	// confirmations ignored because the message was not in flight
+	unsigned long long readOverflowCount;	// received messages abandoned to the IotHub because the read batch was full
+	unsigned long long readDropCount;		// accepted messages dropped after processReadBatch abandoned them READ_BATCH_MAX_PASSES times
+	unsigned long long yieldErrorCount;		// coroutines resumed by the connection that raised an error
+} ConnectionStats;
+
+typedef struct SendPoolSlab SendPoolSlab;
+
+// free list of send records, plus a scratch buffer reused by each sendBatch call
+typedef struct {
+	SendCallbackInfo *freeList;			// released records go on the end, so each one is reused as late as possible
+	SendCallbackInfo *freeTail;
+	SendPoolSlab *slabs;
+	unsigned int recordCount;
+	unsigned int freeCount;
+	unsigned long long hitCount;		// records and buffers reused from the pool
+	unsigned long long missCount;		// times we had to go to malloc
+	void *scratch;
+	size_t scratchSize;
+	bool isScratchBusy;
+} SendPool;
+
+typedef enum {
+	THREAD_EVENT_CONFIRMATION,			// SDK send confirmation, data is the SendCallbackInfo
+	THREAD_EVENT_SUBMIT_FAILED,			// SDK would not take the message, data is the SendCallbackInfo
+	THREAD_EVENT_RECEIVE,				// received message, data is a clone of the message handle
+} ThreadEventType;
+
+// background io thread, owns the client handle while it is running
+typedef struct {
+	pthread_t thread;
+	bool isStarted;
+	IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle;
+	Ring sendRing;						// lua -> io thread, messages to hand to the SDK
+	Ring eventRing;						// io thread -> lua, confirmations and received messages
+	RingEntry *overflow;				// events waiting for room in the event ring, only used by the io thread
+	int overflowCount;
+	int overflowSize;
+	int wakePipe[2];					// wakes the io thread when there is something to send, or it has to stop
+	int eventPipe[2];					// wakes lua when there are events to dispatch
+	atomic_bool isStopping;
+	atomic_bool isEventSignalled;
+	atomic_llong lastMessageReceiveTime;
+	atomic_ullong doWorkCount;			// added to the connection stats by threadDispatch
+	unsigned int idleIntervalMs;
+} ThreadInfo;
+
 typedef struct {
 	IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle;
 	bool isConnected;
+	lua_State *L;						// state of the lua call currently running the connection, used for the callbacks
+	int receiveFunctionRef;				// registry refs to the processRead, processSent and processReadBatch functions
+	int sendConfirmationFunctionRef;
+	int readBatchFunctionRef;
+	WaitEngine waitEngine;
+	WaitTimer doWorkTimer;
+	unsigned int doWorkInterval;
+	unsigned int idleIntervalMs;		// the interval doubles up to this while the connection is idle
+	
+	// send window, messages over maxInFlight are queued here until a confirmation frees a slot
+	unsigned int maxInFlight;
+	unsigned int maxQueued;
+	unsigned int inFlightCount;
+	unsigned int queuedCount;
+	SendCallbackInfo *queueHead;
+	SendCallbackInfo *queueTail;
+	unsigned long long lastSequence;
+	unsigned long long lastEnvelopeSequence;
+	InFlightTable inFlight;				// every send record taken from the pool, by sequence number and message id
+	
+	TransportInfo *transportInfo;		// set if this device connection is using a shared transport
+	bool isBatching;					// connect option batching, set on each new SDK client
+	ThreadInfo *thread;					// set in threaded mode
+	SendPool sendPool;
+	MessageIdGenerator idGenerator;		// makes the ids for messages sent without an id
+	bool isLazyMessage;					// pass lazy message userdata to the callbacks instead of tables
+	
+	// received messages waiting to be passed to processReadBatch
+	Ring readBatchRing;
+	RingEntry *readBatchEntries;		// messages being passed to lua, taken from the ring, result is the passes so far
+	unsigned int readBatchDelayMs;
+	unsigned long long readBatchDue;	// time the oldest waiting message must be passed to lua
+	WaitTimer readBatchTimer;
+	bool isReadBatchFlushing;
+	
+	// store and forward journal, un-acked records are sent again before any new messages
+	Journal *journal;
+	bool isJournalReplaying;
+	unsigned long long journalReplayOffset;
+	unsigned long long journalReplayEnd;	// records from here on were written by this connection
+	
+	// automatic reconnect, the client handle is made again from the saved connection string
+	char *connectionString;				// only set if auto reconnect is on
+	IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol;
+	int statusFunctionRef;				// registry ref to the processStatus function
+	WaitTimer reconnectTimer;
+	const char *reconnectReason;		// passed to processStatus when the timer fires
+	unsigned int renewSeconds;
+	unsigned int reconnectErrors;
+	unsigned int failedSendCount;		// failed confirmations in a row
+	unsigned int reconnectDelayMs;
+	bool isReconnecting;				// in flight messages returned by the SDK are kept to send again
+	SendCallbackInfo *retryHead;		// messages to send again before the queue
+	SendCallbackInfo *retryTail;
+	unsigned int retryCount;
+	
+	// make before break renew, the new client runs next to the old one before it takes over
+	bool isHotStandby;
+	unsigned int standbyWarmMs;
+	IOTHUB_CLIENT_LL_HANDLE standbyClientHandle;	// new client warming up
+	IOTHUB_CLIENT_LL_HANDLE drainingClientHandle;	// old client waiting for the confirmations of its messages
+	unsigned int drainingInFlightCount;
+	bool isDrainClosing;				// the draining client is being destroyed, the messages it returns are kept to send again
+	WaitTimer standbyTimer;
+	
+	// time taken by each new client to connect, up to its first confirmation or received message
+	unsigned int connectCount;
+	bool isConnectPending;
+	unsigned long long connectStartTime;
+	unsigned long long connectCpuNs;	// cpu used by DoWork while connecting, not measured in threaded mode
+	unsigned long long lastConnectMs;
+	unsigned long long lastConnectCpuNs;
+	unsigned long long totalConnectMs;
+	unsigned long long totalConnectCpuNs;
+	
+	// deflate streams and buffer used for the messages sent with compress set
+	Compressor compressor;
+	size_t compressMinBytes;
+	
+	// buffer the body table of a message is encoded into, see encodeMessageBody
+	Encoder encoder;
+	
+	ConnectionStats stats;
+	
+	// only set for the loopback protocol, see iothubloopback.c
+	char *loopbackDeviceId;				// device the messages passed to loopbackReceive are queued for
+	unsigned int loopbackLatencyMs;
+	double loopbackErrorRate;
+	
+	// coalescer, small messages with the same properties are held and sent together in one envelope message
+	unsigned int coalesceDelayMs;		// 0 if the coalescer is off
+	size_t coalesceMaxBytes;
+	CoalesceFormat coalesceFormat;
+	SendCallbackInfo *coalesceHead;		// messages in the open envelope
+	SendCallbackInfo *coalesceTail;
+	unsigned int coalesceCount;
+	unsigned char *coalesceBuffer;		// body of the open envelope, coalesceMaxBytes long
+	size_t coalesceLength;
+	WaitTimer coalesceTimer;
+	
+	// coroutines waiting in sendMessageYield for the confirmation of their message
+	YieldWait *yieldHead;
+	YieldWait *yieldTail;
+	YieldWait *readyHead;				// confirmed or timed out, resumed once the SDK work has returned
+	YieldWait *readyTail;
+	WaitTimer yieldTimer;				// due at the earliest yield timeout
+	int resumeFunctionRef;				// registry ref to the processResume function
+	int yieldErrorRef;					// registry ref to the error of the last resumed coroutine that failed
+	int callbackErrorRef;				// registry ref to an error raised by a callback, held until the connection work has returned
 } ConnectInfo;
 
+typedef enum {
+	YIELD_WAIT_PENDING,					// on the yield list, waiting for the message
+	YIELD_WAIT_READY,					// on the ready list, waiting to be resumed
+	YIELD_WAIT_RESUMED,					// resumed or passed to processResume by the connection
+	YIELD_WAIT_CLOSED					// the connection was collected before the coroutine was resumed
+} YieldWaitState;
+
+// a coroutine waiting in sendMessageYield, a userdata left on the stack of the coroutine so it lives as long as the wait
+struct YieldWait {
+	ConnectInfo *info;
+	SendCallbackInfo *sendCallbackInfo;	// record of the message while it is pending, or NULL
+	lua_State *thread;
+	int threadRef;						// registry ref that keeps the coroutine alive until the connection is done with it
+	YieldWaitState state;
+	unsigned long long sequence;
+	unsigned long long due;				// time the coroutine is resumed with a timeout, 0 for no timeout
+	bool isDone;						// false if it was resumed by the timeout
+	IOTHUB_CLIENT_CONFIRMATION_RESULT result;
+	YieldWait *next;					// on the yield or ready list of the connection
+	YieldWait *prev;
+};
 
+// shared transport, a set of device connections multiplexed over one connection to the IotHub
+struct TransportInfo {
+	TRANSPORT_HANDLE transportHandle;
+	IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol;
+	ConnectInfo **devices;
+	int deviceCount;
+	int deviceSize;
+	int leadIndex;
+	WaitEngine waitEngine;
+	WaitTimer doWorkTimer;
+	unsigned int doWorkInterval;
+	unsigned int idleIntervalMs;		// the lowest idleIntervalMs of the devices
+};
 
 
 typedef struct {
@@ -51,51 +338,223 @@ typedef struct {
 	bool isDone;	
 } SyncSendStatus;
 
-typedef struct {
+// where a send record is, returned by messageStatus
+typedef enum {
+	SEND_STATE_FREE,					// in the pool
+	SEND_STATE_QUEUED,					// in the send queue or the retry list, waiting for a slot in the send window
+	SEND_STATE_COALESCED,				// in the open envelope of the coalescer
+	SEND_STATE_IN_FLIGHT				// handed to the SDK, or to the io thread in threaded mode
+} SendState;
+
+struct SendCallbackInfo {
 	IOTHUB_MESSAGE_HANDLE messageHandle;
 	IOTHUB_CLIENT_CONFIRMATION_RESULT result;
-	char *messageId;
-	bool isSendSync;
-} SendCallbackInfo;
+	char *messageId;					// points to messageIdBuffer, unless the id is too long to fit
+	unsigned long long sequence;
+	ConnectInfo *info;
+	SyncSendStatus *syncStatus;			// only set for a sync send, points to the waiting sendMessage stack
+	SendCallbackInfo *next;				// next in the send queue, or in the pool free list
+	IOTHUB_CLIENT_LL_HANDLE clientHandle;	// client the message was handed to, not set in threaded mode
+	unsigned long long journalOffset;	// journal record of the message, or JOURNAL_NO_RECORD
+	unsigned long long sendTimeNs;		// time sendMessage was called, for the send latency
+	SendCallbackInfo *members;			// messages sent in this envelope by the coalescer, linked by next
+	SendState state;
+	YieldWait *yieldWait;				// coroutine waiting in sendMessageYield for the confirmation, or NULL
+	char messageIdBuffer[SEND_ID_INLINE_SIZE];
+};
+
+struct SendPoolSlab {
+	SendPoolSlab *next;
+	SendCallbackInfo records[SEND_POOL_SLAB_SIZE];
+};
+
+// message passed to the callbacks in lazy mode, the fields are read from the SDK message when they are used
+typedef struct {
+	IOTHUB_MESSAGE_HANDLE messageHandle;	// NULL once the message is no longer available
+	bool isOwned;							// destroy the message handle when collected
+} LazyMessage;
 
+// message settings that are parsed and checked once, and then used for many messages
+typedef struct {
+	IOTHUBMESSAGE_CONTENT_TYPE contentType;
+	char *correlationId;
+	bool isCompress;
+	size_t propertyCount;
+	char **propertyNames;
+	char **propertyValues;
+} MessageTemplate;
 
-static lua_State *callbackState;
-static SyncSendStatus syncSendStatus;
 
 static int luaLibInfo(lua_State *L);
 static int luaConnect(lua_State *L);
 static int luaGenerateUUID(lua_State *L);
+static int luaLoopAll(lua_State *L);
+static int luaCreateTransport(lua_State *L);
+static int luaMessageTemplate(lua_State *L);
 
 static luaL_Reg luaAzureIotHubMethods[] = {
 	{"info", luaLibInfo },
 	{"connect", luaConnect },
+	{"createTransport", luaCreateTransport },
+	{"loopAll", luaLoopAll },
 	{"generateUUID", luaGenerateUUID },
+	{"messageTemplate", luaMessageTemplate },
 	{NULL, NULL} 
 };
 
 static int luaDisconnect(lua_State *L);
 static int luaSendMessage(lua_State *L);
+static int luaSendMessageYield(lua_State *L);
 static int luaGetSendStatus(lua_State *L);
 static int luaLastMessageReceiveTime(lua_State *L);
 static int luaLoop(lua_State *L);
+static int luaSendBatch(lua_State *L);
+static int luaDispatch(lua_State *L);
+static int luaGetPollInfo(lua_State *L);
+static int luaStep(lua_State *L);
+static int luaGetPoolStats(lua_State *L);
+static int luaMessageStatus(lua_State *L);
+static int luaPending(lua_State *L);
+static int luaCancel(lua_State *L);
+static int luaGetConnectStats(lua_State *L);
+static int luaStats(lua_State *L);
+static int luaLoopbackReceive(lua_State *L);
 
 
 static luaL_Reg luaAzureIotHubConnectionMethods[] = {
 	{"disconnect", luaDisconnect },
 	{"sendMessage", luaSendMessage },
+	{"sendMessageYield", luaSendMessageYield },
+	{"sendBatch", luaSendBatch },
+	{"dispatch", luaDispatch },
+	{"getPollInfo", luaGetPollInfo },
+	{"step", luaStep },
+	{"getPoolStats", luaGetPoolStats },
+	{"messageStatus", luaMessageStatus },
+	{"pending", luaPending },
+	{"cancel", luaCancel },
+	{"getConnectStats", luaGetConnectStats },
+	{"stats", luaStats },
+	{"loopbackReceive", luaLoopbackReceive },
 	{"getSendStatus", luaGetSendStatus },
 	{"lastMessageReceiveTime", luaLastMessageReceiveTime },
 	{"loop", luaLoop },
 	{NULL, NULL} 
 };
 
+static int luaTransportAddDevice(lua_State *L);
+static int luaTransportLoop(lua_State *L);
+static int luaTransportGetDeviceCount(lua_State *L);
+static int luaTransportDestroy(lua_State *L);
+
+static luaL_Reg luaAzureIotHubTransportMethods[] = {
+	{"addDevice", luaTransportAddDevice },
+	{"loop", luaTransportLoop },
+	{"getDeviceCount", luaTransportGetDeviceCount },
+	{"destroy", luaTransportDestroy },
+	{NULL, NULL} 
+};
+
+
+static void DoWorkTimerCallback(WaitTimer *timer);
+static void ReadBatchTimerCallback(WaitTimer *timer);
+static void ReconnectTimerCallback(WaitTimer *timer);
+static void StandbyTimerCallback(WaitTimer *timer);
+static void CoalesceTimerCallback(WaitTimer *timer);
+static void YieldTimerCallback(WaitTimer *timer);
+static void connectionResumeYields(ConnectInfo *info);
+static void connectionFinishDrain(ConnectInfo *info);
+static void connectionFlushReadBatch(ConnectInfo *info, bool isForced);
+static void SendConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* userContextCallback);
+static void connectionSubmitQueued(ConnectInfo *info);
+static SendCallbackInfo *newSendCallbackInfo(ConnectInfo *info, IOTHUB_MESSAGE_HANDLE messageHandle);
+static bool connectionCheckHealth(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo, IOTHUB_CLIENT_CONFIRMATION_RESULT result);
+static void connectionRetry(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo);
+static void connectionSpliceRetry(ConnectInfo *info);
+static void connectionClose(ConnectInfo *info);
+static void connectionFlushCoalesced(ConnectInfo *info);
+static int pushSendResult(lua_State *L, bool isDone, IOTHUB_CLIENT_CONFIRMATION_RESULT result, unsigned long long sequence);
+static void setNewMessageId(MessageIdGenerator *idGenerator, IOTHUB_MESSAGE_HANDLE messageHandle);
+static void transportWakeUp(TransportInfo *transport);
+static int threadDispatch(ConnectInfo *info);
+static void threadWakeUp(ThreadInfo *thread);
+static void transportRemoveDevice(TransportInfo *transport, ConnectInfo *info);
+
+/*
+ The openssl tlsio init and deinit are process wide, so they are counted over all of the connections and shared
+ transports. Lua states on different threads can connect at the same time, so the count is locked.
+*/
+static pthread_mutex_t tlsMutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int tlsUseCount = 0;
+
+static void tlsAcquire(void)
+{
+	pthread_mutex_lock(&tlsMutex);
+	if ( tlsUseCount ++ == 0 ) {
+		tlsio_openssl_init();
+	}
+	pthread_mutex_unlock(&tlsMutex);
+}
+
+static void tlsRelease(void)
+{
+	pthread_mutex_lock(&tlsMutex);
+	if ( tlsUseCount > 0 && -- tlsUseCount == 0 ) {
+		tlsio_openssl_deinit();
+	}
+	pthread_mutex_unlock(&tlsMutex);
+}
+
+static unsigned long long threadCpuTimeNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return (unsigned long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ A new client has been made, time how long it takes before it is working.
+*/
+static void connectionStartConnectTime(ConnectInfo *info)
+{
+	info->connectCount ++;
+	info->isConnectPending = true;
+	info->connectStartTime = waitTimeNow();
+	info->connectCpuNs = 0;
+}
+
+/*
+ The client has confirmed a message or received one, so it has connected.
+*/
+static void connectionSetConnected(ConnectInfo *info)
+{
+	if ( info->isConnectPending ) {
+		info->isConnectPending = false;
+		info->lastConnectMs = waitTimeNow() - info->connectStartTime;
+		info->lastConnectCpuNs = info->connectCpuNs;
+		info->totalConnectMs += info->lastConnectMs;
+		info->totalConnectCpuNs += info->connectCpuNs;
+	}
+}
 
-void pushConnectInfo(lua_State *L, ConnectInfo *info)
+ConnectInfo *pushConnectInfo(lua_State *L, ConnectInfo *info)
 {
 	lua_pushstring(L, "info");
 	ConnectInfo *userData = lua_newuserdata(L, sizeof(ConnectInfo));
 	memcpy(userData, info, sizeof(ConnectInfo));
+	luaL_setmetatable(L, CONNECT_INFO_METATABLE_NAME);
 	lua_settable(L, -3);	
+	
+	// the wait engine and timers hold pointers to themselves, so they can only be setup once in the user data
+	waitEngineInit(&userData->waitEngine);
+	waitTimerInit(&userData->doWorkTimer, DoWorkTimerCallback, userData);
+	waitTimerInit(&userData->readBatchTimer, ReadBatchTimerCallback, userData);
+	waitTimerInit(&userData->reconnectTimer, ReconnectTimerCallback, userData);
+	waitTimerInit(&userData->standbyTimer, StandbyTimerCallback, userData);
+	waitTimerInit(&userData->coalesceTimer, CoalesceTimerCallback, userData);
+	waitTimerInit(&userData->yieldTimer, YieldTimerCallback, userData);
+	userData->doWorkInterval = WAIT_BUSY_INTERVAL_MS;
+	return userData;
 }
 
 ConnectInfo *readConnectInfo(lua_State *L, int index)
@@ -110,715 +569,5645 @@ ConnectInfo *readConnectInfo(lua_State *L, int index)
 }
 
 
-void pushMessageTable(lua_State *L, IOTHUB_MESSAGE_HANDLE messageHandle)
+/*
+ Run one cycle of the iothub client, and schedule the next cycle. While messages are still being sent we come back 
+ quickly, otherwise the interval backs off until WAIT_IDLE_INTERVAL_MS so an idle connection does not use any cpu.
+*/
+static void connectionDoWork(ConnectInfo *info)
 {
-    IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(messageHandle);
-
-	lua_createtable(L, 2, 2);
-
-	lua_pushstring(L, "contentType");
-	lua_pushnumber(L, contentType);
-	lua_settable(L, -3);			
+	IOTHUB_CLIENT_STATUS sendStatus;
 	
-    if ( ! ( contentType == IOTHUBMESSAGE_BYTEARRAY || contentType == IOTHUBMESSAGE_STRING ) ) {
-		lua_pushstring(L, "errorMessage");
-		lua_pushstring(L, "invalid message content");
-		lua_settable(L, -3);			
+	if ( !( info->iotHubClientHandle && info->isConnected ) ) {
 		return;
 	}
+	if ( info->thread ) {
+		// the io thread does the SDK work, we only need to run the callbacks
+		threadDispatch(info);
+		connectionFlushReadBatch(info, false);
+		return;
+	}
+	unsigned long long cpuStart = info->isConnectPending ? threadCpuTimeNs() : 0;
+	IoTHubClient_LL_DoWork(info->iotHubClientHandle);
+	info->stats.doWorkCount ++;
+	if ( info->isConnectPending ) {
+		info->connectCpuNs += threadCpuTimeNs() - cpuStart;
+	}
 	
-    if (contentType == IOTHUBMESSAGE_BYTEARRAY) {
-    	const unsigned char *buffer = NULL;
-    	size_t size = 0;
-        if (IoTHubMessage_GetByteArray(messageHandle, &buffer, &size) == IOTHUB_MESSAGE_OK) {
-			lua_pushstring(L, "text");
-			lua_pushlstring(L, (const char *) buffer, size);
-			lua_settable(L, -3);
-			lua_pushstring(L, "length");
-			lua_pushnumber(L, size);
+	// a hot standby client is warming up or the old one is draining, see connectionPromoteStandby
+	if ( info->standbyClientHandle && info->isConnected ) {
+		IoTHubClient_LL_DoWork(info->standbyClientHandle);
+		info->stats.doWorkCount ++;
+	}
+	if ( info->drainingClientHandle && info->isConnected ) {
+		IoTHubClient_LL_DoWork(info->drainingClientHandle);
+		info->stats.doWorkCount ++;
+		if ( info->drainingInFlightCount == 0 ) {
+			connectionFinishDrain(info);
+		}
+	}
+	
+	// a callback may have disconnected us during the DoWork
+	if ( !( info->iotHubClientHandle && info->isConnected ) ) {
+		return;
+	}
+	connectionFlushReadBatch(info, false);
+	if ( !( info->iotHubClientHandle && info->isConnected ) ) {
+		return;
+	}
+	connectionSubmitQueued(info);
+	if ( IoTHubClient_LL_GetSendStatus(info->iotHubClientHandle, &sendStatus) == IOTHUB_CLIENT_OK 
+			&& sendStatus == IOTHUB_CLIENT_SEND_STATUS_BUSY ) {
+		info->doWorkInterval = WAIT_BUSY_INTERVAL_MS;
+	}
+	else {
+		info->doWorkInterval *= 2;
+		if ( info->doWorkInterval > info->idleIntervalMs ) {
+			info->doWorkInterval = info->idleIntervalMs;
+		}
+	}
+	waitTimerStart(&info->waitEngine, &info->doWorkTimer, waitTimeNow() + info->doWorkInterval);
+}
+
+static void DoWorkTimerCallback(WaitTimer *timer)
+{
+	connectionDoWork((ConnectInfo *) timer->context);
+}
+
+/*
+ Something has been queued to send, so do the next cycle as soon as possible.
+*/
+static void connectionWakeUp(ConnectInfo *info)
+{
+	if ( info->thread ) {
+		threadWakeUp(info->thread);
+		return;
+	}
+	info->doWorkInterval = WAIT_BUSY_INTERVAL_MS;
+	waitTimerStart(&info->waitEngine, &info->doWorkTimer, waitTimeNow());
+	if ( info->transportInfo ) {
+		transportWakeUp(info->transportInfo);
+	}
+}
+
+/*
+ Sleep and process the connection until the deadline (monotonic milliseconds), or until *isDone is set by a callback.
+*/
+static void connectionWait(ConnectInfo *info, unsigned long long deadline, bool *isDone)
+{
+	while ( info->iotHubClientHandle && info->isConnected && info->callbackErrorRef == LUA_NOREF ) {
+		if ( isDone && *isDone ) {
+			break;
+		}
+		if ( waitEngineWait(&info->waitEngine, deadline) > 0 ) {
+			connectionDoWork(info);
+		}
+		waitEngineExpire(&info->waitEngine, waitTimeNow());
+		connectionResumeYields(info);
+		if ( waitTimeNow() >= deadline ) {
+			break;
+		}
+	}
+}
+
+/*
+ Inflated bodies are read into a compressor for each thread, so a lazy message can be read after its connection has
+ gone. The compressor is made on first use and freed when the thread exits.
+*/
+static pthread_key_t receiveCompressorKey;
+static pthread_once_t receiveCompressorOnce = PTHREAD_ONCE_INIT;
+
+static void receiveCompressorDestroy(void *compressor)
+{
+	compressorFree((Compressor *) compressor);
+	free(compressor);
+}
+
+static void receiveCompressorCreateKey(void)
+{
+	pthread_key_create(&receiveCompressorKey, receiveCompressorDestroy);
+}
+
+static Compressor *receiveCompressor(void)
+{
+	Compressor *compressor;
+	pthread_once(&receiveCompressorOnce, receiveCompressorCreateKey);
+	compressor = pthread_getspecific(receiveCompressorKey);
+	if ( compressor == NULL ) {
+		compressor = malloc(sizeof(Compressor));
+		if ( compressor == NULL ) {
+			return NULL;
+		}
+		compressorInit(compressor);
+		if ( pthread_setspecific(receiveCompressorKey, compressor) != 0 ) {
+			receiveCompressorDestroy(compressor);
+			return NULL;
+		}
+	}
+	return compressor;
+}
+
+/*
+ If the sender compressed the message body, replace 'buffer' and 'size' with the inflated body. The inflated body is
+ kept in the compressor of the thread, so it is only valid until the next message is read. Returns false if the body
+ is compressed and cannot be inflated.
+*/
+static bool inflateMessageBody(IOTHUB_MESSAGE_HANDLE messageHandle, const unsigned char **buffer, size_t *size)
+{
+	Compressor *compressor;
+	const unsigned char *output;
+	size_t outputLength;
+	MAP_HANDLE propertyMap = IoTHubMessage_Properties(messageHandle);
+	const char *encoding = propertyMap ? Map_GetValueFromKey(propertyMap, COMPRESS_ENCODING_PROPERTY) : NULL;
+	if ( encoding == NULL || strcmp(encoding, COMPRESS_ENCODING_DEFLATE) != 0 ) {
+		return true;
+	}
+	compressor = receiveCompressor();
+	if ( compressor == NULL || !compressorInflate(compressor, *buffer, *size, &output, &outputLength) ) {
+		return false;
+	}
+	*buffer = output;
+	*size = outputLength;
+	return true;
+}
+
+/*
+ Set the text and length fields of the table at the top of the stack from the body of a byte array message, or 
+ errorMessage if the body cannot be read. Both fields come from the one read, so a compressed body is only inflated
+ once.
+*/
+static void setByteArrayFields(lua_State *L, IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	const unsigned char *buffer = NULL;
+	size_t size = 0;
+	if ( IoTHubMessage_GetByteArray(messageHandle, &buffer, &size) != IOTHUB_MESSAGE_OK ) {
+		lua_pushstring(L, "cannot save data");
+		lua_setfield(L, -2, "errorMessage");
+	}
+	else if ( !inflateMessageBody(messageHandle, &buffer, &size) ) {
+		lua_pushstring(L, "cannot inflate data");
+		lua_setfield(L, -2, "errorMessage");
+	}
+	else {
+		lua_pushlstring(L, (const char *) buffer, size);
+		lua_setfield(L, -2, "text");
+		lua_pushnumber(L, size);
+		lua_setfield(L, -2, "length");
+	}
+}
+
+/*
+ Push the message properties as a table, or nil if the message has none.
+*/
+static void pushMessageProperties(lua_State *L, IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	// Retrieve properties from the message
+	MAP_HANDLE mapProperties = messageHandle ? IoTHubMessage_Properties(messageHandle) : NULL;
+	const char*const* keys;
+	const char*const* values;
+	size_t propertyCount = 0;
+	if ( mapProperties != NULL && Map_GetInternals(mapProperties, &keys, &values, &propertyCount) == MAP_OK && propertyCount > 0 ) {
+		size_t index;
+		lua_createtable(L, 0, propertyCount);
+		for (index = 0; index < propertyCount; index++) {
+			lua_pushstring(L, keys[index]);
+			lua_pushstring(L, values[index]);
 			lua_settable(L, -3);
 		}
+	}
+	else {
+		lua_pushnil(L);
+	}
+}
+
+/*
+ Push the value of one message field for the lazy message __index, or nil if the message does not have the field.
+ The text, length and errorMessage of a byte array message are set together by setByteArrayFields instead. Returns false and pushes
+ nothing if 'name' is not a message field.
+*/
+static bool pushMessageField(lua_State *L, IOTHUB_MESSAGE_HANDLE messageHandle, const char *name)
+{
+	IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(messageHandle);
+	bool isValid = ( contentType == IOTHUBMESSAGE_BYTEARRAY || contentType == IOTHUBMESSAGE_STRING );
+
+	if ( strcmp(name, "contentType") == 0 ) {
+		lua_pushnumber(L, contentType);
+	}
+	else if ( strcmp(name, "errorMessage") == 0 ) {
+		if ( !isValid ) {
+			lua_pushstring(L, "invalid message content");
+		}
+		else if ( contentType == IOTHUBMESSAGE_STRING && IoTHubMessage_GetString(messageHandle) == NULL ) {
+			lua_pushstring(L, "cannot save text");
+		}
 		else {
-			lua_pushstring(L, "errorMessage");
-			lua_pushstring(L, "cannot save data");
-			lua_settable(L, -3);			
+			lua_pushnil(L);
 		}
 	}
-    if (contentType == IOTHUBMESSAGE_STRING) {
-    	const char *buffer;
-        if ( (buffer = IoTHubMessage_GetString(messageHandle)) != NULL ) {
-			lua_pushstring(L, "text");
-			lua_pushstring(L, buffer);
-			lua_settable(L, -3);
+	else if ( strcmp(name, "text") == 0 || strcmp(name, "length") == 0 ) {
+		if ( contentType == IOTHUBMESSAGE_STRING && name[0] == 't' ) {
+			lua_pushstring(L, IoTHubMessage_GetString(messageHandle));
 		}
 		else {
-			lua_pushstring(L, "errorMessage");
-			lua_pushstring(L, "cannot save text");
-			lua_settable(L, -3);			
+			lua_pushnil(L);
 		}
 	}
+	else if ( strcmp(name, "id") == 0 ) {
+		lua_pushstring(L, isValid ? IoTHubMessage_GetMessageId(messageHandle) : NULL);
+	}
+	else if ( strcmp(name, "correlationId") == 0 ) {
+		lua_pushstring(L, isValid ? IoTHubMessage_GetCorrelationId(messageHandle) : NULL);
+	}
+	else if ( strcmp(name, "property") == 0 ) {
+		pushMessageProperties(L, isValid ? messageHandle : NULL);
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+void pushMessageTable(lua_State *L, IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(messageHandle);
+	const char *text;
+
+	lua_createtable(L, 0, 6);
+	lua_pushnumber(L, contentType);
+	lua_setfield(L, -2, "contentType");
 	
+	if ( contentType == IOTHUBMESSAGE_BYTEARRAY ) {
+		setByteArrayFields(L, messageHandle);
+	}
+	else if ( contentType == IOTHUBMESSAGE_STRING ) {
+		if ( ( text = IoTHubMessage_GetString(messageHandle) ) != NULL ) {
+			lua_pushstring(L, text);
+			lua_setfield(L, -2, "text");
+		}
+		else {
+			lua_pushstring(L, "cannot save text");
+			lua_setfield(L, -2, "errorMessage");
+		}
+	}
+	else {
+		lua_pushstring(L, "invalid message content");
+		lua_setfield(L, -2, "errorMessage");
+		return;
+	}
 	
-	lua_pushstring(L, "id");
 	lua_pushstring(L, IoTHubMessage_GetMessageId(messageHandle));
-	lua_settable(L, -3);
-	
-	lua_pushstring(L, "correlationId");
+	lua_setfield(L, -2, "id");
 	lua_pushstring(L, IoTHubMessage_GetCorrelationId(messageHandle));
-	lua_settable(L, -3);
-		
-    // Retrieve properties from the message
-    MAP_HANDLE mapProperties = IoTHubMessage_Properties(messageHandle);
-    if (mapProperties != NULL) {
-        const char*const* keys;
-        const char*const* values;
-        size_t propertyCount = 0;
-        if (Map_GetInternals(mapProperties, &keys, &values, &propertyCount) == MAP_OK) {
-            if (propertyCount > 0) {
-				lua_pushstring(L, "property");
-				lua_createtable(L, 0, propertyCount);
-                size_t index;
-                for (index = 0; index < propertyCount; index++) {
-					lua_pushstring(L, keys[index]);
-					lua_pushstring(L, values[index]);
-					lua_settable(L, -3);
-                }
-                lua_settable(L, -3);
-            }
-        }
-    }
+	lua_setfield(L, -2, "correlationId");
+	pushMessageProperties(L, messageHandle);
+	lua_setfield(L, -2, "property");
 }
 
-static IOTHUBMESSAGE_DISPOSITION_RESULT ReceiveMessageCallback(IOTHUB_MESSAGE_HANDLE messageHandle, void* userContextCallback)
+/*
+ Lazy message.
+ 
+ With the connect option lazyMessages the callbacks are passed a small userdata instead of a message table, the 
+ fields are only read from the SDK message when lua asks for them, and are then kept in the userdata uservalue table.
+ If the message is owned by the library the userdata takes it over and destroys it when collected, otherwise the
+ message is only readable until the callback returns.
+*/
+
+static int luaMessageToTable(lua_State *L)
 {
-	lua_State *L = callbackState;
-	IOTHUBMESSAGE_DISPOSITION_RESULT result = IOTHUBMESSAGE_ACCEPTED;
-	lua_getfield(L, LUA_REGISTRYINDEX, RECEIVE_FUNCTION_CALLBACK_NAME);
-	if ( lua_isfunction(L, -1) ) {
-		pushMessageTable(L, messageHandle);
-		lua_call(L, 1, 1);
-		if ( lua_isnumber(L, -1) ) {
-			result = lua_tonumber(L, -1);
+	LazyMessage *lazyMessage = luaL_checkudata(L, 1, MESSAGE_METATABLE_NAME);
+	if ( lazyMessage->messageHandle == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Message is no longer available");
+		return 2;
+	}
+	pushMessageTable(L, lazyMessage->messageHandle);
+	return 1;
+}
+
+static int luaMessageIndex(lua_State *L)
+{
+	LazyMessage *lazyMessage = luaL_checkudata(L, 1, MESSAGE_METATABLE_NAME);
+	const char *name = luaL_checkstring(L, 2);
+	
+	if ( strcmp(name, "toTable") == 0 ) {
+		lua_pushcfunction(L, luaMessageToTable);
+		return 1;
+	}
+	lua_getuservalue(L, 1);
+	if ( lua_istable(L, -1) ) {
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+		if ( !lua_isnil(L, -1) ) {
+			return 1;
 		}
 		lua_pop(L, 1);
 	}
 	else {
-		lua_pop(L, 1);			// get receiveFunction
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 2);
+		lua_pushvalue(L, -1);
+		lua_setuservalue(L, 1);
 	}
-    return result;
+	// field cache table is at the top of the stack
+	if ( lazyMessage->messageHandle && IoTHubMessage_GetContentType(lazyMessage->messageHandle) == IOTHUBMESSAGE_BYTEARRAY
+			&& ( strcmp(name, "text") == 0 || strcmp(name, "length") == 0 || strcmp(name, "errorMessage") == 0 ) ) {
+		// the body fields are cached together, marked with a true key as errorMessage is usually nil
+		lua_pushboolean(L, 1);
+		lua_rawget(L, -2);
+		bool isRead = !lua_isnil(L, -1);
+		lua_pop(L, 1);
+		if ( !isRead ) {
+			setByteArrayFields(L, lazyMessage->messageHandle);
+			lua_pushboolean(L, 1);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, -3);
+		}
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+		return 1;
+	}
+	if ( lazyMessage->messageHandle == NULL || !pushMessageField(L, lazyMessage->messageHandle, name) ) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+	return 1;
 }
 
-static void SendConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* userContextCallback)
+static int luaMessageGC(lua_State *L)
 {
-	IOTHUBMESSAGE_CONTENT_TYPE contentType;
-	SendCallbackInfo *sendCallbackInfo = ( SendCallbackInfo *) userContextCallback;
-	lua_State *L = callbackState;	
-	if ( sendCallbackInfo == NULL ) {
-		return;
+	LazyMessage *lazyMessage = lua_touserdata(L, 1);
+	if ( lazyMessage && lazyMessage->messageHandle && lazyMessage->isOwned ) {
+		IoTHubMessage_Destroy(lazyMessage->messageHandle);
 	}
-	// check for bug when sending error, the service can send multiple callbacks on one message
-    contentType = IoTHubMessage_GetContentType(sendCallbackInfo->messageHandle);
-	
-    if ( contentType != IOTHUBMESSAGE_BYTEARRAY && contentType != IOTHUBMESSAGE_STRING ) {
-		return;
+	if ( lazyMessage ) {
+		lazyMessage->messageHandle = NULL;
 	}
-	
-	lua_getfield(L, LUA_REGISTRYINDEX, SEND_CONFIRMATION_FUNCTION_CALLBACK_NAME);
-	if ( lua_isfunction(L, -1) ) {
-		lua_pushnumber(L, result);
-		pushMessageTable(L, sendCallbackInfo->messageHandle);
-		lua_call(L, 2, 0);
+	return 0;
+}
+
+/*
+ Callback errors.
+ 
+ The callbacks are run from inside the SDK DoWork and the timers of the wait engine, so a lua error must not unwind
+ through them. Each callback is called protected, the first error is held by the connection, and connectionRaiseError
+ raises it from the lua call that ran the connection once that work has returned. Later errors from the same cycle
+ are dropped.
+*/
+
+/*
+ Hold the error at the top of the stack, unless an earlier one is already held.
+*/
+static void connectionHoldError(ConnectInfo *info, lua_State *L)
+{
+	if ( info->callbackErrorRef == LUA_NOREF ) {
+		info->callbackErrorRef = luaL_ref(L, LUA_REGISTRYINDEX);
 	}
-	lua_pop(L, 1); 			// pop back table getfield sendConfirmFunction
-	
-	// check to see if we saved a random uuid for this message	
-	if ( result != IOTHUB_CLIENT_CONFIRMATION_ERROR) {		
-		if ( sendCallbackInfo->isSendSync ) {
-			syncSendStatus.isDone = true;
-			syncSendStatus.result = result;
-		}
-		IoTHubMessage_Destroy(sendCallbackInfo->messageHandle);
-	}	
-	if ( sendCallbackInfo->messageId ) {
-		free(sendCallbackInfo->messageId);
-		sendCallbackInfo->messageId = NULL;
+	else {
+		lua_pop(L, 1);
 	}
-	free(sendCallbackInfo);
 }
 
-/***  
-IotHub object, returned by the @{connect} function
-@table iotHub
-@tfield boolean isConnect If true then this connection has been made
-@tfield function disconnect @{disconnect} Disconnects from the IotHub.
-@tfield function sendMessage @{sendMessage} Sends out a message.
-@tfield function getSendStatus @{getSendStatus} Returns the current sending status.
-@tfield function lastMessageReceiveTime @{lastMessageReceiveTime} Returns the last time a message was received.
-@tfield function loop @{loop} Loops around the message queue completing sending and receiving messages.
+/*
+ Call the function below 'argumentCount' arguments protected, on an error it is held and 'resultCount' nils are left 
+ in place of the results. Returns false if the function raised an error.
 */
+static bool connectionCall(ConnectInfo *info, lua_State *L, int argumentCount, int resultCount)
+{
+	int index;
+	if ( lua_pcall(L, argumentCount, resultCount, 0) == LUA_OK ) {
+		return true;
+	}
+	connectionHoldError(info, L);
+	for ( index = 0; index < resultCount; index ++ ) {
+		lua_pushnil(L);
+	}
+	return false;
+}
 
-  
-/***  
-Message table used for sending or receiving via the Azure IotHub.
+/*
+ Raise the error held from a callback, if there is one. Only called from a lua function once the connection work it 
+ ran has returned.
+*/
+static void connectionRaiseError(lua_State *L, ConnectInfo *info)
+{
+	if ( info && info->callbackErrorRef != LUA_NOREF ) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, info->callbackErrorRef);
+		luaL_unref(L, LUA_REGISTRYINDEX, info->callbackErrorRef);
+		info->callbackErrorRef = LUA_NOREF;
+		lua_error(L);
+	}
+}
 
-On sending a message, you need to only fill in the __text__ field before passing this table to the @{sendMessage} function.
+/*
+ Push the message for a callback, as a table or as a lazy message. If 'isOwned' is set and a lazy message is 
+ returned, the lazy message now owns the message handle. Returns NULL when a table was pushed.
+*/
+static LazyMessage *pushMessage(lua_State *L, ConnectInfo *info, IOTHUB_MESSAGE_HANDLE messageHandle, bool isOwned)
+{
+	if ( !info->isLazyMessage ) {
+		pushMessageTable(L, messageHandle);
+		return NULL;
+	}
+	LazyMessage *lazyMessage = lua_newuserdata(L, sizeof(LazyMessage));
+	lazyMessage->messageHandle = messageHandle;
+	lazyMessage->isOwned = isOwned;
+	luaL_setmetatable(L, MESSAGE_METATABLE_NAME);
+	return lazyMessage;
+}
 
-On receving a message the __text__, __contentType__ and __length__ will have values, other fields will be set if they are present in the message.
+/*
+ Call a function with 'argumentCount' arguments on the stack, one of which is the message pushed by pushMessage.
+ A lazy message that does not own its handle is cut off from it once the call returns. The call is protected, see 
+ connectionCall, returns false if the function raised an error.
+*/
+static bool callWithMessage(lua_State *L, ConnectInfo *info, LazyMessage *lazyMessage, int argumentCount, int resultCount)
+{
+	int functionIndex = lua_gettop(L) - argumentCount;
+	int index;
+	bool isOk;
+	unsigned long long startNs = statsTimeNowNs();
+	
+	if ( lazyMessage == NULL || lazyMessage->isOwned ) {
+		isOk = connectionCall(info, L, argumentCount, resultCount);
+		statsHistogramRecord(&info->stats.callbackTime, statsTimeNowNs() - startNs);
+		return isOk;
+	}
+	// keep a copy of the lazy message below the function, so it cannot be collected before it is cut off
+	for ( index = functionIndex + 1; index <= lua_gettop(L); index ++ ) {
+		if ( lua_touserdata(L, index) == lazyMessage ) {
+			lua_pushvalue(L, index);
+			lua_insert(L, functionIndex);
+			break;
+		}
+	}
+	isOk = connectionCall(info, L, argumentCount, resultCount);
+	statsHistogramRecord(&info->stats.callbackTime, statsTimeNowNs() - startNs);
+	lazyMessage->messageHandle = NULL;
+	lua_remove(L, functionIndex);
+	return isOk;
+}
 
-@table message
-@tfield string text Mesasge text, this can be a text string or binary data with embedded zeros. 
-@tfield number,nil length If the length is provided then the text field will be encoded as binary data, with that length
-@tfield number,nil contentType The message text can be overridden by using this field. It can be one of the following:
+/*
+ Batched receive.
+ 
+ With a processReadBatch callback, received messages are kept in a ring and passed to lua as one array at the end 
+ of the loop cycle, or once the oldest has waited readBatchDelayMs. The SDK needs the disposition before the receive
+ callback returns, so each message is accepted once it is in the ring. If the ring is full the message is abandoned,
+ and the IotHub sends it again later. The IotHub has already been told a held message is accepted, so when 
+ processReadBatch abandons one it can only be retried here: it is passed again in the next batch, up to 
+ READ_BATCH_MAX_PASSES times, and then dropped so a message lua never takes cannot keep new ones out of the ring.
+*/
+
+static bool readBatchInit(ConnectInfo *info, ConnectOptions *options)
+{
+	if ( !ringInit(&info->readBatchRing, options->readBatchSize) ) {
+		return false;
+	}
+	info->readBatchEntries = calloc(info->readBatchRing.mask + 1, sizeof(RingEntry));
+	if ( info->readBatchEntries == NULL ) {
+		ringFree(&info->readBatchRing);
+		return false;
+	}
+	info->readBatchDelayMs = options->readBatchDelayMs;
+	return true;
+}
+
+static void readBatchFree(ConnectInfo *info)
+{
+	RingEntry entry;
+	if ( info->readBatchEntries == NULL ) {
+		return;
+	}
+	while ( ringPop(&info->readBatchRing, &entry) ) {
+		IoTHubMessage_Destroy((IOTHUB_MESSAGE_HANDLE) entry.data);
+	}
+	ringFree(&info->readBatchRing);
+	free(info->readBatchEntries);
+	info->readBatchEntries = NULL;
+}
+
+static IOTHUBMESSAGE_DISPOSITION_RESULT connectionBufferRead(ConnectInfo *info, IOTHUB_MESSAGE_HANDLE messageHandle, bool isOwned)
+{
+	RingEntry entry = { 0, 0, NULL };
+	
+	entry.data = isOwned ? messageHandle : IoTHubMessage_Clone(messageHandle);
+	if ( entry.data == NULL ) {
+		return IOTHUBMESSAGE_ABANDONED;
+	}
+	if ( ringCount(&info->readBatchRing) == 0 ) {
+		info->readBatchDue = waitTimeNow() + info->readBatchDelayMs;
+		waitTimerStart(&info->waitEngine, &info->readBatchTimer, info->readBatchDue);
+	}
+	if ( !ringPush(&info->readBatchRing, &entry) ) {
+		IoTHubMessage_Destroy((IOTHUB_MESSAGE_HANDLE) entry.data);
+		info->stats.readOverflowCount ++;
+		return IOTHUBMESSAGE_ABANDONED;
+	}
+	return IOTHUBMESSAGE_ACCEPTED;
+}
+
+/*
+ Pass all of the waiting messages to processReadBatch, and act on the array of dispositions it returns. The call is 
+ protected so the batch is always released, if processReadBatch fails every message in it counts as abandoned, and 
+ the error is held for connectionRaiseError unless the connection is closing.
+*/
+static void deliverReadBatch(ConnectInfo *info, bool isForced)
+{
+	lua_State *L = info->L;
+	RingEntry *entries = info->readBatchEntries;
+	int count = 0;
+	int index;
+	int status;
+	
+	while ( ringPop(&info->readBatchRing, &entries[count]) ) {
+		count ++;
+	}
+	if ( L == NULL || info->readBatchFunctionRef == LUA_NOREF ) {
+		for ( index = 0; index < count; index ++ ) {
+			IoTHubMessage_Destroy((IOTHUB_MESSAGE_HANDLE) entries[index].data);
+		}
+		return;
+	}
+	
+	info->isReadBatchFlushing = true;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, info->readBatchFunctionRef);
+	lua_createtable(L, count, 0);
+	for ( index = 0; index < count; index ++ ) {
+		// the messages stay with us, so an abandoned message can be passed again
+		pushMessage(L, info, (IOTHUB_MESSAGE_HANDLE) entries[index].data, false);
+		lua_rawseti(L, -2, index + 1);
+	}
+	// keep the array below the function, so the lazy messages can be cut off after the call
+	lua_pushvalue(L, -1);
+	lua_insert(L, -3);
+	unsigned long long startNs = statsTimeNowNs();
+	status = lua_pcall(L, 1, 1, 0);
+	statsHistogramRecord(&info->stats.callbackTime, statsTimeNowNs() - startNs);
+	
+	// dispositions or the error at -1, messages at -2
+	for ( index = 0; index < count; index ++ ) {
+		IOTHUBMESSAGE_DISPOSITION_RESULT result = status == LUA_OK ? IOTHUBMESSAGE_ACCEPTED : IOTHUBMESSAGE_ABANDONED;
+		if ( status == LUA_OK && lua_istable(L, -1) ) {
+			lua_rawgeti(L, -1, index + 1);
+			if ( lua_isnumber(L, -1) ) {
+				result = lua_tointeger(L, -1);
+			}
+			lua_pop(L, 1);
+		}
+		if ( info->isLazyMessage ) {
+			lua_rawgeti(L, -2, index + 1);
+			LazyMessage *lazyMessage = luaL_testudata(L, -1, MESSAGE_METATABLE_NAME);
+			if ( lazyMessage ) {
+				lazyMessage->messageHandle = NULL;
+			}
+			lua_pop(L, 1);
+		}
+		if ( result != IOTHUBMESSAGE_ABANDONED ) {
+			IoTHubMessage_Destroy((IOTHUB_MESSAGE_HANDLE) entries[index].data);
+			continue;
+		}
+		// processReadBatch may have run the loop and filled the ring again, so there might not be room to keep it
+		entries[index].result ++;
+		if ( entries[index].result >= READ_BATCH_MAX_PASSES || !ringPush(&info->readBatchRing, &entries[index]) ) {
+			IoTHubMessage_Destroy((IOTHUB_MESSAGE_HANDLE) entries[index].data);
+			info->stats.readDropCount ++;
+		}
+	}
+	lua_remove(L, -2);
+	if ( ringCount(&info->readBatchRing) > 0 ) {
+		info->readBatchDue = waitTimeNow() + info->readBatchDelayMs;
+		waitTimerStart(&info->waitEngine, &info->readBatchTimer, info->readBatchDue);
+	}
+	info->isReadBatchFlushing = false;
+	if ( status != LUA_OK && !isForced ) {
+		connectionHoldError(info, L);
+		return;
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ Called at the end of each loop cycle, passes the waiting messages to lua if the ring is full or the oldest message
+ has waited long enough. isForced passes them on regardless, when the connection is closing.
+*/
+static void connectionFlushReadBatch(ConnectInfo *info, bool isForced)
+{
+	unsigned int count;
+	if ( info->readBatchEntries == NULL || info->isReadBatchFlushing ) {
+		return;
+	}
+	count = ringCount(&info->readBatchRing);
+	if ( count == 0 ) {
+		return;
+	}
+	if ( !isForced && count <= info->readBatchRing.mask && waitTimeNow() < info->readBatchDue ) {
+		return;
+	}
+	waitTimerStop(&info->waitEngine, &info->readBatchTimer);
+	deliverReadBatch(info, isForced);
+}
+
+static void ReadBatchTimerCallback(WaitTimer *timer)
+{
+	connectionFlushReadBatch((ConnectInfo *) timer->context, false);
+}
+
+/*
+ Return the body of the message and its length, or NULL if the body cannot be read.
+*/
+static const unsigned char *readMessageBody(IOTHUB_MESSAGE_HANDLE messageHandle, size_t *length)
+{
+	const unsigned char *body = NULL;
+	if ( IoTHubMessage_GetContentType(messageHandle) == IOTHUBMESSAGE_BYTEARRAY ) {
+		if ( IoTHubMessage_GetByteArray(messageHandle, &body, length) != IOTHUB_MESSAGE_OK ) {
+			return NULL;
+		}
+		return body;
+	}
+	body = (const unsigned char *) IoTHubMessage_GetString(messageHandle);
+	*length = body ? strlen((const char *) body) : 0;
+	return body;
+}
+
+/*
+ Pass a received message to processRead. If 'isOwned' is set the message belongs to the library and is destroyed 
+ here, or handed over to a lazy message.
+*/
+static IOTHUBMESSAGE_DISPOSITION_RESULT receiveMessage(ConnectInfo *info, IOTHUB_MESSAGE_HANDLE messageHandle, bool isOwned)
+{
+	lua_State *L = info->L;
+	IOTHUBMESSAGE_DISPOSITION_RESULT result = IOTHUBMESSAGE_ACCEPTED;
+	LazyMessage *lazyMessage = NULL;
+	size_t bodyLength = 0;
+	connectionSetConnected(info);
+	info->stats.receiveCount ++;
+	if ( readMessageBody(messageHandle, &bodyLength) ) {
+		info->stats.receiveBytes += bodyLength;
+	}
+	if ( info->readBatchEntries ) {
+		return connectionBufferRead(info, messageHandle, isOwned);
+	}
+	if ( L && info->receiveFunctionRef != LUA_NOREF ) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, info->receiveFunctionRef);
+		if ( lua_isfunction(L, -1) ) {
+			lazyMessage = pushMessage(L, info, messageHandle, isOwned);
+			if ( !callWithMessage(L, info, lazyMessage, 1, 1) ) {
+				// the IotHub sends it again, the same as a failed processReadBatch
+				result = IOTHUBMESSAGE_ABANDONED;
+			}
+			else if ( lua_isnumber(L, -1) ) {
+				result = lua_tonumber(L, -1);
+			}
+			lua_pop(L, 1);
+		}
+		else {
+			lua_pop(L, 1);			// get receiveFunction
+		}
+	}
+	if ( isOwned && lazyMessage == NULL ) {
+		IoTHubMessage_Destroy(messageHandle);
+	}
+    return result;
+}
+
+static IOTHUBMESSAGE_DISPOSITION_RESULT ReceiveMessageCallback(IOTHUB_MESSAGE_HANDLE messageHandle, void* userContextCallback)
+{
+	return receiveMessage((ConnectInfo *) userContextCallback, messageHandle, false);
+}
+
+/*
+ Send record pool.
+ 
+ Send records are only taken and released on the lua thread, so the pool needs no locking. Records are never 
+ returned to malloc until the connection is garbage collected.
+*/
+
+static bool sendPoolGrow(SendPool *pool)
+{
+	SendPoolSlab *slab = malloc(sizeof(SendPoolSlab));
+	int index;
+	if ( slab == NULL ) {
+		return false;
+	}
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	for ( index = SEND_POOL_SLAB_SIZE - 1; index >= 0; index -- ) {
+		slab->records[index].state = SEND_STATE_FREE;
+		slab->records[index].next = pool->freeList;
+		pool->freeList = &slab->records[index];
+		if ( pool->freeTail == NULL ) {
+			pool->freeTail = &slab->records[index];
+		}
+	}
+	pool->recordCount += SEND_POOL_SLAB_SIZE;
+	pool->freeCount += SEND_POOL_SLAB_SIZE;
+	return true;
+}
+
+static SendCallbackInfo *sendPoolTake(SendPool *pool)
+{
+	SendCallbackInfo *sendCallbackInfo;
+	if ( pool->freeList ) {
+		pool->hitCount ++;
+	}
+	else {
+		pool->missCount ++;
+		if ( !sendPoolGrow(pool) ) {
+			return NULL;
+		}
+	}
+	sendCallbackInfo = pool->freeList;
+	pool->freeList = sendCallbackInfo->next;
+	if ( pool->freeList == NULL ) {
+		pool->freeTail = NULL;
+	}
+	pool->freeCount --;
+	return sendCallbackInfo;
+}
+
+static void sendPoolRelease(SendCallbackInfo *sendCallbackInfo)
+{
+	SendPool *pool = &sendCallbackInfo->info->sendPool;
+	inFlightRemove(&sendCallbackInfo->info->inFlight, sendCallbackInfo->sequence, sendCallbackInfo->messageId, sendCallbackInfo);
+	if ( sendCallbackInfo->messageId != sendCallbackInfo->messageIdBuffer ) {
+		free(sendCallbackInfo->messageId);
+	}
+	sendCallbackInfo->messageId = NULL;
+	// a late duplicate confirmation for this record is not in flight, see SendConfirmationCallback
+	sendCallbackInfo->messageHandle = NULL;
+	sendCallbackInfo->state = SEND_STATE_FREE;
+	sendCallbackInfo->next = NULL;
+	if ( pool->freeTail ) {
+		pool->freeTail->next = sendCallbackInfo;
+	}
+	else {
+		pool->freeList = sendCallbackInfo;
+	}
+	pool->freeTail = sendCallbackInfo;
+	pool->freeCount ++;
+}
+
+/*
+ Return a scratch buffer of at least 'size' bytes. The buffer is kept for the next call, unless it is already being
+ used further up the stack, in that case a new buffer is allocated and must be given back with sendPoolReleaseScratch.
+*/
+static void *sendPoolTakeScratch(SendPool *pool, size_t size)
+{
+	if ( pool->isScratchBusy ) {
+		pool->missCount ++;
+		return calloc(1, size);
+	}
+	if ( size > pool->scratchSize ) {
+		void *scratch = realloc(pool->scratch, size);
+		pool->missCount ++;
+		if ( scratch == NULL ) {
+			return NULL;
+		}
+		pool->scratch = scratch;
+		pool->scratchSize = size;
+	}
+	else {
+		pool->hitCount ++;
+	}
+	pool->isScratchBusy = true;
+	memset(pool->scratch, 0, size);
+	return pool->scratch;
+}
+
+static void sendPoolReleaseScratch(SendPool *pool, void *scratch)
+{
+	if ( scratch == pool->scratch ) {
+		pool->isScratchBusy = false;
+	}
+	else {
+		free(scratch);
+	}
+}
+
+static void sendPoolFree(SendPool *pool)
+{
+	while ( pool->slabs ) {
+		SendPoolSlab *slab = pool->slabs;
+		pool->slabs = slab->next;
+		free(slab);
+	}
+	free(pool->scratch);
+	memset(pool, 0, sizeof(SendPool));
+}
+
+/*
+ Store and forward journal.
+ 
+ With the connect option 'journal' each message is written to the journal file before it is sent, and acked when the 
+ IotHub confirms it. Messages left in the journal by an earlier run are decoded and sent again first on connect. 
+ A message is stored as a JournalMessageHeader followed by the body, the id and correlation id strings and then a 
+ (name length, value length, name, value) entry for each property. Strings are stored with their NUL terminator.
+*/
+
+typedef struct {
+	uint8_t contentType;
+	uint8_t reserved;
+	uint16_t propertyCount;
+	uint32_t bodyLength;
+	uint16_t idLength;
+	uint16_t correlationIdLength;
+} JournalMessageHeader;
+
+static size_t journalStringSize(const char *text)
+{
+	return text ? strlen(text) + 1 : 0;
+}
+
+static unsigned char *journalPut(unsigned char *position, const void *data, size_t length)
+{
+	if ( length > 0 ) {
+		memcpy(position, data, length);
+	}
+	return position + length;
+}
+
+/*
+ Write the message to the journal, the record offset is kept in the send record so it can be acked later.
+ Returns false if the message is too large to encode or the journal is full.
+*/
+static bool connectionJournalSend(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo)
+{
+	IOTHUB_MESSAGE_HANDLE messageHandle = sendCallbackInfo->messageHandle;
+	JournalMessageHeader header;
+	const unsigned char *body = NULL;
+	size_t bodyLength = 0;
+	const char *const *names = NULL;
+	const char *const *values = NULL;
+	size_t propertyCount = 0;
+	size_t index;
+	
+	if ( info->journal == NULL ) {
+		return true;
+	}
+	IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(messageHandle);
+	if ( contentType == IOTHUBMESSAGE_BYTEARRAY ) {
+		if ( IoTHubMessage_GetByteArray(messageHandle, &body, &bodyLength) != IOTHUB_MESSAGE_OK ) {
+			return false;
+		}
+	}
+	else {
+		body = (const unsigned char *) IoTHubMessage_GetString(messageHandle);
+		bodyLength = journalStringSize((const char *) body);
+	}
+	const char *messageId = IoTHubMessage_GetMessageId(messageHandle);
+	const char *correlationId = IoTHubMessage_GetCorrelationId(messageHandle);
+	MAP_HANDLE propertyMap = IoTHubMessage_Properties(messageHandle);
+	if ( propertyMap && Map_GetInternals(propertyMap, &names, &values, &propertyCount) != MAP_OK ) {
+		propertyCount = 0;
+	}
+	
+	size_t length = sizeof(JournalMessageHeader) + bodyLength + journalStringSize(messageId) + journalStringSize(correlationId);
+	for ( index = 0; index < propertyCount; index ++ ) {
+		size_t nameSize = journalStringSize(names[index]);
+		size_t valueSize = journalStringSize(values[index]);
+		if ( nameSize > UINT16_MAX || valueSize > UINT16_MAX ) {
+			return false;
+		}
+		length += sizeof(uint16_t) * 2 + nameSize + valueSize;
+	}
+	if ( bodyLength > UINT32_MAX || propertyCount > UINT16_MAX || journalStringSize(messageId) > UINT16_MAX || journalStringSize(correlationId) > UINT16_MAX ) {
+		return false;
+	}
+	
+	unsigned long long offset;
+	unsigned char *position = journalReserve(info->journal, length, &offset);
+	if ( position == NULL ) {
+		return false;
+	}
+	header.contentType = (uint8_t) contentType;
+	header.reserved = 0;
+	header.propertyCount = (uint16_t) propertyCount;
+	header.bodyLength = (uint32_t) bodyLength;
+	header.idLength = (uint16_t) journalStringSize(messageId);
+	header.correlationIdLength = (uint16_t) journalStringSize(correlationId);
+	position = journalPut(position, &header, sizeof(JournalMessageHeader));
+	position = journalPut(position, body, bodyLength);
+	position = journalPut(position, messageId, header.idLength);
+	position = journalPut(position, correlationId, header.correlationIdLength);
+	for ( index = 0; index < propertyCount; index ++ ) {
+		uint16_t sizes[2];
+		sizes[0] = (uint16_t) journalStringSize(names[index]);
+		sizes[1] = (uint16_t) journalStringSize(values[index]);
+		position = journalPut(position, sizes, sizeof(sizes));
+		position = journalPut(position, names[index], sizes[0]);
+		position = journalPut(position, values[index], sizes[1]);
+	}
+	journalCommit(info->journal, offset);
+	sendCallbackInfo->journalOffset = offset;
+	return true;
+}
+
+/*
+ The message has been delivered, or can never be sent, so remove it from the journal.
+*/
+static void connectionJournalAck(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo)
+{
+	if ( info->journal && sendCallbackInfo->journalOffset != JOURNAL_NO_RECORD ) {
+		journalAck(info->journal, sendCallbackInfo->journalOffset);
+	}
+	sendCallbackInfo->journalOffset = JOURNAL_NO_RECORD;
+}
+
+/*
+ Decode a journal record back into a SDK message. Returns NULL if the record is not a valid message.
+*/
+static IOTHUB_MESSAGE_HANDLE journalReadMessage(const unsigned char *data, size_t length)
+{
+	JournalMessageHeader header;
+	const unsigned char *end = data + length;
+	IOTHUB_MESSAGE_HANDLE messageHandle;
+	uint16_t index;
+	
+	if ( length < sizeof(JournalMessageHeader) ) {
+		return NULL;
+	}
+	memcpy(&header, data, sizeof(JournalMessageHeader));
+	data += sizeof(JournalMessageHeader);
+	if ( (size_t) (end - data) < (size_t) header.bodyLength + header.idLength + header.correlationIdLength ) {
+		return NULL;
+	}
+	if ( header.contentType == IOTHUBMESSAGE_BYTEARRAY ) {
+		messageHandle = IoTHubMessage_CreateFromByteArray(data, header.bodyLength);
+	}
+	else if ( header.contentType == IOTHUBMESSAGE_STRING && header.bodyLength > 0 && data[header.bodyLength - 1] == 0 ) {
+		messageHandle = IoTHubMessage_CreateFromString((const char *) data);
+	}
+	else {
+		return NULL;
+	}
+	if ( messageHandle == NULL ) {
+		return NULL;
+	}
+	data += header.bodyLength;
+	if ( header.idLength > 0 && data[header.idLength - 1] == 0 ) {
+		IoTHubMessage_SetMessageId(messageHandle, (const char *) data);
+	}
+	data += header.idLength;
+	if ( header.correlationIdLength > 0 && data[header.correlationIdLength - 1] == 0 ) {
+		IoTHubMessage_SetCorrelationId(messageHandle, (const char *) data);
+	}
+	data += header.correlationIdLength;
+	
+	MAP_HANDLE propertyMap = IoTHubMessage_Properties(messageHandle);
+	for ( index = 0; index < header.propertyCount; index ++ ) {
+		uint16_t sizes[2];
+		if ( (size_t) (end - data) < sizeof(sizes) ) {
+			break;
+		}
+		memcpy(sizes, data, sizeof(sizes));
+		data += sizeof(sizes);
+		if ( sizes[0] == 0 || sizes[1] == 0 || (size_t) (end - data) < (size_t) sizes[0] + sizes[1] ) {
+			break;
+		}
+		const char *name = (const char *) data;
+		const char *value = (const char *) data + sizes[0];
+		data += sizes[0] + sizes[1];
+		if ( name[sizes[0] - 1] != 0 || value[sizes[1] - 1] != 0 || Map_AddOrUpdate(propertyMap, name, value) != MAP_OK ) {
+			break;
+		}
+	}
+	if ( index < header.propertyCount ) {
+		IoTHubMessage_Destroy(messageHandle);
+		return NULL;
+	}
+	return messageHandle;
+}
+
+/*
+ Start sending the messages left in the journal by an earlier connection, before any new ones.
+*/
+static void connectionStartReplay(ConnectInfo *info)
+{
+	if ( info->journal && info->journal->pendingCount > 0 ) {
+		info->isJournalReplaying = true;
+		info->journalReplayOffset = JOURNAL_NO_RECORD;
+		info->journalReplayEnd = info->journal->tail;
+	}
+}
+
+/*
+ Return a send record for the next message left in the journal, or NULL when there are no more. Records that 
+ cannot be decoded are acked, so they are dropped from the journal.
+*/
+static SendCallbackInfo *connectionNextReplay(ConnectInfo *info)
+{
+	unsigned long long offset = info->journalReplayOffset;
+	const void *data;
+	size_t length;
+	
+	while ( journalNext(info->journal, &offset, &data, &length) && offset < info->journalReplayEnd ) {
+		IOTHUB_MESSAGE_HANDLE messageHandle = journalReadMessage(data, length);
+		if ( messageHandle == NULL ) {
+			journalAck(info->journal, offset);
+			info->journalReplayOffset = offset;
+			continue;
+		}
+		SendCallbackInfo *sendCallbackInfo = newSendCallbackInfo(info, messageHandle);
+		if ( sendCallbackInfo == NULL ) {
+			// leave the replay position, so the record is tried again on the next call
+			IoTHubMessage_Destroy(messageHandle);
+			return NULL;
+		}
+		sendCallbackInfo->journalOffset = offset;
+		info->journalReplayOffset = offset;
+		return sendCallbackInfo;
+	}
+	info->isJournalReplaying = false;
+	return NULL;
+}
+
+/*
+ Coroutine sends.
+ 
+ sendMessageYield sends the message and yields the calling coroutine, with a YieldWait userdata left on its stack.
+ The wait keeps a registry ref to the coroutine, and is linked to the send record until the message is confirmed or
+ its timeout passes. The wait then moves to the ready list, and the coroutine is resumed, or passed to processResume, 
+ by connectionResumeYields once the SDK work has returned, so lua never runs inside a DoWork from a resumed coroutine.
+*/
+
+static void yieldListAdd(YieldWait **head, YieldWait **tail, YieldWait *wait)
+{
+	wait->next = NULL;
+	wait->prev = *tail;
+	if ( *tail ) {
+		(*tail)->next = wait;
+	}
+	else {
+		*head = wait;
+	}
+	*tail = wait;
+}
+
+static void yieldListRemove(YieldWait **head, YieldWait **tail, YieldWait *wait)
+{
+	if ( wait->prev ) {
+		wait->prev->next = wait->next;
+	}
+	else {
+		*head = wait->next;
+	}
+	if ( wait->next ) {
+		wait->next->prev = wait->prev;
+	}
+	else {
+		*tail = wait->prev;
+	}
+	wait->next = NULL;
+	wait->prev = NULL;
+}
+
+static void connectionAddYield(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo, YieldWait *wait)
+{
+	wait->sendCallbackInfo = sendCallbackInfo;
+	wait->state = YIELD_WAIT_PENDING;
+	sendCallbackInfo->yieldWait = wait;
+	yieldListAdd(&info->yieldHead, &info->yieldTail, wait);
+	if ( wait->due && ( !info->yieldTimer.isActive || wait->due < info->yieldTimer.due ) ) {
+		waitTimerStart(&info->waitEngine, &info->yieldTimer, wait->due);
+	}
+}
+
+/*
+ Take the wait off its send record and the yield list. The timer is left to find out for itself that the wait has
+ gone, unless there are no waits left.
+*/
+static void connectionUnlinkYield(ConnectInfo *info, YieldWait *wait)
+{
+	if ( wait->sendCallbackInfo ) {
+		wait->sendCallbackInfo->yieldWait = NULL;
+		wait->sendCallbackInfo = NULL;
+	}
+	yieldListRemove(&info->yieldHead, &info->yieldTail, wait);
+	if ( info->yieldHead == NULL ) {
+		waitTimerStop(&info->waitEngine, &info->yieldTimer);
+	}
+}
+
+/*
+ The message of a waiting coroutine has been confirmed, or its timeout has passed, queue the coroutine to be resumed.
+ Called from the SDK callbacks, so nothing is run here.
+*/
+static void connectionFinishYield(ConnectInfo *info, YieldWait *wait, bool isDone, IOTHUB_CLIENT_CONFIRMATION_RESULT result)
+{
+	connectionUnlinkYield(info, wait);
+	wait->isDone = isDone;
+	wait->result = result;
+	wait->state = YIELD_WAIT_READY;
+	yieldListAdd(&info->readyHead, &info->readyTail, wait);
+}
+
+/*
+ Resume the coroutines on the ready list, or pass them to processResume. Only called from the lua calls that run the 
+ connection, after the SDK work has returned. An error in a coroutine or in processResume does not stop the others,
+ it is counted and kept for stats.
+*/
+static void connectionResumeYields(ConnectInfo *info)
+{
+	lua_State *L = info->L;
+	int status;
+	
+	while ( L && info->readyHead ) {
+		YieldWait *wait = info->readyHead;
+		lua_State *thread = wait->thread;
+		int threadRef = wait->threadRef;
+		yieldListRemove(&info->readyHead, &info->readyTail, wait);
+		wait->state = YIELD_WAIT_RESUMED;
+		wait->threadRef = LUA_NOREF;
+		
+		// the yield itself can fail if it was across a C call, then the coroutine is not waiting for us
+		if ( lua_status(thread) != LUA_YIELD ) {
+			luaL_unref(L, LUA_REGISTRYINDEX, threadRef);
+			continue;
+		}
+		if ( info->resumeFunctionRef != LUA_NOREF ) {
+			lua_rawgeti(L, LUA_REGISTRYINDEX, info->resumeFunctionRef);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, threadRef);
+			luaL_unref(L, LUA_REGISTRYINDEX, threadRef);
+			status = lua_pcall(L, pushSendResult(L, wait->isDone, wait->result, wait->sequence) + 1, 0, 0);
+		}
+		else {
+			// sendMessageYieldContinue returns the result from the wait, so nothing is passed in
+			status = lua_resume(thread, L, 0);
+			if ( status == LUA_OK || status == LUA_YIELD ) {
+				lua_settop(thread, 0);
+			}
+			else {
+				lua_xmove(thread, L, 1);
+			}
+			luaL_unref(L, LUA_REGISTRYINDEX, threadRef);
+		}
+		// the coroutine may have used the connection and left its own state behind
+		info->L = L;
+		if ( status != LUA_OK && status != LUA_YIELD ) {
+			info->stats.yieldErrorCount ++;
+			luaL_unref(L, LUA_REGISTRYINDEX, info->yieldErrorRef);
+			info->yieldErrorRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+	}
+}
+
+/*
+ Queue the coroutines whose send has timed out, the messages stay pending.
+*/
+static void YieldTimerCallback(WaitTimer *timer)
+{
+	ConnectInfo *info = (ConnectInfo *) timer->context;
+	unsigned long long now = waitTimeNow();
+	unsigned long long nextDue = WAIT_NO_DEADLINE;
+	YieldWait *wait = info->yieldHead;
+	
+	while ( wait ) {
+		YieldWait *next = wait->next;
+		if ( wait->due && wait->due <= now ) {
+			connectionFinishYield(info, wait, false, IOTHUB_CLIENT_CONFIRMATION_OK);
+		}
+		else if ( wait->due && wait->due < nextDue ) {
+			nextDue = wait->due;
+		}
+		wait = next;
+	}
+	if ( nextDue != WAIT_NO_DEADLINE && info->yieldHead ) {
+		waitTimerStart(&info->waitEngine, &info->yieldTimer, nextDue);
+	}
+}
+
+/*
+ Drop the refs to any waiting coroutines without resuming them, used when the connection is garbage collected. A 
+ coroutine resumed after this returns false and 'closed' from sendMessageYield.
+*/
+static void connectionReleaseYields(lua_State *L, ConnectInfo *info)
+{
+	while ( info->yieldHead ) {
+		connectionFinishYield(info, info->yieldHead, false, IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY);
+	}
+	while ( info->readyHead ) {
+		YieldWait *wait = info->readyHead;
+		yieldListRemove(&info->readyHead, &info->readyTail, wait);
+		wait->state = YIELD_WAIT_CLOSED;
+		wait->info = NULL;
+		luaL_unref(L, LUA_REGISTRYINDEX, wait->threadRef);
+		wait->threadRef = LUA_NOREF;
+	}
+}
+
+/*
+ Report the result of a send back to lua, and release the send record. If 'isOwned' is set the message handle is 
+ no longer used by the SDK, and is destroyed here or handed over to a lazy message. The waiting sendMessage, the 
+ journal and any waiting coroutine are updated and the record released before processSent is called, so nothing 
+ is left pointing at the record whatever the callback does.
+*/
+static void completeSend(SendCallbackInfo *sendCallbackInfo, IOTHUB_CLIENT_CONFIRMATION_RESULT result, bool isOwned)
+{
+	ConnectInfo *info = sendCallbackInfo->info;
+	lua_State *L = info->L;	
+	IOTHUB_MESSAGE_HANDLE messageHandle = sendCallbackInfo->messageHandle;
+	LazyMessage *lazyMessage = NULL;
+	
+	// an envelope from the coalescer passes its result on to each of the messages sent in it
+	if ( sendCallbackInfo->members ) {
+		SendCallbackInfo *member = sendCallbackInfo->members;
+		sendCallbackInfo->members = NULL;
+		sendPoolRelease(sendCallbackInfo);
+		if ( isOwned ) {
+			IoTHubMessage_Destroy(messageHandle);
+		}
+		while ( member ) {
+			SendCallbackInfo *next = member->next;
+			completeSend(member, result, true);
+			member = next;
+		}
+		return;
+	}
+	sendCallbackInfo->result = result;
+	if ( result == IOTHUB_CLIENT_CONFIRMATION_OK ) {
+		connectionSetConnected(info);
+	}
+	if ( result <= IOTHUB_CLIENT_CONFIRMATION_ERROR ) {
+		info->stats.confirmationCounts[result] ++;
+	}
+	statsHistogramRecord(&info->stats.sendLatency, statsTimeNowNs() - sendCallbackInfo->sendTimeNs);
+	
+	if ( sendCallbackInfo->syncStatus ) {
+		sendCallbackInfo->syncStatus->isDone = true;
+		sendCallbackInfo->syncStatus->result = result;
+		sendCallbackInfo->syncStatus = NULL;
+	}
+	// processSent has the final result, so the message can never be sent from this session. Only messages destroyed
+	// with the client are kept, so they are sent again on the next connect that uses the journal
+	if ( result != IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY ) {
+		connectionJournalAck(info, sendCallbackInfo);
+	}
+	if ( sendCallbackInfo->yieldWait ) {
+		connectionFinishYield(info, sendCallbackInfo->yieldWait, true, result);
+	}
+	unsigned long long sequence = sendCallbackInfo->sequence;
+	sendPoolRelease(sendCallbackInfo);
+	
+	if ( L && info->sendConfirmationFunctionRef != LUA_NOREF ) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, info->sendConfirmationFunctionRef);
+		if ( lua_isfunction(L, -1) ) {
+			lua_pushnumber(L, result);
+			lazyMessage = pushMessage(L, info, messageHandle, isOwned);
+			lua_pushnumber(L, sequence);
+			callWithMessage(L, info, lazyMessage, 3, 0);
+		}
+		else {
+			lua_pop(L, 1); 			// pop back the rawgeti sendConfirmFunction
+		}
+	}
+	if ( isOwned && lazyMessage == NULL ) {
+		IoTHubMessage_Destroy(messageHandle);
+	}
+}
+
+static void SendConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* userContextCallback)
+{
+	SendCallbackInfo *sendCallbackInfo = ( SendCallbackInfo *) userContextCallback;
+	if ( sendCallbackInfo == NULL ) {
+		return;
+	}
+	// check for bug when sending error, the service can send multiple callbacks on one message, a record that 
+	// has already been confirmed is back in the pool or waiting to be sent again, so it is not in flight
+	if ( sendCallbackInfo->state != SEND_STATE_IN_FLIGHT 
+			|| inFlightFind(&sendCallbackInfo->info->inFlight, sendCallbackInfo->sequence) != sendCallbackInfo ) {
+		sendCallbackInfo->info->stats.duplicateAckCount ++;
+		return;
+	}
+	
+	if ( sendCallbackInfo->info->drainingClientHandle && sendCallbackInfo->clientHandle == sendCallbackInfo->info->drainingClientHandle ) {
+		if ( sendCallbackInfo->info->drainingInFlightCount > 0 ) {
+			sendCallbackInfo->info->drainingInFlightCount --;
+		}
+	}
+	else if ( sendCallbackInfo->info->inFlightCount > 0 ) {
+		sendCallbackInfo->info->inFlightCount --;
+	}
+	if ( sendCallbackInfo->info->connectionString && connectionCheckHealth(sendCallbackInfo->info, sendCallbackInfo, result) ) {
+		return;
+	}
+	
+	completeSend(sendCallbackInfo, result, true);
+}
+
+/*
+ Hand a message to the SDK, taking one slot of the send window.
+*/
+static IOTHUB_CLIENT_RESULT connectionSubmit(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo)
+{
+	IOTHUB_CLIENT_RESULT result;
+	SendState state = sendCallbackInfo->state;
+	sendCallbackInfo->state = SEND_STATE_IN_FLIGHT;
+	if ( info->thread ) {
+		// the io thread hands the message to the SDK, it drains the whole ring each time so only wake it when empty
+		RingEntry entry = { 0, 0, sendCallbackInfo };
+		bool isEmpty = ringCount(&info->thread->sendRing) == 0;
+		result = ringPush(&info->thread->sendRing, &entry) ? IOTHUB_CLIENT_OK : IOTHUB_CLIENT_ERROR;
+		if ( result == IOTHUB_CLIENT_OK && isEmpty ) {
+			threadWakeUp(info->thread);
+		}
+	}
+	else {
+		sendCallbackInfo->clientHandle = info->iotHubClientHandle;
+		result = IoTHubClient_LL_SendEventAsync(info->iotHubClientHandle, sendCallbackInfo->messageHandle, SendConfirmationCallback, sendCallbackInfo);
+	}
+	if ( result == IOTHUB_CLIENT_OK ) {
+		size_t bodyLength = 0;
+		SendCallbackInfo *member;
+		for ( member = sendCallbackInfo->members; member; member = member->next ) {
+			member->state = SEND_STATE_IN_FLIGHT;
+		}
+		info->inFlightCount ++;
+		info->stats.sendCount ++;
+		if ( readMessageBody(sendCallbackInfo->messageHandle, &bodyLength) ) {
+			info->stats.sendBytes += bodyLength;
+		}
+	}
+	else {
+		sendCallbackInfo->state = state;
+	}
+	return result;
+}
+
+static void connectionQueue(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo)
+{
+	sendCallbackInfo->state = SEND_STATE_QUEUED;
+	sendCallbackInfo->next = NULL;
+	if ( info->queueTail ) {
+		info->queueTail->next = sendCallbackInfo;
+	}
+	else {
+		info->queueHead = sendCallbackInfo;
+	}
+	info->queueTail = sendCallbackInfo;
+	info->queuedCount ++;
+}
+
+static SendCallbackInfo *connectionUnqueue(ConnectInfo *info)
+{
+	SendCallbackInfo *sendCallbackInfo = info->queueHead;
+	if ( sendCallbackInfo ) {
+		info->queueHead = sendCallbackInfo->next;
+		if ( info->queueHead == NULL ) {
+			info->queueTail = NULL;
+		}
+		sendCallbackInfo->next = NULL;
+		info->queuedCount --;
+	}
+	return sendCallbackInfo;
+}
+
+/*
+ Keep a message that was handed to the SDK, but not delivered, so it can be sent again before the queue.
+*/
+static void connectionRetry(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo)
+{
+	sendCallbackInfo->state = SEND_STATE_QUEUED;
+	sendCallbackInfo->next = NULL;
+	if ( info->retryTail ) {
+		info->retryTail->next = sendCallbackInfo;
+	}
+	else {
+		info->retryHead = sendCallbackInfo;
+	}
+	info->retryTail = sendCallbackInfo;
+	info->retryCount ++;
+}
+
+/*
+ Move the messages to send again to the front of the queue, in the order they were first sent.
+*/
+static void connectionSpliceRetry(ConnectInfo *info)
+{
+	if ( info->retryHead == NULL ) {
+		return;
+	}
+	info->retryTail->next = info->queueHead;
+	info->queueHead = info->retryHead;
+	if ( info->queueTail == NULL ) {
+		info->queueTail = info->retryTail;
+	}
+	info->queuedCount += info->retryCount;
+	info->retryHead = NULL;
+	info->retryTail = NULL;
+	info->retryCount = 0;
+}
+
+/*
+ Take a message out of the send queue or the retry list, wherever it is. Returns false if it is in neither.
+*/
+static bool connectionUnlinkQueued(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo)
+{
+	SendCallbackInfo **head = &info->queueHead;
+	SendCallbackInfo **tail = &info->queueTail;
+	unsigned int *count = &info->queuedCount;
+	int list;
+	for ( list = 0; list < 2; list ++ ) {
+		SendCallbackInfo *previous = NULL;
+		SendCallbackInfo *current;
+		for ( current = *head; current; previous = current, current = current->next ) {
+			if ( current == sendCallbackInfo ) {
+				if ( previous ) {
+					previous->next = current->next;
+				}
+				else {
+					*head = current->next;
+				}
+				if ( *tail == current ) {
+					*tail = previous;
+				}
+				current->next = NULL;
+				( *count ) --;
+				return true;
+			}
+		}
+		head = &info->retryHead;
+		tail = &info->retryTail;
+		count = &info->retryCount;
+	}
+	return false;
+}
+
+/*
+ Move queued messages into the send window while there are free slots. Messages left in the journal from before 
+ this connection go first.
+*/
+static void connectionSubmitQueued(ConnectInfo *info)
+{
+	if ( info->isReconnecting ) {
+		return;
+	}
+	connectionSpliceRetry(info);
+	while ( info->inFlightCount < info->maxInFlight && info->isConnected ) {
+		SendCallbackInfo *sendCallbackInfo = NULL;
+		if ( info->isJournalReplaying ) {
+			sendCallbackInfo = connectionNextReplay(info);
+		}
+		if ( sendCallbackInfo == NULL ) {
+			if ( info->queueHead == NULL ) {
+				break;
+			}
+			sendCallbackInfo = connectionUnqueue(info);
+		}
+		if ( connectionSubmit(info, sendCallbackInfo) != IOTHUB_CLIENT_OK ) {
+			completeSend(sendCallbackInfo, IOTHUB_CLIENT_CONFIRMATION_ERROR, true);
+		}
+	}
+}
+
+/*
+ Coalescer, small messages sent close together with the same properties are held for up to coalesceDelayMs and then
+ sent to the IotHub as one envelope message. Each message keeps its own send record, linked to the record of the 
+ envelope, and is passed to processSent with the result of the envelope.
+*/
+
+/*
+ True if both messages have the same correlation id and properties, so they can be sent in the same envelope.
+*/
+static bool isSameProperties(IOTHUB_MESSAGE_HANDLE first, IOTHUB_MESSAGE_HANDLE second)
+{
+	const char *const *names = NULL;
+	const char *const *values = NULL;
+	const char *const *secondNames = NULL;
+	const char *const *secondValues = NULL;
+	size_t count = 0;
+	size_t secondCount = 0;
+	size_t index;
+	
+	const char *correlationId = IoTHubMessage_GetCorrelationId(first);
+	const char *secondCorrelationId = IoTHubMessage_GetCorrelationId(second);
+	if ( ( correlationId == NULL ) != ( secondCorrelationId == NULL ) || ( correlationId && strcmp(correlationId, secondCorrelationId) != 0 ) ) {
+		return false;
+	}
+	MAP_HANDLE propertyMap = IoTHubMessage_Properties(first);
+	MAP_HANDLE secondPropertyMap = IoTHubMessage_Properties(second);
+	if ( propertyMap && Map_GetInternals(propertyMap, &names, &values, &count) != MAP_OK ) {
+		return false;
+	}
+	if ( secondPropertyMap && Map_GetInternals(secondPropertyMap, &secondNames, &secondValues, &secondCount) != MAP_OK ) {
+		return false;
+	}
+	if ( count != secondCount ) {
+		return false;
+	}
+	for ( index = 0; index < count; index ++ ) {
+		const char *value = Map_GetValueFromKey(secondPropertyMap, names[index]);
+		if ( value == NULL || strcmp(value, values[index]) != 0 ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ Make the envelope message from the coalesce buffer, with the correlation id and properties of the first message 
+ plus the envelope format and message count. Returns NULL if the message cannot be made.
+*/
+static IOTHUB_MESSAGE_HANDLE createEnvelopeMessage(ConnectInfo *info, IOTHUB_MESSAGE_HANDLE first)
+{
+	const char *const *names = NULL;
+	const char *const *values = NULL;
+	size_t count = 0;
+	size_t index;
+	char countText[16];
+	
+	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromByteArray(info->coalesceBuffer, info->coalesceLength);
+	if ( messageHandle == NULL ) {
+		return NULL;
+	}
+	setNewMessageId(&info->idGenerator, messageHandle);
+	if ( IoTHubMessage_GetCorrelationId(first) ) {
+		IoTHubMessage_SetCorrelationId(messageHandle, IoTHubMessage_GetCorrelationId(first));
+	}
+	MAP_HANDLE firstPropertyMap = IoTHubMessage_Properties(first);
+	MAP_HANDLE propertyMap = IoTHubMessage_Properties(messageHandle);
+	if ( firstPropertyMap && Map_GetInternals(firstPropertyMap, &names, &values, &count) != MAP_OK ) {
+		count = 0;
+	}
+	for ( index = 0; index < count; index ++ ) {
+		if ( Map_AddOrUpdate(propertyMap, names[index], values[index]) != MAP_OK ) {
+			IoTHubMessage_Destroy(messageHandle);
+			return NULL;
+		}
+	}
+	snprintf(countText, sizeof(countText), "%u", info->coalesceCount);
+	const char *format = info->coalesceFormat == COALESCE_FORMAT_JSON ? COALESCE_FORMAT_JSON_TEXT : COALESCE_FORMAT_FRAMES_TEXT;
+	if ( Map_AddOrUpdate(propertyMap, COALESCE_FORMAT_PROPERTY, format) != MAP_OK 
+			|| Map_AddOrUpdate(propertyMap, COALESCE_COUNT_PROPERTY, countText) != MAP_OK ) {
+		IoTHubMessage_Destroy(messageHandle);
+		return NULL;
+	}
+	return messageHandle;
+}
+
+/*
+ Send the open envelope, if there is one. The envelope goes through the send window the same as a single message, 
+ if it cannot be made the messages in it are failed with messageSend.ERROR.
+*/
+static void connectionFlushCoalesced(ConnectInfo *info)
+{
+	SendCallbackInfo *member = info->coalesceHead;
+	SendCallbackInfo *envelope = NULL;
+	if ( member == NULL ) {
+		return;
+	}
+	waitTimerStop(&info->waitEngine, &info->coalesceTimer);
+	if ( info->coalesceFormat == COALESCE_FORMAT_JSON ) {
+		// room for the closing bracket is kept when each message is added
+		info->coalesceBuffer[info->coalesceLength ++] = ']';
+	}
+	IOTHUB_MESSAGE_HANDLE messageHandle = createEnvelopeMessage(info, member->messageHandle);
+	if ( messageHandle ) {
+		envelope = sendPoolTake(&info->sendPool);
+	}
+	info->coalesceHead = NULL;
+	info->coalesceTail = NULL;
+	info->coalesceCount = 0;
+	info->coalesceLength = 0;
+	
+	if ( envelope == NULL ) {
+		if ( messageHandle ) {
+			IoTHubMessage_Destroy(messageHandle);
+		}
+		while ( member ) {
+			SendCallbackInfo *next = member->next;
+			completeSend(member, IOTHUB_CLIENT_CONFIRMATION_ERROR, true);
+			member = next;
+		}
+		return;
+	}
+	// the caller only sees the messages in the envelope, so it is numbered apart from them with the top bit set
+	envelope->messageHandle = messageHandle;
+	envelope->messageId = NULL;
+	envelope->syncStatus = NULL;
+	envelope->next = NULL;
+	envelope->clientHandle = NULL;
+	envelope->info = info;
+	envelope->sequence = ENVELOPE_SEQUENCE_BIT | ++ info->lastEnvelopeSequence;
+	envelope->journalOffset = JOURNAL_NO_RECORD;
+	envelope->members = member;
+	envelope->sendTimeNs = statsTimeNowNs();
+	envelope->state = SEND_STATE_QUEUED;
+	envelope->yieldWait = NULL;
+	if ( !inFlightAdd(&info->inFlight, envelope->sequence, NULL, envelope) ) {
+		envelope->members = NULL;
+		sendPoolRelease(envelope);
+		IoTHubMessage_Destroy(messageHandle);
+		while ( member ) {
+			SendCallbackInfo *next = member->next;
+			completeSend(member, IOTHUB_CLIENT_CONFIRMATION_ERROR, true);
+			member = next;
+		}
+		return;
+	}
+	
+	if ( info->isConnected && info->inFlightCount < info->maxInFlight && info->queueHead == NULL && info->retryHead == NULL 
+			&& !info->isJournalReplaying && !info->isReconnecting ) {
+		if ( connectionSubmit(info, envelope) != IOTHUB_CLIENT_OK ) {
+			completeSend(envelope, IOTHUB_CLIENT_CONFIRMATION_ERROR, true);
+			return;
+		}
+	}
+	else {
+		connectionQueue(info, envelope);
+	}
+	connectionWakeUp(info);
+}
+
+static void CoalesceTimerCallback(WaitTimer *timer)
+{
+	connectionFlushCoalesced((ConnectInfo *) timer->context);
+}
+
+/*
+ Add the message to the open envelope, sending the envelope first if the message will not fit in it or has different
+ properties. Returns false if the message has to be sent on its own, because it is too large, has a compressed body
+ or the envelope buffer cannot be allocated.
+*/
+static bool connectionCoalesce(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo)
+{
+	IOTHUB_MESSAGE_HANDLE messageHandle = sendCallbackInfo->messageHandle;
+	bool isJson = info->coalesceFormat == COALESCE_FORMAT_JSON;
+	size_t closeLength = isJson ? 1 : 0;
+	size_t bodyLength = 0;
+	
+	const unsigned char *body = readMessageBody(messageHandle, &bodyLength);
+	size_t frameLength = bodyLength + ( isJson ? 1 : COALESCE_FRAME_HEADER_BYTES );
+	MAP_HANDLE propertyMap = IoTHubMessage_Properties(messageHandle);
+	// the envelope cannot say which of its messages are compressed
+	if ( body == NULL || frameLength + closeLength > info->coalesceMaxBytes || bodyLength > UINT32_MAX 
+			|| ( propertyMap && Map_GetValueFromKey(propertyMap, COMPRESS_ENCODING_PROPERTY) ) ) {
+		return false;
+	}
+	if ( info->coalesceBuffer == NULL ) {
+		info->coalesceBuffer = malloc(info->coalesceMaxBytes);
+		if ( info->coalesceBuffer == NULL ) {
+			return false;
+		}
+	}
+	if ( info->coalesceHead && ( info->coalesceLength + frameLength + closeLength > info->coalesceMaxBytes 
+			|| !isSameProperties(info->coalesceHead->messageHandle, messageHandle) ) ) {
+		connectionFlushCoalesced(info);
+	}
+	
+	unsigned char *position = info->coalesceBuffer + info->coalesceLength;
+	if ( isJson ) {
+		*position ++ = info->coalesceHead ? ',' : '[';
+	}
+	else {
+		// big endian length before each body
+		*position ++ = (unsigned char) ( bodyLength >> 24 );
+		*position ++ = (unsigned char) ( bodyLength >> 16 );
+		*position ++ = (unsigned char) ( bodyLength >> 8 );
+		*position ++ = (unsigned char) bodyLength;
+	}
+	if ( bodyLength > 0 ) {
+		memcpy(position, body, bodyLength);
+	}
+	info->coalesceLength += frameLength;
+	
+	sendCallbackInfo->state = SEND_STATE_COALESCED;
+	sendCallbackInfo->next = NULL;
+	if ( info->coalesceTail ) {
+		info->coalesceTail->next = sendCallbackInfo;
+	}
+	else {
+		info->coalesceHead = sendCallbackInfo;
+		waitTimerStart(&info->waitEngine, &info->coalesceTimer, waitTimeNow() + info->coalesceDelayMs);
+	}
+	info->coalesceTail = sendCallbackInfo;
+	info->coalesceCount ++;
+	return true;
+}
+
+/*
+ Fail the messages waiting in the open envelope, used when disconnecting.
+*/
+static void connectionDropCoalesced(ConnectInfo *info, IOTHUB_CLIENT_CONFIRMATION_RESULT result)
+{
+	SendCallbackInfo *member = info->coalesceHead;
+	waitTimerStop(&info->waitEngine, &info->coalesceTimer);
+	info->coalesceHead = NULL;
+	info->coalesceTail = NULL;
+	info->coalesceCount = 0;
+	info->coalesceLength = 0;
+	while ( member ) {
+		SendCallbackInfo *next = member->next;
+		completeSend(member, result, true);
+		member = next;
+	}
+}
+
+/*
+ Fail all of the messages still waiting in the queue, used when disconnecting.
+*/
+static void connectionFlushQueue(ConnectInfo *info, IOTHUB_CLIENT_CONFIRMATION_RESULT result)
+{
+	SendCallbackInfo *sendCallbackInfo;
+	connectionDropCoalesced(info, result);
+	connectionSpliceRetry(info);
+	while ( (sendCallbackInfo = connectionUnqueue(info)) != NULL ) {
+		completeSend(sendCallbackInfo, result, true);
+	}
+}
+
+/*
+ Background io thread.
+ 
+ In threaded mode the io thread owns the client handle and does all of the SDK work. Messages to send are passed to 
+ it through the send ring, and the SDK callbacks on the io thread pass confirmations and copies of received messages
+ back through the event ring. The lua callbacks are only called from threadDispatch on the lua thread.
+*/
+
+static void threadWakeUp(ThreadInfo *thread)
+{
+	// the pipe is non blocking, if it is full the thread is already going to wake up
+	if ( write(thread->wakePipe[1], "w", 1) < 0 ) {
+		return;
+	}
+}
+
+static void threadSignalEvent(ThreadInfo *thread)
+{
+	if ( !atomic_exchange(&thread->isEventSignalled, true) ) {
+		if ( write(thread->eventPipe[1], "e", 1) < 0 ) {
+			return;
+		}
+	}
+}
+
+/*
+ Pass an event to lua, if the event ring is full the event waits in the overflow list, so that confirmations
+ are never lost. Called on the io thread. Every send record handed to the io thread posts one event, and lua never
+ has more than maxInFlight records with the io thread, so the overflow allocated in threadCreate always has room 
+ for them. Only a repeated confirmation from the SDK can find it full, lua would discard that one anyway.
+*/
+static void threadPostEvent(ThreadInfo *thread, ThreadEventType type, int result, void *data)
+{
+	RingEntry entry = { type, result, data };
+	if ( thread->overflowCount == 0 && ringPush(&thread->eventRing, &entry) ) {
+		threadSignalEvent(thread);
+		return;
+	}
+	if ( thread->overflowCount < thread->overflowSize ) {
+		thread->overflow[thread->overflowCount ++] = entry;
+	}
+}
+
+static void threadFlushOverflow(ThreadInfo *thread)
+{
+	int index = 0;
+	while ( index < thread->overflowCount && ringPush(&thread->eventRing, &thread->overflow[index]) ) {
+		index ++;
+	}
+	if ( index > 0 ) {
+		thread->overflowCount -= index;
+		memmove(thread->overflow, &thread->overflow[index], sizeof(RingEntry) * thread->overflowCount);
+		threadSignalEvent(thread);
+	}
+}
+
+static void ThreadSendConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* userContextCallback)
+{
+	SendCallbackInfo *sendCallbackInfo = ( SendCallbackInfo *) userContextCallback;
+	if ( sendCallbackInfo ) {
+		threadPostEvent(sendCallbackInfo->info->thread, THREAD_EVENT_CONFIRMATION, result, sendCallbackInfo);
+	}
+}
+
+/*
+ Lua cannot be called from the io thread to decide the disposition, so received messages are accepted once a copy 
+ is in the event ring. If lua has fallen behind the message is abandoned so that the IotHub sends it again later.
+*/
+static IOTHUBMESSAGE_DISPOSITION_RESULT ThreadReceiveMessageCallback(IOTHUB_MESSAGE_HANDLE messageHandle, void* userContextCallback)
+{
+	ThreadInfo *thread = (ThreadInfo *) userContextCallback;
+	atomic_store(&thread->lastMessageReceiveTime, time(NULL));
+	if ( thread->overflowCount > 0 ) {
+		return IOTHUBMESSAGE_ABANDONED;
+	}
+	IOTHUB_MESSAGE_HANDLE cloneHandle = IoTHubMessage_Clone(messageHandle);
+	if ( cloneHandle == NULL ) {
+		return IOTHUBMESSAGE_ABANDONED;
+	}
+	RingEntry entry = { THREAD_EVENT_RECEIVE, 0, cloneHandle };
+	if ( !ringPush(&thread->eventRing, &entry) ) {
+		IoTHubMessage_Destroy(cloneHandle);
+		return IOTHUBMESSAGE_ABANDONED;
+	}
+	threadSignalEvent(thread);
+	return IOTHUBMESSAGE_ACCEPTED;
+}
+
+static void *threadWorker(void *arg)
+{
+	ThreadInfo *thread = (ThreadInfo *) arg;
+	unsigned int doWorkInterval = WAIT_BUSY_INTERVAL_MS;
+	struct pollfd wakeFd;
+	IOTHUB_CLIENT_STATUS sendStatus;
+	RingEntry entry;
+	char buffer[64];
+	
+	wakeFd.fd = thread->wakePipe[0];
+	wakeFd.events = POLLIN;
+	while ( !atomic_load(&thread->isStopping) ) {
+		while ( read(thread->wakePipe[0], buffer, sizeof(buffer)) > 0 ) {
+		}
+		while ( ringPop(&thread->sendRing, &entry) ) {
+			SendCallbackInfo *sendCallbackInfo = (SendCallbackInfo *) entry.data;
+			if ( IoTHubClient_LL_SendEventAsync(thread->iotHubClientHandle, sendCallbackInfo->messageHandle, ThreadSendConfirmationCallback, sendCallbackInfo) != IOTHUB_CLIENT_OK ) {
+				threadPostEvent(thread, THREAD_EVENT_SUBMIT_FAILED, IOTHUB_CLIENT_CONFIRMATION_ERROR, sendCallbackInfo);
+			}
+			doWorkInterval = WAIT_BUSY_INTERVAL_MS;
+		}
+		threadFlushOverflow(thread);
+		IoTHubClient_LL_DoWork(thread->iotHubClientHandle);
+		atomic_fetch_add_explicit(&thread->doWorkCount, 1, memory_order_relaxed);
+		
+		if ( IoTHubClient_LL_GetSendStatus(thread->iotHubClientHandle, &sendStatus) == IOTHUB_CLIENT_OK 
+				&& sendStatus == IOTHUB_CLIENT_SEND_STATUS_BUSY ) {
+			doWorkInterval = WAIT_BUSY_INTERVAL_MS;
+		}
+		else if ( doWorkInterval < thread->idleIntervalMs ) {
+			doWorkInterval *= 2;
+			if ( doWorkInterval > thread->idleIntervalMs ) {
+				doWorkInterval = thread->idleIntervalMs;
+			}
+		}
+		wakeFd.revents = 0;
+		poll(&wakeFd, 1, doWorkInterval);
+	}
+	return NULL;
+}
+
+static bool setNonBlockingPipe(int *pipeFds)
+{
+	if ( pipe(pipeFds) != 0 ) {
+		return false;
+	}
+	fcntl(pipeFds[0], F_SETFL, fcntl(pipeFds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(pipeFds[1], F_SETFL, fcntl(pipeFds[1], F_GETFL) | O_NONBLOCK);
+	fcntl(pipeFds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pipeFds[1], F_SETFD, FD_CLOEXEC);
+	return true;
+}
+
+static void threadFree(ThreadInfo *thread)
+{
+	ringFree(&thread->sendRing);
+	ringFree(&thread->eventRing);
+	free(thread->overflow);
+	if ( thread->wakePipe[0] >= 0 ) {
+		close(thread->wakePipe[0]);
+		close(thread->wakePipe[1]);
+	}
+	if ( thread->eventPipe[0] >= 0 ) {
+		close(thread->eventPipe[0]);
+		close(thread->eventPipe[1]);
+	}
+	free(thread);
+}
+
+/*
+ Allocate the rings and pipes for the io thread, the thread is started later by threadStart.
+*/
+static ThreadInfo *threadCreate(ConnectOptions *options)
+{
+	ThreadInfo *thread = calloc(1, sizeof(ThreadInfo));
+	unsigned int ringSize = options->ringSize;
+	if ( thread == NULL ) {
+		return NULL;
+	}
+	thread->wakePipe[0] = thread->wakePipe[1] = -1;
+	thread->eventPipe[0] = thread->eventPipe[1] = -1;
+	atomic_init(&thread->isStopping, false);
+	atomic_init(&thread->isEventSignalled, false);
+	atomic_init(&thread->lastMessageReceiveTime, 0);
+	atomic_init(&thread->doWorkCount, 0);
+	thread->idleIntervalMs = options->idleIntervalMs;
+	
+	// there is always room for a full send window
+	if ( ringSize < options->maxInFlight ) {
+		ringSize = options->maxInFlight;
+	}
+	// room for an event for every record that lua can have outstanding, so the io thread never allocates
+	thread->overflowSize = (int) ( options->maxInFlight + options->maxQueued );
+	thread->overflow = malloc(sizeof(RingEntry) * thread->overflowSize);
+	if ( thread->overflow == NULL || !ringInit(&thread->sendRing, ringSize) || !ringInit(&thread->eventRing, ringSize) 
+			|| !setNonBlockingPipe(thread->wakePipe) || !setNonBlockingPipe(thread->eventPipe) ) {
+		threadFree(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+static bool threadStart(ConnectInfo *info)
+{
+	ThreadInfo *thread = info->thread;
+	thread->iotHubClientHandle = info->iotHubClientHandle;
+	atomic_store(&thread->isStopping, false);
+	if ( pthread_create(&thread->thread, NULL, threadWorker, thread) != 0 ) {
+		return false;
+	}
+	thread->isStarted = true;
+	waitEngineAddFd(&info->waitEngine, thread->eventPipe[0], POLLIN);
+	return true;
+}
+
+static void threadStop(ThreadInfo *thread)
+{
+	if ( thread->isStarted ) {
+		atomic_store(&thread->isStopping, true);
+		threadWakeUp(thread);
+		pthread_join(thread->thread, NULL);
+		thread->isStarted = false;
+	}
+}
+
+/*
+ Run the lua callbacks for all of the events waiting from the io thread. Returns the number of events.
+*/
+static int threadDispatch(ConnectInfo *info)
+{
+	ThreadInfo *thread = info->thread;
+	RingEntry entry;
+	char buffer[64];
+	int count = 0;
+	
+	atomic_store(&thread->isEventSignalled, false);
+	while ( read(thread->eventPipe[0], buffer, sizeof(buffer)) > 0 ) {
+	}
+	info->stats.doWorkCount += atomic_exchange_explicit(&thread->doWorkCount, 0, memory_order_relaxed);
+	while ( info->thread == thread && ringPop(&thread->eventRing, &entry) ) {
+		count ++;
+		if ( entry.type == THREAD_EVENT_CONFIRMATION ) {
+			SendConfirmationCallback(entry.result, entry.data);
+		}
+		else if ( entry.type == THREAD_EVENT_SUBMIT_FAILED ) {
+			SendCallbackInfo *sendCallbackInfo = (SendCallbackInfo *) entry.data;
+			if ( info->inFlightCount > 0 ) {
+				info->inFlightCount --;
+			}
+			completeSend(sendCallbackInfo, IOTHUB_CLIENT_CONFIRMATION_ERROR, true);
+		}
+		else if ( entry.type == THREAD_EVENT_RECEIVE ) {
+			// the message is a clone made by the io thread, so it belongs to us
+			receiveMessage(info, (IOTHUB_MESSAGE_HANDLE) entry.data, true);
+		}
+	}
+	// a callback may have disconnected and released the thread
+	if ( info->thread == thread && info->isConnected ) {
+		connectionSubmitQueued(info);
+	}
+	return count;
+}
+
+/*
+ Called once the io thread has stopped and the client handle is destroyed. Dispatches the last of the events, returns
+ any messages the thread never handed to the SDK, and releases the thread.
+*/
+static void threadDrain(ConnectInfo *info)
+{
+	ThreadInfo *thread = info->thread;
+	RingEntry entry;
+	
+	do {
+		threadFlushOverflow(thread);
+		threadDispatch(info);
+	} while ( thread->overflowCount > 0 || ringCount(&thread->eventRing) > 0 );
+	
+	while ( ringPop(&thread->sendRing, &entry) ) {
+		SendCallbackInfo *sendCallbackInfo = (SendCallbackInfo *) entry.data;
+		completeSend(sendCallbackInfo, IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY, true);
+	}
+	waitEngineRemoveFd(&info->waitEngine, thread->eventPipe[0]);
+	info->thread = NULL;
+	threadFree(thread);
+}
+
+/*
+ Automatic reconnect.
+ 
+ The SDK does not tell us when the session keys are about to expire, or when the connection has stopped working, so
+ with the connect option autoReconnect the client handle is made again from the saved connection string every 
+ renewSeconds, and after reconnectErrors failed confirmations in a row. The new client is made before the old one is
+ destroyed, messages in flight on the old client are sent again on the new one before the queue.
+*/
+
+static void connectionNotifyStatus(ConnectInfo *info, ConnectionStatus status, const char *reason)
+{
+	lua_State *L = info->L;
+	if ( L && info->statusFunctionRef != LUA_NOREF ) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, info->statusFunctionRef);
+		if ( lua_isfunction(L, -1) ) {
+			lua_pushinteger(L, status);
+			lua_pushstring(L, reason);
+			connectionCall(info, L, 2, 0);
+		}
+		else {
+			lua_pop(L, 1);
+		}
+	}
+}
+
+/*
+ Start the reconnect timer, unless it is already due sooner.
+*/
+static void connectionScheduleReconnect(ConnectInfo *info, const char *reason, unsigned long long due)
+{
+	if ( info->reconnectTimer.isActive && info->reconnectTimer.due <= due ) {
+		return;
+	}
+	info->reconnectReason = reason;
+	waitTimerStart(&info->waitEngine, &info->reconnectTimer, due);
+}
+
+/*
+ Return the time to wait before the next reconnect after a failure, the delay doubles up to RECONNECT_MAX_DELAY_MS
+ until a message is delivered.
+*/
+static unsigned long long connectionNextReconnectDue(ConnectInfo *info)
+{
+	unsigned int delayMs = info->reconnectDelayMs;
+	info->reconnectDelayMs *= 2;
+	if ( info->reconnectDelayMs > RECONNECT_MAX_DELAY_MS ) {
+		info->reconnectDelayMs = RECONNECT_MAX_DELAY_MS;
+	}
+	return waitTimeNow() + delayMs;
+}
+
+static void connectionScheduleRenew(ConnectInfo *info)
+{
+	waitTimerStop(&info->waitEngine, &info->reconnectTimer);
+	if ( info->renewSeconds > 0 ) {
+		connectionScheduleReconnect(info, "renew", waitTimeNow() + (unsigned long long) info->renewSeconds * 1000);
+	}
+}
+
+/*
+ Track the confirmations of an auto reconnect connection. Returns true if the message has been kept to send again,
+ instead of being passed to processSent.
+*/
+static bool connectionCheckHealth(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo, IOTHUB_CLIENT_CONFIRMATION_RESULT result)
+{
+	if ( result == IOTHUB_CLIENT_CONFIRMATION_OK ) {
+		info->failedSendCount = 0;
+		info->reconnectDelayMs = RECONNECT_MIN_DELAY_MS;
+		return false;
+	}
+	if ( result == IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY ) {
+		if ( info->isReconnecting || info->isDrainClosing ) {
+			connectionRetry(info, sendCallbackInfo);
+			return true;
+		}
+		return false;
+	}
+	info->failedSendCount ++;
+	if ( info->reconnectErrors > 0 && info->failedSendCount >= info->reconnectErrors ) {
+		connectionScheduleReconnect(info, "errors", connectionNextReconnectDue(info));
+		info->failedSendCount = 0;
+	}
+	// after a timeout the message belongs to us again, after an error the SDK may still use it
+	if ( result == IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT ) {
+		connectionRetry(info, sendCallbackInfo);
+		return true;
+	}
+	return false;
+}
+
+/*
+ Dispatch the events left by the stopped io thread, and keep the messages it never handed to the SDK. The thread 
+ can then be started again with a new client handle.
+*/
+static void threadRecall(ConnectInfo *info)
+{
+	ThreadInfo *thread = info->thread;
+	RingEntry entry;
+	
+	do {
+		threadFlushOverflow(thread);
+		threadDispatch(info);
+		if ( info->thread != thread ) {
+			// a callback has disconnected and released the thread
+			return;
+		}
+	} while ( thread->overflowCount > 0 || ringCount(&thread->eventRing) > 0 );
+	
+	while ( ringPop(&thread->sendRing, &entry) ) {
+		connectionRetry(info, (SendCallbackInfo *) entry.data);
+	}
+}
+
+/*
+ Pass the connect options that are SDK client options to a new client, they are only set if the connect options 
+ were used. Returns false if the client refuses the batching option, which only the HTTP transport has.
+*/
+static bool connectionSetClientOptions(ConnectInfo *info, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle)
+{
+	if ( info->loopbackLatencyMs > 0 ) {
+		IoTHubClient_LL_SetOption(iotHubClientHandle, LOOPBACK_OPTION_LATENCY_MS, &info->loopbackLatencyMs);
+	}
+	if ( info->loopbackErrorRate > 0 ) {
+		IoTHubClient_LL_SetOption(iotHubClientHandle, LOOPBACK_OPTION_ERROR_RATE, &info->loopbackErrorRate);
+	}
+	if ( info->isBatching ) {
+		bool isBatching = true;
+		return IoTHubClient_LL_SetOption(iotHubClientHandle, "Batching", &isBatching) == IOTHUB_CLIENT_OK;
+	}
+	return true;
+}
+
+/*
+ Make a new client from the saved connection string, with the receive callback and client options set. Returns 
+ NULL on failure.
+*/
+static IOTHUB_CLIENT_LL_HANDLE connectionCreateClient(ConnectInfo *info)
+{
+	IOTHUB_CLIENT_RESULT result;
+	IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle = IoTHubClient_LL_CreateFromConnectionString(info->connectionString, info->protocol);
+	if ( iotHubClientHandle == NULL ) {
+		return NULL;
+	}
+	if ( info->thread ) {
+		result = IoTHubClient_LL_SetMessageCallback(iotHubClientHandle, ThreadReceiveMessageCallback, info->thread);
+	}
+	else {
+		result = IoTHubClient_LL_SetMessageCallback(iotHubClientHandle, ReceiveMessageCallback, info);
+	}
+	if ( result != IOTHUB_CLIENT_OK || !connectionSetClientOptions(info, iotHubClientHandle) ) {
+		IoTHubClient_LL_Destroy(iotHubClientHandle);
+		return NULL;
+	}
+	return iotHubClientHandle;
+}
+
+/*
+ Destroy the old client left draining after a hot standby took over. Messages still waiting for a confirmation
+ from it are sent again on the current client.
+*/
+static void connectionFinishDrain(ConnectInfo *info)
+{
+	IOTHUB_CLIENT_LL_HANDLE drainingClientHandle = info->drainingClientHandle;
+	if ( drainingClientHandle == NULL ) {
+		return;
+	}
+	waitTimerStop(&info->waitEngine, &info->standbyTimer);
+	info->isDrainClosing = info->isConnected;
+	IoTHubClient_LL_Destroy(drainingClientHandle);
+	info->drainingClientHandle = NULL;
+	info->drainingInFlightCount = 0;
+	info->isDrainClosing = false;
+	if ( info->iotHubClientHandle && info->isConnected && info->retryHead ) {
+		connectionWakeUp(info);
+	}
+}
+
+/*
+ The standby client has had time to connect, so new messages go to it from now on. The old client keeps running
+ until it has confirmed the messages already sent on it, or STANDBY_DRAIN_MS has passed.
+*/
+static void connectionPromoteStandby(ConnectInfo *info)
+{
+	connectionFinishDrain(info);
+	if ( !( info->iotHubClientHandle && info->isConnected ) || info->standbyClientHandle == NULL ) {
+		return;
+	}
+	info->drainingClientHandle = info->iotHubClientHandle;
+	info->drainingInFlightCount = info->inFlightCount;
+	info->iotHubClientHandle = info->standbyClientHandle;
+	info->standbyClientHandle = NULL;
+	info->inFlightCount = 0;
+	info->failedSendCount = 0;
+	connectionStartConnectTime(info);
+	if ( info->drainingInFlightCount == 0 ) {
+		connectionFinishDrain(info);
+	}
+	else {
+		waitTimerStart(&info->waitEngine, &info->standbyTimer, waitTimeNow() + STANDBY_DRAIN_MS);
+	}
+	if ( !( info->iotHubClientHandle && info->isConnected ) ) {
+		return;
+	}
+	connectionScheduleRenew(info);
+	connectionWakeUp(info);
+	connectionNotifyStatus(info, CONNECTION_STATUS_CONNECTED, "renew");
+}
+
+/*
+ Start warming up a new client next to the current one, it takes over once standbyWarmMs has passed.
+*/
+static bool connectionStartStandby(ConnectInfo *info)
+{
+	info->standbyClientHandle = connectionCreateClient(info);
+	if ( info->standbyClientHandle == NULL ) {
+		return false;
+	}
+	waitTimerStart(&info->waitEngine, &info->standbyTimer, waitTimeNow() + info->standbyWarmMs);
+	connectionWakeUp(info);
+	return true;
+}
+
+static void StandbyTimerCallback(WaitTimer *timer)
+{
+	ConnectInfo *info = (ConnectInfo *) timer->context;
+	if ( info->standbyClientHandle ) {
+		connectionPromoteStandby(info);
+	}
+	else {
+		connectionFinishDrain(info);
+	}
+}
+
+/*
+ Replace the client handle with a new one. If the new client cannot be made the old one is kept, and the reconnect
+ is tried again later. With the hot standby option a renew warms up the new client first, see connectionStartStandby.
+*/
+static void connectionReconnect(ConnectInfo *info)
+{
+	const char *reason = info->reconnectReason;
+	bool isStandby = info->isHotStandby && strcmp(reason, "renew") == 0;
+	
+	if ( info->standbyClientHandle ) {
+		// the current client has failed while the standby was warming up, so use the standby now
+		connectionPromoteStandby(info);
+		return;
+	}
+	connectionNotifyStatus(info, CONNECTION_STATUS_RECONNECTING, reason);
+	connectionFinishDrain(info);
+	if ( !( info->iotHubClientHandle && info->isConnected ) ) {
+		return;
+	}
+	if ( isStandby ) {
+		if ( !connectionStartStandby(info) ) {
+			connectionNotifyStatus(info, CONNECTION_STATUS_DISCONNECTED, "Cannot create a new client");
+			if ( info->iotHubClientHandle && info->isConnected ) {
+				connectionScheduleReconnect(info, reason, connectionNextReconnectDue(info));
+			}
+		}
+		return;
+	}
+	IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle = connectionCreateClient(info);
+	if ( iotHubClientHandle == NULL ) {
+		connectionNotifyStatus(info, CONNECTION_STATUS_DISCONNECTED, "Cannot create a new client");
+		if ( info->iotHubClientHandle && info->isConnected ) {
+			connectionScheduleReconnect(info, reason, connectionNextReconnectDue(info));
+		}
+		return;
+	}
+	
+	// the new handle is in place before the old one is destroyed, so a callback that disconnects closes the new one
+	IOTHUB_CLIENT_LL_HANDLE oldClientHandle = info->iotHubClientHandle;
+	waitTimerStop(&info->waitEngine, &info->doWorkTimer);
+	info->isReconnecting = true;
+	if ( info->thread ) {
+		threadStop(info->thread);
+	}
+	info->iotHubClientHandle = iotHubClientHandle;
+	connectionFlushReadBatch(info, true);
+	IoTHubClient_LL_Destroy(oldClientHandle);
+	if ( info->thread ) {
+		threadRecall(info);
+	}
+	if ( !( info->iotHubClientHandle && info->isConnected ) ) {
+		return;
+	}
+	info->isReconnecting = false;
+	info->inFlightCount = 0;
+	info->failedSendCount = 0;
+	if ( info->thread && !threadStart(info) ) {
+		connectionNotifyStatus(info, CONNECTION_STATUS_DISCONNECTED, "Cannot start the io thread");
+		connectionClose(info);
+		return;
+	}
+	connectionStartConnectTime(info);
+	connectionScheduleRenew(info);
+	connectionWakeUp(info);
+	connectionNotifyStatus(info, CONNECTION_STATUS_CONNECTED, reason);
+}
+
+static void ReconnectTimerCallback(WaitTimer *timer)
+{
+	ConnectInfo *info = (ConnectInfo *) timer->context;
+	if ( info->iotHubClientHandle && info->isConnected && !info->isReconnecting ) {
+		connectionReconnect(info);
+	}
+}
+
+/*
+ Release the registry refs to the lua callbacks.
+*/
+static void connectionReleaseCallbacks(lua_State *L, ConnectInfo *info)
+{
+	if ( L ) {
+		luaL_unref(L, LUA_REGISTRYINDEX, info->receiveFunctionRef);
+		luaL_unref(L, LUA_REGISTRYINDEX, info->sendConfirmationFunctionRef);
+		luaL_unref(L, LUA_REGISTRYINDEX, info->readBatchFunctionRef);
+		luaL_unref(L, LUA_REGISTRYINDEX, info->statusFunctionRef);
+		luaL_unref(L, LUA_REGISTRYINDEX, info->resumeFunctionRef);
+		luaL_unref(L, LUA_REGISTRYINDEX, info->yieldErrorRef);
+	}
+	info->receiveFunctionRef = LUA_NOREF;
+	info->sendConfirmationFunctionRef = LUA_NOREF;
+	info->readBatchFunctionRef = LUA_NOREF;
+	info->statusFunctionRef = LUA_NOREF;
+	info->resumeFunctionRef = LUA_NOREF;
+	info->yieldErrorRef = LUA_NOREF;
+}
+
+/*
+ Destroy the client handle and release the callbacks. Any messages still in flight or queued are returned to
+ processSent with the DESTROY result, and any received messages still waiting are passed to processReadBatch.
+*/
+static void connectionClose(ConnectInfo *info)
+{
+	// messages returned by the SDK from here on are passed to processSent, not kept to send again
+	info->isReconnecting = false;
+	waitTimerStop(&info->waitEngine, &info->reconnectTimer);
+	waitTimerStop(&info->waitEngine, &info->standbyTimer);
+	if ( info->standbyClientHandle ) {
+		IoTHubClient_LL_Destroy(info->standbyClientHandle);
+		info->standbyClientHandle = NULL;
+	}
+	if ( info->drainingClientHandle ) {
+		// messages still waiting on the old client are passed to processSent with the DESTROY result
+		IOTHUB_CLIENT_LL_HANDLE drainingClientHandle = info->drainingClientHandle;
+		info->drainingClientHandle = NULL;
+		info->drainingInFlightCount = 0;
+		IoTHubClient_LL_Destroy(drainingClientHandle);
+	}
+	if ( info->iotHubClientHandle && info->isConnected ) {
+		waitTimerStop(&info->waitEngine, &info->doWorkTimer);
+		if ( info->thread ) {
+			threadStop(info->thread);
+		}
+		IoTHubClient_LL_Destroy(info->iotHubClientHandle);
+		info->isConnected = false;
+		info->iotHubClientHandle = NULL;
+		if ( info->thread ) {
+			threadDrain(info);
+		}
+		connectionFlushReadBatch(info, true);
+		info->inFlightCount = 0;
+		connectionFlushQueue(info, IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY);
+		if ( info->transportInfo ) {
+			transportRemoveDevice(info->transportInfo, info);
+		}
+		else {
+			tlsRelease();
+		}
+	}
+	if ( info->thread ) {
+		// io thread was created but the connection failed before it could be started
+		threadFree(info->thread);
+		info->thread = NULL;
+	}
+	if ( info->journal ) {
+		// un-acked messages stay in the file for the next connection
+		journalClose(info->journal);
+		info->journal = NULL;
+		info->isJournalReplaying = false;
+	}
+	connectionReleaseCallbacks(info->L, info);
+}
+
+/*
+ Garbage collect for the connection info user data, closes the connection if the lua code has not called disconnect.
+ The callbacks are released first, since we cannot call back into lua from here.
+*/
+static int luaConnectInfoGC(lua_State *L)
+{
+	ConnectInfo *info = lua_touserdata(L, 1);
+	if ( info ) {
+		connectionReleaseCallbacks(L, info);
+		connectionReleaseYields(L, info);
+		luaL_unref(L, LUA_REGISTRYINDEX, info->callbackErrorRef);
+		info->callbackErrorRef = LUA_NOREF;
+		info->L = NULL;
+		connectionClose(info);
+		sendPoolFree(&info->sendPool);
+		inFlightFree(&info->inFlight);
+		readBatchFree(info);
+		free(info->connectionString);
+		info->connectionString = NULL;
+		compressorFree(&info->compressor);
+		encoderFree(&info->encoder);
+		free(info->coalesceBuffer);
+		info->coalesceBuffer = NULL;
+		free(info->loopbackDeviceId);
+		info->loopbackDeviceId = NULL;
+	}
+	return 0;
+}
+
+/***  
+IotHub object, returned by the @{connect} function
+@table iotHub
+@tfield boolean isConnect If true then this connection has been made
+@tfield function disconnect @{disconnect} Disconnects from the IotHub.
+@tfield function sendMessage @{sendMessage} Sends out a message.
+@tfield function sendMessageYield @{sendMessageYield} Sends out a message and yields the coroutine until it is confirmed.
+@tfield function getSendStatus @{getSendStatus} Returns the current sending status.
+@tfield function lastMessageReceiveTime @{lastMessageReceiveTime} Returns the last time a message was received.
+@tfield function loop @{loop} Loops around the message queue completing sending and receiving messages.
+@tfield function dispatch @{dispatch} Runs the callbacks for events waiting from the io thread.
+@tfield function getPollInfo @{getPollInfo} Returns the fds and timeout for an external event loop.
+@tfield function step @{step} Runs one cycle of the connection without waiting.
+@tfield function getPoolStats @{getPoolStats} Returns the send record pool counters.
+@tfield function getConnectStats @{getConnectStats} Returns the time taken to connect each client.
+@tfield function stats @{stats} Returns the send and receive counters and latency histograms.
+@tfield function loopbackReceive @{loopbackReceive} Queues a message to receive on a loopback connection.
+*/
+
+  
+/***  
+Message table used for sending or receiving via the Azure IotHub.
+
+On sending a message, you need to only fill in the __text__ field before passing this table to the @{sendMessage} function.
+
+On receving a message the __text__, __contentType__ and __length__ will have values, other fields will be set if they are present in the message.
+
+@table message
+@tfield string text Mesasge text, this can be a text string or binary data with embedded zeros. 
+@tfield number,nil length If the length is provided then the text field will be encoded as binary data, with that length
+@tfield number,nil contentType The message text can be overridden by using this field. It can be one of the following:
+
+
+	nil                   Use the length field too decide which encoding too use string or byte.
+	contentType.BYTE      Always encode using byte encoding.
+	contentType.STRING    Always encode using string encoding.
+
+@tfield string,nil id Message id, if set to nil, then the @{sendMessage} function will automatically assign an id, see the connect option __idStrategy__									
+@tfield string,nil correlationId You can read/write the correlationId.						
+@tfield table,nil property Set of name="Value" pairs as property values to send with the message.
+@tfield table,nil body Table to send instead of the __text__, encoded in C with the __encoding__ field. A table with 
+only the keys 1..n is an array, and an empty table is an empty array, others are objects with string or number keys. 
+Numbers with an integral value up to 2^53 are sent as integers and others as floats, strings that are not valid 
+UTF-8 are binary and are sent as a base64 string in JSON or a byte string in CBOR. Use @{null} for a null value. The 
+body is always sent as bytes, the __length__ and __contentType__ fields are not used.
+@tfield string,nil encoding Encoding of the __body__ table, 'json' (the default) or 'cbor'.
+@tfield string,nil compress Set to 'deflate' to send the text compressed with zlib, if it is at least the connect option 
+__compressMinBytes__ long and gets smaller. A compressed message is sent as bytes with the property 
+__contentEncoding__='deflate'. The text of a received message with this property is inflated before it is passed 
+to lua, while the property is left so the message can be seen to have been compressed. If it cannot be inflated the
+message has no __text__ and __errorMessage__ is 'cannot inflate data'.
+  
+@usage
+-- basic text message
+local message = {
+  text = 'Basic text message'
+} 
+-- sends out the message
+iothub:sendMessage(message)
+-- also sends out the same message above
+iothub:sendMessage('Basic text message')
+
+-- basic data message with a fixed length of 12
+local message = {
+  text = 'Basic data message',
+  length = 12
+} 
+
+-- forced text message to always send out 12 character string
+local message = {
+  text = 'Basic data message',
+  length = 12,
+  contentType = luaazureiothub.contentType.STRING,
+} 
+
+-- table sent as the JSON {"temperature":21.5,"readings":[1,2,3],"alarm":null}
+local message = {
+  body = { temperature = 21.5, readings = { 1, 2, 3 }, alarm = luaazureiothub.null },
+  encoding = 'json',
+}
+
+-- string message with a property value of 'messageType', and a special message id
+local message = {
+  text = 'Basic text message',
+  property = {
+     messageType='event',
+  },
+  id = 'My test id',
+} 
+
+*/
+
+
+/***
+Connect to the Azure IotHub, if successfull returns an IotHub object.
+@function connect
+@tparam string,table connectString String to connect to the Azure IotHub, or a table with the fields __connectionString__,
+__protocol__, __processRead__ and __processSent__ plus any of the options below.
+@tparam[opt=AMQP] string protocol Name of the protocol (case insensitive), can be 'AMQP', 'MQTT', 'HTTP' or 'LOOPBACK'.
+The 'LOOPBACK' protocol does not connect to an IotHub, sent messages are confirmed by the library after 
+__loopbackLatencyMs__ and messages queued with @{loopbackReceive} are received, so an application can be tested 
+offline. The connection string must still have the HostName, DeviceId and SharedAccessKey fields.
+@tparam[opt=nil] function processRead Function to process read messages, see the callback function @{processRead}.
+@tparam[opt=nil] function processSent Function to process reply after sending a message, see the callback function @{processSent}.
+The table form can also have a __processReadBatch__ function, see @{processReadBatch}, a __processStatus__ 
+function, see @{processStatus}, and a __processResume__ function, see @{processResume}.
+
+Options that can only be set using the table form:
+
+	maxInFlight    Number of messages that can be waiting for a confirmation from the IotHub, default 1.
+	maxQueued      Number of messages that can be queued waiting for a free in flight slot, default 1024.
+	               Once the queue is full @{sendMessage} returns false, 'Busy'.
+	idleIntervalMs Longest time in milliseconds between two SDK DoWork calls while nothing is being sent, 
+	               default 50. The SDK does not give out its socket, so a received message or confirmation is 
+	               only seen on the next DoWork, see @{loop} for the trade-off.
+	batching       If true the HTTP transport posts all of the messages waiting to be sent in one request, set
+	               maxInFlight to at least the number of messages sent together. Only the HTTP protocol has this
+	               option, connect fails with any other protocol. Default false.
+	threaded       If true the SDK work is done on a background io thread, and the callbacks are run from
+	               @{dispatch}, @{loop} or a waiting @{sendMessage}. Received messages are accepted by the io thread,
+	               the value returned from processRead is ignored. Default false.
+	ringSize       Number of entries in each ring between lua and the io thread, default 1024.
+	idStrategy     How ids are made for messages sent without an id, default 'uuid'. Can be one of:
+	               'uuid'          uuid_generate for each message.
+	               'uuid-batched'  Random uuids made from one read of random bytes for every 32 messages.
+	               'sequence'      A random uuid made at connect, followed by '-' and a hex counter.
+	lazyMessages   If true the callbacks are passed a message userdata instead of a @{message} table. The fields 
+	               are only read from the message when they are used, and message:toTable() returns the full table.
+	               A received message can only be read inside processRead, unless the fields were read there. 
+	               Default false.
+	readBatchSize  Number of received messages held for @{processReadBatch}, default 64.
+	readBatchDelayMs  Longest time in milliseconds a received message is held before the batch is passed to
+	               @{processReadBatch}, default 0 which passes the batch at the end of the loop cycle.
+	poolSize       Number of send records to allocate up front, default 0. The pool grows in blocks of 64 records
+	               as needed, see @{getPoolStats}.
+	journal        Path of a file used to store sent messages until they are confirmed. Messages are written to
+	               the journal before they are sent, and removed once they are passed to @{processSent} with any
+	               status other than messageSend.DESTROYED, since a failed message is never sent again in the same 
+	               session. Messages destroyed with the client when the connection closes, or left by a crash, are
+	               sent again first on the next connect using the same file. A message that @{sendMessage} could 
+	               not hand to the SDK is removed. Only one connection can use a file at a time.
+	journalBytes   Size of the journal file, default 16MB. Once it is full @{sendMessage} returns false, 'Journal full'.
+	journalSync    If true each change to the journal is flushed to disk before returning, default false which
+	               leaves the writes to the kernel so they only survive a process crash, not a power failure.
+	autoReconnect  If true the SDK client is made again from the connection string every renewSeconds, before
+	               the session keys expire, and after reconnectErrors failed confirmations in a row. Messages in 
+	               flight, or returned with messageSend.TIMEOUT, are sent again on the new client and are not 
+	               passed to @{processSent} until they are delivered. Default false.
+	renewSeconds   Seconds between each new client with autoReconnect, 0 to only reconnect on errors, default 3000.
+	reconnectErrors  Failed confirmations in a row before a reconnect, 0 to never reconnect on errors, default 3.
+	               After a failed reconnect the wait doubles from 1 second up to 60 seconds.
+	hotStandby     If true with autoReconnect, a renew makes the new client and runs it next to the old one for
+	               standbyWarmMs so it can connect and authenticate, before new messages are sent on it. The old
+	               client is kept until it has confirmed its messages, for up to 30 seconds, and any it has not 
+	               confirmed by then are sent again on the new client. Needs autoReconnect and cannot be used with
+	               threaded. Default false.
+	standbyWarmMs  Milliseconds the hot standby client runs before it takes over, default 10000.
+	compressMinBytes  Messages sent with __compress__ set are only compressed if the body is at least this many
+	               bytes, default 256.
+	coalesceDelayMs  If more than 0, messages sent one after the other with the same correlation id and properties
+	               are held for up to this many milliseconds and sent to the IotHub as one envelope message. The
+	               envelope has the properties of its messages plus __envelope__ set to the coalesceFormat and 
+	               __envelopeCount__ set to the number of messages, the ids of the messages are not sent. Each message 
+	               is still passed to @{processSent} with its own sequence number once the envelope is confirmed. A 
+	               sync @{sendMessage}, @{sendBatch} or a message that cannot join the envelope sends it straight 
+	               away. Compressed messages are never coalesced. Default 0.
+	coalesceMaxBytes  Largest envelope body, a message that would make it larger sends the envelope first and 
+	               starts a new one, default 4096.
+	coalesceFormat 'json' to send the bodies as a JSON array, so each body must be a JSON value, or 'frames' 
+	               to send each body after its length as 4 byte big endian integer. Default 'json'.
+	loopbackLatencyMs  With the 'loopback' protocol, milliseconds before each sent message is confirmed, 
+	               default 0 which confirms them on the next loop cycle.
+	loopbackErrorRate  With the 'loopback' protocol, the fraction of sent messages from 0 to 1 that are failed 
+	               with messageSend.ERROR instead of confirmed, default 0.
+
+@treturn iotHub object table if successfully connected to the IotHub.
+@treturn false, errorMessage False and an error message if failed to connect
+
+@usage
+local luaazureiothub = require 'luaazureiothub'
+
+local processRead = function(message)
+  print("received a message:")
+  print(message)				
+  return luaazureiothub.messageReceive.ACCEPTED
+end
+
+local processSendConfirmation = function(status, message)
+  -- called when the message has been sent or has an error 
+  if status == luaazureiothub.messageSend.OK then
+    print('RX message ack')
+  else
+    print('RX message error:' .. status)
+  end
+  print(message)
+end
+
+local connectionString = 'HostName=hostname.azure-devices.net;DeviceId=deviceId;SharedAccessKey=????'
+local iothub, errorMessage = luaazureiothub.connect(connectionString, 'amqp', processRead, processSendConfirmation)
+
+-- or using the table form, with up to 256 messages waiting for a confirmation
+local iothub, errorMessage = luaazureiothub.connect{
+  connectionString = connectionString,
+  protocol = 'amqp',
+  processRead = processRead,
+  processSent = processSendConfirmation,
+  maxInFlight = 256,
+}
+
+*/
+
+/*
+ Read the optional settings from the connect table at 'index', any missing values are left as the defaults.
+ Returns NULL, or an error message if a setting is not valid.
+*/
+static const char *readConnectOptions(lua_State *L, int index, ConnectOptions *options)
+{
+	options->maxInFlight = DEFAULT_MAX_IN_FLIGHT;
+	options->maxQueued = DEFAULT_MAX_QUEUED;
+	options->idleIntervalMs = WAIT_IDLE_INTERVAL_MS;
+	options->isBatching = false;
+	options->isThreaded = false;
+	options->ringSize = DEFAULT_RING_SIZE;
+	options->poolSize = 0;
+	options->idStrategy = MESSAGE_ID_UUID;
+	options->isLazyMessage = false;
+	options->readBatchSize = DEFAULT_READ_BATCH_SIZE;
+	options->readBatchDelayMs = DEFAULT_READ_BATCH_DELAY_MS;
+	options->journalPath = NULL;
+	options->journalBytes = DEFAULT_JOURNAL_BYTES;
+	options->isJournalSync = false;
+	options->isAutoReconnect = false;
+	options->renewSeconds = DEFAULT_RENEW_SECONDS;
+	options->reconnectErrors = DEFAULT_RECONNECT_ERRORS;
+	options->isHotStandby = false;
+	options->standbyWarmMs = DEFAULT_STANDBY_WARM_MS;
+	options->compressMinBytes = DEFAULT_COMPRESS_MIN_BYTES;
+	options->coalesceDelayMs = 0;
+	options->coalesceMaxBytes = DEFAULT_COALESCE_MAX_BYTES;
+	options->coalesceFormat = COALESCE_FORMAT_JSON;
+	options->loopbackLatencyMs = 0;
+	options->loopbackErrorRate = 0;
+	if ( !lua_istable(L, index) ) {
+		return NULL;
+	}
+	
+	lua_getfield(L, index, "maxInFlight");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0 ) {
+		options->maxInFlight = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "maxQueued");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) >= 0 ) {
+		options->maxQueued = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "idleIntervalMs");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0 ) {
+		options->idleIntervalMs = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "batching");
+	options->isBatching = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "threaded");
+	options->isThreaded = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "ringSize");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0 ) {
+		options->ringSize = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "poolSize");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0 ) {
+		options->poolSize = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "idStrategy");
+	if ( lua_isstring(L, -1) && !messageIdReadStrategy(lua_tostring(L, -1), &options->idStrategy) ) {
+		lua_pop(L, 1);
+		return "idStrategy can only be 'uuid', 'uuid-batched' or 'sequence'";
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "lazyMessages");
+	options->isLazyMessage = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "readBatchSize");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0 ) {
+		options->readBatchSize = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "readBatchDelayMs");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) >= 0 ) {
+		options->readBatchDelayMs = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	// the path string is kept alive by the connect table
+	lua_getfield(L, index, "journal");
+	if ( lua_isstring(L, -1) ) {
+		options->journalPath = lua_tostring(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "journalBytes");
+	if ( lua_isnumber(L, -1) && lua_tonumber(L, -1) > 0 ) {
+		options->journalBytes = (size_t) lua_tonumber(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "journalSync");
+	options->isJournalSync = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "autoReconnect");
+	options->isAutoReconnect = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "renewSeconds");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) >= 0 ) {
+		options->renewSeconds = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "reconnectErrors");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) >= 0 ) {
+		options->reconnectErrors = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "hotStandby");
+	options->isHotStandby = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	if ( options->isHotStandby && options->isThreaded ) {
+		return "hotStandby cannot be used with threaded mode";
+	}
+	if ( options->isHotStandby && !options->isAutoReconnect ) {
+		return "hotStandby can only be used with autoReconnect";
+	}
+	
+	lua_getfield(L, index, "standbyWarmMs");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) >= 0 ) {
+		options->standbyWarmMs = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "compressMinBytes");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) >= 0 ) {
+		options->compressMinBytes = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "coalesceDelayMs");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) >= 0 ) {
+		options->coalesceDelayMs = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "coalesceMaxBytes");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0 ) {
+		options->coalesceMaxBytes = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "coalesceFormat");
+	if ( lua_isstring(L, -1) ) {
+		if ( strcmp(lua_tostring(L, -1), COALESCE_FORMAT_JSON_TEXT) == 0 ) {
+			options->coalesceFormat = COALESCE_FORMAT_JSON;
+		}
+		else if ( strcmp(lua_tostring(L, -1), COALESCE_FORMAT_FRAMES_TEXT) == 0 ) {
+			options->coalesceFormat = COALESCE_FORMAT_FRAMES;
+		}
+		else {
+			lua_pop(L, 1);
+			return "coalesceFormat can only be 'json' or 'frames'";
+		}
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "loopbackLatencyMs");
+	if ( lua_isnumber(L, -1) && lua_tointeger(L, -1) >= 0 ) {
+		options->loopbackLatencyMs = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "loopbackErrorRate");
+	if ( lua_isnumber(L, -1) ) {
+		if ( lua_tonumber(L, -1) < 0 || lua_tonumber(L, -1) > 1 ) {
+			lua_pop(L, 1);
+			return "loopbackErrorRate must be from 0 to 1";
+		}
+		options->loopbackErrorRate = lua_tonumber(L, -1);
+	}
+	lua_pop(L, 1);
+	return NULL;
+}
+
+/*
+ Save the processRead and processSent functions at the stack positions as registry refs in the connection, and
+ register the connection as the context for the SDK message callback. On failure the client handle is destroyed.
+*/
+static bool connectionSetCallbacks(lua_State *L, ConnectInfo *info, int receiveIndex, int sendConfirmationIndex, int readBatchIndex)
+{
+	info->L = L;
+	if ( lua_isfunction(L, receiveIndex) ) {		
+		lua_pushvalue(L, receiveIndex);
+		info->receiveFunctionRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	if ( lua_isfunction(L, sendConfirmationIndex) ) {
+		lua_pushvalue(L, sendConfirmationIndex);
+		info->sendConfirmationFunctionRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	if ( lua_isfunction(L, readBatchIndex) ) {
+		lua_pushvalue(L, readBatchIndex);
+		info->readBatchFunctionRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	IOTHUB_CLIENT_RESULT result;
+	if ( info->thread ) {
+		result = IoTHubClient_LL_SetMessageCallback(info->iotHubClientHandle, ThreadReceiveMessageCallback, info->thread);
+	}
+	else {
+		result = IoTHubClient_LL_SetMessageCallback(info->iotHubClientHandle, ReceiveMessageCallback, info);
+	}
+	if ( result != IOTHUB_CLIENT_OK ) {
+		IoTHubClient_LL_Destroy(info->iotHubClientHandle);
+		info->iotHubClientHandle = NULL;
+		info->isConnected = false;
+		return false;
+	}
+	return true;
+}
+
+/*
+ Return the SDK transport provider for the protocol name, or NULL if it is not known.
+*/
+static IOTHUB_CLIENT_TRANSPORT_PROVIDER readProtocol(const char *protocolText)
+{
+	if ( strcasecmp("AMQP", protocolText) == 0 ) {
+		return AMQP_Protocol;
+	}
+	if ( strcasecmp("HTTP", protocolText) == 0 ) {
+		return HTTP_Protocol;
+	}
+	if ( strcasecmp("MQTT", protocolText) == 0 ) {
+		return MQTT_Protocol;
+	}
+	if ( strcasecmp("LOOPBACK", protocolText) == 0 ) {
+		return Loopback_Protocol;
+	}
+	return NULL;
+}
+
+/*
+ Push a new iotHub object for the client handle. The processRead, processSent and processReadBatch functions are 
+ taken from the absolute stack positions. Returns NULL with the reason in errorMessage and pushes nothing if the 
+ connection cannot be setup, in that case the client handle has been destroyed. In threaded mode the io thread is 
+ created here, but not started.
+*/
+static ConnectInfo *pushConnection(lua_State *L, ConnectInfo *info, ConnectOptions *options, int receiveIndex, int sendConfirmationIndex, int readBatchIndex, const char **errorMessage)
+{
+	luaL_newlib(L, luaAzureIotHubConnectionMethods);
+	info->isConnected = true;
+	info->maxInFlight = options->maxInFlight;
+	info->maxQueued = options->maxQueued;
+	info->idleIntervalMs = options->idleIntervalMs;
+	info->isLazyMessage = options->isLazyMessage;
+	if ( options->isThreaded ) {
+		info->thread = threadCreate(options);
+		if ( info->thread == NULL ) {
+			IoTHubClient_LL_Destroy(info->iotHubClientHandle);
+			info->iotHubClientHandle = NULL;
+			info->isConnected = false;
+			lua_pop(L, 1);
+			*errorMessage = "Cannot create the io thread";
+			return NULL;
+		}
+	}
+	ConnectInfo *connectInfo = pushConnectInfo(L, info);
+	messageIdInit(&connectInfo->idGenerator, options->idStrategy);
+	compressorInit(&connectInfo->compressor);
+	encoderInit(&connectInfo->encoder);
+	connectInfo->compressMinBytes = options->compressMinBytes;
+	connectInfo->coalesceDelayMs = options->coalesceDelayMs;
+	connectInfo->coalesceMaxBytes = options->coalesceMaxBytes;
+	connectInfo->coalesceFormat = options->coalesceFormat;
+	connectInfo->loopbackLatencyMs = options->loopbackLatencyMs;
+	connectInfo->loopbackErrorRate = options->loopbackErrorRate;
+	connectInfo->isBatching = options->isBatching;
+	while ( connectInfo->sendPool.recordCount < options->poolSize && sendPoolGrow(&connectInfo->sendPool) ) {
+	}
+	*errorMessage = NULL;
+	if ( !connectionSetClientOptions(connectInfo, connectInfo->iotHubClientHandle) ) {
+		*errorMessage = "batching can only be used with the HTTP protocol";
+	}
+	if ( *errorMessage == NULL && lua_isfunction(L, readBatchIndex) && !readBatchInit(connectInfo, options) ) {
+		*errorMessage = "Out of memory";
+	}
+	if ( *errorMessage == NULL && options->journalPath ) {
+		connectInfo->journal = journalOpen(options->journalPath, options->journalBytes, options->isJournalSync, errorMessage);
+	}
+	if ( *errorMessage ) {
+		IoTHubClient_LL_Destroy(connectInfo->iotHubClientHandle);
+		connectInfo->iotHubClientHandle = NULL;
+		connectInfo->isConnected = false;
+		lua_pop(L, 1);
+		return NULL;
+	}
+	if ( !connectionSetCallbacks(L, connectInfo, receiveIndex, sendConfirmationIndex, readBatchIndex) ) {
+		lua_pop(L, 1);
+		*errorMessage = "Cannot setup message callback";
+		return NULL;
+	}	
+	connectionStartReplay(connectInfo);
+	connectionStartConnectTime(connectInfo);
+	lua_pushstring(L, "isConnect");
+	lua_pushboolean(L, 1);
+	lua_settable(L, -3);	
+	return connectInfo;
+}
+
+/*
+ Return a copy of the value of the field 'name' in the connection string, or NULL if it is not found.
+*/
+static char *readConnectionStringField(const char *connectionString, const char *name)
+{
+	size_t nameLength = strlen(name);
+	const char *field = connectionString;
+	while ( field && *field ) {
+		const char *end = strchr(field, ';');
+		size_t fieldLength = end ? (size_t) (end - field) : strlen(field);
+		if ( fieldLength > nameLength && strncmp(field, name, nameLength) == 0 && field[nameLength] == '=' ) {
+			return strndup(field + nameLength + 1, fieldLength - nameLength - 1);
+		}
+		field = end ? end + 1 : NULL;
+	}
+	return NULL;
+}
+
+static int luaConnect(lua_State *L)
+{
+	
+	const char *connectionString = NULL;
+	IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol = NULL;
+	ConnectInfo info;
+	ConnectOptions options;
+
+// Lua call params
+// connect( connectionString, [protocol = AMQP, receiveCoRoutine] )
+// or connect{ connectionString=.., protocol=.., processRead=.., processSent=.., [options] }
+
+	memset(&info, 0, sizeof(ConnectInfo));
+	info.receiveFunctionRef = LUA_NOREF;
+	info.sendConfirmationFunctionRef = LUA_NOREF;
+	info.readBatchFunctionRef = LUA_NOREF;
+	info.statusFunctionRef = LUA_NOREF;
+	info.resumeFunctionRef = LUA_NOREF;
+	info.yieldErrorRef = LUA_NOREF;
+	info.callbackErrorRef = LUA_NOREF;
+	const char *optionsError = readConnectOptions(L, 1, &options);
+	if ( optionsError ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, optionsError);
+		return 2;
+	}
+	if ( lua_istable(L, 1) ) {
+		// move the table fields into the same stack positions as the plain call
+		lua_settop(L, 1);
+		lua_getfield(L, 1, "connectionString");
+		lua_getfield(L, 1, "protocol");
+		lua_getfield(L, 1, "processRead");
+		lua_getfield(L, 1, "processSent");
+		lua_getfield(L, 1, "processReadBatch");
+		lua_getfield(L, 1, "processStatus");
+		lua_getfield(L, 1, "processResume");
+		lua_remove(L, 1);
+	}
+	else {
+		lua_settop(L, 4);
+		lua_pushnil(L);
+		lua_pushnil(L);
+		lua_pushnil(L);
+	}
+	
+	if ( !lua_isstring(L, 1) ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Parameter #1 is not a connection string");
+		return 2;
+	}
+	
+	connectionString = lua_tostring(L, 1);
+
+
+	if ( lua_isstring(L, 2) ) {
+		protocol = readProtocol(lua_tostring(L, 2));
+		if ( protocol == NULL ) {
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, "Parameter #2 can only be 'amqp', 'http', 'mqtt' or 'loopback'");
+			return 2;
+		}
+	}
+	else {
+		protocol = AMQP_Protocol;
+	}
+	
+
+	info.iotHubClientHandle = IoTHubClient_LL_CreateFromConnectionString(connectionString, protocol);
+	if ( info.iotHubClientHandle == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Failed to connect");
+		return 2;
+	}
+	
+	const char *errorMessage;
+	ConnectInfo *connectInfo = pushConnection(L, &info, &options, 3, 4, 5, &errorMessage);
+	if ( connectInfo == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, errorMessage);
+		return 2;
+	}	
+	tlsAcquire();
+	if ( connectInfo->thread && !threadStart(connectInfo) ) {
+		connectionClose(connectInfo);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Cannot start the io thread");
+		return 2;
+	}
+	if ( lua_isfunction(L, 6) ) {
+		lua_pushvalue(L, 6);
+		connectInfo->statusFunctionRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	if ( lua_isfunction(L, 7) ) {
+		lua_pushvalue(L, 7);
+		connectInfo->resumeFunctionRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	if ( protocol == Loopback_Protocol ) {
+		connectInfo->loopbackDeviceId = readConnectionStringField(connectionString, "DeviceId");
+	}
+	if ( options.isAutoReconnect ) {
+		connectInfo->connectionString = strdup(connectionString);
+		connectInfo->protocol = protocol;
+		connectInfo->renewSeconds = options.renewSeconds;
+		connectInfo->reconnectErrors = options.reconnectErrors;
+		connectInfo->reconnectDelayMs = RECONNECT_MIN_DELAY_MS;
+		connectInfo->isHotStandby = options.isHotStandby;
+		connectInfo->standbyWarmMs = options.standbyWarmMs;
+		if ( connectInfo->connectionString == NULL ) {
+			connectionClose(connectInfo);
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, "Out of memory");
+			return 2;
+		}
+		connectionScheduleRenew(connectInfo);
+	}
+	connectionWakeUp(connectInfo);
+		
+	return 1;
+}
+
+
+/***  
+Transport object, returned by the @{createTransport} function.
+
+A shared transport multiplexes many device connections over one connection to the IotHub, so a gateway
+does not need a socket and TLS handshake for each of its devices.
+@table transport
+@tfield function addDevice @{transport:addDevice} Adds a device connection to the transport.
+@tfield function loop @{transport:loop} Loops around the shared connection for all of the devices.
+@tfield function getDeviceCount @{transport:getDeviceCount} Returns the number of connected devices.
+@tfield function destroy @{transport:destroy} Disconnects all of the devices and closes the shared connection.
+*/
+
+static void TransportDoWorkTimerCallback(WaitTimer *timer);
+
+static TransportInfo *readTransportInfo(lua_State *L, int index)
+{
+	TransportInfo *transport = NULL;
+	if ( lua_istable(L, index) ) {
+		lua_getfield(L, index, "transport");
+		transport = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+	}
+	return transport;
+}
+
+static void transportWakeUp(TransportInfo *transport)
+{
+	transport->doWorkInterval = WAIT_BUSY_INTERVAL_MS;
+	waitTimerStart(&transport->waitEngine, &transport->doWorkTimer, waitTimeNow());
+}
+
+static bool transportAddDevice(TransportInfo *transport, ConnectInfo *info)
+{
+	if ( transport->deviceCount == transport->deviceSize ) {
+		int size = transport->deviceSize ? transport->deviceSize * 2 : 16;
+		ConnectInfo **devices = realloc(transport->devices, sizeof(ConnectInfo *) * size);
+		if ( devices == NULL ) {
+			return false;
+		}
+		transport->devices = devices;
+		transport->deviceSize = size;
+	}
+	transport->devices[transport->deviceCount ++] = info;
+	info->transportInfo = transport;
+	if ( info->idleIntervalMs < transport->idleIntervalMs ) {
+		transport->idleIntervalMs = info->idleIntervalMs;
+	}
+	return true;
+}
+
+static void transportRemoveDevice(TransportInfo *transport, ConnectInfo *info)
+{
+	int index;
+	for ( index = 0; index < transport->deviceCount; index ++ ) {
+		if ( transport->devices[index] == info ) {
+			transport->devices[index] = transport->devices[-- transport->deviceCount];
+			break;
+		}
+	}
+	info->transportInfo = NULL;
+}
+
+/*
+ Run one cycle of the shared transport. The SDK services the shared connection for every registered device
+ when any one of the device clients calls DoWork, so only one device is used per cycle. The device is rotated
+ so that each client also gets its own timeout processing.
+*/
+static void transportDoWork(TransportInfo *transport)
+{
+	bool isBusy = false;
+	int index;
+	
+	if ( transport->deviceCount > 0 ) {
+		ConnectInfo *lead = transport->devices[transport->leadIndex % transport->deviceCount];
+		transport->leadIndex ++;
+		if ( lead->iotHubClientHandle && lead->isConnected ) {
+			IoTHubClient_LL_DoWork(lead->iotHubClientHandle);
+			lead->stats.doWorkCount ++;
+		}
+		// callbacks can disconnect devices, so check the count on each pass
+		for ( index = 0; index < transport->deviceCount; index ++ ) {
+			ConnectInfo *info = transport->devices[index];
+			// the device wait engines are not run by the transport, so the coalesce, yield and read batch timers are 
+			// checked here
+			if ( info->coalesceHead && waitTimeNow() >= info->coalesceTimer.due ) {
+				connectionFlushCoalesced(info);
+			}
+			if ( info->yieldTimer.isActive && waitTimeNow() >= info->yieldTimer.due ) {
+				waitTimerStop(&info->waitEngine, &info->yieldTimer);
+				YieldTimerCallback(&info->yieldTimer);
+			}
+			connectionFlushReadBatch(info, false);
+			if ( index >= transport->deviceCount || transport->devices[index] != info ) {
+				// processReadBatch disconnected the device, the next one has moved into its place
+				index --;
+				continue;
+			}
+			connectionSubmitQueued(info);
+			if ( info->inFlightCount > 0 || info->queuedCount > 0 || info->coalesceHead ) {
+				isBusy = true;
+			}
+		}
+	}
+	if ( isBusy ) {
+		transport->doWorkInterval = WAIT_BUSY_INTERVAL_MS;
+	}
+	else {
+		transport->doWorkInterval *= 2;
+		if ( transport->doWorkInterval > transport->idleIntervalMs ) {
+			transport->doWorkInterval = transport->idleIntervalMs;
+		}
+	}
+	if ( transport->transportHandle ) {
+		waitTimerStart(&transport->waitEngine, &transport->doWorkTimer, waitTimeNow() + transport->doWorkInterval);
+	}
+}
+
+static void TransportDoWorkTimerCallback(WaitTimer *timer)
+{
+	transportDoWork((TransportInfo *) timer->context);
+}
+
+/*
+ Disconnect all of the devices and close the shared connection. If isCallbackAllowed is false then the device 
+ callbacks are released first, since they cannot be called during garbage collection.
+*/
+static void transportClose(lua_State *L, TransportInfo *transport, bool isCallbackAllowed)
+{
+	while ( transport->deviceCount > 0 ) {
+		ConnectInfo *info = transport->devices[0];
+		if ( isCallbackAllowed ) {
+			info->L = L;
+		}
+		else {
+			connectionReleaseCallbacks(L, info);
+			info->L = NULL;
+		}
+		connectionClose(info);
+		// make sure we do not loop forever if the device was not connected
+		transportRemoveDevice(transport, info);
+	}
+	if ( transport->transportHandle ) {
+		waitTimerStop(&transport->waitEngine, &transport->doWorkTimer);
+		IoTHubTransport_Destroy(transport->transportHandle);
+		transport->transportHandle = NULL;
+		tlsRelease();
+	}
+	free(transport->devices);
+	transport->devices = NULL;
+	transport->deviceSize = 0;
+}
+
+static int luaTransportInfoGC(lua_State *L)
+{
+	TransportInfo *transport = lua_touserdata(L, 1);
+	if ( transport ) {
+		transportClose(L, transport, false);
+	}
+	return 0;
+}
+
+/***
+Create a shared transport to the IotHub.
+
+Devices are then added to the transport using @{transport:addDevice}, and all of them share the one connection.
+@function createTransport
+@tparam string protocol Name of the protocol (case insensitive), can be 'AMQP', 'HTTP' or 'LOOPBACK'. MQTT cannot be 
+shared as the protocol only allows one device per connection.
+@tparam string hostName Host name of the IotHub, e.g. 'myhub.azure-devices.net'
+@treturn transport object table if the transport was created.
+@treturn false, errorMessage False and an error message if failed to create the transport
+
+@usage
+local transport = luaazureiothub.createTransport('amqp', 'myhub.azure-devices.net')
+local device1 = transport:addDevice('device1', deviceKey1, { processRead = processRead, processSent = processSent })
+local device2 = transport:addDevice('device2', deviceKey2, { processRead = processRead, processSent = processSent })
+device1:sendMessage('from device 1', 0)
+device2:sendMessage('from device 2', 0)
+transport:loop(1000)
+
+*/
+static int luaCreateTransport(lua_State *L)
+{
+	IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol = NULL;
+	
+	if ( lua_isstring(L, 1) ) {
+		protocol = readProtocol(lua_tostring(L, 1));
+	}
+	if ( protocol == NULL || protocol == MQTT_Protocol ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Parameter #1 can only be 'amqp', 'http' or 'loopback'");
+		return 2;
+	}
+	if ( !lua_isstring(L, 2) ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Parameter #2 is not a host name");
+		return 2;
+	}
+	
+	// split the host name into the iothub name and suffix
+	const char *hostName = lua_tostring(L, 2);
+	const char *suffix = strchr(hostName, '.');
+	if ( suffix == NULL || suffix == hostName || suffix[1] == 0 ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Parameter #2 must be a host name in the form 'name.suffix'");
+		return 2;
+	}
+	lua_pushlstring(L, hostName, suffix - hostName);
+	const char *iotHubName = lua_tostring(L, -1);
+	suffix ++;
+	
+	tlsAcquire();
+	TRANSPORT_HANDLE transportHandle = IoTHubTransport_Create(protocol, iotHubName, suffix);
+	lua_pop(L, 1);				// iotHubName
+	if ( transportHandle == NULL ) {
+		tlsRelease();
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Failed to create transport");
+		return 2;
+	}
+	
+	luaL_newlib(L, luaAzureIotHubTransportMethods);
+	lua_pushstring(L, "transport");
+	TransportInfo *transport = lua_newuserdata(L, sizeof(TransportInfo));
+	memset(transport, 0, sizeof(TransportInfo));
+	transport->transportHandle = transportHandle;
+	transport->protocol = protocol;
+	waitEngineInit(&transport->waitEngine);
+	waitTimerInit(&transport->doWorkTimer, TransportDoWorkTimerCallback, transport);
+	transport->doWorkInterval = WAIT_BUSY_INTERVAL_MS;
+	transport->idleIntervalMs = WAIT_IDLE_INTERVAL_MS;
+	luaL_setmetatable(L, TRANSPORT_INFO_METATABLE_NAME);
+	lua_settable(L, -3);
+	return 1;
+}
+
+/***
+Transport Class.
+This class is returned by the @{createTransport} function.
+@section Transport
+
+*/
+
+/***
+Add a device connection to the shared transport.
+@function transport:addDevice
+@tparam string deviceId Id of the device registered on the IotHub.
+@tparam string deviceKey Shared access key of the device.
+@tparam[opt=nil] table callbacks Table with the __processRead__ and __processSent__ callback functions, this table can 
+also contain any of the options used in the table form of @{connect}. The __autoReconnect__ option is ignored, since
+the device client is made from the shared transport.
+@treturn iotHub object table for this device, with the same functions as returned by @{connect}.
+@treturn false, errorMessage False and an error message if the device cannot be added.
+*/
+static int luaTransportAddDevice(lua_State *L)
+{
+	TransportInfo *transport = readTransportInfo(L, 1);
+	ConnectOptions options;
+	ConnectInfo info;
+	IOTHUB_CLIENT_DEVICE_CONFIG config;
+	
+	if ( transport == NULL || transport->transportHandle == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Transport has been destroyed or not found");
+		return 2;
+	}
+	if ( !lua_isstring(L, 2) || !lua_isstring(L, 3) ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Parameter #1 and #2 must be the device id and key");
+		return 2;
+	}
+	
+	const char *optionsError = readConnectOptions(L, 4, &options);
+	if ( optionsError ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, optionsError);
+		return 2;
+	}
+	if ( options.isThreaded ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Threaded mode cannot be used with a shared transport");
+		return 2;
+	}
+	lua_settop(L, 4);
+	if ( lua_istable(L, 4) ) {
+		lua_getfield(L, 4, "processRead");
+		lua_getfield(L, 4, "processSent");
+		lua_getfield(L, 4, "processReadBatch");
+	}
+	else {
+		lua_pushnil(L);
+		lua_pushnil(L);
+		lua_pushnil(L);
+	}
+	
+	memset(&config, 0, sizeof(IOTHUB_CLIENT_DEVICE_CONFIG));
+	config.protocol = transport->protocol;
+	config.transportHandle = IoTHubTransport_GetLLTransport(transport->transportHandle);
+	config.deviceId = lua_tostring(L, 2);
+	config.deviceKey = lua_tostring(L, 3);
+	
+	memset(&info, 0, sizeof(ConnectInfo));
+	info.receiveFunctionRef = LUA_NOREF;
+	info.sendConfirmationFunctionRef = LUA_NOREF;
+	info.readBatchFunctionRef = LUA_NOREF;
+	info.statusFunctionRef = LUA_NOREF;
+	info.resumeFunctionRef = LUA_NOREF;
+	info.yieldErrorRef = LUA_NOREF;
+	info.callbackErrorRef = LUA_NOREF;
+	info.iotHubClientHandle = IoTHubClient_LL_CreateWithTransport(&config);
+	if ( info.iotHubClientHandle == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Failed to add device");
+		return 2;
+	}
+	
+	const char *errorMessage;
+	ConnectInfo *connectInfo = pushConnection(L, &info, &options, 5, 6, 7, &errorMessage);
+	if ( connectInfo == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, errorMessage);
+		return 2;
+	}
+	if ( !transportAddDevice(transport, connectInfo) ) {
+		connectionClose(connectInfo);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Out of memory");
+		return 2;
+	}
+	if ( transport->protocol == Loopback_Protocol ) {
+		connectInfo->loopbackDeviceId = strdup(lua_tostring(L, 2));
+	}
+	// keep the transport alive for as long as the device
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "transport");
+	connectionWakeUp(connectInfo);
+	return 1;
+}
+
+/*
+ Returns true if a callback of one of the devices has raised an error that is waiting for connectionRaiseError.
+*/
+static bool transportHasError(TransportInfo *transport)
+{
+	int index;
+	for ( index = 0; index < transport->deviceCount; index ++ ) {
+		if ( transport->devices[index]->callbackErrorRef != LUA_NOREF ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/***
+Loop around the shared connection to process sending and receiving messages for all of the devices.
+@function transport:loop
+@tparam[opt=1000] integer timeoutMs Number of milliseconds to process the shared connection, if <=0 then the loop
+will process only one cycle and return.
+Each cycle also passes the messages held for the __processReadBatch__ of each device, sends the messages held by 
+its coalescer, and resumes the coroutines waiting in @{sendMessageYield} whose message is confirmed or whose 
+timeout has passed, so the devices do not need their own @{loop}.
+*/
+static int luaTransportLoop(lua_State *L)
+{
+	TransportInfo *transport = readTransportInfo(L, 1);
+	int timeoutMs = DEFAULT_LOOP_ALL_TIMEOUT_MS;
+	int index;
+	
+	if ( lua_isnumber(L, 2) ) {
+		timeoutMs = lua_tointeger(L, 2);
+	}
+	if ( transport && transport->transportHandle ) {
+		for ( index = 0; index < transport->deviceCount; index ++ ) {
+			transport->devices[index]->L = L;
+		}
+		transportDoWork(transport);
+		if ( timeoutMs > 0 ) {
+			unsigned long long deadline = waitTimeNow() + timeoutMs;
+			while ( transport->transportHandle && waitTimeNow() < deadline && !transportHasError(transport) ) {
+				if ( waitEngineWait(&transport->waitEngine, deadline) > 0 ) {
+					transportDoWork(transport);
+				}
+				waitEngineExpire(&transport->waitEngine, waitTimeNow());
+			}
+		}
+		for ( index = 0; index < transport->deviceCount; index ++ ) {
+			connectionResumeYields(transport->devices[index]);
+		}
+		for ( index = 0; index < transport->deviceCount; index ++ ) {
+			connectionRaiseError(L, transport->devices[index]);
+		}
+	}
+	return 0;
+}
+
+/***
+Get the number of devices connected to the shared transport.
+@function transport:getDeviceCount
+@treturn integer Number of connected devices.
+*/
+static int luaTransportGetDeviceCount(lua_State *L)
+{
+	TransportInfo *transport = readTransportInfo(L, 1);
+	lua_pushinteger(L, transport ? transport->deviceCount : 0);
+	return 1;
+}
+
+/***
+Disconnect all of the devices and close the shared connection.
+@function transport:destroy
+@treturn boolean True if succesfull
+*/
+static int luaTransportDestroy(lua_State *L)
+{
+	TransportInfo *transport = readTransportInfo(L, 1);
+	if ( transport ) {
+		transportClose(L, transport, true);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+
+/***
+Loop around the event queues of a set of connections, in one pass.
+
+This is the same as calling @{loop} on each connection, but sleeps on all of the connections at once. Use this when
+one lua state is driving many device connections.
+
+@function loopAll
+@tparam table connections Array of iotHub objects returned by @{connect}, disconnected entries are skipped.
+@tparam[opt=1000] integer timeoutMs Number of milliseconds to process the connections, if <=0 then each connection is
+processed for only one cycle.
+@treturn integer Number of connected iotHub objects that were processed.
+
+@usage
+local hubs = {}
+for index, connectionString in ipairs(connectionStrings) do
+  hubs[index] = luaazureiothub.connect(connectionString, 'amqp', processRead, processSendConfirmation)
+end
+while true do
+  luaazureiothub.loopAll(hubs, 100)
+end
+
+*/
+static int luaLoopAll(lua_State *L)
+{
+	int timeoutMs = DEFAULT_LOOP_ALL_TIMEOUT_MS;
+	int count = 0;
+	int index;
+	
+	if ( !lua_istable(L, 1) ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Parameter #1 must be an array of iotHub objects");
+		return 2;
+	}
+	if ( lua_isnumber(L, 2) ) {
+		timeoutMs = lua_tointeger(L, 2);
+	}
+	
+	int size = lua_rawlen(L, 1);
+	WaitEngine **engines = malloc(sizeof(WaitEngine *) * (size + 1));
+	ConnectInfo **infos = malloc(sizeof(ConnectInfo *) * (size + 1));
+	// the poll set for all of the connections, made once and used for every wait in this call
+	struct pollfd *fds = malloc(sizeof(struct pollfd) * WAIT_MAX_FDS * (size + 1));
+	if ( engines == NULL || infos == NULL || fds == NULL ) {
+		free(engines);
+		free(infos);
+		free(fds);
+		return luaL_error(L, "Out of memory");
+	}
+	
+	for ( index = 1; index <= size; index ++ ) {
+		lua_rawgeti(L, 1, index);
+		int connectionIndex = lua_gettop(L);
+		ConnectInfo *info = readConnectInfo(L, connectionIndex);
+		if ( info && info->iotHubClientHandle && info->isConnected ) {
+			info->L = L;
+			infos[count] = info;
+			engines[count] = &info->waitEngine;
+			count ++;
+		}
+		lua_settop(L, connectionIndex - 1);			// connection table and the info field
+	}
+	
+	for ( index = 0; index < count; index ++ ) {
+		connectionDoWork(infos[index]);
+	}
+	if ( timeoutMs > 0 ) {
+		unsigned long long deadline = waitTimeNow() + timeoutMs;
+		while ( waitTimeNow() < deadline ) {
+			if ( waitEngineWaitMany(engines, count, fds, deadline) > 0 ) {
+				for ( index = 0; index < count; index ++ ) {
+					if ( waitEngineIsReady(engines[index]) ) {
+						connectionDoWork(infos[index]);
+					}
+				}
+			}
+			unsigned long long now = waitTimeNow();
+			bool isError = false;
+			for ( index = 0; index < count; index ++ ) {
+				waitEngineExpire(engines[index], now);
+				isError = isError || infos[index]->callbackErrorRef != LUA_NOREF;
+			}
+			// stop waiting so the error is raised now
+			if ( isError ) {
+				break;
+			}
+		}
+	}
+	free(engines);
+	free(infos);
+	free(fds);
+	// read the connections again, a resumed coroutine can take one out of the array
+	for ( index = 1; index <= size; index ++ ) {
+		lua_rawgeti(L, 1, index);
+		int connectionIndex = lua_gettop(L);
+		ConnectInfo *info = readConnectInfo(L, connectionIndex);
+		if ( info && info->L == L ) {
+			connectionResumeYields(info);
+		}
+		lua_settop(L, connectionIndex - 1);
+	}
+	for ( index = 1; index <= size; index ++ ) {
+		lua_rawgeti(L, 1, index);
+		int connectionIndex = lua_gettop(L);
+		ConnectInfo *info = readConnectInfo(L, connectionIndex);
+		connectionRaiseError(L, info);
+		lua_settop(L, connectionIndex - 1);
+	}
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+
+/***
+Return a random uuid.
+@function generateUUID
+@tparam[opt='uuid-batched'] string strategy Use 'uuid' to call uuid_generate for every uuid, or 'uuid-batched' to 
+make the uuids from a block of random bytes that is read once for every 32 uuids.
+@treturn string random uuid
+
+*/
+static int luaGenerateUUID(lua_State *L)
+{
+	// one generator per thread, as each lua state may be running on its own thread
+	static _Thread_local MessageIdGenerator batchGenerator;
+	static _Thread_local bool isBatchGeneratorReady = false;
+	MessageIdGenerator uuidGenerator;
+	MessageIdGenerator *generator = &batchGenerator;
+	char buffer[MESSAGE_ID_BUFFER_SIZE];
+	
+	if ( lua_isstring(L, 1) && strcasecmp(lua_tostring(L, 1), "uuid") == 0 ) {
+		messageIdInit(&uuidGenerator, MESSAGE_ID_UUID);
+		generator = &uuidGenerator;
+	}
+	else if ( !isBatchGeneratorReady ) {
+		messageIdInit(&batchGenerator, MESSAGE_ID_UUID_BATCHED);
+		isBatchGeneratorReady = true;
+	}
+	size_t length = messageIdNext(generator, buffer);
+	lua_pushlstring(L, buffer, length);
+	return 1;
+}
+
+/***
+Return the current library version.
+@function info
+@treturn string Library version string
+
+*/
+static int luaLibInfo (lua_State *L) 
+{
+	lua_pushstring(L, "luaazureiothub version 0.1");  
+	return 1;
+}
+
+/***
+Callback Functions.
+These functions are called from the library to send back data and return status of sent messages from the Iot Hub.
+@section Callbacks
+
+*/
+
+
+/***
+Callback function to read messages sent from the IotHub.
+You need to create a function with these parameters and pass the function as a parameter to the @{connect} function.
+@function processRead
+@tparam message message The @{message} table sent from the IotHub.
+@treturn integer You can return values from the static table @{messageReceive}, to accept or reject the message.
+If you do not return a valid integer then the library will return messageReceive.ACCEPTED as default.
+
+*/
+
+
+/***
+Callback function to accept a sent message.
+You need to create a function with these parameters and pass the function as a parameter to the @{connect} function.
+@function processSent
+@tparam integer status The status of the sent message, see the static table @{messageSend} for the possible values.
+@tparam message message A copy of the @{message} that has been sent. This message has been re-encoded from the C library
+so it will not have any extra fields added when used in the @{sendMessage} function.
+@tparam number sequence The sequence number returned by @{sendMessage} for this message. When more than one message
+is in flight the confirmations can arrive in any order, so use this to match them up.
+
+*/
+
+/***
+Callback function for the connection status, only called when the connect option __autoReconnect__ is set.
+@function processStatus
+@tparam integer status The new status, see the static table @{connectionStatus}.
+@tparam string reason 'renew' when the client is replaced before the session keys expire, 'errors' after failed 
+confirmations, or the error message when the status is DISCONNECTED.
+
+*/
+
+/***
+Callback function to resume a coroutine that is waiting in @{sendMessageYield}.
+If this function is passed in the @{connect} table the connection does not resume the coroutine itself when its
+message is confirmed or times out, so a scheduler can resume the coroutine along with the others it runs. It is 
+called once the SDK work has returned, and an error from it is counted in @{stats} instead of being raised.
+@function processResume
+@tparam thread coroutine The coroutine to resume.
+@param ... The result of the send, which @{sendMessageYield} returns when the coroutine is resumed whatever values 
+it is resumed with.
+
+@usage
+local processResume = function(co, ...)
+  scheduler.ready(co, ...)
+end
+*/
+
+/***
+Callback function to read a batch of messages sent from the IotHub.
+If this function is passed in the @{connect} table it is used instead of @{processRead}. Received messages are held 
+by the library and passed in one call at the end of each loop cycle, or once the oldest message has waited for the
+connect option __readBatchDelayMs__.
+
+The SDK needs an answer as soon as each message arrives, so messages are accepted when they are held. If the 
+batch is full, incoming messages are abandoned so the IotHub sends them again later.
+@function processReadBatch
+@tparam table messages Array of @{message} tables, in the order they were received.
+@treturn table Array of values from the static table @{messageReceive}, one for each message. A message returned 
+as messageReceive.ABANDONED is kept and passed again in the next batch. It has already been accepted by the 
+IotHub, so a message is passed in at most three batches and then dropped and counted in @{stats}. Any other value, or no value, drops the 
+message. If the function raises an error every message in the batch counts as abandoned.
+
+@usage
+local processReadBatch = function(messages)
+  local results = {}
+  for index, message in ipairs(messages) do
+    results[index] = handleCommand(message) and luaazureiothub.messageReceive.ACCEPTED or luaazureiothub.messageReceive.ABANDONED
+  end
+  return results
+end
+*/
+
+/***
+IotHub Class.
+This class is returned by the @{connect} function.
+@section IotHub
+
+*/
+
+/***
+Disconnect from the iothub
+@function iotHub:disconnect
+@treturn boolean True if succesfull in disconecting
+
+*/
+static int luaDisconnect(lua_State *L)
+{
+	ConnectInfo *info = readConnectInfo(L, 1);
+	if ( info ) {
+		info->L = L;
+		connectionClose(info);
+		connectionResumeYields(info);
+		lua_getfield(L, 1, "isConnect");
+		if ( lua_isboolean(L, -1) ) {
+			lua_pushvalue(L, 1);
+			lua_pushstring(L, "isConnect");
+			lua_pushboolean(L, 0);
+			lua_settable(L, -3);
+		}
+		lua_pop(L, 2);			// isConnect field, info user data
+	}
+	connectionRaiseError(L, info);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+
+/***
+Sends a message to the Azure IotHub
+@function iotHub:sendMessage
+@tparam table,string message Mesasge to send, this field can be a string or a @{message}  table. If you use a string then
+message sent will be a simple message with string encoding. This can also be a template made by @{messageTemplate},
+in which case the next parameter is the message body string and the timeoutSeconds follow it.
+@tparam[opt=240] number timeoutSeconds Number of seconds to wait for the Ack reply to be recieved from the IotHub, fractions
+of a second can be used.
+
+if the timeoutSeconds == 0, then this function will return as soon as the message has been sent. It is up to the calling
+code to then call the @{loop} function to wait for the message ack to be sent back from the IotHub.
+
+If the send window set by the connect option __maxInFlight__ is full, the message is queued and sent as soon as
+a confirmation frees up a slot.
+
+@treturn boolean,number True if successfully sent (or queued) the message, and the sequence number of the message. 
+The same sequence number is passed to the @{processSent} callback.
+@treturn boolean,string,integer False with the error message, and extra error code returned from the call to send message. 
+See the static values in the table @{clientResult} for the error codes returned.
+
+*/
+
+/*
+ Give the message a new id from the connection id generator.
+*/
+static void setNewMessageId(MessageIdGenerator *idGenerator, IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	char buffer[MESSAGE_ID_BUFFER_SIZE];
+	messageIdNext(idGenerator, buffer);
+	IoTHubMessage_SetMessageId(messageHandle, buffer);	
+}
+
+/*
+ Read the compress field of the message or template table at 'index'. Returns false with an error message pushed
+ on the stack if the value is not a known encoding.
+*/
+static bool readCompressField(lua_State *L, int index, bool *isCompress)
+{
+	lua_getfield(L, index, "compress");
+	*isCompress = !lua_isnil(L, -1);
+	if ( *isCompress && !( lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), COMPRESS_ENCODING_DEFLATE) == 0 ) ) {
+		lua_pop(L, 1);
+		lua_pushstring(L, "message.compress can only be 'deflate'");
+		return false;
+	}
+	lua_pop(L, 1);
+	return true;
+}
+
+/*
+ Compress the body with the connection compressor if it is long enough and gets smaller. Returns true with 'body' and
+ 'bodyLength' changed to the compressed data, which is only valid until the next message is compressed.
+*/
+static bool compressMessageBody(ConnectInfo *info, const char **body, size_t *bodyLength)
+{
+	const unsigned char *output;
+	size_t outputLength;
+	if ( *bodyLength < info->compressMinBytes || !compressorDeflate(&info->compressor, *body, *bodyLength, &output, &outputLength) ) {
+		return false;
+	}
+	*body = (const char *) output;
+	*bodyLength = outputLength;
+	return true;
+}
+
+/*
+ Set the content encoding property on a message with a compressed body, this is done after the other properties so 
+ that it cannot be overwritten. Returns false with an error message pushed on the stack on failure.
+*/
+static bool setContentEncoding(lua_State *L, IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	if ( Map_AddOrUpdate(IoTHubMessage_Properties(messageHandle), COMPRESS_ENCODING_PROPERTY, COMPRESS_ENCODING_DEFLATE) != MAP_OK ) {
+		lua_pushstring(L, "Cannot assign message property " COMPRESS_ENCODING_PROPERTY);
+		return false;
+	}
+	return true;
+}
+
+static bool encodeBodyValue(lua_State *L, Encoder *encoder, EncodeFormat format, int index, int depth);
+
+/*
+ Encode the number or string key at the top of the stack, JSON object keys are always strings.
+*/
+static bool encodeBodyKey(lua_State *L, Encoder *encoder, EncodeFormat format, int index)
+{
+	int keyType = lua_type(L, index);
+	if ( keyType == LUA_TSTRING ) {
+		return encodeBodyValue(L, encoder, format, index, 0);
+	}
+	if ( keyType != LUA_TNUMBER ) {
+		lua_pushfstring(L, "Cannot encode a %s key in message.body", lua_typename(L, keyType));
+		return false;
+	}
+	if ( format == ENCODE_FORMAT_CBOR ) {
+		return encodeBodyValue(L, encoder, format, index, 0);
+	}
+	if ( !encoderAppend(encoder, "\"", 1) || !encodeBodyValue(L, encoder, format, index, 0) ) {
+		return false;
+	}
+	if ( !encoderAppend(encoder, "\"", 1) ) {
+		lua_pushstring(L, "message.body is too large");
+		return false;
+	}
+	return true;
+}
+
+/*
+ Encode the table at the absolute stack 'index'. A table with only the keys 1..n is an array, an empty table is an
+ empty array, any other table is an object.
+*/
+static bool encodeBodyTable(lua_State *L, Encoder *encoder, EncodeFormat format, int index, int depth)
+{
+	size_t arrayLength = lua_rawlen(L, index);
+	size_t keyCount = 0;
+	bool isArray = true;
+	bool isFirst = true;
+	size_t arrayIndex;
+
+	if ( depth >= ENCODE_MAX_DEPTH ) {
+		lua_pushstring(L, "message.body is nested too deeply");
+		return false;
+	}
+	if ( !lua_checkstack(L, 4) ) {
+		lua_pushstring(L, "Out of memory");
+		return false;
+	}
+	lua_pushnil(L);
+	while ( lua_next(L, index) != 0 ) {
+		lua_Number key = lua_tonumber(L, -2);
+		if ( lua_type(L, -2) != LUA_TNUMBER || key < 1 || key > arrayLength || key != (lua_Number) (size_t) key ) {
+			isArray = false;
+		}
+		keyCount ++;
+		lua_pop(L, 1);
+	}
+	isArray = isArray && keyCount == arrayLength;
+
+	if ( isArray ) {
+		if ( ( format == ENCODE_FORMAT_JSON && !encoderAppend(encoder, "[", 1) ) 
+				|| ( format == ENCODE_FORMAT_CBOR && !encoderCborHead(encoder, CBOR_MAJOR_ARRAY, arrayLength) ) ) {
+			lua_pushstring(L, "message.body is too large");
+			return false;
+		}
+		for ( arrayIndex = 1; arrayIndex <= arrayLength; arrayIndex ++ ) {
+			if ( format == ENCODE_FORMAT_JSON && arrayIndex > 1 && !encoderAppend(encoder, ",", 1) ) {
+				lua_pushstring(L, "message.body is too large");
+				return false;
+			}
+			lua_rawgeti(L, index, arrayIndex);
+			if ( !encodeBodyValue(L, encoder, format, lua_gettop(L), depth + 1) ) {
+				return false;
+			}
+			lua_pop(L, 1);
+		}
+		if ( format == ENCODE_FORMAT_JSON && !encoderAppend(encoder, "]", 1) ) {
+			lua_pushstring(L, "message.body is too large");
+			return false;
+		}
+		return true;
+	}
+	
+	if ( ( format == ENCODE_FORMAT_JSON && !encoderAppend(encoder, "{", 1) ) 
+			|| ( format == ENCODE_FORMAT_CBOR && !encoderCborHead(encoder, CBOR_MAJOR_MAP, keyCount) ) ) {
+		lua_pushstring(L, "message.body is too large");
+		return false;
+	}
+	lua_pushnil(L);
+	while ( lua_next(L, index) != 0 ) {
+		int top = lua_gettop(L);
+		if ( format == ENCODE_FORMAT_JSON && !isFirst && !encoderAppend(encoder, ",", 1) ) {
+			lua_pushstring(L, "message.body is too large");
+			return false;
+		}
+		isFirst = false;
+		if ( !encodeBodyKey(L, encoder, format, top - 1) ) {
+			return false;
+		}
+		if ( format == ENCODE_FORMAT_JSON && !encoderAppend(encoder, ":", 1) ) {
+			lua_pushstring(L, "message.body is too large");
+			return false;
+		}
+		if ( !encodeBodyValue(L, encoder, format, top, depth + 1) ) {
+			return false;
+		}
+		lua_pop(L, 1);
+	}
+	if ( format == ENCODE_FORMAT_JSON && !encoderAppend(encoder, "}", 1) ) {
+		lua_pushstring(L, "message.body is too large");
+		return false;
+	}
+	return true;
+}
+
+/*
+ Encode the value at the absolute stack 'index'. Returns false with an error message pushed on the stack, which can
+ be left with other values above 'index', see encodeMessageBody.
+*/
+static bool encodeBodyValue(lua_State *L, Encoder *encoder, EncodeFormat format, int index, int depth)
+{
+	bool isDone = false;
+	size_t length;
+	const char *text;
+	lua_Number number;
+	
+	switch ( lua_type(L, index) ) {
+		case LUA_TTABLE:
+			return encodeBodyTable(L, encoder, format, index, depth);
+		case LUA_TSTRING:
+			text = lua_tolstring(L, index, &length);
+			isDone = format == ENCODE_FORMAT_JSON ? encoderJsonString(encoder, text, length) : encoderCborString(encoder, text, length);
+			break;
+		case LUA_TNUMBER:
+			number = lua_tonumber(L, index);
+			if ( format == ENCODE_FORMAT_JSON && ( number != number || number - number != 0 ) ) {
+				lua_pushstring(L, "Cannot encode nan or inf in json");
+				return false;
+			}
+			isDone = format == ENCODE_FORMAT_JSON ? encoderJsonNumber(encoder, number) : encoderCborNumber(encoder, number);
+			break;
+		case LUA_TBOOLEAN:
+			if ( format == ENCODE_FORMAT_JSON ) {
+				isDone = lua_toboolean(L, index) ? encoderAppend(encoder, "true", 4) : encoderAppend(encoder, "false", 5);
+			}
+			else {
+				isDone = encoderCborHead(encoder, CBOR_MAJOR_SIMPLE, lua_toboolean(L, index) ? CBOR_SIMPLE_TRUE : CBOR_SIMPLE_FALSE);
+			}
+			break;
+		case LUA_TLIGHTUSERDATA:
+			// luaazureiothub.null
+			if ( lua_touserdata(L, index) == NULL ) {
+				isDone = format == ENCODE_FORMAT_JSON ? encoderAppend(encoder, "null", 4) : encoderCborHead(encoder, CBOR_MAJOR_SIMPLE, CBOR_SIMPLE_NULL);
+				break;
+			}
+			// fall through
+		default:
+			lua_pushfstring(L, "Cannot encode a %s in message.body", luaL_typename(L, index));
+			return false;
+	}
+	if ( !isDone ) {
+		lua_pushstring(L, "message.body is too large");
+	}
+	return isDone;
+}
 
+/*
+ Encode the body field of the @{message} table at 'index' into the connection encoder, in the format of its encoding
+ field. Returns false with an error message pushed on the stack on failure.
+*/
+static bool encodeMessageBody(lua_State *L, ConnectInfo *info, int index)
+{
+	EncodeFormat format = ENCODE_FORMAT_JSON;
+	int top = lua_gettop(L);
+	
+	index = lua_absindex(L, index);
+	lua_getfield(L, index, "encoding");
+	if ( lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "cbor") == 0 ) {
+		format = ENCODE_FORMAT_CBOR;
+	}
+	else if ( !lua_isnil(L, -1) && !( lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "json") == 0 ) ) {
+		lua_pop(L, 1);
+		lua_pushstring(L, "message.encoding can only be 'json' or 'cbor'");
+		return false;
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, index, "body");
+	if ( !lua_istable(L, -1) ) {
+		lua_pop(L, 1);
+		lua_pushstring(L, "message.body must be a table");
+		return false;
+	}
+	encoderReset(&info->encoder);
+	if ( !encodeBodyValue(L, &info->encoder, format, top + 1, 0) ) {
+		// drop what the walk left on the stack, and keep the error message
+		lua_insert(L, top + 1);
+		lua_settop(L, top + 1);
+		return false;
+	}
+	lua_pop(L, 1);
+	return true;
+}
 
-	nil                   Use the length field too decide which encoding too use string or byte.
-	contentType.BYTE      Always encode using byte encoding.
-	contentType.STRING    Always encode using string encoding.
+/*
+ Create a SDK message from the string or @{message} table at the stack 'index'. Returns NULL with an error message 
+ pushed on the stack if the message cannot be created.
+*/
+static IOTHUB_MESSAGE_HANDLE createMessage(lua_State *L, int index, ConnectInfo *info)
+{
+	IOTHUB_MESSAGE_HANDLE messageHandle = NULL;
+	IOTHUBMESSAGE_CONTENT_TYPE contentType = IOTHUBMESSAGE_STRING;
+	const char *messageText = NULL;
+	size_t messageTextLength = 0;
+	bool isMessageValid = false;
+	bool isCompress = false;
+	bool isCompressed = false;
+	bool isBody = false;
+	
+	// check to see if the param is a string
+	if ( lua_isstring(L, index) ) {
+		messageText = lua_tolstring(L, index, &messageTextLength);
+		contentType = IOTHUBMESSAGE_STRING;
+		isMessageValid = true;
+	}
+	
+	// check to see if the param is a message table
+	if ( lua_istable(L, index) ) {
+		
+		// message.body, encoded into the connection encoder buffer and always sent as bytes
+		lua_getfield(L, index, "body");
+		isBody = !lua_isnil(L, -1);
+		lua_pop(L, 1);
+		if ( isBody ) {
+			if ( !encodeMessageBody(L, info, index) ) {
+				return NULL;
+			}
+			messageText = (const char *) info->encoder.buffer;
+			messageTextLength = info->encoder.length;
+			contentType = IOTHUBMESSAGE_BYTEARRAY;
+		}
+		
+		// message.text
+		lua_getfield(L, index, "text");
+		if ( !isBody && !lua_isstring(L, -1) ) {
+			lua_pop(L, 1);
+			lua_pushstring(L, "message.text or message.body must be used");
+			return NULL;			
+		}
+		// the text stays referenced by the message table, so it is safe to use after the pop
+		if ( !isBody ) {
+			messageText = lua_tolstring(L, -1, &messageTextLength);
+		}
+		lua_pop(L, 1);			// remove text field
+
+		// message.length
+		lua_getfield(L, index, "length");
+		if ( !isBody && lua_isnumber(L, -1) ) {
+			contentType = IOTHUBMESSAGE_BYTEARRAY;
+			if ( lua_tointeger(L, -1) >= 0 && (size_t) lua_tointeger(L, -1) < messageTextLength ) {
+				messageTextLength = lua_tointeger(L, -1);
+			}
+		}
+		lua_pop(L, 1);			// remove length field
 
-@tfield string,nil id Message id, if set to nil, then the @{sendMessage} function will automatically assign a random uuid									
-@tfield string,nil correlationId You can read/write the correlationId.						
-@tfield table,nil property Set of name="Value" pairs as property values to send with the message.
-  
-@usage
--- basic text message
-local message = {
-  text = 'Basic text message'
-} 
--- sends out the message
-iothub:sendMessage(message)
--- also sends out the same message above
-iothub:sendMessage('Basic text message')
 
--- basic data message with a fixed length of 12
-local message = {
-  text = 'Basic data message',
-  length = 12
-} 
+		// message.contentType
+		lua_getfield(L, index, "contentType");
+		if ( !isBody && lua_isnumber(L, -1) ) {
+			contentType = lua_tointeger(L, -1);
+			if ( ! ( contentType == IOTHUBMESSAGE_BYTEARRAY || contentType == IOTHUBMESSAGE_STRING ) ) {
+				contentType = IOTHUBMESSAGE_BYTEARRAY;
+			}
+		}
+		lua_pop(L, 1);		// remove contentType field
+		
+		// message.compress
+		if ( !readCompressField(L, index, &isCompress) ) {
+			return NULL;
+		}
+		isMessageValid = true;
+		
+	}
+	if ( ! isMessageValid) {
+		lua_pushstring(L, "message must be a string or table");
+		return NULL;
+	}
+	
+	// a compressed body is always sent as bytes
+	if ( isCompress && compressMessageBody(info, &messageText, &messageTextLength) ) {
+		contentType = IOTHUBMESSAGE_BYTEARRAY;
+		isCompressed = true;
+	}
+	
+	if ( contentType == IOTHUBMESSAGE_BYTEARRAY ) {
+		messageHandle = IoTHubMessage_CreateFromByteArray((const unsigned char *) messageText, messageTextLength);
+		if ( messageHandle == NULL ) {
+			lua_pushstring(L, "Cannot create binary message");
+			return NULL;
+		}
+	}
+	if ( contentType == IOTHUBMESSAGE_STRING ) {
+		messageHandle = IoTHubMessage_CreateFromString(messageText);
+		if ( messageHandle == NULL ) {
+			lua_pushstring(L, "Cannot create string message");
+			return NULL;
+		}
+	}
 
--- forced text message to always send out 12 character string
-local message = {
-  text = 'Basic data message',
-  length = 12,
-  contentType = luaazureiothub.contentType.STRING,
-} 
+	// last check to see if we have a message
+	if ( messageHandle == NULL ) {
+		lua_pushstring(L, "Cannot create message");
+		return NULL;
+	}
+	
 
--- string message with a property value of 'messageType', and a special message id
-local message = {
-  text = 'Basic text message',
+	// check to see if the param is a message table
+	if ( lua_istable(L, index) ) {			
+		// now set the message using with the messageHandle
+		// message.id
+
+		lua_getfield(L, index, "id");
+		if ( lua_isstring(L, -1) ) {
+			IoTHubMessage_SetMessageId(messageHandle, lua_tostring(L, -1) );	
+		}
+		else {
+			setNewMessageId(&info->idGenerator, messageHandle);
+		}
+		lua_pop(L, 1);			// remove id field
+
+		// correlationId			
+		lua_getfield(L, index, "correlationId");
+		if ( lua_isstring(L, -1) ) {
+			IoTHubMessage_SetCorrelationId(messageHandle, lua_tostring(L, -1));	
+		}
+		lua_pop(L, 1);			// remove correlationId field
+		
+
+		// property			
+		lua_getfield(L, index, "property");
+		if ( lua_istable(L, -1) ) {
+			MAP_HANDLE propertyMap = IoTHubMessage_Properties(messageHandle);		
+			lua_pushnil(L);  // first key
+			while (lua_next(L, -2) != 0) {
+				// uses 'key' (at index -2) and 'value' (at index -1)
+				const char *propertyName;
+				const char *propertyValue;
+				propertyName = lua_tostring(L, -2);
+				propertyValue = lua_tostring(L, -1);
+				if (Map_AddOrUpdate(propertyMap, propertyName, propertyValue) != MAP_OK) {
+					IoTHubMessage_Destroy(messageHandle);	
+					lua_pushfstring(L, "Cannot assign message property %s=%s", propertyName, propertyValue);
+					lua_replace(L, -4);		// replace the property table with the error, drop key and value
+					lua_pop(L, 2);
+					return NULL;					
+				}		
+				// removes 'value'; keeps 'key' for next iteration
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1); 		// remove property field
+	}
+	if ( isCompressed && !setContentEncoding(L, messageHandle) ) {
+		IoTHubMessage_Destroy(messageHandle);
+		return NULL;
+	}
+	return messageHandle;
+}
+
+static void freeMessageTemplate(MessageTemplate *messageTemplate)
+{
+	size_t index;
+	for ( index = 0; index < messageTemplate->propertyCount; index ++ ) {
+		free(messageTemplate->propertyNames[index]);
+		free(messageTemplate->propertyValues[index]);
+	}
+	free(messageTemplate->propertyNames);
+	free(messageTemplate->propertyValues);
+	free(messageTemplate->correlationId);
+	memset(messageTemplate, 0, sizeof(MessageTemplate));
+}
+
+static int luaMessageTemplateGC(lua_State *L)
+{
+	MessageTemplate *messageTemplate = lua_touserdata(L, 1);
+	if ( messageTemplate ) {
+		freeMessageTemplate(messageTemplate);
+	}
+	return 0;
+}
+
+/*
+ Copy the properties from the table at the top of the stack into the template. They are checked by adding them to
+ a SDK map, so any name or value the SDK would refuse is reported now rather than on each send. Returns false with
+ an error message pushed on the stack on failure.
+*/
+static bool readTemplateProperties(lua_State *L, MessageTemplate *messageTemplate)
+{
+	const char * const *names;
+	const char * const *values;
+	size_t count;
+	size_t index;
+	MAP_HANDLE propertyMap = Map_Create(NULL);
+	
+	if ( propertyMap == NULL ) {
+		lua_pushstring(L, "Out of memory");
+		return false;
+	}
+	lua_pushnil(L);
+	while ( lua_next(L, -2) != 0 ) {
+		// copy the key so that lua_tostring does not change the key used by lua_next
+		lua_pushvalue(L, -2);
+		const char *propertyName = lua_tostring(L, -1);
+		const char *propertyValue = lua_tostring(L, -2);
+		if ( propertyName == NULL || propertyValue == NULL || Map_AddOrUpdate(propertyMap, propertyName, propertyValue) != MAP_OK ) {
+			lua_pushfstring(L, "Cannot assign message property %s=%s", propertyName ? propertyName : "?", propertyValue ? propertyValue : "?");
+			lua_replace(L, -4);
+			lua_pop(L, 2);
+			Map_Destroy(propertyMap);
+			return false;
+		}
+		lua_pop(L, 2);
+	}
+	
+	if ( Map_GetInternals(propertyMap, &names, &values, &count) != MAP_OK ) {
+		Map_Destroy(propertyMap);
+		lua_pushstring(L, "Cannot read message properties");
+		return false;
+	}
+	messageTemplate->propertyNames = calloc(count + 1, sizeof(char *));
+	messageTemplate->propertyValues = calloc(count + 1, sizeof(char *));
+	if ( messageTemplate->propertyNames == NULL || messageTemplate->propertyValues == NULL ) {
+		Map_Destroy(propertyMap);
+		lua_pushstring(L, "Out of memory");
+		return false;
+	}
+	for ( index = 0; index < count; index ++ ) {
+		messageTemplate->propertyNames[index] = strdup(names[index]);
+		messageTemplate->propertyValues[index] = strdup(values[index]);
+		messageTemplate->propertyCount ++;
+		if ( messageTemplate->propertyNames[index] == NULL || messageTemplate->propertyValues[index] == NULL ) {
+			Map_Destroy(propertyMap);
+			lua_pushstring(L, "Out of memory");
+			return false;
+		}
+	}
+	Map_Destroy(propertyMap);
+	return true;
+}
+
+/***
+Create a message template.
+
+A template holds the message settings that are the same for many messages. The properties are checked and 
+copied once when the template is made, so sending with a template does not have to read a lua table for each message.
+
+@function messageTemplate
+@tparam table settings Table with any of the fields __property__, __correlationId__, __contentType__ and __compress__, 
+these are the same as the fields in the @{message} table.
+@return messageTemplate object to pass to @{sendMessage}.
+@treturn false, errorMessage False and an error message if the template cannot be made.
+
+@usage
+local template = luaazureiothub.messageTemplate{
   property = {
-     messageType='event',
+    messageType = 'telemetry',
+    schemaVersion = '2',
+    siteId = 'site-42',
   },
-  id = 'My test id',
-} 
+}
+iothub:sendMessage(template, '{"temperature":21.5}', 0)
+*/
+static int luaMessageTemplate(lua_State *L)
+{
+	if ( !lua_istable(L, 1) ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Parameter #1 must be a table");
+		return 2;
+	}
+	lua_settop(L, 1);
+	MessageTemplate *messageTemplate = lua_newuserdata(L, sizeof(MessageTemplate));		// at index 2
+	memset(messageTemplate, 0, sizeof(MessageTemplate));
+	luaL_setmetatable(L, MESSAGE_TEMPLATE_METATABLE_NAME);
+	messageTemplate->contentType = IOTHUBMESSAGE_STRING;
+	
+	lua_getfield(L, 1, "contentType");
+	if ( lua_isnumber(L, -1) ) {
+		messageTemplate->contentType = lua_tointeger(L, -1);
+		if ( ! ( messageTemplate->contentType == IOTHUBMESSAGE_BYTEARRAY || messageTemplate->contentType == IOTHUBMESSAGE_STRING ) ) {
+			messageTemplate->contentType = IOTHUBMESSAGE_BYTEARRAY;
+		}
+	}
+	lua_pop(L, 1);
+	
+	if ( !readCompressField(L, 1, &messageTemplate->isCompress) ) {
+		lua_pushboolean(L, 0);
+		lua_insert(L, -2);
+		return 2;
+	}
+	
+	lua_getfield(L, 1, "correlationId");
+	if ( lua_isstring(L, -1) ) {
+		messageTemplate->correlationId = strdup(lua_tostring(L, -1));
+		if ( messageTemplate->correlationId == NULL ) {
+			return luaL_error(L, "Out of memory");
+		}
+	}
+	lua_pop(L, 1);
+	
+	lua_getfield(L, 1, "property");
+	if ( lua_istable(L, -1) ) {
+		if ( !readTemplateProperties(L, messageTemplate) ) {
+			// the template is released by the garbage collector
+			lua_pushboolean(L, 0);
+			lua_insert(L, -2);
+			return 2;
+		}
+	}
+	lua_pop(L, 1);
+	return 1;
+}
+
+/*
+ Create a SDK message from the template at 'index' with the body string at 'bodyIndex'. Returns NULL with an 
+ error message pushed on the stack if the message cannot be created.
+*/
+static IOTHUB_MESSAGE_HANDLE createTemplateMessage(lua_State *L, int index, int bodyIndex, ConnectInfo *info)
+{
+	MessageTemplate *messageTemplate = luaL_checkudata(L, index, MESSAGE_TEMPLATE_METATABLE_NAME);
+	IOTHUB_MESSAGE_HANDLE messageHandle;
+	size_t bodyLength;
+	size_t propertyIndex;
+	
+	if ( !lua_isstring(L, bodyIndex) ) {
+		lua_pushstring(L, "message body must be a string");
+		return NULL;
+	}
+	const char *body = lua_tolstring(L, bodyIndex, &bodyLength);
+	bool isCompressed = messageTemplate->isCompress && compressMessageBody(info, &body, &bodyLength);
+	if ( messageTemplate->contentType == IOTHUBMESSAGE_BYTEARRAY || isCompressed ) {
+		messageHandle = IoTHubMessage_CreateFromByteArray((const unsigned char *) body, bodyLength);
+	}
+	else {
+		messageHandle = IoTHubMessage_CreateFromString(body);
+	}
+	if ( messageHandle == NULL ) {
+		lua_pushstring(L, "Cannot create message");
+		return NULL;
+	}
+	setNewMessageId(&info->idGenerator, messageHandle);
+	if ( messageTemplate->correlationId ) {
+		IoTHubMessage_SetCorrelationId(messageHandle, messageTemplate->correlationId);
+	}
+	if ( messageTemplate->propertyCount > 0 ) {
+		MAP_HANDLE propertyMap = IoTHubMessage_Properties(messageHandle);
+		for ( propertyIndex = 0; propertyIndex < messageTemplate->propertyCount; propertyIndex ++ ) {
+			// the names were checked and made unique when the template was made
+			if ( Map_Add(propertyMap, messageTemplate->propertyNames[propertyIndex], messageTemplate->propertyValues[propertyIndex]) != MAP_OK ) {
+				IoTHubMessage_Destroy(messageHandle);
+				lua_pushstring(L, "Cannot assign message property");
+				return NULL;
+			}
+		}
+	}
+	if ( isCompressed && !setContentEncoding(L, messageHandle) ) {
+		IoTHubMessage_Destroy(messageHandle);
+		return NULL;
+	}
+	return messageHandle;
+}
+
+/*
+ Take a send record for the message from the pool, give it the next sequence number of the connection and add it to
+ the in flight table. Returns NULL if out of memory.
+*/
+static SendCallbackInfo *newSendCallbackInfo(ConnectInfo *info, IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	SendCallbackInfo *sendCallbackInfo = sendPoolTake(&info->sendPool);
+	if ( sendCallbackInfo == NULL ) {
+		return NULL;
+	}
+	sendCallbackInfo->messageHandle = messageHandle;
+	sendCallbackInfo->messageId = NULL;
+	sendCallbackInfo->syncStatus = NULL;
+	sendCallbackInfo->next = NULL;
+	sendCallbackInfo->clientHandle = NULL;
+	sendCallbackInfo->info = info;
+	sendCallbackInfo->sequence = ++ info->lastSequence;
+	sendCallbackInfo->journalOffset = JOURNAL_NO_RECORD;
+	sendCallbackInfo->members = NULL;
+	sendCallbackInfo->sendTimeNs = statsTimeNowNs();
+	sendCallbackInfo->state = SEND_STATE_QUEUED;
+	sendCallbackInfo->yieldWait = NULL;
+	
+	const char *messageId = IoTHubMessage_GetMessageId(messageHandle);
+	if ( messageId ) {
+		size_t length = strlen(messageId);
+		if ( length < SEND_ID_INLINE_SIZE ) {
+			memcpy(sendCallbackInfo->messageIdBuffer, messageId, length + 1);
+			sendCallbackInfo->messageId = sendCallbackInfo->messageIdBuffer;
+		}
+		else {
+			info->sendPool.missCount ++;
+			sendCallbackInfo->messageId = strdup(messageId);
+		}
+	}
+	if ( !inFlightAdd(&info->inFlight, sendCallbackInfo->sequence, sendCallbackInfo->messageId, sendCallbackInfo) ) {
+		sendPoolRelease(sendCallbackInfo);
+		return NULL;
+	}
+	return sendCallbackInfo;
+}
+
+/*
+ Push the values returned by a sync send, 'isDone' is false if the message was not confirmed in time. Returns the
+ number of values pushed.
+*/
+static int pushSendResult(lua_State *L, bool isDone, IOTHUB_CLIENT_CONFIRMATION_RESULT result, unsigned long long sequence)
+{
+	if ( !isDone ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "timeout");
+		return 2;
+	}
+	if ( result == IOTHUB_CLIENT_CONFIRMATION_OK ) {
+		lua_pushboolean(L, 1);
+		lua_pushnumber(L, sequence);
+		return 2;
+	}
+	lua_pushboolean(L, 0);
+	lua_pushfstring(L, "Cannot send message, received: %s", ENUM_TO_STRING(IOTHUB_CLIENT_CONFIRMATION_RESULT, result));
+	lua_pushinteger(L, result);
+	return 3;
+}
+
+/*
+ Send the record now if there is room in the send window, else queue it up behind the others. Returns the result of
+ a send tried straight away, on failure the record has not been queued and is still owned by the caller.
+*/
+static IOTHUB_CLIENT_RESULT connectionSendOrQueue(ConnectInfo *info, SendCallbackInfo *sendCallbackInfo)
+{
+	if ( info->inFlightCount < info->maxInFlight && info->queueHead == NULL && info->retryHead == NULL 
+			&& !info->isJournalReplaying && !info->isReconnecting ) {
+		return connectionSubmit(info, sendCallbackInfo);
+	}
+	connectionQueue(info, sendCallbackInfo);
+	return IOTHUB_CLIENT_OK;
+}
+
+/*
+ Make the message from the parameters at index 2 onwards, and send it now if there is room in the send window, else
+ queue it up behind the others. If 'syncStatus' is set it is updated once the message is confirmed. Returns 0 with
+ the send record in *sent, or the number of values pushed for the error.
+*/
+static int connectionSendMessage(lua_State *L, ConnectInfo *info, SyncSendStatus *syncStatus, SendCallbackInfo **sent)
+{
+	SendCallbackInfo *sendCallbackInfo;
+	
+	if ( info->inFlightCount >= info->maxInFlight && info->queuedCount >= info->maxQueued ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Busy");
+		return 2;			
+	}
+	
+	bool isTemplate = luaL_testudata(L, 2, MESSAGE_TEMPLATE_METATABLE_NAME) != NULL;
+	if ( !( lua_isstring(L, 2) || lua_istable(L, 2) || isTemplate ) ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Parameter #2 must be a string, table or message template");
+		return 2;
+	}
+	
+	IOTHUB_MESSAGE_HANDLE messageHandle = isTemplate ? createTemplateMessage(L, 2, 3, info) : createMessage(L, 2, info);
+	if ( messageHandle == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_insert(L, -2);			// false, errorMessage
+		return 2;
+	}
+	
+	sendCallbackInfo = newSendCallbackInfo(info, messageHandle);
+	if ( sendCallbackInfo == NULL ) {
+		IoTHubMessage_Destroy(messageHandle);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Out of memory");
+		return 2;
+	}
+	if ( !connectionJournalSend(info, sendCallbackInfo) ) {
+		IoTHubMessage_Destroy(messageHandle);
+		sendPoolRelease(sendCallbackInfo);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Journal full");
+		return 2;
+	}
+	sendCallbackInfo->syncStatus = syncStatus;
+	
+	// a message that cannot join the open envelope sends it first, so the messages stay in order, and a sync
+	// send does not wait for the coalesce delay
+	bool isCoalesced = false;
+	if ( info->coalesceDelayMs > 0 ) {
+		isCoalesced = connectionCoalesce(info, sendCallbackInfo);
+		if ( !isCoalesced || syncStatus ) {
+			connectionFlushCoalesced(info);
+		}
+	}
+			
+	// send the message now if there is room in the send window, else queue it up behind the others
+	if ( isCoalesced ) {
+		// sent in the envelope, see connectionFlushCoalesced
+	}
+	else {
+		IOTHUB_CLIENT_RESULT result = connectionSendOrQueue(info, sendCallbackInfo);
+		if ( result != IOTHUB_CLIENT_OK ) {
+			// the caller is told the message was not sent, so it is not kept in the journal
+			connectionJournalAck(info, sendCallbackInfo);
+		    IoTHubMessage_Destroy(sendCallbackInfo->messageHandle);	
+		    sendPoolRelease(sendCallbackInfo);
+			lua_pushboolean(L, 0);
+			lua_pushfstring(L, "Cannot send message %s", ENUM_TO_STRING(IOTHUB_CLIENT_RESULT, result));
+			lua_pushnumber(L, result);
+			return 3;
+		}
+	}
+	connectionWakeUp(info);
+	*sent = sendCallbackInfo;
+	return 0;
+}
+
+static int luaSendMessage(lua_State *L)
+{	
+	SendCallbackInfo *sendCallbackInfo;
+	ConnectInfo *info = readConnectInfo(L, 1);
+	lua_Number timeoutSeconds = SEND_TIMEOUT_SECONDS;
+	SyncSendStatus syncStatus;
+
+	if ( info && info->iotHubClientHandle && info->isConnected ) {
+		info->L = L;
+		
+		// a template is followed by the message body, so the timeout moves up one
+		int timeoutIndex = luaL_testudata(L, 2, MESSAGE_TEMPLATE_METATABLE_NAME) ? 4 : 3;
+		// look for param #3 , timeout seconds
+		if ( lua_isnumber(L, timeoutIndex) ) {
+			timeoutSeconds = lua_tonumber(L, timeoutIndex);
+		}
+		
+		syncStatus.isDone = false;
+		int errorCount = connectionSendMessage(L, info, timeoutSeconds > 0 ? &syncStatus : NULL, &sendCallbackInfo);
+		if ( errorCount > 0 ) {
+			connectionRaiseError(L, info);
+			return errorCount;
+		}
+		unsigned long long sequence = sendCallbackInfo->sequence;
+		
+		// return since we are in async mode
+		if ( timeoutSeconds <= 0 ) {
+			connectionRaiseError(L, info);
+			lua_pushboolean(L, 1);
+			lua_pushnumber(L, sequence);
+			return 2;
+		}
+		
+		connectionWait(info, waitTimeNow() + (unsigned long long) (timeoutSeconds * 1000), &syncStatus.isDone);
+		
+		if ( !syncStatus.isDone ) {
+			// still waiting in the SDK or queue, so stop the confirmation writing back to this stack, this must be
+			// done before an error from a callback is raised and this frame is gone
+			sendCallbackInfo->syncStatus = NULL;
+		}
+		connectionRaiseError(L, info);
+		return pushSendResult(L, syncStatus.isDone, syncStatus.result, sequence);
+	}
+	else {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Not connected or IotHub object not found");
+		return 2;
+	}
+	return 0;
+}
 
+/*
+ Called when a coroutine waiting in sendMessageYield is resumed, the result is taken from the wait that was left on 
+ the stack at 'base' before the yield, so any values passed to resume are ignored.
 */
+static int sendMessageYieldContinue(lua_State *L)
+{
+	int base = 0;
+	lua_getctx(L, &base);
+	YieldWait *wait = lua_touserdata(L, base);
+	
+	switch ( wait->state ) {
+		case YIELD_WAIT_RESUMED:
+			break;
+		case YIELD_WAIT_READY:
+			// resumed by something other than the connection before it got round to it
+			yieldListRemove(&wait->info->readyHead, &wait->info->readyTail, wait);
+			luaL_unref(L, LUA_REGISTRYINDEX, wait->threadRef);
+			wait->threadRef = LUA_NOREF;
+			wait->state = YIELD_WAIT_RESUMED;
+			break;
+		case YIELD_WAIT_PENDING:
+			// resumed by something other than the connection, the message is still pending
+			connectionUnlinkYield(wait->info, wait);
+			luaL_unref(L, LUA_REGISTRYINDEX, wait->threadRef);
+			wait->threadRef = LUA_NOREF;
+			wait->state = YIELD_WAIT_RESUMED;
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, "Resumed before the message was confirmed");
+			return 2;
+		case YIELD_WAIT_CLOSED:
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, "closed");
+			return 2;
+	}
+	return pushSendResult(L, wait->isDone, wait->result, wait->sequence);
+}
 
+/*
+ Returns true if the calling coroutine can yield back to its resume. Lua 5.2 can yield through a lua function or 
+ pcall and xpcall, but not through any other C function, for example a callback run from table.sort. Only the frames
+ on the stack are checked, so a lua function called from C without a frame of its own, such as a metamethod run 
+ from lua_gettable, is not found, the yield then fails after the message has been sent.
+*/
+static bool isYieldable(lua_State *L)
+{
+	lua_Debug ar;
+	bool isYieldable = !lua_pushthread(L);
+	lua_pop(L, 1);
+	if ( !isYieldable ) {
+		return false;
+	}
+	lua_pushglobaltable(L);
+	lua_getfield(L, -1, "pcall");
+	lua_getfield(L, -2, "xpcall");
+	// level 0 is sendMessageYield itself
+	for ( int level = 1; isYieldable && lua_getstack(L, level, &ar); level ++ ) {
+		lua_getinfo(L, "Sf", &ar);
+		if ( strcmp(ar.what, "C") == 0 && !lua_rawequal(L, -1, -3) && !lua_rawequal(L, -1, -2) ) {
+			isYieldable = false;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 3);
+	return isYieldable;
+}
 
 /***
-Connect to the Azure IotHub, if successfull returns an IotHub object.
-@function connect
-@tparam string connectString String to connect to the Azure IotHub
-@tparam[opt=AMQP] string protocol Name of the protocol (case insensitive), can be 'AMQP', 'MQTT' or 'HTTP'
-@tparam[opt=nil] function processRead Function to process read messages, see the callback function @{processRead}.
-@tparam[opt=nil] function processSent Function to process reply after sending a message, see the callback function @{processSent}.
-@treturn iotHub object table if successfully connected to the IotHub.
-@treturn false, errorMessage False and an error message if failed to connect
+Sends a message from a coroutine, and yields the coroutine until the message is confirmed.
+
+The message is sent the same as a sync @{sendMessage}, but instead of running the connection until the message is
+confirmed the calling coroutine yields. The coroutine is resumed by @{loop}, @{dispatch} or any other call that runs 
+the connection once the message is confirmed, or after timeoutSeconds. So many coroutines can each wait on their 
+own message while sharing one lua state and connection.
+
+If the connect option __processResume__ is set, the coroutine is passed to that function instead of being resumed 
+by the connection, so a scheduler can resume it in its own time.
+
+The yield cannot cross a C call other than pcall or xpcall, so this cannot be called from the main thread, or from 
+inside one of the callbacks or any other C function. That is checked before the message is sent, and the message is 
+not sent.
+
+Coroutines are only resumed once the connection has finished its SDK work, so an error raised by a resumed coroutine
+or by __processResume__ does not unwind the connection, it is counted in @{stats} as yieldErrors.
+
+@function iotHub:sendMessageYield
+@tparam table,string message Message to send, the same as @{sendMessage}, including a template followed by the body.
+@tparam[opt=240] number timeoutSeconds Number of seconds to wait for the confirmation, if <= 0 the coroutine waits 
+until the message is confirmed or the connection is closed.
+@treturn boolean,number True and the sequence number of the message once it is confirmed.
+@treturn boolean,string,integer False with the error message, and the error code, the same as @{sendMessage}.
+@treturn boolean,string False and 'timeout' if the message was not confirmed in time, the message is still pending.
+@treturn boolean,string False and 'closed' if the connection was garbage collected before the message was confirmed.
+@treturn boolean,string False and an error if the coroutine was resumed by something other than the connection 
+before the message was confirmed, the message is still pending.
 
 @usage
-local luaazureiothub = require 'luaazureiothub'
-
-local processRead = function(message)
-  print("received a message:")
-  print(message)				
-  return luaazureiothub.messageReceive.ACCEPTED
-end
-
-local processSendConfirmation = function(status, message)
-  -- called when the message has been sent or has an error 
-  if status == luaazureiothub.messageSend.OK then
-    print('RX message ack')
-  else
-    print('RX message error:' .. status)
+local isDone = false
+local sender = coroutine.wrap(function()
+  for index = 1, 10 do
+    local ok, sequenceOrError = iothub:sendMessageYield({ text = 'reading ' .. index }, 30)
+    print(index, ok, sequenceOrError)
   end
-  print(message)
+  isDone = true
+end)
+sender()
+while not isDone do
+  iothub:loop(0.1)
 end
-
-local connectionString = 'HostName=hostname.azure-devices.net;DeviceId=deviceId;SharedAccessKey=????'
-local iothub, errorMessage = luaazureiothub.connect(connectionString, 'amqp', processRead, processSendConfirmation)
-
 */
-
-static int luaConnect(lua_State *L)
+static int luaSendMessageYield(lua_State *L)
 {
+	SendCallbackInfo *sendCallbackInfo;
+	ConnectInfo *info = readConnectInfo(L, 1);
+	lua_Number timeoutSeconds = SEND_TIMEOUT_SECONDS;
+	SyncSendStatus syncStatus;
 	
-	const char *connectionString = NULL;
-	IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol = NULL;
-	ConnectInfo info;
+	if ( info == NULL || info->iotHubClientHandle == NULL || !info->isConnected ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Not connected or IotHub object not found");
+		return 2;
+	}
+	if ( !isYieldable(L) ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "sendMessageYield can only be called from a coroutine that can yield");
+		return 2;
+	}
+	int timeoutIndex = luaL_testudata(L, 2, MESSAGE_TEMPLATE_METATABLE_NAME) ? 4 : 3;
+	if ( lua_isnumber(L, timeoutIndex) ) {
+		timeoutSeconds = lua_tonumber(L, timeoutIndex);
+	}
+	
+	// the coroutine is about to be suspended, so callbacks after the yield go back to the state that was running
+	lua_State *previousL = info->L;
+	info->L = L;
+	syncStatus.isDone = false;
+	int errorCount = connectionSendMessage(L, info, &syncStatus, &sendCallbackInfo);
+	info->L = previousL;
+	if ( errorCount > 0 ) {
+		return errorCount;
+	}
+	unsigned long long sequence = sendCallbackInfo->sequence;
+	if ( syncStatus.isDone ) {
+		return pushSendResult(L, true, syncStatus.result, sequence);
+	}
+	
+	sendCallbackInfo->syncStatus = NULL;
+	YieldWait *wait = (YieldWait *) lua_newuserdata(L, sizeof(YieldWait));
+	wait->info = info;
+	wait->thread = L;
+	wait->sequence = sequence;
+	wait->due = timeoutSeconds > 0 ? waitTimeNow() + (unsigned long long) (timeoutSeconds * 1000) : 0;
+	wait->isDone = false;
+	wait->result = IOTHUB_CLIENT_CONFIRMATION_OK;
+	lua_pushthread(L);
+	wait->threadRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	connectionAddYield(info, sendCallbackInfo, wait);
+	return lua_yieldk(L, 0, lua_gettop(L), sendMessageYieldContinue);
+}
 
-// Lua call params
-// connect( connectionString, [protocol = AMQP, receiveCoRoutine] )
+/***
+Sends an array of messages to the Azure IotHub in one call.
+
+All of the messages are created in one call, and each one is sent the same way as @{sendMessage}: straight to the 
+SDK while there is room in the send window set by the connect option __maxInFlight__, else queued behind the 
+messages already waiting. A message that does not fit in the queue either has the errorMessage 'Busy'. To have the 
+HTTP transport post the messages as one request, connect with the __batching__ option and a __maxInFlight__ of at 
+least the batch size.
+
+@function iotHub:sendBatch
+@tparam table messages Array of messages, each one can be a string or a @{message} table.
+@tparam[opt=0] integer timeoutMs Number of milliseconds to wait for all of the messages to be confirmed by the IotHub, 
+if <=0 then this function returns as soon as the messages have been handed to the SDK.
+@treturn boolean,table True and an array with one result table for each message. A result table has the field 
+__sequence__ if the message was sent, __status__ if the message was confirmed within the timeout (see @{messageSend}) 
+and __errorMessage__ if the message could not be sent.
+@treturn boolean,string False with the error message.
+
+@usage
+local ok, results = iotHub:sendBatch({ 'reading 1', 'reading 2', { text = 'reading 3', property = { type = 'temp' } } }, 5000)
+for index, result in ipairs(results) do
+  print(index, result.sequence, result.status, result.errorMessage)
+end
 
+*/
+static int luaSendBatch(lua_State *L)
+{
+	ConnectInfo *info = readConnectInfo(L, 1);
+	int timeoutMs = 0;
+	int index;
 	
-	if ( !lua_isstring(L, 1) ) {
+	if ( !( info && info->iotHubClientHandle && info->isConnected ) ) {
 		lua_pushboolean(L, 0);
-		lua_pushstring(L, "Parameter #1 is not a connection string");
+		lua_pushstring(L, "Not connected or IotHub object not found");
 		return 2;
 	}
+	if ( !lua_istable(L, 2) ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Parameter #2 must be an array of messages");
+		return 2;
+	}
+	if ( lua_isnumber(L, 3) ) {
+		timeoutMs = lua_tointeger(L, 3);
+	}
+	info->L = L;
+	lua_settop(L, 3);
+	// messages held by the coalescer were sent first
+	connectionFlushCoalesced(info);
 	
-	connectionString = lua_tostring(L, 1);
-
-
-	if ( lua_isstring(L, 2) ) {
-		protocol = NULL;
-		const char *protocolText = lua_tostring(L, 2);
-		if ( strcasecmp("AMQP", protocolText) == 0 ) {
-			protocol = AMQP_Protocol;
+	int count = lua_rawlen(L, 2);
+	SyncSendStatus *syncStatus = NULL;
+	size_t scratchSize = sizeof(SendCallbackInfo *) * (count + 1);
+	if ( timeoutMs > 0 ) {
+		scratchSize += sizeof(SyncSendStatus) * (count + 1);
+	}
+	// the record array and sync status array share one scratch buffer from the pool
+	void *scratch = sendPoolTakeScratch(&info->sendPool, scratchSize);
+	if ( scratch == NULL ) {
+		return luaL_error(L, "Out of memory");
+	}
+	SendCallbackInfo **sendCallbackInfos = (SendCallbackInfo **) scratch;
+	if ( timeoutMs > 0 ) {
+		syncStatus = (SyncSendStatus *) &sendCallbackInfos[count + 1];
+	}
+	
+	lua_createtable(L, count, 0);			// results, at index 4
+	for ( index = 0; index < count; index ++ ) {
+		lua_createtable(L, 0, 2);
+		lua_rawgeti(L, 2, index + 1);
+		IOTHUB_MESSAGE_HANDLE messageHandle = NULL;
+		SendCallbackInfo *sendCallbackInfo = NULL;
+		if ( info->inFlightCount >= info->maxInFlight && info->queuedCount >= info->maxQueued ) {
+			lua_pushstring(L, "Busy");
 		}
-		if ( strcasecmp("HTTP", protocolText) == 0 ) {
-			protocol = HTTP_Protocol;
+		else {
+			messageHandle = createMessage(L, -1, info);
 		}
-		if ( strcasecmp("MQTT", protocolText) == 0 ) {
-			protocol = MQTT_Protocol;
+		if ( messageHandle ) {
+			sendCallbackInfo = newSendCallbackInfo(info, messageHandle);
+			if ( sendCallbackInfo == NULL ) {
+				IoTHubMessage_Destroy(messageHandle);
+				lua_pushstring(L, "Out of memory");
+			}
+			else if ( !connectionJournalSend(info, sendCallbackInfo) ) {
+				IoTHubMessage_Destroy(messageHandle);
+				sendPoolRelease(sendCallbackInfo);
+				sendCallbackInfo = NULL;
+				lua_pushstring(L, "Journal full");
+			}
 		}
-		if ( protocol == NULL ) {
-			lua_pushboolean(L, 0);
-			lua_pushstring(L, "Parameter #2 can only be 'amqp', 'http' or 'mqtt'");
-			return 2;
+		if ( sendCallbackInfo ) {
+			if ( syncStatus ) {
+				sendCallbackInfo->syncStatus = &syncStatus[index];
+			}
+			IOTHUB_CLIENT_RESULT result = connectionSendOrQueue(info, sendCallbackInfo);
+			if ( result == IOTHUB_CLIENT_OK ) {
+				sendCallbackInfos[index] = sendCallbackInfo;
+				lua_pushnumber(L, sendCallbackInfo->sequence);
+				lua_setfield(L, -3, "sequence");
+			}
+			else {
+				connectionJournalAck(info, sendCallbackInfo);
+				IoTHubMessage_Destroy(messageHandle);
+				sendPoolRelease(sendCallbackInfo);
+				lua_pushfstring(L, "Cannot send message %s", ENUM_TO_STRING(IOTHUB_CLIENT_RESULT, result));
+			}
 		}
+		if ( sendCallbackInfos[index] == NULL ) {
+			lua_setfield(L, -3, "errorMessage");
+		}
+		lua_pop(L, 1);						// message
+		lua_rawseti(L, 4, index + 1);
 	}
-	else {
-		protocol = AMQP_Protocol;
-	}
+	connectionWakeUp(info);
 	
-
-	info.iotHubClientHandle = IoTHubClient_LL_CreateFromConnectionString(connectionString, protocol);
-	if ( info.iotHubClientHandle == NULL ) {
-		lua_pushboolean(L, 0);
-		lua_pushstring(L, "Failed to connect");
-		return 2;
+	if ( syncStatus ) {
+		// wait for each message in turn, they are usually confirmed in order
+		unsigned long long deadline = waitTimeNow() + timeoutMs;
+		for ( index = 0; index < count; index ++ ) {
+			if ( sendCallbackInfos[index] && !syncStatus[index].isDone ) {
+				connectionWait(info, deadline, &syncStatus[index].isDone);
+				if ( !syncStatus[index].isDone ) {
+					break;
+				}
+			}
+		}
+		for ( index = 0; index < count; index ++ ) {
+			if ( sendCallbackInfos[index] == NULL ) {
+				continue;
+			}
+			if ( syncStatus[index].isDone ) {
+				lua_rawgeti(L, 4, index + 1);
+				lua_pushinteger(L, syncStatus[index].result);
+				lua_setfield(L, -2, "status");
+				lua_pop(L, 1);
+			}
+			else {
+				// still waiting in the SDK, so stop the confirmation writing back to the status array
+				sendCallbackInfos[index]->syncStatus = NULL;
+			}
+		}
 	}
+	sendPoolReleaseScratch(&info->sendPool, scratch);
+	// only once nothing points into the scratch buffer
+	connectionRaiseError(L, info);
+	lua_pushboolean(L, 1);
+	lua_insert(L, 4);
+	return 2;
+}
+
+
+/***
+Loop around the event queue to process sending and receiving of messages.
+
+You will need to call this if you whish to receive any messages and or if you have sent a message using @{sendMessage} 
+setting the timoutSeconds to 0. 
+
+@function iotHub:loop
+@tparam[opt=1] number timeoutSeconds Number of seconds to loop around and process the message queues. If you set this
+value to <=0 then the loop will process only one cycle and return. Fractions of a second can be used, e.g. 0.05 for 50ms.
+
+While waiting the loop sleeps until the connection next needs servicing, so it does not use any cpu when idle.
+The SDK does not give out its socket to wait on, so the connection is serviced on a timer instead. While messages 
+are being sent the SDK DoWork is called every 1ms, once they are confirmed the interval doubles up to the connect 
+option __idleIntervalMs__ (default 50ms). This means an idle connection can take up to __idleIntervalMs__ to pass 
+a received message to @{processRead} and to ack it to the IotHub, where spinning on DoWork would see it at once. 
+Set __idleIntervalMs__ to 1 for the lowest latency, at the cost of waking up 1000 times a second.
+
+An error raised by a callback stops the loop, and is raised again from here once the connection has finished the 
+work it was doing. Only the first error from a cycle is raised. A message whose @{processRead} raised an error is 
+abandoned, so the IotHub sends it again.
+
+@usage
+-- send out 10 async messages
+for counter = 1, 10 do
+  -- send message but do not wait for reply
+  iotHub:sendMessage('Test message ' .. counter, 0)
+  -- process the messages sent out and maybe also read some in
+  iotHub:loop()
+end
+
+*/
+
+static int luaLoop(lua_State *L)
+{
+	ConnectInfo *info = readConnectInfo(L, 1);
 	
-	
-	callbackState = L;
-//	lua_pushthread(callbackState);
+	// default to wait for one second
+	lua_Number timeoutSeconds = 1;
+	if ( lua_isnumber(L, 2) ) {
+		timeoutSeconds = lua_tonumber(L, 2);
+	}
+	if ( info && info->iotHubClientHandle && info->isConnected ) {
+		info->L = L;
+		connectionDoWork(info);
+		if ( timeoutSeconds > 0 ) {
+			connectionWait(info, waitTimeNow() + (unsigned long long) (timeoutSeconds * 1000), NULL);
+		}
+		connectionResumeYields(info);
+	}
+	connectionRaiseError(L, info);
+	return 0;
+}
+
+/***
+Run the processRead and processSent callbacks for the events waiting from the io thread.
+
+In threaded mode the SDK work is done on a background io thread, and the callbacks are only ever called from 
+this function, @{loop}, @{loopAll} or a waiting @{sendMessage}. For a connection that is not threaded this does one
+cycle of @{loop}.
+
+@function iotHub:dispatch
+@tparam[opt=0] number timeoutMs Milliseconds to wait for the first event if none are waiting.
+@treturn integer Number of events dispatched.
+
+@usage
+local iothub = luaazureiothub.connect{ connectionString = connectionString, processSent = processSent, threaded = true }
+iothub:sendMessage('Test message', 0)
+while true do
+  iothub:dispatch(100)
+  -- other work
+end
 
-//	lua_createtable(callbackState, 0, 2);
+*/
+static int luaDispatch(lua_State *L)
+{
+	ConnectInfo *info = readConnectInfo(L, 1);
+	int timeoutMs = 0;
+	int count = 0;
 	
-	if ( lua_isfunction(L, 3) ) {		
-		lua_pushstring(callbackState, RECEIVE_FUNCTION_CALLBACK_NAME);
-		lua_pushvalue(L, 3);
-		lua_xmove(L, callbackState, 1);
-		lua_settable(callbackState, LUA_REGISTRYINDEX );
+	if ( lua_isnumber(L, 2) ) {
+		timeoutMs = lua_tointeger(L, 2);
 	}
-	if ( lua_isfunction(L, 4) ) {
-		lua_pushstring(callbackState, SEND_CONFIRMATION_FUNCTION_CALLBACK_NAME);
-		lua_pushvalue(L, 4);
-		lua_xmove(L, callbackState, 1);
-		lua_settable(callbackState, LUA_REGISTRYINDEX);
+	if ( info && info->iotHubClientHandle && info->isConnected ) {
+		info->L = L;
+		if ( info->thread ) {
+			count = threadDispatch(info);
+			if ( count == 0 && timeoutMs > 0 && info->thread ) {
+				if ( waitEngineWait(&info->waitEngine, waitTimeNow() + timeoutMs) > 0 && info->thread ) {
+					count = threadDispatch(info);
+				}
+			}
+			// timers such as the reconnect timer still run on the lua thread
+			waitEngineExpire(&info->waitEngine, waitTimeNow());
+		}
+		else {
+			connectionDoWork(info);
+			if ( timeoutMs > 0 ) {
+				connectionWait(info, waitTimeNow() + timeoutMs, NULL);
+			}
+		}
+		connectionResumeYields(info);
 	}
-		
-	if (IoTHubClient_LL_SetMessageCallback(info.iotHubClientHandle, ReceiveMessageCallback, NULL) != IOTHUB_CLIENT_OK) {
-		IoTHubClient_LL_Destroy(info.iotHubClientHandle);
-		lua_pushboolean(L, 0);
-		lua_pushstring(L, "Cannot setup message callback");
-		return 2;
-	}	
-	tlsio_openssl_init();
-	luaL_newlib(L, luaAzureIotHubConnectionMethods);
-	info.isConnected = true;
-	pushConnectInfo(L, &info);	
-	lua_pushstring(L, "isConnect");
-	lua_pushboolean(L, 1);
-	lua_settable(L, -3);	
-		
+	connectionRaiseError(L, info);
+	lua_pushinteger(L, count);
 	return 1;
 }
 
+/*
+ Return the milliseconds until the next timer of the connection is due, 0 if it is already due or -1 if there are
+ no timers running.
+*/
+static int connectionNextTimeoutMs(ConnectInfo *info)
+{
+	unsigned long long nextDue = waitEngineNextDue(&info->waitEngine);
+	unsigned long long now = waitTimeNow();
+	if ( nextDue == WAIT_NO_DEADLINE ) {
+		return -1;
+	}
+	if ( nextDue <= now ) {
+		return 0;
+	}
+	return nextDue - now > INT_MAX ? INT_MAX : (int) (nextDue - now);
+}
 
 /***
-Return a random uuid.
-@function generateUUID
-@treturn string random uuid
+Get what an external event loop has to wait on before it next calls @{step}.
+
+The SDK does not give out its socket, so without the io thread there are no fds and the timeout is when the SDK 
+next needs its DoWork, this backs off from 1ms while messages are in flight up to 50ms when idle. In threaded mode 
+the io thread does the SDK work, and the fd is readable as soon as it has a confirmation or received message for 
+lua, so the event loop only wakes up when there is something to do.
+
+@function iotHub:getPollInfo
+@treturn table Table with the following fields:
+
+	fds            Array of tables, one for each fd, with the fields __fd__ (number) and __events__, 'r' to wait 
+	               for the fd to be readable, 'w' for writable or 'rw' for both.
+	timeoutMs      Milliseconds until @{step} must be called even if no fds are ready, 0 if it is due now or -1 
+	               if there is nothing to wait for.
+
+@treturn false,string False and an error message if not connected.
 
+@usage
+local cqueues = require 'cqueues'
+local poll = require 'cqueues'.poll
+local iothub = luaazureiothub.connect{ connectionString = connectionString, processSent = processSent, threaded = true }
+local queue = cqueues.new()
+queue:wrap(function()
+  while true do
+    local info = iothub:getPollInfo()
+    local fd = info.fds[1]
+    poll({ pollfd = fd.fd, events = fd.events }, info.timeoutMs >= 0 and info.timeoutMs / 1000 or nil)
+    iothub:step()
+  end
+end)
 */
-static int luaGenerateUUID(lua_State *L)
+static int luaGetPollInfo(lua_State *L)
 {
-	uuid_t uuid;
-	uuid_generate(uuid);
-	char buffer[40];
-	uuid_unparse(uuid, buffer);
-	lua_pushstring(L, buffer);
+	ConnectInfo *info = readConnectInfo(L, 1);
+	int index;
+	if ( info == NULL || info->iotHubClientHandle == NULL || !info->isConnected ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Not connected or IotHub object not found");
+		return 2;
+	}
+	lua_createtable(L, 0, 2);
+	lua_createtable(L, info->waitEngine.fdCount, 0);
+	for ( index = 0; index < info->waitEngine.fdCount; index ++ ) {
+		short events = info->waitEngine.fds[index].events;
+		lua_createtable(L, 0, 2);
+		lua_pushinteger(L, info->waitEngine.fds[index].fd);
+		lua_setfield(L, -2, "fd");
+		lua_pushstring(L, ( events & POLLIN ) && ( events & POLLOUT ) ? "rw" : ( events & POLLOUT ) ? "w" : "r");
+		lua_setfield(L, -2, "events");
+		lua_rawseti(L, -2, index + 1);
+	}
+	lua_setfield(L, -2, "fds");
+	lua_pushinteger(L, connectionNextTimeoutMs(info));
+	lua_setfield(L, -2, "timeoutMs");
 	return 1;
 }
 
 /***
-Return the current library version.
-@function info
-@treturn string Library version string
+Run one cycle of the connection without waiting, for use with an external event loop.
+
+This calls the SDK DoWork once, or in threaded mode runs the callbacks for the events from the io thread, and then 
+runs any of the library timers that are due, such as the coalescer and reconnect timers. Call it when one of the 
+fds from @{getPollInfo} is ready, or its timeout has passed.
 
+@function iotHub:step
+@treturn integer Milliseconds until the next call is needed, the same as the __timeoutMs__ field of @{getPollInfo}.
+@treturn false,string False and an error message if not connected.
+
+@usage
+local timeoutMs = iothub:step()
 */
-static int luaLibInfo (lua_State *L) 
+static int luaStep(lua_State *L)
 {
-	lua_pushstring(L, "luaazureiothub version 0.1");  
+	ConnectInfo *info = readConnectInfo(L, 1);
+	if ( info == NULL || info->iotHubClientHandle == NULL || !info->isConnected ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Not connected or IotHub object not found");
+		return 2;
+	}
+	info->L = L;
+	// the DoWork restarts its own timer, so the expire only runs the other timers
+	connectionDoWork(info);
+	if ( info->iotHubClientHandle && info->isConnected ) {
+		waitEngineExpire(&info->waitEngine, waitTimeNow());
+	}
+	connectionResumeYields(info);
+	connectionRaiseError(L, info);
+	lua_pushinteger(L, info->iotHubClientHandle && info->isConnected ? connectionNextTimeoutMs(info) : -1);
 	return 1;
 }
 
-/***
-Callback Functions.
-These functions are called from the library to send back data and return status of sent messages from the Iot Hub.
-@section Callbacks
-
+/*
+ Find the send record for the sequence number or message id at 'index', envelopes made by the coalescer are not 
+ visible to lua. Returns NULL if the message is not pending.
 */
+static SendCallbackInfo *findPendingSend(lua_State *L, ConnectInfo *info, int index)
+{
+	SendCallbackInfo *sendCallbackInfo = NULL;
+	if ( lua_type(L, index) == LUA_TNUMBER ) {
+		lua_Number sequence = lua_tonumber(L, index);
+		if ( sequence >= 1 && sequence < (lua_Number) ENVELOPE_SEQUENCE_BIT ) {
+			sendCallbackInfo = inFlightFind(&info->inFlight, (unsigned long long) sequence);
+		}
+	}
+	else if ( lua_type(L, index) == LUA_TSTRING ) {
+		sendCallbackInfo = inFlightFindId(&info->inFlight, lua_tostring(L, index));
+	}
+	if ( sendCallbackInfo && sendCallbackInfo->members ) {
+		return NULL;
+	}
+	return sendCallbackInfo;
+}
+
+static const char *sendStateName(SendState state)
+{
+	switch ( state ) {
+		case SEND_STATE_QUEUED:
+			return "queued";
+		case SEND_STATE_COALESCED:
+			return "coalesced";
+		case SEND_STATE_IN_FLIGHT:
+			return "inFlight";
+		default:
+			return "free";
+	}
+}
 
+static int compareSendSequence(const void *first, const void *second)
+{
+	unsigned long long firstSequence = ( *(SendCallbackInfo *const *) first )->sequence;
+	unsigned long long secondSequence = ( *(SendCallbackInfo *const *) second )->sequence;
+	return firstSequence < secondSequence ? -1 : firstSequence > secondSequence;
+}
 
 /***
-Callback function to read messages sent from the IotHub.
-You need to create a function with these parameters and pass the function as a parameter to the @{connect} function.
-@function processRead
-@tparam message message The @{message} table sent from the IotHub.
-@treturn integer You can return values from the static table @{messageReceive}, to accept or reject the message.
-If you do not return a valid integer then the library will return messageReceive.ACCEPTED as default.
+Get the status of a message that has been sent and not yet passed to @{processSent}.
+
+The message is found in a hash table of the pending messages of the connection, so this is the same cost however 
+many messages are waiting.
+
+@function iotHub:messageStatus
+@tparam number,string id The sequence number returned by @{sendMessage}, or the message id.
+@treturn string,number The status and the sequence number of the message. The status is one of:
+
+	queued         Waiting in the library for a free in flight slot.
+	coalesced      Held by the coalescer, waiting for its envelope to be sent.
+	inFlight       Handed to the SDK and waiting for a confirmation.
+
+@treturn false,string False and an error message if the message is not pending.
+
+@usage
+local ok, sequence = iothub:sendMessage({ text = 'hello', id = 'reading-42' }, 0)
+print(iothub:messageStatus('reading-42'))
+*/
+static int luaMessageStatus(lua_State *L)
+{
+	ConnectInfo *info = readConnectInfo(L, 1);
+	if ( info == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "IotHub object not found");
+		return 2;
+	}
+	SendCallbackInfo *sendCallbackInfo = findPendingSend(L, info, 2);
+	if ( sendCallbackInfo == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Message is not pending");
+		return 2;
+	}
+	lua_pushstring(L, sendStateName(sendCallbackInfo->state));
+	lua_pushnumber(L, sendCallbackInfo->sequence);
+	return 2;
+}
 
-*/
+/***
+Get all of the messages that have been sent and not yet passed to @{processSent}.
 
+@function iotHub:pending
+@treturn table Array of tables in the order the messages were sent, each with the following fields:
 
-/***
-Callback function to accept a sent message.
-You need to create a function with these parameters and pass the function as a parameter to the @{connect} function.
-@function processSent
-@tparam integer status The status of the sent message, see the static table @{messageSend} for the possible values.
-@tparam message message A copy of the @{message} that has been sent. This message has been re-encoded from the C library
-so it will not have any extra fields added when used in the @{sendMessage} function.
+	sequence       The sequence number returned by @{sendMessage}.
+	id             The message id, if the message has one.
+	status         The status of the message, see @{messageStatus}.
 
+@usage
+for _, message in ipairs(iothub:pending()) do
+  print(message.sequence, message.id, message.status)
+end
 */
+static int luaPending(lua_State *L)
+{
+	ConnectInfo *info = readConnectInfo(L, 1);
+	SendCallbackInfo *sendCallbackInfo;
+	unsigned int index = 0;
+	unsigned int count = 0;
+	unsigned int position;
+	if ( info == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "IotHub object not found");
+		return 2;
+	}
+	SendCallbackInfo **records = sendPoolTakeScratch(&info->sendPool, sizeof(SendCallbackInfo *) * ( info->inFlight.count + 1 ));
+	if ( records == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Out of memory");
+		return 2;
+	}
+	while ( (sendCallbackInfo = inFlightNext(&info->inFlight, &index)) != NULL ) {
+		if ( sendCallbackInfo->members == NULL ) {
+			records[count ++] = sendCallbackInfo;
+		}
+	}
+	qsort(records, count, sizeof(SendCallbackInfo *), compareSendSequence);
+	
+	lua_createtable(L, count, 0);
+	for ( position = 0; position < count; position ++ ) {
+		lua_createtable(L, 0, 3);
+		lua_pushnumber(L, records[position]->sequence);
+		lua_setfield(L, -2, "sequence");
+		if ( records[position]->messageId ) {
+			lua_pushstring(L, records[position]->messageId);
+			lua_setfield(L, -2, "id");
+		}
+		lua_pushstring(L, sendStateName(records[position]->state));
+		lua_setfield(L, -2, "status");
+		lua_rawseti(L, -2, position + 1);
+	}
+	sendPoolReleaseScratch(&info->sendPool, records);
+	return 1;
+}
 
 /***
-IotHub Class.
-This class is returned by the @{connect} function.
-@section IotHub
+Cancel a message that is still waiting in the send queue.
 
-*/
+The message is removed from the queue and the journal, and is not passed to @{processSent}. A sync 
+@{sendMessage} or @{sendMessageYield} waiting on the message returns with messageSend.ERROR. Messages that have been handed to the SDK, or 
+are held by the coalescer, can no longer be cancelled.
 
-/***
-Disconnect from the iothub
-@function iotHub:disconnect
-@treturn boolean True if succesfull in disconecting
+@function iotHub:cancel
+@tparam number,string id The sequence number returned by @{sendMessage}, or the message id.
+@treturn boolean True if the message was cancelled.
+@treturn false,string False and an error message.
 
+@usage
+local ok, sequence = iothub:sendMessage('hello', 0)
+if iothub:messageStatus(sequence) == 'queued' then
+  iothub:cancel(sequence)
+end
 */
-static int luaDisconnect(lua_State *L)
+static int luaCancel(lua_State *L)
 {
 	ConnectInfo *info = readConnectInfo(L, 1);
-	if ( info ) {
-		if ( info->iotHubClientHandle && info->isConnected ) {
-			IoTHubClient_LL_Destroy(info->iotHubClientHandle);
-			info->isConnected = false;
-			info->iotHubClientHandle = NULL;
-			tlsio_openssl_deinit();
-		}
-		lua_getfield(L, 1, "isConnect");
-		if ( lua_isboolean(L, -1) ) {
-			lua_pushvalue(L, 1);
-			lua_pushstring(L, "isConnect");
-			lua_pushboolean(L, 0);
-			lua_settable(L, -3);
-		}
-		lua_pop(L, 2);			// isConnect field, info user data
+	if ( info == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "IotHub object not found");
+		return 2;
+	}
+	SendCallbackInfo *sendCallbackInfo = findPendingSend(L, info, 2);
+	if ( sendCallbackInfo == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Message is not pending");
+		return 2;
+	}
+	if ( sendCallbackInfo->state != SEND_STATE_QUEUED || !connectionUnlinkQueued(info, sendCallbackInfo) ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Message has already been sent");
+		return 2;
+	}
+	if ( sendCallbackInfo->syncStatus ) {
+		sendCallbackInfo->syncStatus->isDone = true;
+		sendCallbackInfo->syncStatus->result = IOTHUB_CLIENT_CONFIRMATION_ERROR;
 	}
+	if ( sendCallbackInfo->yieldWait ) {
+		connectionFinishYield(info, sendCallbackInfo->yieldWait, true, IOTHUB_CLIENT_CONFIRMATION_ERROR);
+	}
+	connectionJournalAck(info, sendCallbackInfo);
+	IoTHubMessage_Destroy(sendCallbackInfo->messageHandle);
+	sendPoolRelease(sendCallbackInfo);
+	info->L = L;
+	connectionResumeYields(info);
 	lua_pushboolean(L, 1);
 	return 1;
 }
 
-
 /***
-Sends a message to the Azure IotHub
-@function iotHub:sendMessage
-@tparam table,string message Mesasge to send, this field can be a string or a @{message}  table. If you use a string then
-message sent will be a simple message with string encoding.
-@tparam[opt=5] number timeoutSeconds Number of seconds to wait for the Ack reply to be recieved from the IotHub
+Get the counters for the pool of send records used by this connection.
 
-if the timeoutSeconds == 0, then this function will return as soon as the message has been sent. It is up to the calling
-code to then call the @{loop} function to wait for the message ack to be sent back from the IotHub.
+Once the pool has grown to the number of messages that are in flight and queued at the same time, sending 
+does not allocate any more memory in this library, and only the __hits__ count goes up.
 
-@treturn boolean,integer True if successfully sent the message, and the result code returned from the send confirmation.
-see the static @{messageSend} table of possible values.
-@treturn boolean,string,integer False with the error message, and extra error code returned from the call to send message. 
-See the static values in the table @{clientResult} for the error codes returned.
+@function iotHub:getPoolStats
+@treturn table Table with the following fields:
 
-*/
+	hits           Number of times a send record or batch buffer was reused from the pool.
+	misses         Number of times memory had to be allocated, including message ids too long to keep in the record.
+	records        Number of send records allocated by the pool.
+	free           Number of send records not in use.
 
-static int luaSendMessage(lua_State *L)
-{	
-	SendCallbackInfo *sendCallbackInfo;
+@usage
+local stats = iothub:getPoolStats()
+print('pool hits', stats.hits, 'misses', stats.misses)
+*/
+static int luaGetPoolStats(lua_State *L)
+{
 	ConnectInfo *info = readConnectInfo(L, 1);
-	IOTHUBMESSAGE_CONTENT_TYPE contentType = IOTHUBMESSAGE_STRING;
-	int timeoutSeconds = SEND_TIMEOUT_SECONDS;
-	const char *messageText;
-	int messageTextLength = 0;
-	bool isMessageValid = false;
-	IOTHUB_CLIENT_STATUS sendStatus;
-
-
-	
-	if ( info && info->iotHubClientHandle && info->isConnected ) {
-		
-		// check to see if the first param is a string
-		if ( lua_isstring(L, 2) ) {
-			messageText = lua_tostring(L, 2);
-			contentType = IOTHUBMESSAGE_STRING;
-			isMessageValid = true;
-		}
-		
-		// check to see if the first param is a message table
-		if ( lua_istable(L, 2) ) {
-			
-			// message.text
-			lua_getfield(L, 2, "text");
-			if ( !lua_isstring(L, -1) ) {
-				lua_pushboolean(L, 0);
-				lua_pushstring(L, "message.text must be used");
-				return 2;			
-			}
-			messageText = lua_tostring(L, -1);
-			lua_pop(L, 1);			// remove text field
-	
-			// message.length
-			lua_getfield(L, 2, "length");
-			if ( lua_isnumber(L, -1) ) {
-				contentType = IOTHUBMESSAGE_BYTEARRAY;
-				messageTextLength = lua_tonumber(L, -1);
-			}
-			lua_pop(L, 1);			// remove length field
-			messageTextLength = strlen(messageText);
-	
-	
-			// message.contentType
-			lua_getfield(L, 2, "contentType");
-			if ( lua_isnumber(L, -1) ) {
-				contentType = lua_tointeger(L, -1);
-				if ( ! ( contentType == IOTHUBMESSAGE_BYTEARRAY || contentType == IOTHUBMESSAGE_STRING ) ) {
-					contentType = IOTHUBMESSAGE_BYTEARRAY;
-				}
-			}
-			lua_pop(L, 1);		// remove contentType field
-			isMessageValid = true;
-			
-		}
-		if ( ! isMessageValid) {
-			lua_pushboolean(L, 0);
-			lua_pushstring(L, "Parameter #2 must be a string or table");
-			return 2;
-		}
-		
-		sendCallbackInfo = (SendCallbackInfo *) malloc(sizeof(SendCallbackInfo));
-		sendCallbackInfo->messageHandle = NULL;
-		sendCallbackInfo->messageId = NULL;
-		sendCallbackInfo->isSendSync = false;
-		
+	if ( info == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "IotHub object not found");
+		return 2;
+	}
+	lua_createtable(L, 0, 4);
+	lua_pushnumber(L, info->sendPool.hitCount);
+	lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, info->sendPool.missCount);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, info->sendPool.recordCount);
+	lua_setfield(L, -2, "records");
+	lua_pushinteger(L, info->sendPool.freeCount);
+	lua_setfield(L, -2, "free");
+	return 1;
+}
 
-		if ( contentType == IOTHUBMESSAGE_BYTEARRAY ) {
-			sendCallbackInfo->messageHandle = IoTHubMessage_CreateFromByteArray((const unsigned char *) messageText, messageTextLength);
-			if ( sendCallbackInfo->messageHandle == NULL ) {
-				free(sendCallbackInfo);
-				lua_pushboolean(L, 0);
-				lua_pushstring(L, "Cannot create binary message");
-				return 2;
-			}
-		}
-		if ( contentType == IOTHUBMESSAGE_STRING ) {
-			sendCallbackInfo->messageHandle = IoTHubMessage_CreateFromString(messageText);
-			if ( sendCallbackInfo->messageHandle == NULL ) {
-				free(sendCallbackInfo);
-				lua_pushboolean(L, 0);
-				lua_pushstring(L, "Cannot create string message");
-				return 2;
-			}
-		}
+/***
+Get the time taken to connect each new client of this connection.
 
-		// last check to see if we have a message
-		if ( sendCallbackInfo->messageHandle == NULL ) {
-			free(sendCallbackInfo);			
-			lua_pushboolean(L, 0);
-			lua_pushstring(L, "Cannot create message");
-			return 2;
-		}
-		
+A client is counted as connected once it has confirmed a message or received one, so this is the time for the 
+TLS handshake, authentication and first round trip. With the connect option __autoReconnect__ each reconnect makes a
+new client, so this shows how much a reconnect costs.
 
-		// check to see if the first param is a message table
-		if ( lua_istable(L, 2) ) {			
-			// now set the message using with the messageHandle
-			// message.id
+@function iotHub:getConnectStats
+@treturn table Table with the following fields:
 
-			lua_getfield(L, 2, "id");
-			if ( lua_isstring(L, -1) ) {
-				IoTHubMessage_SetMessageId(sendCallbackInfo->messageHandle, lua_tostring(L, -1) );	
-			}
-			else {
-				uuid_t uuid;
-				uuid_generate(uuid);
-				char buffer[40];
-				uuid_unparse(uuid, buffer);
-				IoTHubMessage_SetMessageId(sendCallbackInfo->messageHandle, buffer);	
-			}
-			lua_pop(L, 1);			// remove id field
+	connects       Number of clients made, including the first one.
+	isConnecting   True if the latest client has not connected yet.
+	lastMs         Milliseconds taken by the latest client to connect.
+	lastCpuMs      Cpu milliseconds used by the library while the latest client was connecting.
+	totalMs        Total milliseconds taken by all of the clients to connect.
+	totalCpuMs     Total cpu milliseconds used while connecting.
 
-			// correlationId			
-			lua_getfield(L, 2, "correlationId");
-			if ( lua_isstring(L, -1) ) {
-				IoTHubMessage_SetCorrelationId(sendCallbackInfo->messageHandle, lua_tostring(L, -1));	
-			}
-			lua_pop(L, 1);			// remove correlationId field
-			
+The cpu time is only measured when the connection is not threaded or using a shared transport.
 
-			// property			
-			lua_getfield(L, 2, "property");
-			if ( lua_istable(L, -1) ) {
-				MAP_HANDLE propertyMap = IoTHubMessage_Properties(sendCallbackInfo->messageHandle);		
-				lua_pushnil(L);  // first key
-				while (lua_next(L, -2) != 0) {
-					// uses 'key' (at index -2) and 'value' (at index -1)
-					const char *propertyName;
-					const char *propertyValue;
-					propertyName = lua_tostring(L, -2);
-					propertyValue = lua_tostring(L, -1);
-					if (Map_AddOrUpdate(propertyMap, propertyName, propertyValue) != MAP_OK) {
-						IoTHubMessage_Destroy(sendCallbackInfo->messageHandle);	
-						free(sendCallbackInfo);
-						lua_pushboolean(L, 0);
-						lua_pushfstring(L, "Cannot assign message property %s=%s", propertyName, propertyValue);
-						return 2;					
-					}		
-					// removes 'value'; keeps 'key' for next iteration
-					lua_pop(L, 1);
-				}
-			}
-			lua_pop(L, 1); 		// remove property field
-		}
-		
-		// look for param #3 , timeout seconds
-		if ( lua_isnumber(L, 3) ) {
-			timeoutSeconds = lua_tointeger(L, 3);
-		}
-		
-		
-		if ( IoTHubClient_LL_GetSendStatus(info->iotHubClientHandle, &sendStatus) ==  IOTHUB_CLIENT_OK ) {
-			if (sendStatus != IOTHUB_CLIENT_SEND_STATUS_IDLE ) {
-			    free(sendCallbackInfo);
-				lua_pushboolean(L, 0);
-				lua_pushstring(L, "Busy");
-				return 2;			
-			}
-		}
-		else {
-		    free(sendCallbackInfo);
-			lua_pushboolean(L, 0);
-			lua_pushstring(L, "Unable to get send status");
-			return 2;			
-		}
-		
-		sendCallbackInfo->isSendSync = (timeoutSeconds != 0);
-		syncSendStatus.isDone = false;
-		const char *messageId = IoTHubMessage_GetMessageId(sendCallbackInfo->messageHandle );
-		
-		if ( messageId ) {
-			sendCallbackInfo->messageId = strdup(messageId);
-		}
-				
-		// send the message
-		IOTHUB_CLIENT_RESULT result = IoTHubClient_LL_SendEventAsync(info->iotHubClientHandle, sendCallbackInfo->messageHandle, SendConfirmationCallback, sendCallbackInfo);
-		if ( result != IOTHUB_CLIENT_OK ) {
-		    IoTHubMessage_Destroy(sendCallbackInfo->messageHandle);	
-		    free(sendCallbackInfo->messageId);
-		    free(sendCallbackInfo);
-			lua_pushboolean(L, 0);
-			lua_pushfstring(L, "Cannot send message %s", ENUM_TO_STRING(IOTHUB_CLIENT_RESULT, result));
-			lua_pushnumber(L, result);
-			return 3;
-		}
-		// return since we are in async mode
-		if ( timeoutSeconds == 0 ) {
-			lua_pushboolean(L, 1);
-			return 1;
-		}
-		
+@usage
+local stats = iothub:getConnectStats()
+print('connected in', stats.lastMs, 'ms using', stats.lastCpuMs, 'ms cpu')
+*/
+static int luaGetConnectStats(lua_State *L)
+{
+	ConnectInfo *info = readConnectInfo(L, 1);
+	if ( info == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "IotHub object not found");
+		return 2;
+	}
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, info->connectCount);
+	lua_setfield(L, -2, "connects");
+	lua_pushboolean(L, info->isConnectPending);
+	lua_setfield(L, -2, "isConnecting");
+	lua_pushnumber(L, info->lastConnectMs);
+	lua_setfield(L, -2, "lastMs");
+	lua_pushnumber(L, info->lastConnectCpuNs / 1000000.0);
+	lua_setfield(L, -2, "lastCpuMs");
+	lua_pushnumber(L, info->totalConnectMs);
+	lua_setfield(L, -2, "totalMs");
+	lua_pushnumber(L, info->totalConnectCpuNs / 1000000.0);
+	lua_setfield(L, -2, "totalCpuMs");
+	return 1;
+}
 
-		unsigned long timeout = time(NULL) + timeoutSeconds;
-		while ( timeout > time(NULL)  ) {
-			IoTHubClient_LL_DoWork(info->iotHubClientHandle);
-			if ( IoTHubClient_LL_GetSendStatus(info->iotHubClientHandle, &sendStatus) ==  IOTHUB_CLIENT_OK ) {
-				if (sendStatus == IOTHUB_CLIENT_SEND_STATUS_IDLE ) {
-					if (  syncSendStatus.isDone ) {
-						break;
-					}
-				}
-			}
-		}
-		int returnStackSize = 0;
-		if ( syncSendStatus.isDone ) {
-			if ( syncSendStatus.result == IOTHUB_CLIENT_CONFIRMATION_OK ) {
-				lua_pushboolean(L, 1);
-				returnStackSize = 1;
-			}
-			else {
-				lua_pushboolean(L, 0);
-				lua_pushfstring(L, "Cannot send message, received: %s", ENUM_TO_STRING(IOTHUB_CLIENT_RESULT, sendCallbackInfo->result));
-				lua_pushinteger(L, sendCallbackInfo->result);
-				returnStackSize = 3;
-			}
-		}
-		else {
-			lua_pushboolean(L, 0);
-			lua_pushstring(L, "timeout");
-			returnStackSize = 2;
+/*
+ Push a table with the count, min, max, mean and percentiles of the histogram in milliseconds, and a buckets array 
+ with a { highestMs, count } pair for each bucket that has values.
+*/
+static void pushHistogram(lua_State *L, const StatsHistogram *histogram)
+{
+	static const struct {
+		const char *name;
+		double percentile;
+	} percentiles[] = { { "p50Ms", 50 }, { "p90Ms", 90 }, { "p99Ms", 99 }, { "p999Ms", 99.9 } };
+	size_t index;
+	int bucketIndex;
+	int bucketCount = 0;
+	
+	lua_createtable(L, 0, 9);
+	lua_pushnumber(L, histogram->count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, histogram->min / 1000000.0);
+	lua_setfield(L, -2, "minMs");
+	lua_pushnumber(L, histogram->max / 1000000.0);
+	lua_setfield(L, -2, "maxMs");
+	lua_pushnumber(L, histogram->count > 0 ? (double) histogram->sum / histogram->count / 1000000.0 : 0);
+	lua_setfield(L, -2, "meanMs");
+	for ( index = 0; index < sizeof(percentiles) / sizeof(percentiles[0]); index ++ ) {
+		lua_pushnumber(L, statsHistogramPercentile(histogram, percentiles[index].percentile) / 1000000.0);
+		lua_setfield(L, -2, percentiles[index].name);
+	}
+	lua_newtable(L);
+	for ( bucketIndex = 0; bucketIndex < STATS_BUCKET_COUNT; bucketIndex ++ ) {
+		if ( histogram->buckets[bucketIndex] > 0 ) {
+			lua_createtable(L, 2, 0);
+			lua_pushnumber(L, statsBucketHighest(bucketIndex) / 1000000.0);
+			lua_rawseti(L, -2, 1);
+			lua_pushnumber(L, histogram->buckets[bucketIndex]);
+			lua_rawseti(L, -2, 2);
+			lua_rawseti(L, -2, ++ bucketCount);
 		}
-		return returnStackSize;
 	}
-	else {
+	lua_setfield(L, -2, "buckets");
+}
+
+/***
+Get the counters and histograms for this connection.
+
+Recording only takes a clock read and a few integer operations per message, so it is always on. The histograms
+are log bucketed in the style of HdrHistogram, each value is counted in a bucket that is within 12.5% of the
+value, and the percentiles are the top of the bucket they fall in.
+
+@function iotHub:stats
+@tparam[opt=false] boolean reset If true the counters and histograms are cleared after they are read, so each
+call returns the values since the last one.
+@treturn table Table with the following fields:
+
+	sends          Number of messages handed to the SDK. A coalesced envelope, or a message sent again after a
+	               reconnect, counts each time.
+	sendBytes      Bytes in the bodies of the messages handed to the SDK.
+	confirmations  Table of the number of messages passed to @{processSent}, by the names in @{messageSend}.
+	receives       Number of messages received.
+	receiveBytes   Bytes in the bodies of the messages received.
+	doWorks        Number of calls to the SDK DoWork.
+	queued         Number of messages waiting for a free in flight slot, this is not reset.
+	inFlight       Number of messages handed to the SDK and waiting for a confirmation, this is not reset.
+	duplicateAcks  Number of confirmations ignored because the message had already been confirmed.
+	readOverflows  Number of received messages abandoned to the IotHub because the @{processReadBatch} batch was full.
+	readDrops      Number of received messages dropped after @{processReadBatch} abandoned them in 3 batches.
+	yieldErrors    Number of coroutines from @{sendMessageYield} that raised an error when resumed by the connection,
+	               or errors from __processResume__.
+	yieldError     The last of those errors, this is not reset, nil if there has been none.
+	sendLatency    Histogram of the time from sendMessage to the confirmation.
+	callbackTime   Histogram of the time spent in processRead, processReadBatch and processSent.
+
+Each histogram is a table with the fields __count__, __minMs__, __maxMs__, __meanMs__, __p50Ms__, __p90Ms__, 
+__p99Ms__, __p999Ms__ and __buckets__, an array of { highestMs, count } pairs for each bucket that has values.
+
+@usage
+local stats = iothub:stats(true)
+print('sent', stats.sends, 'ok', stats.confirmations.OK, 'p99', stats.sendLatency.p99Ms, 'ms')
+*/
+static int luaStats(lua_State *L)
+{
+	// read before readConnectInfo, which leaves the info userdata on the stack above the arguments
+	bool isReset = lua_toboolean(L, 2);
+	ConnectInfo *info = readConnectInfo(L, 1);
+	if ( info == NULL ) {
 		lua_pushboolean(L, 0);
-		lua_pushstring(L, "Not connected or IotHub object not found");
+		lua_pushstring(L, "IotHub object not found");
 		return 2;
 	}
-	return 0;
+	ConnectionStats *stats = &info->stats;
+	if ( info->thread ) {
+		stats->doWorkCount += atomic_exchange_explicit(&info->thread->doWorkCount, 0, memory_order_relaxed);
+	}
+	lua_createtable(L, 0, 15);
+	lua_pushnumber(L, stats->sendCount);
+	lua_setfield(L, -2, "sends");
+	lua_pushnumber(L, stats->sendBytes);
+	lua_setfield(L, -2, "sendBytes");
+	lua_createtable(L, 0, 4);
+	lua_pushnumber(L, stats->confirmationCounts[IOTHUB_CLIENT_CONFIRMATION_OK]);
+	lua_setfield(L, -2, "OK");
+	lua_pushnumber(L, stats->confirmationCounts[IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY]);
+	lua_setfield(L, -2, "DESTROYED");
+	lua_pushnumber(L, stats->confirmationCounts[IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT]);
+	lua_setfield(L, -2, "TIMEOUT");
+	lua_pushnumber(L, stats->confirmationCounts[IOTHUB_CLIENT_CONFIRMATION_ERROR]);
+	lua_setfield(L, -2, "ERROR");
+	lua_setfield(L, -2, "confirmations");
+	lua_pushnumber(L, stats->receiveCount);
+	lua_setfield(L, -2, "receives");
+	lua_pushnumber(L, stats->receiveBytes);
+	lua_setfield(L, -2, "receiveBytes");
+	lua_pushnumber(L, stats->doWorkCount);
+	lua_setfield(L, -2, "doWorks");
+	lua_pushinteger(L, info->queuedCount + info->retryCount);
+	lua_setfield(L, -2, "queued");
+	lua_pushinteger(L, info->inFlightCount);
+	lua_setfield(L, -2, "inFlight");
+	lua_pushnumber(L, stats->duplicateAckCount);
+	lua_setfield(L, -2, "duplicateAcks");
+	lua_pushnumber(L, stats->readOverflowCount);
+	lua_setfield(L, -2, "readOverflows");
+	lua_pushnumber(L, stats->readDropCount);
+	lua_setfield(L, -2, "readDrops");
+	lua_pushnumber(L, stats->yieldErrorCount);
+	lua_setfield(L, -2, "yieldErrors");
+	lua_rawgeti(L, LUA_REGISTRYINDEX, info->yieldErrorRef);
+	lua_setfield(L, -2, "yieldError");
+	pushHistogram(L, &stats->sendLatency);
+	lua_setfield(L, -2, "sendLatency");
+	pushHistogram(L, &stats->callbackTime);
+	lua_setfield(L, -2, "callbackTime");
+	if ( isReset ) {
+		memset(stats, 0, sizeof(ConnectionStats));
+	}
+	return 1;
 }
 
-
 /***
-Loop around the event queue to process sending and receiving of messages.
+Queue a message to be received by this connection, only for a connection made with the 'loopback' protocol.
 
-You will need to call this if you whish to receive any messages and or if you have sent a message using @{sendMessage} 
-setting the timoutSeconds to 0. 
+The message is passed to @{processRead} or @{processReadBatch} on a later loop cycle, the same as a message sent
+from the cloud. A message that is abandoned is passed again on the next cycle. Messages are queued by device id, 
+so they are still received after a reconnect.
 
-@function iotHub:loop
-@tparam[opt=1] integer timeoutSeconds Number of seconds to loop around and process the message queues. If you set this
-value to <=0 then the loop will process only one cycle and return.
+@function iotHub:loopbackReceive
+@tparam string,table message Message to receive, a string or a @{message} table.
+@treturn boolean True if the message was queued.
+@treturn false,string False and an error message.
 
 @usage
--- send out 10 async messages
-for counter = 1, 10 do
-  -- send message but do not wait for reply
-  iotHub:sendMessage('Test message ' .. counter, 0)
-  -- process the messages sent out and maybe also read some in
-  iotHub:loop()
-end
-
+local iothub = luaazureiothub.connect{ connectionString = 'HostName=test.loopback;DeviceId=device1;SharedAccessKey=dGVzdA==',
+  protocol = 'loopback', processRead = processRead, loopbackLatencyMs = 5 }
+iothub:loopbackReceive({ text = 'command', property = { action = 'reboot' } })
+iothub:loop(0.1)
 */
-
-static int luaLoop(lua_State *L)
+static int luaLoopbackReceive(lua_State *L)
 {
 	ConnectInfo *info = readConnectInfo(L, 1);
-	
-	// default to wait for one second
-	int timeoutSeconds = 1;
-	if ( lua_isnumber(L, 2) ) {
-		timeoutSeconds = lua_tointeger(L, 2);
+	if ( info == NULL || info->loopbackDeviceId == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Not a loopback connection or IotHub object not found");
+		return 2;
 	}
-	if ( info && info->iotHubClientHandle && info->isConnected ) {
-		unsigned long timeout = time(NULL) + timeoutSeconds;
-		IoTHubClient_LL_DoWork(info->iotHubClientHandle);
-		while ( timeout > time(NULL) ) {
-			IoTHubClient_LL_DoWork(info->iotHubClientHandle);
-		}
+	if ( !( lua_isstring(L, 2) || lua_istable(L, 2) ) ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Parameter #2 must be a string or table");
+		return 2;
 	}
-	return 0;
+	IOTHUB_MESSAGE_HANDLE messageHandle = createMessage(L, 2, info);
+	if ( messageHandle == NULL ) {
+		lua_pushboolean(L, 0);
+		lua_insert(L, -2);			// false, errorMessage
+		return 2;
+	}
+	if ( !loopbackInject(info->loopbackDeviceId, messageHandle) ) {
+		IoTHubMessage_Destroy(messageHandle);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Out of memory");
+		return 2;
+	}
+	connectionWakeUp(info);
+	lua_pushboolean(L, 1);
+	return 1;
 }
 
 /***
@@ -839,6 +6228,12 @@ static int luaGetSendStatus(lua_State *L)
 	ConnectInfo *info = readConnectInfo(L, 1);
 	IOTHUB_CLIENT_STATUS status;
 	
+	if ( info && info->iotHubClientHandle && info->isConnected && info->thread ) {
+		// the SDK belongs to the io thread, so work it out from our own counts
+		status = ( info->inFlightCount > 0 || info->queuedCount > 0 ) ? IOTHUB_CLIENT_SEND_STATUS_BUSY : IOTHUB_CLIENT_SEND_STATUS_IDLE;
+		lua_pushinteger(L, status);
+		return 1;
+	}
 	if ( info && info->iotHubClientHandle && info->isConnected ) {
 		if ( IoTHubClient_LL_GetSendStatus(info->iotHubClientHandle, &status) !=  IOTHUB_CLIENT_OK ) {
 			lua_pushboolean(L, 0);
@@ -864,6 +6259,16 @@ static int luaLastMessageReceiveTime(lua_State *L)
 	ConnectInfo *info = readConnectInfo(L, 1);
 	time_t lastMessageReceiveTime;
 	
+	if ( info && info->iotHubClientHandle && info->isConnected && info->thread ) {
+		lastMessageReceiveTime = atomic_load(&info->thread->lastMessageReceiveTime);
+		if ( lastMessageReceiveTime == 0 ) {
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, "Unable to get last message receive time");
+			return 2;
+		}
+		lua_pushnumber(L, lastMessageReceiveTime);
+		return 1;
+	}
 	if ( info && info->iotHubClientHandle && info->isConnected ) {
 		if ( IoTHubClient_LL_GetLastMessageReceiveTime(info->iotHubClientHandle, &lastMessageReceiveTime) !=  IOTHUB_CLIENT_OK ) {
 			lua_pushboolean(L, 0);
@@ -899,6 +6304,12 @@ Static values to pass back from the message recieve function
 
 
 
+/***
+Value to use in a @{message} __body__ table for a JSON null or CBOR null, as a lua table cannot hold nil.
+@field null
+*/
+
+
 /***
 Static values to define the message content type in the @{message} table.
 @table contentType
@@ -917,6 +6328,14 @@ Static values that are sent from the IotHub after a message has been sent
 */
 
 
+/***
+Static values passed to the @{processStatus} function.
+@table connectionStatus
+@tfield integer CONNECTED a new client has replaced the old one
+@tfield integer RECONNECTING a new client is about to be made
+@tfield integer DISCONNECTED the new client could not be made, the old client is kept and the reconnect tried again later
+*/
+
 /***
 Static values to define the send status returned by the @{getSendStatus} function.
 @table sendStatus
@@ -937,8 +6356,33 @@ Static values to define the returned error code from the call to @{sendMessage}
 
 int luaopen_luaazureiothub (lua_State *L) 
 {
+	luaL_newmetatable(L, CONNECT_INFO_METATABLE_NAME);
+	lua_pushcfunction(L, luaConnectInfoGC);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	
+	luaL_newmetatable(L, TRANSPORT_INFO_METATABLE_NAME);
+	lua_pushcfunction(L, luaTransportInfoGC);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	
+	luaL_newmetatable(L, MESSAGE_TEMPLATE_METATABLE_NAME);
+	lua_pushcfunction(L, luaMessageTemplateGC);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	
+	luaL_newmetatable(L, MESSAGE_METATABLE_NAME);
+	lua_pushcfunction(L, luaMessageIndex);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, luaMessageGC);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	
 	luaL_newlib(L, luaAzureIotHubMethods);
 	
+	lua_pushlightuserdata(L, NULL);
+	lua_setfield(L, -2, "null");
+	
 	lua_pushstring(L, "messageReceive");
 	lua_createtable(L, 0, 3);
 
@@ -992,6 +6436,24 @@ int luaopen_luaazureiothub (lua_State *L)
 	lua_settable(L, -3);		// messageSend
 	
 
+	lua_pushstring(L, "connectionStatus");
+	lua_createtable(L, 0, 3);
+	
+	lua_pushstring(L, "CONNECTED");
+	lua_pushnumber(L, CONNECTION_STATUS_CONNECTED);
+	lua_settable(L, -3);
+	
+	lua_pushstring(L, "RECONNECTING");
+	lua_pushnumber(L, CONNECTION_STATUS_RECONNECTING);
+	lua_settable(L, -3);
+	
+	lua_pushstring(L, "DISCONNECTED");
+	lua_pushnumber(L, CONNECTION_STATUS_DISCONNECTED);
+	lua_settable(L, -3);
+	
+	lua_settable(L, -3);		// connectionStatus
+	
+
 	lua_pushstring(L, "sendStatus");
 	lua_createtable(L, 0, 2);
 	
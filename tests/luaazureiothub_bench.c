@@ -0,0 +1,421 @@
+/*
+
+ Microbenchmarks for the luaazureiothub library.
+
+ The library is linked against the stub SDK in tests/sdk, so the numbers are the cost of the library itself: turning
+ lua values into SDK messages and back, making message ids and calling the lua callbacks. Each benchmark is run
+ with a growing number of iterations until it takes at least BENCH_MIN_TIME_MS, and then one JSON object is printed
+ per benchmark:
+
+	{"name":"sendMessage/table-8","iterations":262144,"nsPerOp":1432.7,"allocsPerOp":21.00}
+
+ allocsPerOp counts every malloc, calloc and realloc made by the library, the stub SDK and lua during the run.
+
+ Usage: luaazureiothub_bench [name prefix]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "iothub_message.h"
+#include "luaazureiothub.h"
+#include "iothubid.h"
+
+
+#define BENCH_MIN_TIME_MS						200			// a run has to take at least this long to be reported
+#define BENCH_MAX_ITERATIONS					100000000
+#define BENCH_CONNECTION_STRING					"HostName=bench.loopback;DeviceId=bench;SharedAccessKey=YmVuY2g="
+
+
+// not in luaazureiothub.h, the library only uses it for its own callbacks
+void pushMessageTable(lua_State *L, IOTHUB_MESSAGE_HANDLE messageHandle);
+
+
+/*
+ Allocation counting.
+
+ The process wide allocator functions are wrapped, so allocations made inside lua and the SDK are counted as well
+ as the ones made by the library.
+*/
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void __libc_free(void *pointer);
+
+static unsigned long long allocCount = 0;
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&allocCount, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	__atomic_add_fetch(&allocCount, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size)
+{
+	if ( size > 0 ) {
+		__atomic_add_fetch(&allocCount, 1, __ATOMIC_RELAXED);
+	}
+	return __libc_realloc(pointer, size);
+}
+
+void free(void *pointer)
+{
+	__libc_free(pointer);
+}
+
+static unsigned long long allocCountNow(void)
+{
+	return __atomic_load_n(&allocCount, __ATOMIC_RELAXED);
+}
+
+static unsigned long long timeNowNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+typedef struct Bench Bench;
+typedef void (*BenchSetup)(lua_State *L, const Bench *bench);
+typedef void (*BenchRun)(lua_State *L, const Bench *bench, long iterations);
+
+struct Bench {
+	const char *name;
+	BenchSetup setup;						// leaves the state used by run on the lua stack
+	BenchRun run;
+	const char *script;						// lua benchmarks, a chunk that returns function(iterations)
+	int count;								// property count or message id strategy for the C benchmarks
+};
+
+
+/*
+ Lua benchmarks.
+
+ Each script is run after BENCH_LUA_PRELUDE and returns the function that is timed. The connections use the
+ loopback protocol with no latency, so a loop confirms everything that was sent before it.
+*/
+
+#define BENCH_LUA_PRELUDE																						\
+	"local luaazureiothub = ...\n"																				\
+	"local body = '{\"temperature\":21.5,\"humidity\":40}'\n"													\
+	"local properties8 = {}\n"																					\
+	"for index = 1, 8 do properties8['key' .. index] = 'value' .. index end\n"									\
+	"local function connect(options)\n"																		\
+	"  options = options or {}\n"																				\
+	"  options.connectionString = '" BENCH_CONNECTION_STRING "'\n"												\
+	"  options.protocol = 'loopback'\n"																			\
+	"  options.maxInFlight = 256\n"																				\
+	"  options.idStrategy = options.idStrategy or 'sequence'\n"													\
+	"  return assert(luaazureiothub.connect(options))\n"														\
+	"end\n"
+
+// send in blocks of half the send window, with a loop after each block to collect the confirmations
+#define BENCH_LUA_SEND(message)																					\
+	"return function(count)\n"																					\
+	"  for index = 1, count do\n"																				\
+	"    iothub:sendMessage(" message ", 0)\n"																	\
+	"    if index % 128 == 0 then iothub:loop(0) end\n"															\
+	"  end\n"																									\
+	"  iothub:loop(0)\n"																						\
+	"end\n"
+
+/*
+ Bodies for the message body benchmarks, with a JSON encoder in plain lua written the way dkjson does it to compare 
+ the body = <table> encoding against.
+*/
+#define BENCH_LUA_BODIES																							\
+	"local reading = { deviceId = 'bench', time = 1700000000, temperature = 21.5, humidity = 40,\n"			\
+	"  online = true, tags = { 'lab', 'floor-2' }, location = { lat = 51.5072, lon = -0.1276 } }\n"			\
+	"local batch = {}\n"																						\
+	"for index = 1, 32 do batch[index] = reading end\n"														\
+	"local escapes = { ['\"'] = '\\\\\"', ['\\\\'] = '\\\\\\\\', ['\\n'] = '\\\\n', ['\\r'] = '\\\\r', ['\\t'] = '\\\\t' }\n"	\
+	"local function escape(text)\n"																			\
+	"  return '\"' .. text:gsub('[%c\"\\\\]', function(c) return escapes[c] or string.format('\\\\u%04x', c:byte()) end) .. '\"'\n"	\
+	"end\n"																									\
+	"local function encodeValue(value, buffer)\n"																\
+	"  local valueType = type(value)\n"																		\
+	"  if valueType == 'string' then buffer[#buffer + 1] = escape(value)\n"									\
+	"  elseif valueType == 'number' then\n"																	\
+	"    buffer[#buffer + 1] = value % 1 == 0 and string.format('%d', value) or string.format('%.17g', value)\n"	\
+	"  elseif valueType == 'boolean' then buffer[#buffer + 1] = tostring(value)\n"							\
+	"  elseif #value > 0 then\n"																				\
+	"    buffer[#buffer + 1] = '['\n"																			\
+	"    for index = 1, #value do\n"																			\
+	"      if index > 1 then buffer[#buffer + 1] = ',' end\n"													\
+	"      encodeValue(value[index], buffer)\n"																\
+	"    end\n"																								\
+	"    buffer[#buffer + 1] = ']'\n"																			\
+	"  else\n"																									\
+	"    buffer[#buffer + 1] = '{'\n"																			\
+	"    local isFirst = true\n"																				\
+	"    for key, item in pairs(value) do\n"																	\
+	"      if not isFirst then buffer[#buffer + 1] = ',' end\n"												\
+	"      isFirst = false\n"																					\
+	"      buffer[#buffer + 1] = escape(tostring(key))\n"														\
+	"      buffer[#buffer + 1] = ':'\n"																		\
+	"      encodeValue(item, buffer)\n"																		\
+	"    end\n"																								\
+	"    buffer[#buffer + 1] = '}'\n"																			\
+	"  end\n"																									\
+	"end\n"																									\
+	"local function encode(value)\n"																			\
+	"  local buffer = {}\n"																					\
+	"  encodeValue(value, buffer)\n"																			\
+	"  return table.concat(buffer)\n"																			\
+	"end\n"
+
+static void setupLua(lua_State *L, const Bench *bench)
+{
+	if ( luaL_loadstring(L, bench->script) != LUA_OK ) {
+		fprintf(stderr, "%s: %s\n", bench->name, lua_tostring(L, -1));
+		exit(1);
+	}
+	lua_getglobal(L, "luaazureiothub");
+	if ( lua_pcall(L, 1, 1, 0) != LUA_OK || !lua_isfunction(L, -1) ) {
+		fprintf(stderr, "%s: %s\n", bench->name, lua_isstring(L, -1) ? lua_tostring(L, -1) : "script must return a function");
+		exit(1);
+	}
+}
+
+static void runLua(lua_State *L, const Bench *bench, long iterations)
+{
+	lua_pushvalue(L, -1);
+	lua_pushinteger(L, iterations);
+	if ( lua_pcall(L, 1, 0, 0) != LUA_OK ) {
+		fprintf(stderr, "%s: %s\n", bench->name, lua_tostring(L, -1));
+		exit(1);
+	}
+}
+
+
+/*
+ pushMessageTable with a message that has an id, a correlation id and bench->count properties.
+*/
+static int messageGC(lua_State *L)
+{
+	IOTHUB_MESSAGE_HANDLE *messageHandle = lua_touserdata(L, 1);
+	if ( *messageHandle ) {
+		IoTHubMessage_Destroy(*messageHandle);
+		*messageHandle = NULL;
+	}
+	return 0;
+}
+
+static void setupMessage(lua_State *L, const Bench *bench)
+{
+	char name[32];
+	char value[32];
+	int index;
+	IOTHUB_MESSAGE_HANDLE *messageHandle = lua_newuserdata(L, sizeof(IOTHUB_MESSAGE_HANDLE));
+
+	// the userdata destroys the message when the lua state is closed
+	*messageHandle = NULL;
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, messageGC);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+
+	*messageHandle = IoTHubMessage_CreateFromString("{\"temperature\":21.5,\"humidity\":40}");
+	if ( *messageHandle == NULL ) {
+		fprintf(stderr, "%s: cannot create message\n", bench->name);
+		exit(1);
+	}
+	IoTHubMessage_SetMessageId(*messageHandle, "2d1b0f3c-7a4e-4c53-9d61-0e8f5a9b7c21");
+	IoTHubMessage_SetCorrelationId(*messageHandle, "bench");
+	for ( index = 0; index < bench->count; index ++ ) {
+		snprintf(name, sizeof(name), "key%d", index);
+		snprintf(value, sizeof(value), "value%d", index);
+		Map_Add(IoTHubMessage_Properties(*messageHandle), name, value);
+	}
+}
+
+static void runMessage(lua_State *L, const Bench *bench, long iterations)
+{
+	IOTHUB_MESSAGE_HANDLE *messageHandle = lua_touserdata(L, -1);
+	long iteration;
+	(void) bench;
+	for ( iteration = 0; iteration < iterations; iteration ++ ) {
+		pushMessageTable(L, *messageHandle);
+		lua_pop(L, 1);
+	}
+}
+
+
+/*
+ messageIdNext with the strategy in bench->count.
+*/
+static void setupMessageId(lua_State *L, const Bench *bench)
+{
+	MessageIdGenerator *generator = lua_newuserdata(L, sizeof(MessageIdGenerator));
+	messageIdInit(generator, (MessageIdStrategy) bench->count);
+}
+
+static void runMessageId(lua_State *L, const Bench *bench, long iterations)
+{
+	MessageIdGenerator *generator = lua_touserdata(L, -1);
+	char buffer[MESSAGE_ID_BUFFER_SIZE];
+	long iteration;
+	(void) bench;
+	for ( iteration = 0; iteration < iterations; iteration ++ ) {
+		messageIdNext(generator, buffer);
+	}
+}
+
+
+static const Bench benches[] = {
+	{ "sendMessage/string", setupLua, runLua,
+		BENCH_LUA_PRELUDE
+		"local iothub = connect()\n"
+		BENCH_LUA_SEND("body"), 0 },
+	{ "sendMessage/table-0", setupLua, runLua,
+		BENCH_LUA_PRELUDE
+		"local iothub = connect()\n"
+		BENCH_LUA_SEND("{ text = body }"), 0 },
+	{ "sendMessage/table-8", setupLua, runLua,
+		BENCH_LUA_PRELUDE
+		"local iothub = connect()\n"
+		BENCH_LUA_SEND("{ text = body, correlationId = 'bench', property = properties8 }"), 0 },
+	{ "sendMessage/template-8", setupLua, runLua,
+		BENCH_LUA_PRELUDE
+		"local iothub = connect()\n"
+		"local template = assert(luaazureiothub.messageTemplate{ correlationId = 'bench', property = properties8 })\n"
+		BENCH_LUA_SEND("template, body"), 0 },
+	// the same tables as JSON made in lua and sent as text, then encoded by the library
+	{ "sendMessage/body-lua-json", setupLua, runLua,
+		BENCH_LUA_PRELUDE BENCH_LUA_BODIES
+		"local iothub = connect()\n"
+		BENCH_LUA_SEND("{ text = encode(reading) }"), 0 },
+	{ "sendMessage/body-json", setupLua, runLua,
+		BENCH_LUA_PRELUDE BENCH_LUA_BODIES
+		"local iothub = connect()\n"
+		BENCH_LUA_SEND("{ body = reading, encoding = 'json' }"), 0 },
+	{ "sendMessage/body-cbor", setupLua, runLua,
+		BENCH_LUA_PRELUDE BENCH_LUA_BODIES
+		"local iothub = connect()\n"
+		BENCH_LUA_SEND("{ body = reading, encoding = 'cbor' }"), 0 },
+	{ "sendMessage/body-lua-json-32", setupLua, runLua,
+		BENCH_LUA_PRELUDE BENCH_LUA_BODIES
+		"local iothub = connect()\n"
+		BENCH_LUA_SEND("{ text = encode(batch) }"), 0 },
+	{ "sendMessage/body-json-32", setupLua, runLua,
+		BENCH_LUA_PRELUDE BENCH_LUA_BODIES
+		"local iothub = connect()\n"
+		BENCH_LUA_SEND("{ body = batch, encoding = 'json' }"), 0 },
+	{ "sendMessage/body-cbor-32", setupLua, runLua,
+		BENCH_LUA_PRELUDE BENCH_LUA_BODIES
+		"local iothub = connect()\n"
+		BENCH_LUA_SEND("{ body = batch, encoding = 'cbor' }"), 0 },
+	{ "pushMessageTable/properties-0", setupMessage, runMessage, NULL, 0 },
+	{ "pushMessageTable/properties-8", setupMessage, runMessage, NULL, 8 },
+	{ "pushMessageTable/properties-64", setupMessage, runMessage, NULL, 64 },
+	{ "messageId/uuid", setupMessageId, runMessageId, NULL, MESSAGE_ID_UUID },
+	{ "messageId/uuid-batched", setupMessageId, runMessageId, NULL, MESSAGE_ID_UUID_BATCHED },
+	{ "messageId/sequence", setupMessageId, runMessageId, NULL, MESSAGE_ID_SEQUENCE },
+	// the send and its confirmation, so subtract sendMessage/string for the cost of the callback
+	{ "dispatch/processSent", setupLua, runLua,
+		BENCH_LUA_PRELUDE
+		"local confirmed = 0\n"
+		"local iothub = connect{ processSent = function() confirmed = confirmed + 1 end }\n"
+		BENCH_LUA_SEND("body"), 0 },
+	{ "dispatch/processRead", setupLua, runLua,
+		BENCH_LUA_PRELUDE
+		"local received = 0\n"
+		"local iothub = connect{ processRead = function(message) received = received + #message.text end }\n"
+		"local message = { text = body, property = properties8 }\n"
+		"return function(count)\n"
+		"  for index = 1, count do\n"
+		"    iothub:loopbackReceive(message)\n"
+		"    iothub:loop(0)\n"
+		"  end\n"
+		"end\n", 0 },
+	{ "dispatch/processRead-lazy", setupLua, runLua,
+		BENCH_LUA_PRELUDE
+		"local received = 0\n"
+		"local iothub = connect{ lazyMessages = true, processRead = function(message) received = received + #message.text end }\n"
+		"local message = { text = body, property = properties8 }\n"
+		"return function(count)\n"
+		"  for index = 1, count do\n"
+		"    iothub:loopbackReceive(message)\n"
+		"    iothub:loop(0)\n"
+		"  end\n"
+		"end\n", 0 },
+	{ NULL, NULL, NULL, NULL, 0 }
+};
+
+
+/*
+ Run one benchmark with more iterations each time until the run is long enough, then print the last run.
+*/
+static void runBench(lua_State *L, const Bench *bench)
+{
+	unsigned long long elapsedNs = 0;
+	unsigned long long allocs = 0;
+	long iterations = 1;
+	long nextIterations = 1;
+	int top = lua_gettop(L);
+
+	bench->setup(L, bench);
+	// warm up, this also makes the first send records and message ids
+	bench->run(L, bench, 1);
+	while ( elapsedNs < BENCH_MIN_TIME_MS * 1000000ULL && iterations < BENCH_MAX_ITERATIONS ) {
+		iterations = nextIterations;
+		lua_gc(L, LUA_GCCOLLECT, 0);
+		unsigned long long startAllocs = allocCountNow();
+		unsigned long long startNs = timeNowNs();
+		bench->run(L, bench, iterations);
+		elapsedNs = timeNowNs() - startNs;
+		allocs = allocCountNow() - startAllocs;
+
+		// aim past the minimum time from the last run, but never more than 100 times the iterations
+		double predicted = elapsedNs > 0 ? (double) iterations * BENCH_MIN_TIME_MS * 1200000.0 / elapsedNs : iterations * 100.0;
+		nextIterations = predicted > iterations * 100.0 ? iterations * 100 : (long) predicted;
+		if ( nextIterations <= iterations ) {
+			nextIterations = iterations * 2;
+		}
+		if ( nextIterations > BENCH_MAX_ITERATIONS ) {
+			nextIterations = BENCH_MAX_ITERATIONS;
+		}
+	}
+	printf("{\"name\":\"%s\",\"iterations\":%ld,\"nsPerOp\":%.1f,\"allocsPerOp\":%.2f}\n", bench->name, iterations,
+			(double) elapsedNs / iterations, (double) allocs / iterations);
+	fflush(stdout);
+	lua_settop(L, top);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *prefix = argc > 1 ? argv[1] : "";
+	const Bench *bench;
+	lua_State *L = luaL_newstate();
+
+	if ( L == NULL ) {
+		fprintf(stderr, "Cannot create the lua state\n");
+		return 1;
+	}
+	luaL_openlibs(L);
+	luaL_requiref(L, "luaazureiothub", luaopen_luaazureiothub, 1);
+	lua_pop(L, 1);
+
+	for ( bench = benches; bench->name; bench ++ ) {
+		if ( strncmp(bench->name, prefix, strlen(prefix)) == 0 ) {
+			runBench(L, bench);
+		}
+	}
+	lua_close(L);
+	return 0;
+}
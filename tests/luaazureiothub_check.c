@@ -0,0 +1,480 @@
+/*
+
+ Behaviour tests for the luaazureiothub library.
+
+ Checks what the library produces against known values, using the loopback protocol and the stub SDK in tests/sdk
+ the same as the soak test, so no IotHub or network is needed. Each test prints a JSON line with its result, and the
+ reasons for a failure on stderr:
+
+	encode		message bodies sent as JSON and as CBOR, read back from the copy of each message that the loopback
+				transport passes to processSent
+	journal		the records replayed after the journal file is opened again: in the order written, after a torn
+				write of the file header, across the end of the ring, and with only the part from the head read
+
+ Usage: luaazureiothub_check [test name]
+
+*/
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "iothubjournal.h"
+#include "luaazureiothub.h"
+
+
+#define CHECK_CONNECTION_STRING					"HostName=check.loopback;DeviceId=check;SharedAccessKey=Y2hlY2s="
+#define CHECK_JOURNAL_OFFSETS					64			// offsets kept of the last records written
+#define CHECK_JOURNAL_PENDING					20			// records left un-acked while the ring wraps
+#define CHECK_JOURNAL_WRAP_RECORDS				300
+#define CHECK_JOURNAL_WRAP_LENGTH				1100		// 1128 byte records, the end of a lap leaves room for a wrap record
+#define CHECK_JOURNAL_GAP_LENGTH				496			// 520 byte records, the end of a lap leaves 16 bytes
+
+
+typedef struct {
+	const char *name;
+	bool (*run)(lua_State *L, const char *name);
+} CheckTest;
+
+
+/*
+ Each case is a body with the JSON text and the CBOR bytes in hex it is sent as, or the error message sendMessage
+ returns for it. Returns the number of checks made and the failures, one to a line.
+*/
+static const char *encodeScript =
+	"local luaazureiothub = ...\n"
+	"local null = luaazureiothub.null\n"
+	"local function nest(depth)\n"
+	"  local body = {}\n"
+	"  for index = 2, depth do body = { body } end\n"
+	"  return body\n"
+	"end\n"
+	"local loop = {}\n"
+	"loop[1] = loop\n"
+	"local cases = {\n"
+	"  { 'integers', { 0, -5, 23, 24, 2^53, -2^53 }, '[0,-5,23,24,9007199254740992,-9007199254740992]',\n"
+	"    '860024171818' .. '1b0020000000000000' .. '3b001fffffffffffff' },\n"
+	"  { 'floats', { 2^53 + 2, 0.1, 1e300, 1.5, -0.25 }, '[9007199254740994.0,0.1,1e+300,1.5,-0.25]',\n"
+	"    '85' .. 'fb4340000000000001' .. 'fb3fb999999999999a' .. 'fb7e37e43c8800759c' .. 'fa3fc00000' .. 'fabe800000' },\n"
+	"  { 'escapes', { 'quote \" backslash \\\\ slash /', '\\b\\f\\n\\r\\t', '\\0\\1\\31\\127', 'caf\\195\\169' },\n"
+	"    '[\"quote \\\\\" backslash \\\\\\\\ slash /\",\"\\\\b\\\\f\\\\n\\\\r\\\\t\",\"\\\\u0000\\\\u0001\\\\u001f\\127\",\"caf\\195\\169\"]',\n"
+	"    '84781b71756f74652022206261636b736c617368205c20736c617368202f65080c0a0d096400011f7f65636166c3a9' },\n"
+	"  { 'binary', { '\\255\\0\\1', 'ab\\128', '\\192\\175', '\\237\\160\\128' }, '[\"/wAB\",\"YWKA\",\"wK8=\",\"7aCA\"]',\n"
+	"    '84' .. '43ff0001' .. '43616280' .. '42c0af' .. '43eda080' },\n"
+	"  { 'null and empty', { null, {}, { {} }, true, false }, '[null,[],[[]],true,false]', '85f6808180f5f4' },\n"
+	"  { 'null field', { alarm = null }, '{\"alarm\":null}', 'a165616c61726df6' },\n"
+	"  { 'number key', { [3] = 'c' }, '{\"3\":\"c\"}', 'a1036163' },\n"
+	"  { 'float key', { [0.5] = 'h' }, '{\"0.5\":\"h\"}', 'a1fa3f0000006168' },\n"
+	"  { 'depth limit', nest(32), string.rep('[', 32) .. string.rep(']', 32), string.rep('81', 31) .. '80' },\n"
+	"  { 'too deep', nest(33), 'message.body is nested too deeply', 'message.body is nested too deeply' },\n"
+	"  { 'contains itself', loop, 'message.body is nested too deeply', 'message.body is nested too deeply' },\n"
+	"}\n"
+	"local received = {}\n"
+	"local iothub = assert(luaazureiothub.connect{\n"
+	"  connectionString = '" CHECK_CONNECTION_STRING "', protocol = 'loopback',\n"
+	"  processSent = function(status, message, sequence) received[sequence] = { status, message.text } end,\n"
+	"})\n"
+	"local function hex(text)\n"
+	"  return (text:gsub('.', function(character) return string.format('%02x', character:byte()) end))\n"
+	"end\n"
+	"local expected = {}\n"
+	"local failures = {}\n"
+	"for _, case in ipairs(cases) do\n"
+	"  for _, encoding in ipairs{ 'json', 'cbor' } do\n"
+	"    local name, wanted = case[1] .. ' ' .. encoding, encoding == 'json' and case[3] or case[4]\n"
+	"    local ok, result = iothub:sendMessage({ body = case[2], encoding = encoding }, 0)\n"
+	"    if wanted:find('^message%.') then\n"
+	"      if ok or result ~= wanted then failures[#failures + 1] = name .. ': ' .. tostring(result) end\n"
+	"    else\n"
+	"      assert(ok, result)\n"
+	"      expected[result] = { name, encoding, wanted }\n"
+	"    end\n"
+	"  end\n"
+	"end\n"
+	"local start = os.time()\n"
+	"while iothub:stats().inFlight + iothub:stats().queued > 0 and os.time() - start < 10 do iothub:loop(0.001) end\n"
+	"iothub:disconnect()\n"
+	"for sequence, case in pairs(expected) do\n"
+	"  local name, encoding, wanted = case[1], case[2], case[3]\n"
+	"  local result = received[sequence]\n"
+	"  local text = result and ( encoding == 'cbor' and hex(result[2]) or result[2] )\n"
+	"  if not result or result[1] ~= luaazureiothub.messageSend.OK then\n"
+	"    failures[#failures + 1] = name .. ': not confirmed'\n"
+	"  elseif text ~= wanted then\n"
+	"    failures[#failures + 1] = name .. ': ' .. text\n"
+	"  end\n"
+	"end\n"
+	"table.sort(failures)\n"
+	"return #cases * 2, table.concat(failures, '\\n')\n";
+
+
+static bool printResult(const char *name, bool isPass, long checkCount)
+{
+	printf("{\"test\":\"%s\",\"result\":\"%s\",\"checks\":%ld}\n", name, isPass ? "pass" : "fail", checkCount);
+	fflush(stdout);
+	return isPass;
+}
+
+/*
+ Run the script with the library as its argument, it returns the number of checks and the failures.
+*/
+static bool runScript(lua_State *L, const char *name, const char *script)
+{
+	const char *failures;
+	long checkCount;
+	bool isPass;
+
+	if ( luaL_loadstring(L, script) != LUA_OK ) {
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+	lua_getglobal(L, "luaazureiothub");
+	if ( lua_pcall(L, 1, 2, 0) != LUA_OK ) {
+		fprintf(stderr, "%s: %s\n", name, lua_tostring(L, -1));
+		exit(1);
+	}
+	checkCount = (long) lua_tointeger(L, -2);
+	failures = lua_tostring(L, -1);
+	isPass = failures && failures[0] == 0;
+	if ( !isPass ) {
+		fprintf(stderr, "%s\n", failures ? failures : "no result");
+	}
+	lua_pop(L, 2);
+	return printResult(name, isPass, checkCount);
+}
+
+static bool checkEncode(lua_State *L, const char *name)
+{
+	return runScript(L, name, encodeScript);
+}
+
+/*
+ Each journal test makes its own file in /tmp, removed once it is done. The data of a record is made from its number,
+ so what is read back can be checked against the number alone.
+*/
+typedef struct {
+	char path[64];
+	unsigned long long offsets[CHECK_JOURNAL_OFFSETS];	// of the last records written, by number
+	long checkCount;
+	long failureCount;
+} JournalCheck;
+
+static void expect(JournalCheck *check, bool isTrue, const char *format, ...)
+{
+	va_list arguments;
+	check->checkCount ++;
+	if ( isTrue ) {
+		return;
+	}
+	check->failureCount ++;
+	va_start(arguments, format);
+	vfprintf(stderr, format, arguments);
+	va_end(arguments);
+	fputc('\n', stderr);
+}
+
+static void makeJournalFile(JournalCheck *check)
+{
+	int fd;
+	strcpy(check->path, "/tmp/luaazureiothub_check_XXXXXX");
+	fd = mkstemp(check->path);
+	if ( fd < 0 ) {
+		fprintf(stderr, "Cannot create a journal file in /tmp\n");
+		exit(1);
+	}
+	close(fd);
+}
+
+static Journal *openJournal(JournalCheck *check)
+{
+	const char *errorMessage = NULL;
+	Journal *journal = journalOpen(check->path, 0, false, &errorMessage);
+	if ( journal == NULL ) {
+		fprintf(stderr, "%s: %s\n", check->path, errorMessage);
+		exit(1);
+	}
+	return journal;
+}
+
+/*
+ Overwrite part of the closed journal file, as a crash part way through a write would leave it.
+*/
+static void tearJournalFile(JournalCheck *check, off_t position, size_t length)
+{
+	unsigned char garbage[4096];
+	int fd = open(check->path, O_WRONLY);
+	memset(garbage, 0xA5, sizeof(garbage));
+	if ( fd < 0 || length > sizeof(garbage) || pwrite(fd, garbage, length, position) != (ssize_t) length ) {
+		fprintf(stderr, "Cannot write to %s\n", check->path);
+		exit(1);
+	}
+	close(fd);
+}
+
+static off_t recordPosition(Journal *journal, unsigned long long offset)
+{
+	return JOURNAL_HEADER_SIZE + offset % journal->capacity;
+}
+
+/*
+ Length of the data of the record 'number', or 'length' if that is not 0.
+*/
+static size_t recordLength(int number, size_t length)
+{
+	return length ? length : (size_t) ( 16 + ( number * 37 ) % 200 );
+}
+
+static void writeRecord(JournalCheck *check, Journal *journal, int number, size_t length)
+{
+	unsigned long long offset;
+	unsigned char *data;
+	size_t index;
+	length = recordLength(number, length);
+	data = journalReserve(journal, length, &offset);
+	expect(check, data != NULL, "record %d: journal full", number);
+	if ( data == NULL ) {
+		return;
+	}
+	for ( index = 0; index < length; index ++ ) {
+		data[index] = (unsigned char) ( number * 31 + index );
+	}
+	journalCommit(journal, offset);
+	check->offsets[number % CHECK_JOURNAL_OFFSETS] = offset;
+}
+
+static void ackRecord(JournalCheck *check, Journal *journal, int number)
+{
+	journalAck(journal, check->offsets[number % CHECK_JOURNAL_OFFSETS]);
+}
+
+/*
+ Check that journalNext steps through the 'count' records in 'numbers', in that order and with their data.
+*/
+static void expectReplay(JournalCheck *check, Journal *journal, const char *stage, const int *numbers, int count, size_t length)
+{
+	unsigned long long offset = JOURNAL_NO_RECORD;
+	const void *data;
+	size_t dataLength;
+	int index = 0;
+
+	expect(check, journal->pendingCount == (unsigned int) count, "%s: %u pending, expected %d", stage, 
+			journal->pendingCount, count);
+	while ( index < count && journalNext(journal, &offset, &data, &dataLength) ) {
+		const unsigned char *bytes = data;
+		bool isData = dataLength == recordLength(numbers[index], length);
+		for ( size_t byteIndex = 0; isData && byteIndex < dataLength; byteIndex ++ ) {
+			isData = bytes[byteIndex] == (unsigned char) ( numbers[index] * 31 + byteIndex );
+		}
+		expect(check, isData, "%s: replay %d is not record %d", stage, index, numbers[index]);
+		index ++;
+	}
+	expect(check, index == count && !journalNext(journal, &offset, &data, &dataLength), 
+			"%s: %d records replayed, expected %d", stage, index + ( index == count ), count);
+}
+
+/*
+ Records acked out of order are skipped, and the rest are replayed in the order written after the file is opened
+ again, with the sequence carrying on.
+*/
+static void checkJournalReplay(JournalCheck *check)
+{
+	static const int pending[] = { 1, 3, 4, 6, 7, 8, 9 };
+	static const int pendingAfterAck[] = { 3, 4, 6, 7, 8, 9, 10 };
+	Journal *journal = openJournal(check);
+	int number;
+
+	for ( number = 0; number < 10; number ++ ) {
+		writeRecord(check, journal, number, 0);
+	}
+	ackRecord(check, journal, 0);
+	ackRecord(check, journal, 5);
+	ackRecord(check, journal, 2);
+	expectReplay(check, journal, "replay", pending, 7, 0);
+	journalClose(journal);
+
+	journal = openJournal(check);
+	expectReplay(check, journal, "replay after reopen", pending, 7, 0);
+	writeRecord(check, journal, 10, 0);
+	ackRecord(check, journal, 1);
+	expectReplay(check, journal, "replay after ack", pendingAfterAck, 7, 0);
+	journalClose(journal);
+
+	journal = openJournal(check);
+	expectReplay(check, journal, "replay after second reopen", pendingAfterAck, 7, 0);
+	journalClose(journal);
+}
+
+/*
+ A torn write of the newest header copy falls back to the older copy, which has the head from one ack before. If
+ both copies are torn the journal starts again empty.
+*/
+static void checkJournalTornHeader(JournalCheck *check)
+{
+	static const int pending[] = { 4, 5, 6, 7, 8, 9 };
+	static const int pendingAfterAck[] = { 5, 6, 7, 8, 9, 10 };
+	Journal *journal = openJournal(check);
+	uint64_t generation;
+	int number;
+
+	for ( number = 0; number < 10; number ++ ) {
+		writeRecord(check, journal, number, 0);
+	}
+	for ( number = 0; number < 4; number ++ ) {
+		ackRecord(check, journal, number);
+	}
+	generation = journal->generation;
+	journalClose(journal);
+	tearJournalFile(check, ( generation & 1 ) * ( JOURNAL_HEADER_SIZE / 2 ) + 16, 8);
+
+	journal = openJournal(check);
+	expect(check, journal->generation == generation - 1, "torn header: generation %llu, expected %llu",
+			(unsigned long long) journal->generation, (unsigned long long) generation - 1);
+	expectReplay(check, journal, "torn header", pending, 6, 0);
+	writeRecord(check, journal, 10, 0);
+	ackRecord(check, journal, 4);
+	journalClose(journal);
+
+	journal = openJournal(check);
+	expectReplay(check, journal, "torn header after ack", pendingAfterAck, 6, 0);
+	journalClose(journal);
+	tearJournalFile(check, 16, 8);
+	tearJournalFile(check, JOURNAL_HEADER_SIZE / 2 + 16, 8);
+
+	journal = openJournal(check);
+	expectReplay(check, journal, "both headers torn", NULL, 0, 0);
+	journalClose(journal);
+}
+
+/*
+ Write records of 'length' bytes for a few laps of the ring, keeping CHECK_JOURNAL_PENDING of them un-acked, then
+ replay them after the file is opened again.
+*/
+static void checkJournalWrap(JournalCheck *check, size_t length, const char *stage)
+{
+	int pending[CHECK_JOURNAL_PENDING + 1];
+	Journal *journal = openJournal(check);
+	int number;
+
+	for ( number = 0; number < CHECK_JOURNAL_WRAP_RECORDS; number ++ ) {
+		if ( number >= CHECK_JOURNAL_PENDING ) {
+			ackRecord(check, journal, number - CHECK_JOURNAL_PENDING);
+		}
+		writeRecord(check, journal, number, length);
+	}
+	expect(check, journal->tail / journal->capacity >= 2, "%s: %llu bytes written, not two laps of the ring", stage,
+			(unsigned long long) journal->tail);
+	journalClose(journal);
+
+	journal = openJournal(check);
+	for ( number = 0; number <= CHECK_JOURNAL_PENDING; number ++ ) {
+		pending[number] = CHECK_JOURNAL_WRAP_RECORDS - CHECK_JOURNAL_PENDING + number;
+	}
+	expectReplay(check, journal, stage, pending, CHECK_JOURNAL_PENDING, length);
+	writeRecord(check, journal, CHECK_JOURNAL_WRAP_RECORDS, length);
+	expectReplay(check, journal, stage, pending, CHECK_JOURNAL_PENDING + 1, length);
+	journalClose(journal);
+}
+
+/*
+ Recovery starts at the head, so the acked records in front of it are not read, even when they are no longer valid.
+*/
+static void checkJournalRecoverFromHead(JournalCheck *check)
+{
+	static const int pending[] = { 5, 6, 7, 8, 9 };
+	Journal *journal = openJournal(check);
+	unsigned long long head;
+	off_t start;
+	int number;
+
+	for ( number = 0; number < 10; number ++ ) {
+		writeRecord(check, journal, number, 0);
+	}
+	for ( number = 0; number < 5; number ++ ) {
+		ackRecord(check, journal, number);
+	}
+	head = journal->head;
+	expect(check, head == check->offsets[5], "recover: head at %llu, expected %llu", head, check->offsets[5]);
+	start = recordPosition(journal, check->offsets[0]);
+	journalClose(journal);
+	tearJournalFile(check, start, head - check->offsets[0]);
+
+	journal = openJournal(check);
+	expect(check, journal->head == head, "recover: head at %llu after reopen, expected %llu", 
+			(unsigned long long) journal->head, head);
+	expectReplay(check, journal, "recover", pending, 5, 0);
+	journalClose(journal);
+}
+
+static bool checkJournal(lua_State *L, const char *name)
+{
+	JournalCheck check;
+	int index;
+	void (*const checks[])(JournalCheck *check) = {
+		checkJournalReplay,
+		checkJournalTornHeader,
+		checkJournalRecoverFromHead,
+	};
+
+	(void) L;
+	memset(&check, 0, sizeof(JournalCheck));
+	for ( index = 0; index < (int) ( sizeof(checks) / sizeof(checks[0]) ); index ++ ) {
+		makeJournalFile(&check);
+		checks[index](&check);
+		unlink(check.path);
+	}
+	// records that end with a wrap record, and with a gap too small for one
+	makeJournalFile(&check);
+	checkJournalWrap(&check, CHECK_JOURNAL_WRAP_LENGTH, "wrap record");
+	unlink(check.path);
+	makeJournalFile(&check);
+	checkJournalWrap(&check, CHECK_JOURNAL_GAP_LENGTH, "wrap gap");
+	unlink(check.path);
+	return printResult(name, check.failureCount == 0, check.checkCount);
+}
+
+static const CheckTest tests[] = {
+	{ "encode", checkEncode },
+	{ "journal", checkJournal },
+	{ NULL, NULL }
+};
+
+int main(int argc, char *argv[])
+{
+	const CheckTest *test;
+	bool isPass = true;
+	bool isFound = false;
+	lua_State *L;
+
+	L = luaL_newstate();
+	if ( L == NULL ) {
+		fprintf(stderr, "Cannot create the lua state\n");
+		return 1;
+	}
+	luaL_openlibs(L);
+	luaL_requiref(L, "luaazureiothub", luaopen_luaazureiothub, 1);
+	lua_pop(L, 1);
+
+	for ( test = tests; test->name; test ++ ) {
+		if ( argc > 1 && strcmp(argv[1], test->name) != 0 ) {
+			continue;
+		}
+		isFound = true;
+		if ( !test->run(L, test->name) ) {
+			isPass = false;
+		}
+	}
+	lua_close(L);
+	if ( !isFound ) {
+		fprintf(stderr, "Usage: %s [test name]\n", argv[0]);
+		return 2;
+	}
+	return isPass ? 0 : 1;
+}
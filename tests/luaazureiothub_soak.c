@@ -0,0 +1,336 @@
+/*
+
+ Soak test for the luaazureiothub library.
+
+ Pushes a large number of messages through each of the ways a send can end, using the loopback protocol and the
+ stub SDK in tests/sdk so no IotHub or network is needed. Each phase is run on a new connection:
+
+	success		every message is confirmed
+	timeout		half of the confirmations are IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT
+	error		half of the sends fail with IOTHUB_CLIENT_CONFIRMATION_ERROR
+	duplicate	as error, and each failure is confirmed twice by the SDK
+	yield		every message is sent with sendMessageYield from a coroutine of its own
+
+ While a phase runs a JSON line is printed every SOAK_SAMPLE_MESSAGES messages with the throughput, RSS and the
+ allocator in use bytes. At the end of the phase, once every message has been confirmed, the growth of the heap since
+ the end of the warm up is divided by the number of messages. A phase fails if this is over the budget, or if the
+ number of confirmations does not match the number of messages sent.
+
+ The yield phase also checks that a coroutine waiting at disconnect is resumed, and after the phases a coroutine is 
+ resumed from a finalizer after its connection has been collected by lua_close.
+
+ Usage: luaazureiothub_soak [messages per phase] [budget in bytes per message]
+
+*/
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "sdkstub.h"
+#include "luaazureiothub.h"
+
+
+#define SOAK_DEFAULT_MESSAGES					1000000		// messages sent in each phase
+#define SOAK_DEFAULT_BUDGET						1.0			// bytes of heap growth allowed for each message
+#define SOAK_WARM_UP_MESSAGES					20000		// sent before the start of a phase is measured
+#define SOAK_SAMPLE_MESSAGES					100000
+#define SOAK_CONNECTION_STRING					"HostName=soak.loopback;DeviceId=soak;SharedAccessKey=c29haw=="
+
+
+typedef struct {
+	const char *name;
+	double errorRate;						// loopbackErrorRate of the connection
+	SdkStubFaults faults;
+	bool isYield;							// send with sendMessageYield instead of sendMessage
+} SoakPhase;
+
+static const SoakPhase phases[] = {
+	{ "success", 0, { 0, 0 }, false },
+	{ "timeout", 0, { 0.5, 0 }, false },
+	{ "error", 0.5, { 0, 0 }, false },
+	{ "duplicate", 0.5, { 0, 1 }, false },
+	{ "yield", 0, { 0, 0 }, true },
+	{ NULL, 0, { 0, 0 }, false }
+};
+
+typedef struct {
+	size_t rssBytes;
+	size_t heapBytes;						// allocated and not yet freed
+	size_t heapFreeBytes;					// free, but still held by the allocator
+	size_t mmapBytes;
+} SoakMemory;
+
+
+/*
+ The script returns a table of functions for one phase. The messages vary in size and properties, so the
+ allocator sees a mix like a real application.
+*/
+static const char *soakScript =
+	"local luaazureiothub, errorRate, isYield = ...\n"
+	"local confirmed, sent, resumed = 0, 0, 0\n"
+	"local statusCounts = {}\n"
+	"local iothub = assert(luaazureiothub.connect{\n"
+	"  connectionString = '" SOAK_CONNECTION_STRING "', protocol = 'loopback', maxInFlight = 256,\n"
+	"  idStrategy = 'sequence', loopbackErrorRate = errorRate,\n"
+	"  processSent = function(status)\n"
+	"    confirmed = confirmed + 1\n"
+	"    statusCounts[status] = (statusCounts[status] or 0) + 1\n"
+	"  end,\n"
+	"})\n"
+	"local function yieldSend(message)\n"
+	"  local ok, errorMessage = iothub:sendMessageYield(message, 0)\n"
+	"  if ok then resumed = resumed + 1 end\n"
+	"  return ok, errorMessage\n"
+	"end\n"
+	"local function send(message)\n"
+	"  if not isYield then return iothub:sendMessage(message, 0) end\n"
+	"  local co = coroutine.create(yieldSend)\n"
+	"  local isResumed, ok, errorMessage = coroutine.resume(co, message)\n"
+	"  assert(isResumed, ok)\n"
+	"  if coroutine.status(co) == 'suspended' then return true end\n"
+	"  return ok, errorMessage\n"
+	"end\n"
+	"local bodies = {}\n"
+	"for index = 1, 16 do bodies[index] = string.rep('x', index * 37) end\n"
+	"local soak = {}\n"
+	"function soak.send(count)\n"
+	"  for index = 1, count do\n"
+	"    sent = sent + 1\n"
+	"    local message = { text = bodies[sent % 16 + 1], correlationId = 'soak', property = { index = tostring(sent) } }\n"
+	"    local ok, errorMessage = send(message)\n"
+	"    while not ok and errorMessage == 'Busy' do\n"
+	"      iothub:loop(0)\n"
+	"      ok, errorMessage = send(message)\n"
+	"    end\n"
+	"    assert(ok, errorMessage)\n"
+	"    if sent % 128 == 0 then iothub:loop(0) end\n"
+	"  end\n"
+	"end\n"
+	"function soak.drain()\n"
+	"  local stats = iothub:stats()\n"
+	"  while stats.inFlight + stats.queued > 0 do\n"
+	"    iothub:loop(0)\n"
+	"    stats = iothub:stats()\n"
+	"  end\n"
+	"  iothub:stats(true)\n"
+	"  local ok = statusCounts[luaazureiothub.messageSend.OK] or 0\n"
+	"  assert(not isYield or resumed == ok, 'resumed ' .. resumed .. ' of ' .. ok)\n"
+	"  assert(stats.yieldErrors == 0, stats.yieldError)\n"
+	"  return sent, confirmed, ok\n"
+	"end\n"
+	"function soak.close()\n"
+	"  local co, result\n"
+	"  if isYield then\n"
+	"    co = coroutine.create(function(message) result = { iothub:sendMessageYield(message, 0) } end)\n"
+	"    assert(coroutine.resume(co, 'waiting at disconnect'))\n"
+	"    assert(coroutine.status(co) == 'suspended')\n"
+	"  end\n"
+	"  iothub:disconnect()\n"
+	"  if isYield then\n"
+	"    assert(coroutine.status(co) == 'dead' and result[1] == false, 'not resumed at disconnect')\n"
+	"    assert(not coroutine.resume(co))\n"
+	"  end\n"
+	"end\n"
+	"return soak\n";
+
+/*
+ Leaves a coroutine waiting in sendMessageYield, and resumes it from a finalizer that lua_close runs after the one
+ of the connection. The finalizers run newest first, so the sentinel is made before the connection.
+*/
+static const char *closeScript =
+	"local luaazureiothub, reportClosed = ...\n"
+	"local co\n"
+	"sentinel = setmetatable({}, { __gc = function() reportClosed(coroutine.resume(co)) end })\n"
+	"iothub = assert(luaazureiothub.connect{ connectionString = '" SOAK_CONNECTION_STRING "', protocol = 'loopback' })\n"
+	"co = coroutine.create(function() return iothub:sendMessageYield('waiting at close', 0) end)\n"
+	"assert(coroutine.resume(co))\n"
+	"assert(coroutine.status(co) == 'suspended')\n";
+
+static bool isClosedResult = false;
+
+
+static double timeNowSeconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void readMemory(lua_State *L, SoakMemory *memory)
+{
+	struct mallinfo2 info;
+	unsigned long pages = 0;
+	unsigned long residentPages = 0;
+	FILE *file;
+
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	info = mallinfo2();
+	memory->heapBytes = info.uordblks + info.hblkhd;
+	memory->heapFreeBytes = info.fordblks;
+	memory->mmapBytes = info.hblkhd;
+	memory->rssBytes = 0;
+	file = fopen("/proc/self/statm", "r");
+	if ( file ) {
+		if ( fscanf(file, "%lu %lu", &pages, &residentPages) == 2 ) {
+			memory->rssBytes = residentPages * sysconf(_SC_PAGESIZE);
+		}
+		fclose(file);
+	}
+}
+
+static void callSoak(lua_State *L, const char *name, int argumentCount, int resultCount)
+{
+	lua_getfield(L, -1 - argumentCount, name);
+	lua_insert(L, -1 - argumentCount);
+	if ( lua_pcall(L, argumentCount, resultCount, 0) != LUA_OK ) {
+		fprintf(stderr, "soak.%s: %s\n", name, lua_tostring(L, -1));
+		exit(1);
+	}
+}
+
+static void sendMessages(lua_State *L, long count)
+{
+	lua_pushinteger(L, count);
+	callSoak(L, "send", 1, 0);
+}
+
+/*
+ Run one phase, returns false if it is over the memory budget or the confirmations do not add up.
+*/
+static bool runPhase(lua_State *L, const SoakPhase *phase, long messageCount, double budget)
+{
+	SoakMemory start;
+	SoakMemory memory;
+	long sentCount = 0;
+	int top = lua_gettop(L);
+
+	sdkStubSetFaults(&phase->faults);
+	if ( luaL_loadstring(L, soakScript) != LUA_OK ) {
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+	lua_getglobal(L, "luaazureiothub");
+	lua_pushnumber(L, phase->errorRate);
+	lua_pushboolean(L, phase->isYield);
+	if ( lua_pcall(L, 3, 1, 0) != LUA_OK ) {
+		fprintf(stderr, "%s: %s\n", phase->name, lua_tostring(L, -1));
+		exit(1);
+	}
+
+	// fill the send pool, the lua string table and the allocator before the start is measured
+	sendMessages(L, SOAK_WARM_UP_MESSAGES);
+	callSoak(L, "drain", 0, 0);
+	readMemory(L, &start);
+
+	double startTime = timeNowSeconds();
+	double sampleTime = startTime;
+	while ( sentCount < messageCount ) {
+		long count = messageCount - sentCount < SOAK_SAMPLE_MESSAGES ? messageCount - sentCount : SOAK_SAMPLE_MESSAGES;
+		sendMessages(L, count);
+		sentCount += count;
+		double now = timeNowSeconds();
+		readMemory(L, &memory);
+		printf("{\"phase\":\"%s\",\"messages\":%ld,\"seconds\":%.3f,\"messagesPerSecond\":%.0f,\"rssBytes\":%zu,"
+				"\"heapBytes\":%zu,\"heapFreeBytes\":%zu,\"mmapBytes\":%zu}\n", phase->name, sentCount, now - startTime,
+				count / (now - sampleTime), memory.rssBytes, memory.heapBytes, memory.heapFreeBytes, memory.mmapBytes);
+		fflush(stdout);
+		sampleTime = now;
+	}
+	callSoak(L, "drain", 0, 3);
+	double elapsed = timeNowSeconds() - startTime;
+	long totalSent = (long) lua_tointeger(L, -3);
+	long totalConfirmed = (long) lua_tointeger(L, -2);
+	long totalOk = (long) lua_tointeger(L, -1);
+	lua_pop(L, 3);
+	readMemory(L, &memory);
+
+	double heapPerMessage = ( (double) memory.heapBytes - (double) start.heapBytes ) / messageCount;
+	double rssPerMessage = ( (double) memory.rssBytes - (double) start.rssBytes ) / messageCount;
+	bool isPass = heapPerMessage <= budget && totalConfirmed == totalSent;
+	printf("{\"phase\":\"%s\",\"result\":\"%s\",\"messages\":%ld,\"confirmed\":%ld,\"ok\":%ld,\"seconds\":%.3f,"
+			"\"messagesPerSecond\":%.0f,\"heapBytesPerMessage\":%.3f,\"rssBytesPerMessage\":%.3f,\"budget\":%.3f}\n",
+			phase->name, isPass ? "pass" : "fail", totalSent, totalConfirmed, totalOk, elapsed, messageCount / elapsed,
+			heapPerMessage, rssPerMessage, budget);
+	fflush(stdout);
+
+	callSoak(L, "close", 0, 0);
+	lua_settop(L, top);
+	return isPass;
+}
+
+static int reportClosed(lua_State *L)
+{
+	const char *errorMessage = lua_tostring(L, 3);
+	isClosedResult = lua_toboolean(L, 1) && lua_isboolean(L, 2) && !lua_toboolean(L, 2) && errorMessage 
+			&& strcmp(errorMessage, "closed") == 0;
+	return 0;
+}
+
+/*
+ Check that a coroutine resumed after its connection has been collected returns false and 'closed'.
+*/
+static bool runCloseCheck(void)
+{
+	lua_State *L = luaL_newstate();
+	if ( L == NULL ) {
+		fprintf(stderr, "Cannot create the lua state\n");
+		exit(1);
+	}
+	luaL_openlibs(L);
+	luaL_requiref(L, "luaazureiothub", luaopen_luaazureiothub, 1);
+	if ( luaL_loadstring(L, closeScript) != LUA_OK ) {
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+	lua_insert(L, -2);
+	lua_pushcfunction(L, reportClosed);
+	if ( lua_pcall(L, 2, 0, 0) != LUA_OK ) {
+		fprintf(stderr, "close: %s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+	lua_close(L);
+	printf("{\"phase\":\"close\",\"result\":\"%s\"}\n", isClosedResult ? "pass" : "fail");
+	fflush(stdout);
+	return isClosedResult;
+}
+
+int main(int argc, char *argv[])
+{
+	long messageCount = argc > 1 ? atol(argv[1]) : SOAK_DEFAULT_MESSAGES;
+	double budget = argc > 2 ? atof(argv[2]) : SOAK_DEFAULT_BUDGET;
+	const SoakPhase *phase;
+	bool isPass = true;
+	lua_State *L;
+
+	if ( messageCount <= 0 ) {
+		fprintf(stderr, "Usage: %s [messages per phase] [budget in bytes per message]\n", argv[0]);
+		return 2;
+	}
+	L = luaL_newstate();
+	if ( L == NULL ) {
+		fprintf(stderr, "Cannot create the lua state\n");
+		return 1;
+	}
+	luaL_openlibs(L);
+	luaL_requiref(L, "luaazureiothub", luaopen_luaazureiothub, 1);
+	lua_pop(L, 1);
+
+	for ( phase = phases; phase->name; phase ++ ) {
+		if ( !runPhase(L, phase, messageCount, budget) ) {
+			isPass = false;
+		}
+	}
+	lua_close(L);
+	if ( !runCloseCheck() ) {
+		isPass = false;
+	}
+	return isPass ? 0 : 1;
+}
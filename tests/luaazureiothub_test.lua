@@ -99,8 +99,9 @@ if iothub then
 		message.text = "Test message async call " .. counter
 		message.property.syncCounter = counter
 		-- call the sendMesasge with a 0 as the timeoutSeconds, this sends the mesasge but does not wait for the result
-		result, errorMessage = iothub:sendMessage(message, 0 )
-		print('Result from send message:', counter,  result, errorMessage)
+		local sequence
+		result, sequence = iothub:sendMessage(message, 0 )
+		print('Result from send message:', counter,  result, sequence)
 	end
 	print("waiting for loop end until the 10th record comes back")
 	
@@ -117,6 +118,41 @@ if iothub then
 	iothub:disconnect()
 end
 
+print("Test connect with a table of options")
+local confirmedSequences = {}
+local confirmedCount = 0
+iothub, errorMessage = luaazureiothub.connect{
+	connectionString = connectionString,
+	protocol = 'amqp',
+	processRead = processRead,
+	processSent = function(status, message, sequence)
+		-- the sequence matches the one returned by sendMessage, confirmations can arrive in any order
+		print('RX message ack', status, sequence)
+		confirmedSequences[sequence] = status
+		confirmedCount = confirmedCount + 1
+	end,
+	maxInFlight = 10,										-- optional: allow 10 async messages to be sent at once
+}
+print('Result from connect:', iothub, errorMessage)
+if iothub then
+	local sequences = {}
+	for counter = 1, 10 do
+		local result, sequence = iothub:sendMessage("Test message in flight " .. counter, 0)
+		print('Result from send message:', counter, result, sequence)
+		assert(result, sequence)
+		sequences[counter] = sequence
+	end
+	print("waiting for the 10 messages in flight to come back")
+	local timeout = posix.time() + 60
+	while confirmedCount < 10 and timeout > posix.time() do
+		iothub:loop(2)
+	end
+	for counter, sequence in ipairs(sequences) do
+		print('Confirmed message:', counter, sequence, confirmedSequences[sequence])
+	end
+	iothub:disconnect()
+end
+
 print('Generate random uuid', luaazureiothub.generateUUID())
 
 
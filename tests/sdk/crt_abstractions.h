@@ -0,0 +1,8 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef CRT_ABSTRACTIONS_H
+#define CRT_ABSTRACTIONS_H
+
+#include "sdkstub.h"
+
+#endif	// CRT_ABSTRACTIONS_H
@@ -0,0 +1,8 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef DOUBLYLINKEDLIST_H
+#define DOUBLYLINKEDLIST_H
+
+#include "sdkstub.h"
+
+#endif	// DOUBLYLINKEDLIST_H
@@ -0,0 +1,8 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef IOTHUB_CLIENT_H
+#define IOTHUB_CLIENT_H
+
+#include "iothub_client_ll.h"
+
+#endif	// IOTHUB_CLIENT_H
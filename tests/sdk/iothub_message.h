@@ -0,0 +1,22 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef IOTHUB_MESSAGE_H
+#define IOTHUB_MESSAGE_H
+
+#include "sdkstub.h"
+#include "map.h"
+
+IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromByteArray(const unsigned char *byteArray, size_t size);
+IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromString(const char *source);
+IOTHUB_MESSAGE_HANDLE IoTHubMessage_Clone(IOTHUB_MESSAGE_HANDLE messageHandle);
+IOTHUB_MESSAGE_RESULT IoTHubMessage_GetByteArray(IOTHUB_MESSAGE_HANDLE messageHandle, const unsigned char **buffer, size_t *size);
+const char *IoTHubMessage_GetString(IOTHUB_MESSAGE_HANDLE messageHandle);
+IOTHUBMESSAGE_CONTENT_TYPE IoTHubMessage_GetContentType(IOTHUB_MESSAGE_HANDLE messageHandle);
+MAP_HANDLE IoTHubMessage_Properties(IOTHUB_MESSAGE_HANDLE messageHandle);
+const char *IoTHubMessage_GetMessageId(IOTHUB_MESSAGE_HANDLE messageHandle);
+IOTHUB_MESSAGE_RESULT IoTHubMessage_SetMessageId(IOTHUB_MESSAGE_HANDLE messageHandle, const char *messageId);
+const char *IoTHubMessage_GetCorrelationId(IOTHUB_MESSAGE_HANDLE messageHandle);
+IOTHUB_MESSAGE_RESULT IoTHubMessage_SetCorrelationId(IOTHUB_MESSAGE_HANDLE messageHandle, const char *correlationId);
+void IoTHubMessage_Destroy(IOTHUB_MESSAGE_HANDLE messageHandle);
+
+#endif	// IOTHUB_MESSAGE_H
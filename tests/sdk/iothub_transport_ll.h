@@ -0,0 +1,44 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef IOTHUB_TRANSPORT_LL_H
+#define IOTHUB_TRANSPORT_LL_H
+
+#include "sdkstub.h"
+
+typedef struct IOTHUB_DEVICE_CONFIG_TAG {
+	const char *deviceId;
+	const char *deviceKey;
+	const char *deviceSasToken;
+} IOTHUB_DEVICE_CONFIG;
+
+typedef struct IOTHUBTRANSPORT_CONFIG_TAG {
+	const IOTHUB_CLIENT_CONFIG *upperConfig;
+	PDLIST_ENTRY waitingToSend;
+} IOTHUBTRANSPORT_CONFIG;
+
+typedef STRING_HANDLE (*pfIoTHubTransport_GetHostname)(TRANSPORT_LL_HANDLE handle);
+typedef IOTHUB_CLIENT_RESULT (*pfIoTHubTransport_SetOption)(TRANSPORT_LL_HANDLE handle, const char *optionName, const void *value);
+typedef TRANSPORT_LL_HANDLE (*pfIoTHubTransport_Create)(const IOTHUBTRANSPORT_CONFIG *config);
+typedef void (*pfIoTHubTransport_Destroy)(TRANSPORT_LL_HANDLE handle);
+typedef IOTHUB_DEVICE_HANDLE (*pfIotHubTransport_Register)(TRANSPORT_LL_HANDLE handle, const IOTHUB_DEVICE_CONFIG *device, 
+		IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, PDLIST_ENTRY waitingToSend);
+typedef void (*pfIotHubTransport_Unregister)(IOTHUB_DEVICE_HANDLE deviceHandle);
+typedef int (*pfIoTHubTransport_Subscribe)(IOTHUB_DEVICE_HANDLE handle);
+typedef void (*pfIoTHubTransport_Unsubscribe)(IOTHUB_DEVICE_HANDLE handle);
+typedef void (*pfIoTHubTransport_DoWork)(TRANSPORT_LL_HANDLE handle, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle);
+typedef IOTHUB_CLIENT_RESULT (*pfIoTHubTransport_GetSendStatus)(IOTHUB_DEVICE_HANDLE handle, IOTHUB_CLIENT_STATUS *iotHubClientStatus);
+
+typedef struct TRANSPORT_PROVIDER_TAG {
+	pfIoTHubTransport_GetHostname IoTHubTransport_GetHostname;
+	pfIoTHubTransport_SetOption IoTHubTransport_SetOption;
+	pfIoTHubTransport_Create IoTHubTransport_Create;
+	pfIoTHubTransport_Destroy IoTHubTransport_Destroy;
+	pfIotHubTransport_Register IoTHubTransport_Register;
+	pfIotHubTransport_Unregister IoTHubTransport_Unregister;
+	pfIoTHubTransport_Subscribe IoTHubTransport_Subscribe;
+	pfIoTHubTransport_Unsubscribe IoTHubTransport_Unsubscribe;
+	pfIoTHubTransport_DoWork IoTHubTransport_DoWork;
+	pfIoTHubTransport_GetSendStatus IoTHubTransport_GetSendStatus;
+} TRANSPORT_PROVIDER;
+
+#endif	// IOTHUB_TRANSPORT_LL_H
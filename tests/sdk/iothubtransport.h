@@ -0,0 +1,12 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef IOTHUBTRANSPORT_H
+#define IOTHUBTRANSPORT_H
+
+#include "iothub_transport_ll.h"
+
+TRANSPORT_HANDLE IoTHubTransport_Create(IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol, const char *iotHubName, const char *iotHubSuffix);
+void IoTHubTransport_Destroy(TRANSPORT_HANDLE transportHandle);
+TRANSPORT_LL_HANDLE IoTHubTransport_GetLLTransport(TRANSPORT_HANDLE transportHandle);
+
+#endif	// IOTHUBTRANSPORT_H
@@ -0,0 +1,10 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef IOTHUBTRANSPORTAMQP_H
+#define IOTHUBTRANSPORTAMQP_H
+
+#include "iothub_transport_ll.h"
+
+const TRANSPORT_PROVIDER *AMQP_Protocol(void);
+
+#endif	// IOTHUBTRANSPORTAMQP_H
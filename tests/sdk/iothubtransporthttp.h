@@ -0,0 +1,10 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef IOTHUBTRANSPORTHTTP_H
+#define IOTHUBTRANSPORTHTTP_H
+
+#include "iothub_transport_ll.h"
+
+const TRANSPORT_PROVIDER *HTTP_Protocol(void);
+
+#endif	// IOTHUBTRANSPORTHTTP_H
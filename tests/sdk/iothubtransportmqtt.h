@@ -0,0 +1,10 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef IOTHUBTRANSPORTMQTT_H
+#define IOTHUBTRANSPORTMQTT_H
+
+#include "iothub_transport_ll.h"
+
+const TRANSPORT_PROVIDER *MQTT_Protocol(void);
+
+#endif	// IOTHUBTRANSPORTMQTT_H
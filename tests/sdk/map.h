@@ -0,0 +1,20 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef MAP_H
+#define MAP_H
+
+#include "sdkstub.h"
+
+typedef int (*MAP_FILTER_CALLBACK)(const char *mapProperty, const char *mapValue);
+
+MAP_HANDLE Map_Create(MAP_FILTER_CALLBACK mapFilterFunc);
+void Map_Destroy(MAP_HANDLE handle);
+MAP_HANDLE Map_Clone(MAP_HANDLE handle);
+MAP_RESULT Map_Add(MAP_HANDLE handle, const char *key, const char *value);
+MAP_RESULT Map_AddOrUpdate(MAP_HANDLE handle, const char *key, const char *value);
+MAP_RESULT Map_Delete(MAP_HANDLE handle, const char *key);
+MAP_RESULT Map_ContainsKey(MAP_HANDLE handle, const char *key, bool *keyExists);
+const char *Map_GetValueFromKey(MAP_HANDLE handle, const char *key);
+MAP_RESULT Map_GetInternals(MAP_HANDLE handle, const char *const **keys, const char *const **values, size_t *count);
+
+#endif	// MAP_H
@@ -0,0 +1,803 @@
+/*
+
+ In memory implementation of the SDK functions declared in sdkstub.h and the headers next to it.
+
+ The LL client follows the real one closely enough for the library: messages are cloned onto a waitingToSend
+ list owned by the client, the transport takes them from there in DoWork and hands them back through
+ IoTHubClient_LL_SendComplete, and destroying the client fails any message still waiting. Every protocol is the
+ loopback transport from src/iothubloopback.c. Timeouts and duplicate confirmations can be added with
+ sdkStubSetFaults, failed sends come from the loopback option loopbackErrorRate.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "iothub_client_ll.h"
+#include "iothub_message.h"
+#include "iothub_transport_ll.h"
+#include "iothubtransport.h"
+#include "iothubtransportamqp.h"
+#include "iothubtransporthttp.h"
+#include "iothubtransportmqtt.h"
+#include "doublylinkedlist.h"
+#include "crt_abstractions.h"
+#include "tlsio_openssl.h"
+#include "map.h"
+
+#include "iothubloopback.h"
+
+
+DEFINE_ENUM_STRINGS(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_RESULT_VALUES)
+
+
+struct STRING_TAG {
+	char *text;
+};
+
+struct MAP_HANDLE_DATA_TAG {
+	char **keys;
+	char **values;
+	size_t count;
+	MAP_FILTER_CALLBACK filter;
+};
+
+struct IOTHUB_MESSAGE_HANDLE_DATA_TAG {
+	IOTHUBMESSAGE_CONTENT_TYPE contentType;
+	unsigned char *data;					// a string body is kept with its null
+	size_t size;
+	char *messageId;
+	char *correlationId;
+	MAP_HANDLE properties;
+};
+
+struct IOTHUB_CLIENT_LL_HANDLE_DATA_TAG {
+	const TRANSPORT_PROVIDER *provider;
+	TRANSPORT_LL_HANDLE transportHandle;
+	IOTHUB_DEVICE_HANDLE deviceHandle;
+	bool isSharedTransport;
+	DLIST_ENTRY waitingToSend;
+	IOTHUB_CLIENT_MESSAGE_CALLBACK_ASYNC messageCallback;
+	void *messageContext;
+	time_t lastMessageReceiveTime;
+};
+
+struct TRANSPORT_HANDLE_DATA_TAG {
+	const TRANSPORT_PROVIDER *provider;
+	TRANSPORT_LL_HANDLE transportHandle;
+};
+
+
+static SdkStubFaults faults = { 0, 0 };
+static uint32_t faultRandomState = 0x9e3779b9;
+
+void sdkStubSetFaults(const SdkStubFaults *newFaults)
+{
+	faults = *newFaults;
+}
+
+static bool isFault(double rate)
+{
+	if ( rate <= 0 ) {
+		return false;
+	}
+	// xorshift32, only needs to be quick and spread evenly
+	faultRandomState ^= faultRandomState << 13;
+	faultRandomState ^= faultRandomState >> 17;
+	faultRandomState ^= faultRandomState << 5;
+	return faultRandomState < rate * 4294967296.0;
+}
+
+
+void DList_InitializeListHead(PDLIST_ENTRY listHead)
+{
+	listHead->Flink = listHead;
+	listHead->Blink = listHead;
+}
+
+int DList_IsListEmpty(const PDLIST_ENTRY listHead)
+{
+	return listHead->Flink == listHead;
+}
+
+void DList_InsertTailList(PDLIST_ENTRY listHead, PDLIST_ENTRY listEntry)
+{
+	listEntry->Blink = listHead->Blink;
+	listEntry->Flink = listHead;
+	listHead->Blink->Flink = listEntry;
+	listHead->Blink = listEntry;
+}
+
+void DList_InsertHeadList(PDLIST_ENTRY listHead, PDLIST_ENTRY listEntry)
+{
+	listEntry->Flink = listHead->Flink;
+	listEntry->Blink = listHead;
+	listHead->Flink->Blink = listEntry;
+	listHead->Flink = listEntry;
+}
+
+void DList_AppendTailList(PDLIST_ENTRY listHead, PDLIST_ENTRY listToAppend)
+{
+	PDLIST_ENTRY listEnd = listHead->Blink;
+	listHead->Blink->Flink = listToAppend;
+	listHead->Blink = listToAppend->Blink;
+	listToAppend->Blink->Flink = listHead;
+	listToAppend->Blink = listEnd;
+}
+
+int DList_RemoveEntryList(PDLIST_ENTRY listEntry)
+{
+	PDLIST_ENTRY nextEntry = listEntry->Flink;
+	PDLIST_ENTRY prevEntry = listEntry->Blink;
+	prevEntry->Flink = nextEntry;
+	nextEntry->Blink = prevEntry;
+	return nextEntry == prevEntry;
+}
+
+PDLIST_ENTRY DList_RemoveHeadList(PDLIST_ENTRY listHead)
+{
+	PDLIST_ENTRY entry = listHead->Flink;
+	DList_RemoveEntryList(entry);
+	return entry;
+}
+
+
+STRING_HANDLE STRING_construct(const char *psz)
+{
+	STRING_HANDLE handle = malloc(sizeof(struct STRING_TAG));
+	if ( handle == NULL ) {
+		return NULL;
+	}
+	handle->text = strdup(psz ? psz : "");
+	if ( handle->text == NULL ) {
+		free(handle);
+		return NULL;
+	}
+	return handle;
+}
+
+void STRING_delete(STRING_HANDLE handle)
+{
+	if ( handle ) {
+		free(handle->text);
+		free(handle);
+	}
+}
+
+const char *STRING_c_str(STRING_HANDLE handle)
+{
+	return handle ? handle->text : NULL;
+}
+
+int mallocAndStrcpy_s(char **destination, const char *source)
+{
+	if ( destination == NULL || source == NULL ) {
+		return 1;
+	}
+	*destination = strdup(source);
+	return *destination == NULL;
+}
+
+
+int tlsio_openssl_init(void)
+{
+	return 0;
+}
+
+void tlsio_openssl_deinit(void)
+{
+}
+
+
+static int mapFind(MAP_HANDLE handle, const char *key)
+{
+	size_t index;
+	for ( index = 0; index < handle->count; index ++ ) {
+		if ( strcmp(handle->keys[index], key) == 0 ) {
+			return (int) index;
+		}
+	}
+	return -1;
+}
+
+static MAP_RESULT mapAppend(MAP_HANDLE handle, const char *key, const char *value)
+{
+	char **keys = realloc(handle->keys, sizeof(char *) * (handle->count + 1));
+	if ( keys == NULL ) {
+		return MAP_ERROR;
+	}
+	handle->keys = keys;
+	char **values = realloc(handle->values, sizeof(char *) * (handle->count + 1));
+	if ( values == NULL ) {
+		return MAP_ERROR;
+	}
+	handle->values = values;
+	handle->keys[handle->count] = strdup(key);
+	handle->values[handle->count] = strdup(value);
+	if ( handle->keys[handle->count] == NULL || handle->values[handle->count] == NULL ) {
+		free(handle->keys[handle->count]);
+		free(handle->values[handle->count]);
+		return MAP_ERROR;
+	}
+	handle->count ++;
+	return MAP_OK;
+}
+
+MAP_HANDLE Map_Create(MAP_FILTER_CALLBACK mapFilterFunc)
+{
+	MAP_HANDLE handle = calloc(1, sizeof(struct MAP_HANDLE_DATA_TAG));
+	if ( handle ) {
+		handle->filter = mapFilterFunc;
+	}
+	return handle;
+}
+
+void Map_Destroy(MAP_HANDLE handle)
+{
+	size_t index;
+	if ( handle == NULL ) {
+		return;
+	}
+	for ( index = 0; index < handle->count; index ++ ) {
+		free(handle->keys[index]);
+		free(handle->values[index]);
+	}
+	free(handle->keys);
+	free(handle->values);
+	free(handle);
+}
+
+MAP_HANDLE Map_Clone(MAP_HANDLE handle)
+{
+	size_t index;
+	MAP_HANDLE clone;
+	if ( handle == NULL ) {
+		return NULL;
+	}
+	clone = Map_Create(handle->filter);
+	if ( clone == NULL ) {
+		return NULL;
+	}
+	for ( index = 0; index < handle->count; index ++ ) {
+		if ( mapAppend(clone, handle->keys[index], handle->values[index]) != MAP_OK ) {
+			Map_Destroy(clone);
+			return NULL;
+		}
+	}
+	return clone;
+}
+
+MAP_RESULT Map_Add(MAP_HANDLE handle, const char *key, const char *value)
+{
+	if ( handle == NULL || key == NULL || value == NULL ) {
+		return MAP_INVALIDARG;
+	}
+	if ( handle->filter && handle->filter(key, value) ) {
+		return MAP_FILTER_REJECT;
+	}
+	if ( mapFind(handle, key) >= 0 ) {
+		return MAP_KEYEXISTS;
+	}
+	return mapAppend(handle, key, value);
+}
+
+MAP_RESULT Map_AddOrUpdate(MAP_HANDLE handle, const char *key, const char *value)
+{
+	int index;
+	if ( handle == NULL || key == NULL || value == NULL ) {
+		return MAP_INVALIDARG;
+	}
+	if ( handle->filter && handle->filter(key, value) ) {
+		return MAP_FILTER_REJECT;
+	}
+	index = mapFind(handle, key);
+	if ( index < 0 ) {
+		return mapAppend(handle, key, value);
+	}
+	char *copy = strdup(value);
+	if ( copy == NULL ) {
+		return MAP_ERROR;
+	}
+	free(handle->values[index]);
+	handle->values[index] = copy;
+	return MAP_OK;
+}
+
+MAP_RESULT Map_Delete(MAP_HANDLE handle, const char *key)
+{
+	int index;
+	if ( handle == NULL || key == NULL ) {
+		return MAP_INVALIDARG;
+	}
+	index = mapFind(handle, key);
+	if ( index < 0 ) {
+		return MAP_KEYNOTFOUND;
+	}
+	free(handle->keys[index]);
+	free(handle->values[index]);
+	handle->count --;
+	memmove(&handle->keys[index], &handle->keys[index + 1], sizeof(char *) * (handle->count - index));
+	memmove(&handle->values[index], &handle->values[index + 1], sizeof(char *) * (handle->count - index));
+	return MAP_OK;
+}
+
+MAP_RESULT Map_ContainsKey(MAP_HANDLE handle, const char *key, bool *keyExists)
+{
+	if ( handle == NULL || key == NULL || keyExists == NULL ) {
+		return MAP_INVALIDARG;
+	}
+	*keyExists = mapFind(handle, key) >= 0;
+	return MAP_OK;
+}
+
+const char *Map_GetValueFromKey(MAP_HANDLE handle, const char *key)
+{
+	int index;
+	if ( handle == NULL || key == NULL ) {
+		return NULL;
+	}
+	index = mapFind(handle, key);
+	return index < 0 ? NULL : handle->values[index];
+}
+
+MAP_RESULT Map_GetInternals(MAP_HANDLE handle, const char *const **keys, const char *const **values, size_t *count)
+{
+	if ( handle == NULL || keys == NULL || values == NULL || count == NULL ) {
+		return MAP_INVALIDARG;
+	}
+	*keys = (const char *const *) handle->keys;
+	*values = (const char *const *) handle->values;
+	*count = handle->count;
+	return MAP_OK;
+}
+
+
+static IOTHUB_MESSAGE_HANDLE messageCreate(IOTHUBMESSAGE_CONTENT_TYPE contentType, const unsigned char *data, size_t size)
+{
+	IOTHUB_MESSAGE_HANDLE messageHandle = calloc(1, sizeof(struct IOTHUB_MESSAGE_HANDLE_DATA_TAG));
+	if ( messageHandle == NULL ) {
+		return NULL;
+	}
+	messageHandle->contentType = contentType;
+	messageHandle->size = size;
+	messageHandle->data = malloc(size > 0 ? size : 1);
+	messageHandle->properties = Map_Create(NULL);
+	if ( messageHandle->data == NULL || messageHandle->properties == NULL ) {
+		IoTHubMessage_Destroy(messageHandle);
+		return NULL;
+	}
+	if ( size > 0 ) {
+		memcpy(messageHandle->data, data, size);
+	}
+	return messageHandle;
+}
+
+static IOTHUB_MESSAGE_RESULT messageSetText(char **field, const char *text)
+{
+	char *copy;
+	if ( text == NULL ) {
+		return IOTHUB_MESSAGE_INVALID_ARG;
+	}
+	copy = strdup(text);
+	if ( copy == NULL ) {
+		return IOTHUB_MESSAGE_ERROR;
+	}
+	free(*field);
+	*field = copy;
+	return IOTHUB_MESSAGE_OK;
+}
+
+IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromByteArray(const unsigned char *byteArray, size_t size)
+{
+	if ( byteArray == NULL && size > 0 ) {
+		return NULL;
+	}
+	return messageCreate(IOTHUBMESSAGE_BYTEARRAY, byteArray, size);
+}
+
+IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromString(const char *source)
+{
+	if ( source == NULL ) {
+		return NULL;
+	}
+	return messageCreate(IOTHUBMESSAGE_STRING, (const unsigned char *) source, strlen(source) + 1);
+}
+
+IOTHUB_MESSAGE_HANDLE IoTHubMessage_Clone(IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	IOTHUB_MESSAGE_HANDLE clone;
+	if ( messageHandle == NULL ) {
+		return NULL;
+	}
+	clone = messageCreate(messageHandle->contentType, messageHandle->data, messageHandle->size);
+	if ( clone == NULL ) {
+		return NULL;
+	}
+	Map_Destroy(clone->properties);
+	clone->properties = Map_Clone(messageHandle->properties);
+	if ( clone->properties == NULL
+			|| ( messageHandle->messageId && messageSetText(&clone->messageId, messageHandle->messageId) != IOTHUB_MESSAGE_OK )
+			|| ( messageHandle->correlationId && messageSetText(&clone->correlationId, messageHandle->correlationId) != IOTHUB_MESSAGE_OK ) ) {
+		IoTHubMessage_Destroy(clone);
+		return NULL;
+	}
+	return clone;
+}
+
+IOTHUB_MESSAGE_RESULT IoTHubMessage_GetByteArray(IOTHUB_MESSAGE_HANDLE messageHandle, const unsigned char **buffer, size_t *size)
+{
+	if ( messageHandle == NULL || buffer == NULL || size == NULL ) {
+		return IOTHUB_MESSAGE_INVALID_ARG;
+	}
+	if ( messageHandle->contentType != IOTHUBMESSAGE_BYTEARRAY ) {
+		return IOTHUB_MESSAGE_INVALID_TYPE;
+	}
+	*buffer = messageHandle->data;
+	*size = messageHandle->size;
+	return IOTHUB_MESSAGE_OK;
+}
+
+const char *IoTHubMessage_GetString(IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	if ( messageHandle == NULL || messageHandle->contentType != IOTHUBMESSAGE_STRING ) {
+		return NULL;
+	}
+	return (const char *) messageHandle->data;
+}
+
+IOTHUBMESSAGE_CONTENT_TYPE IoTHubMessage_GetContentType(IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	return messageHandle ? messageHandle->contentType : IOTHUBMESSAGE_UNKNOWN;
+}
+
+MAP_HANDLE IoTHubMessage_Properties(IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	return messageHandle ? messageHandle->properties : NULL;
+}
+
+const char *IoTHubMessage_GetMessageId(IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	return messageHandle ? messageHandle->messageId : NULL;
+}
+
+IOTHUB_MESSAGE_RESULT IoTHubMessage_SetMessageId(IOTHUB_MESSAGE_HANDLE messageHandle, const char *messageId)
+{
+	if ( messageHandle == NULL ) {
+		return IOTHUB_MESSAGE_INVALID_ARG;
+	}
+	return messageSetText(&messageHandle->messageId, messageId);
+}
+
+const char *IoTHubMessage_GetCorrelationId(IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	return messageHandle ? messageHandle->correlationId : NULL;
+}
+
+IOTHUB_MESSAGE_RESULT IoTHubMessage_SetCorrelationId(IOTHUB_MESSAGE_HANDLE messageHandle, const char *correlationId)
+{
+	if ( messageHandle == NULL ) {
+		return IOTHUB_MESSAGE_INVALID_ARG;
+	}
+	return messageSetText(&messageHandle->correlationId, correlationId);
+}
+
+void IoTHubMessage_Destroy(IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+	if ( messageHandle ) {
+		free(messageHandle->data);
+		free(messageHandle->messageId);
+		free(messageHandle->correlationId);
+		Map_Destroy(messageHandle->properties);
+		free(messageHandle);
+	}
+}
+
+
+const TRANSPORT_PROVIDER *AMQP_Protocol(void)
+{
+	return Loopback_Protocol();
+}
+
+const TRANSPORT_PROVIDER *HTTP_Protocol(void)
+{
+	return Loopback_Protocol();
+}
+
+const TRANSPORT_PROVIDER *MQTT_Protocol(void)
+{
+	return Loopback_Protocol();
+}
+
+TRANSPORT_HANDLE IoTHubTransport_Create(IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol, const char *iotHubName, const char *iotHubSuffix)
+{
+	IOTHUB_CLIENT_CONFIG upperConfig;
+	IOTHUBTRANSPORT_CONFIG config;
+	TRANSPORT_HANDLE transportHandle;
+
+	if ( protocol == NULL || iotHubName == NULL || iotHubSuffix == NULL ) {
+		return NULL;
+	}
+	transportHandle = calloc(1, sizeof(struct TRANSPORT_HANDLE_DATA_TAG));
+	if ( transportHandle == NULL ) {
+		return NULL;
+	}
+	memset(&upperConfig, 0, sizeof(IOTHUB_CLIENT_CONFIG));
+	upperConfig.protocol = protocol;
+	upperConfig.iotHubName = iotHubName;
+	upperConfig.iotHubSuffix = iotHubSuffix;
+	config.upperConfig = &upperConfig;
+	config.waitingToSend = NULL;
+	transportHandle->provider = protocol();
+	transportHandle->transportHandle = transportHandle->provider->IoTHubTransport_Create(&config);
+	if ( transportHandle->transportHandle == NULL ) {
+		free(transportHandle);
+		return NULL;
+	}
+	return transportHandle;
+}
+
+void IoTHubTransport_Destroy(TRANSPORT_HANDLE transportHandle)
+{
+	if ( transportHandle ) {
+		transportHandle->provider->IoTHubTransport_Destroy(transportHandle->transportHandle);
+		free(transportHandle);
+	}
+}
+
+TRANSPORT_LL_HANDLE IoTHubTransport_GetLLTransport(TRANSPORT_HANDLE transportHandle)
+{
+	return transportHandle ? transportHandle->transportHandle : NULL;
+}
+
+
+/*
+ Copy the value of a 'name=value' field in the connection string, or return NULL if it is not found.
+*/
+static char *readField(const char *connectionString, const char *name)
+{
+	size_t nameLength = strlen(name);
+	const char *field = connectionString;
+	while ( field && *field ) {
+		const char *end = strchr(field, ';');
+		if ( strncmp(field, name, nameLength) == 0 && field[nameLength] == '=' ) {
+			field += nameLength + 1;
+			return end ? strndup(field, end - field) : strdup(field);
+		}
+		field = end ? end + 1 : NULL;
+	}
+	return NULL;
+}
+
+static IOTHUB_CLIENT_LL_HANDLE clientNew(const TRANSPORT_PROVIDER *provider)
+{
+	IOTHUB_CLIENT_LL_HANDLE handle = calloc(1, sizeof(struct IOTHUB_CLIENT_LL_HANDLE_DATA_TAG));
+	if ( handle ) {
+		DList_InitializeListHead(&handle->waitingToSend);
+		handle->provider = provider;
+	}
+	return handle;
+}
+
+static bool clientRegister(IOTHUB_CLIENT_LL_HANDLE handle, const char *deviceId, const char *deviceKey, const char *deviceSasToken)
+{
+	IOTHUB_DEVICE_CONFIG deviceConfig;
+	deviceConfig.deviceId = deviceId;
+	deviceConfig.deviceKey = deviceKey;
+	deviceConfig.deviceSasToken = deviceSasToken;
+	handle->deviceHandle = handle->provider->IoTHubTransport_Register(handle->transportHandle, &deviceConfig, handle, &handle->waitingToSend);
+	return handle->deviceHandle != NULL;
+}
+
+IOTHUB_CLIENT_LL_HANDLE IoTHubClient_LL_CreateFromConnectionString(const char *connectionString, IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol)
+{
+	IOTHUB_CLIENT_CONFIG config;
+	IOTHUB_CLIENT_LL_HANDLE handle = NULL;
+	char *hostName;
+	char *deviceId;
+	char *deviceKey;
+	char *deviceSasToken;
+	char *suffix;
+
+	if ( connectionString == NULL || protocol == NULL ) {
+		return NULL;
+	}
+	hostName = readField(connectionString, "HostName");
+	deviceId = readField(connectionString, "DeviceId");
+	deviceKey = readField(connectionString, "SharedAccessKey");
+	deviceSasToken = readField(connectionString, "SharedAccessSignature");
+	suffix = hostName ? strchr(hostName, '.') : NULL;
+	if ( suffix && deviceId && ( deviceKey || deviceSasToken ) ) {
+		*suffix ++ = 0;
+		memset(&config, 0, sizeof(IOTHUB_CLIENT_CONFIG));
+		config.protocol = protocol;
+		config.deviceId = deviceId;
+		config.deviceKey = deviceKey;
+		config.deviceSasToken = deviceSasToken;
+		config.iotHubName = hostName;
+		config.iotHubSuffix = suffix;
+		handle = IoTHubClient_LL_Create(&config);
+	}
+	free(hostName);
+	free(deviceId);
+	free(deviceKey);
+	free(deviceSasToken);
+	return handle;
+}
+
+IOTHUB_CLIENT_LL_HANDLE IoTHubClient_LL_Create(const IOTHUB_CLIENT_CONFIG *config)
+{
+	IOTHUBTRANSPORT_CONFIG transportConfig;
+	IOTHUB_CLIENT_LL_HANDLE handle;
+
+	if ( config == NULL || config->protocol == NULL ) {
+		return NULL;
+	}
+	handle = clientNew(config->protocol());
+	if ( handle == NULL ) {
+		return NULL;
+	}
+	// as in the SDK the transport is given the client's list when it is made, and again when the device is registered
+	transportConfig.upperConfig = config;
+	transportConfig.waitingToSend = &handle->waitingToSend;
+	handle->transportHandle = handle->provider->IoTHubTransport_Create(&transportConfig);
+	if ( handle->transportHandle == NULL ) {
+		free(handle);
+		return NULL;
+	}
+	if ( !clientRegister(handle, config->deviceId, config->deviceKey, config->deviceSasToken) ) {
+		handle->provider->IoTHubTransport_Destroy(handle->transportHandle);
+		free(handle);
+		return NULL;
+	}
+	return handle;
+}
+
+IOTHUB_CLIENT_LL_HANDLE IoTHubClient_LL_CreateWithTransport(const IOTHUB_CLIENT_DEVICE_CONFIG *config)
+{
+	IOTHUB_CLIENT_LL_HANDLE handle;
+	if ( config == NULL || config->protocol == NULL || config->transportHandle == NULL ) {
+		return NULL;
+	}
+	handle = clientNew(config->protocol());
+	if ( handle == NULL ) {
+		return NULL;
+	}
+	handle->transportHandle = config->transportHandle;
+	handle->isSharedTransport = true;
+	if ( !clientRegister(handle, config->deviceId, config->deviceKey, config->deviceSasToken) ) {
+		free(handle);
+		return NULL;
+	}
+	return handle;
+}
+
+void IoTHubClient_LL_Destroy(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle)
+{
+	if ( iotHubClientHandle == NULL ) {
+		return;
+	}
+	iotHubClientHandle->provider->IoTHubTransport_Unregister(iotHubClientHandle->deviceHandle);
+	if ( !iotHubClientHandle->isSharedTransport ) {
+		iotHubClientHandle->provider->IoTHubTransport_Destroy(iotHubClientHandle->transportHandle);
+	}
+	while ( !DList_IsListEmpty(&iotHubClientHandle->waitingToSend) ) {
+		PDLIST_ENTRY entry = DList_RemoveHeadList(&iotHubClientHandle->waitingToSend);
+		IOTHUB_MESSAGE_LIST *message = containingRecord(entry, IOTHUB_MESSAGE_LIST, entry);
+		if ( message->callback ) {
+			message->callback(IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY, message->context);
+		}
+		IoTHubMessage_Destroy(message->messageHandle);
+		free(message);
+	}
+	free(iotHubClientHandle);
+}
+
+IOTHUB_CLIENT_RESULT IoTHubClient_LL_SendEventAsync(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, IOTHUB_MESSAGE_HANDLE eventMessageHandle,
+		IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK eventConfirmationCallback, void *userContextCallback)
+{
+	IOTHUB_MESSAGE_LIST *message;
+	if ( iotHubClientHandle == NULL || eventMessageHandle == NULL || ( eventConfirmationCallback == NULL && userContextCallback ) ) {
+		return IOTHUB_CLIENT_INVALID_ARG;
+	}
+	message = malloc(sizeof(IOTHUB_MESSAGE_LIST));
+	if ( message == NULL ) {
+		return IOTHUB_CLIENT_ERROR;
+	}
+	message->messageHandle = IoTHubMessage_Clone(eventMessageHandle);
+	if ( message->messageHandle == NULL ) {
+		free(message);
+		return IOTHUB_CLIENT_ERROR;
+	}
+	message->callback = eventConfirmationCallback;
+	message->context = userContextCallback;
+	message->ms_timesOutAfter = 0;
+	DList_InsertTailList(&iotHubClientHandle->waitingToSend, &message->entry);
+	return IOTHUB_CLIENT_OK;
+}
+
+IOTHUB_CLIENT_RESULT IoTHubClient_LL_GetSendStatus(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, IOTHUB_CLIENT_STATUS *iotHubClientStatus)
+{
+	if ( iotHubClientHandle == NULL || iotHubClientStatus == NULL ) {
+		return IOTHUB_CLIENT_INVALID_ARG;
+	}
+	return iotHubClientHandle->provider->IoTHubTransport_GetSendStatus(iotHubClientHandle->deviceHandle, iotHubClientStatus);
+}
+
+IOTHUB_CLIENT_RESULT IoTHubClient_LL_SetMessageCallback(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, IOTHUB_CLIENT_MESSAGE_CALLBACK_ASYNC messageCallback,
+		void *userContextCallback)
+{
+	if ( iotHubClientHandle == NULL ) {
+		return IOTHUB_CLIENT_INVALID_ARG;
+	}
+	if ( messageCallback ) {
+		if ( iotHubClientHandle->provider->IoTHubTransport_Subscribe(iotHubClientHandle->deviceHandle) != 0 ) {
+			return IOTHUB_CLIENT_ERROR;
+		}
+	}
+	else {
+		iotHubClientHandle->provider->IoTHubTransport_Unsubscribe(iotHubClientHandle->deviceHandle);
+	}
+	iotHubClientHandle->messageCallback = messageCallback;
+	iotHubClientHandle->messageContext = userContextCallback;
+	return IOTHUB_CLIENT_OK;
+}
+
+void IoTHubClient_LL_DoWork(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle)
+{
+	if ( iotHubClientHandle ) {
+		iotHubClientHandle->provider->IoTHubTransport_DoWork(iotHubClientHandle->transportHandle, iotHubClientHandle);
+	}
+}
+
+IOTHUB_CLIENT_RESULT IoTHubClient_LL_GetLastMessageReceiveTime(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, time_t *lastMessageReceiveTime)
+{
+	if ( iotHubClientHandle == NULL || lastMessageReceiveTime == NULL ) {
+		return IOTHUB_CLIENT_INVALID_ARG;
+	}
+	if ( iotHubClientHandle->lastMessageReceiveTime == 0 ) {
+		return IOTHUB_CLIENT_INDEFINITE_TIME;
+	}
+	*lastMessageReceiveTime = iotHubClientHandle->lastMessageReceiveTime;
+	return IOTHUB_CLIENT_OK;
+}
+
+IOTHUB_CLIENT_RESULT IoTHubClient_LL_SetOption(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, const char *optionName, const void *value)
+{
+	if ( iotHubClientHandle == NULL || optionName == NULL || value == NULL ) {
+		return IOTHUB_CLIENT_INVALID_ARG;
+	}
+	return iotHubClientHandle->provider->IoTHubTransport_SetOption(iotHubClientHandle->transportHandle, optionName, value);
+}
+
+void IoTHubClient_LL_SendComplete(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, PDLIST_ENTRY completed, IOTHUB_CLIENT_CONFIRMATION_RESULT result)
+{
+	if ( iotHubClientHandle == NULL || completed == NULL ) {
+		return;
+	}
+	while ( !DList_IsListEmpty(completed) ) {
+		PDLIST_ENTRY entry = DList_RemoveHeadList(completed);
+		IOTHUB_MESSAGE_LIST *message = containingRecord(entry, IOTHUB_MESSAGE_LIST, entry);
+		IOTHUB_CLIENT_CONFIRMATION_RESULT messageResult = result;
+		if ( messageResult == IOTHUB_CLIENT_CONFIRMATION_OK && isFault(faults.timeoutRate) ) {
+			messageResult = IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT;
+		}
+		if ( message->callback ) {
+			message->callback(messageResult, message->context);
+			// the second call comes after the first has released everything to do with the message
+			if ( messageResult != IOTHUB_CLIENT_CONFIRMATION_OK && isFault(faults.duplicateRate) ) {
+				message->callback(messageResult, message->context);
+			}
+		}
+		IoTHubMessage_Destroy(message->messageHandle);
+		free(message);
+	}
+}
+
+IOTHUBMESSAGE_DISPOSITION_RESULT IoTHubClient_LL_MessageCallback(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, IOTHUB_MESSAGE_HANDLE message)
+{
+	if ( iotHubClientHandle == NULL || message == NULL || iotHubClientHandle->messageCallback == NULL ) {
+		return IOTHUBMESSAGE_ABANDONED;
+	}
+	iotHubClientHandle->lastMessageReceiveTime = time(NULL);
+	return iotHubClientHandle->messageCallback(message, iotHubClientHandle->messageContext);
+}
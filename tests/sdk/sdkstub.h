@@ -0,0 +1,166 @@
+/*
+
+ Stand in for the parts of the Azure IoT device SDK used by the luaazureiothub library.
+
+ The headers in this directory have the same names as the SDK headers, so the library sources build against them
+ unchanged. It is only used by the benchmarks and test harnesses, which measure the cost of the library itself, so
+ every protocol is served by the loopback transport and no network or TLS code is linked in.
+
+*/
+
+#ifndef SDKSTUB_H
+#define SDKSTUB_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+
+// enum to string tables, the values argument is pasted onto _NAMES to find the list of names for the enum
+#define DEFINE_ENUM_STRINGS(enumName, values)																	\
+	const char *enumName##Strings(enumName value)																\
+	{																											\
+		static const char *names[] = { values##_NAMES };														\
+		return ( (size_t) value < sizeof(names) / sizeof(names[0]) ) ? names[value] : "UNKNOWN";				\
+	}
+#define DECLARE_ENUM_STRINGS(enumName, values)	const char *enumName##Strings(enumName value);
+#define ENUM_TO_STRING(enumName, value)			enumName##Strings(value)
+
+
+typedef enum {
+	IOTHUB_CLIENT_OK,
+	IOTHUB_CLIENT_INVALID_ARG,
+	IOTHUB_CLIENT_ERROR,
+	IOTHUB_CLIENT_INVALID_SIZE,
+	IOTHUB_CLIENT_INDEFINITE_TIME
+} IOTHUB_CLIENT_RESULT;
+#define IOTHUB_CLIENT_RESULT_VALUES_NAMES		"IOTHUB_CLIENT_OK", "IOTHUB_CLIENT_INVALID_ARG", "IOTHUB_CLIENT_ERROR", \
+												"IOTHUB_CLIENT_INVALID_SIZE", "IOTHUB_CLIENT_INDEFINITE_TIME"
+DECLARE_ENUM_STRINGS(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_RESULT_VALUES)
+
+typedef enum {
+	IOTHUB_CLIENT_CONFIRMATION_OK,
+	IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY,
+	IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT,
+	IOTHUB_CLIENT_CONFIRMATION_ERROR
+} IOTHUB_CLIENT_CONFIRMATION_RESULT;
+#define IOTHUB_CLIENT_CONFIRMATION_RESULT_VALUES_NAMES	"IOTHUB_CLIENT_CONFIRMATION_OK", "IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY", \
+														"IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT", "IOTHUB_CLIENT_CONFIRMATION_ERROR"
+
+typedef enum {
+	IOTHUB_CLIENT_SEND_STATUS_IDLE,
+	IOTHUB_CLIENT_SEND_STATUS_BUSY
+} IOTHUB_CLIENT_STATUS;
+
+typedef enum {
+	IOTHUBMESSAGE_ACCEPTED,
+	IOTHUBMESSAGE_REJECTED,
+	IOTHUBMESSAGE_ABANDONED
+} IOTHUBMESSAGE_DISPOSITION_RESULT;
+
+typedef enum {
+	IOTHUBMESSAGE_BYTEARRAY,
+	IOTHUBMESSAGE_STRING,
+	IOTHUBMESSAGE_UNKNOWN
+} IOTHUBMESSAGE_CONTENT_TYPE;
+
+typedef enum {
+	IOTHUB_MESSAGE_OK,
+	IOTHUB_MESSAGE_INVALID_ARG,
+	IOTHUB_MESSAGE_INVALID_TYPE,
+	IOTHUB_MESSAGE_ERROR
+} IOTHUB_MESSAGE_RESULT;
+
+typedef enum {
+	MAP_OK,
+	MAP_ERROR,
+	MAP_INVALIDARG,
+	MAP_KEYEXISTS,
+	MAP_KEYNOTFOUND,
+	MAP_FILTER_REJECT
+} MAP_RESULT;
+
+
+typedef struct MAP_HANDLE_DATA_TAG *MAP_HANDLE;
+typedef struct IOTHUB_MESSAGE_HANDLE_DATA_TAG *IOTHUB_MESSAGE_HANDLE;
+typedef struct IOTHUB_CLIENT_LL_HANDLE_DATA_TAG *IOTHUB_CLIENT_LL_HANDLE;
+typedef struct TRANSPORT_HANDLE_DATA_TAG *TRANSPORT_HANDLE;
+typedef struct STRING_TAG *STRING_HANDLE;
+typedef void *TRANSPORT_LL_HANDLE;
+typedef void *IOTHUB_DEVICE_HANDLE;
+
+
+typedef struct DLIST_ENTRY_TAG {
+	struct DLIST_ENTRY_TAG *Flink;
+	struct DLIST_ENTRY_TAG *Blink;
+} DLIST_ENTRY, *PDLIST_ENTRY;
+
+#define containingRecord(address, type, field)	((type *) ((uintptr_t) (address) - offsetof(type, field)))
+
+void DList_InitializeListHead(PDLIST_ENTRY listHead);
+int DList_IsListEmpty(const PDLIST_ENTRY listHead);
+void DList_InsertTailList(PDLIST_ENTRY listHead, PDLIST_ENTRY listEntry);
+void DList_InsertHeadList(PDLIST_ENTRY listHead, PDLIST_ENTRY listEntry);
+void DList_AppendTailList(PDLIST_ENTRY listHead, PDLIST_ENTRY listToAppend);
+int DList_RemoveEntryList(PDLIST_ENTRY listEntry);
+PDLIST_ENTRY DList_RemoveHeadList(PDLIST_ENTRY listHead);
+
+
+STRING_HANDLE STRING_construct(const char *psz);
+void STRING_delete(STRING_HANDLE handle);
+const char *STRING_c_str(STRING_HANDLE handle);
+
+
+typedef IOTHUBMESSAGE_DISPOSITION_RESULT (*IOTHUB_CLIENT_MESSAGE_CALLBACK_ASYNC)(IOTHUB_MESSAGE_HANDLE message, void *userContextCallback);
+typedef void (*IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK)(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *userContextCallback);
+
+struct TRANSPORT_PROVIDER_TAG;
+typedef const struct TRANSPORT_PROVIDER_TAG *(*IOTHUB_CLIENT_TRANSPORT_PROVIDER)(void);
+
+typedef struct IOTHUB_CLIENT_CONFIG_TAG {
+	IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol;
+	const char *deviceId;
+	const char *deviceKey;
+	const char *deviceSasToken;
+	const char *iotHubName;
+	const char *iotHubSuffix;
+	const char *protocolGatewayHostName;
+} IOTHUB_CLIENT_CONFIG;
+
+typedef struct IOTHUB_CLIENT_DEVICE_CONFIG_TAG {
+	IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol;
+	void *transportHandle;
+	const char *deviceId;
+	const char *deviceKey;
+	const char *deviceSasToken;
+} IOTHUB_CLIENT_DEVICE_CONFIG;
+
+typedef struct IOTHUB_MESSAGE_LIST_TAG {
+	IOTHUB_MESSAGE_HANDLE messageHandle;
+	IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK callback;
+	void *context;
+	DLIST_ENTRY entry;
+	uint64_t ms_timesOutAfter;
+} IOTHUB_MESSAGE_LIST;
+
+
+// faults the stub LL client adds to the confirmations coming back from the transport, used by the soak test
+typedef struct {
+	double timeoutRate;						// fraction of confirmations changed to IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT
+	double duplicateRate;					// fraction of failed confirmations called back a second time, as the SDK can do
+} SdkStubFaults;
+
+void sdkStubSetFaults(const SdkStubFaults *faults);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// SDKSTUB_H
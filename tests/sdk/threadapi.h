@@ -0,0 +1,8 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef THREADAPI_H
+#define THREADAPI_H
+
+#include "sdkstub.h"
+
+#endif	// THREADAPI_H
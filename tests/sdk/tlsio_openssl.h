@@ -0,0 +1,11 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef TLSIO_OPENSSL_H
+#define TLSIO_OPENSSL_H
+
+#include "sdkstub.h"
+
+int tlsio_openssl_init(void);
+void tlsio_openssl_deinit(void);
+
+#endif	// TLSIO_OPENSSL_H
@@ -0,0 +1,8 @@
+// stand in for the SDK header of the same name, see sdkstub.h
+
+#ifndef XIO_H
+#define XIO_H
+
+#include "sdkstub.h"
+
+#endif	// XIO_H